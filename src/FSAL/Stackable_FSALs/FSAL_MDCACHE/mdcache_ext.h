@@ -38,6 +38,18 @@
  * @{
  */
 
+/**
+ * @brief Replacement policies of the entry and chunk LRU
+ */
+
+enum mdcache_lru_policy {
+	/** Two-level LRU, new entries at the LRU of L1 */
+	MDCACHE_LRU_POLICY_LRU,
+	/** Adaptive replacement, new entries on probation in L2 */
+	MDCACHE_LRU_POLICY_ARC,
+	MDCACHE_LRU_POLICY_COUNT
+};
+
 /**
  * @brief Structure to hold MDCACHE paramaters
  */
@@ -109,6 +121,22 @@ struct mdcache_parameter {
 	    we disable caching, when in extremis.  Defaults to 8,
 	    settable with Futility_Count */
 	uint32_t futility_count;
+	/** Replacement policy of the entry and chunk LRU.  Defaults to
+	    LRU, settable with LRU_Policy. */
+	uint32_t lru_policy;
+	/** File to which hot entries are saved and from which they are
+	    reloaded at startup.  Defaults to NULL (no snapshot),
+	    settable with Snapshot_Path. */
+	char *snapshot_path;
+	/** Seconds between two snapshots, 0 to only save one at
+	    shutdown.  Defaults to 300, settable with Snapshot_Interval. */
+	uint32_t snapshot_interval;
+	/** Largest number of entries in a snapshot.  Defaults to 10000,
+	    settable with Snapshot_Entries. */
+	uint32_t snapshot_entries;
+	/** Number of threads reloading a snapshot.  Defaults to 4,
+	    settable with Snapshot_Reload_Threads. */
+	uint32_t snapshot_reload_threads;
 };
 
 extern struct mdcache_parameter mdcache_param;
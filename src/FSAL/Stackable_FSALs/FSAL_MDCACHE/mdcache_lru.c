@@ -51,6 +51,7 @@
 #include "nfs_core.h"
 #include "log.h"
 #include "mdcache_lru.h"
+#include "mdcache_lru_policy.h"
 #include "mdcache_hash.h"
 #include "abstract_atomic.h"
 #include "gsh_intrinsic.h"
@@ -151,6 +152,62 @@ struct lru_q_lane {
 static struct lru_q_lane LRU[LRU_N_Q_LANES];
 static struct lru_q_lane CHUNK_LRU[LRU_N_Q_LANES];
 
+/**
+ * With LRU_Policy = ARC, new entries wait on probation in L2 and only a
+ * second reference moves them to L1; L2 is kept near a target size that
+ * adapts to the misses on entries reaped recently, remembered as ghosts
+ * (see mdcache_lru_policy.h).  Ghosts are striped by the hash of their key,
+ * since the lane of an entry depends on where it was allocated.  Chunks of
+ * dirents have no identity once reaped, so they go through the same queues
+ * without ghosts and follow the share of L2 the entries adapted to.
+ *
+ * The LRU thread still demotes entries from L1 to L2 to close their file
+ * descriptors, which for ARC puts them back on probation.
+ */
+
+#define LRU_ARC (mdcache_param.lru_policy == MDCACHE_LRU_POLICY_ARC)
+
+struct lru_ghost_stripe {
+	pthread_mutex_t mtx;
+	struct lru_ghosts g;
+	 CACHE_PAD(0);
+};
+
+static struct lru_ghost_stripe LRU_GHOSTS[LRU_N_Q_LANES];
+
+/* Hits and misses of the policy, counted in the lane of the entry or chunk
+ * so that hot paths do not share a line; summed when read */
+struct lru_policy_stripe {
+	struct lru_policy_stats st;
+	 CACHE_PAD(0);
+};
+
+static struct lru_policy_stripe LRU_POLICY_ST[LRU_N_Q_LANES];
+
+#define LRU_POLICY_STAT(lane, field) \
+	((void) atomic_inc_uint64_t(&LRU_POLICY_ST[lane].st.field))
+
+/**
+ * @brief Sum the hits and misses of the policy over the lanes
+ *
+ * @param[out] st  The totals
+ */
+void lru_policy_stats_get(struct lru_policy_stats *st)
+{
+	struct lru_policy_stats *lane;
+	int i;
+
+	memset(st, 0, sizeof(*st));
+	for (i = 0; i < LRU_N_Q_LANES; i++) {
+		lane = &LRU_POLICY_ST[i].st;
+		st->entry_hit += atomic_fetch_uint64_t(&lane->entry_hit);
+		st->entry_miss += atomic_fetch_uint64_t(&lane->entry_miss);
+		st->ghost_hit += atomic_fetch_uint64_t(&lane->ghost_hit);
+		st->chunk_hit += atomic_fetch_uint64_t(&lane->chunk_hit);
+		st->chunk_miss += atomic_fetch_uint64_t(&lane->chunk_miss);
+	}
+}
+
 /**
  * The refcount mechanism distinguishes 3 key object states:
  *
@@ -239,6 +296,25 @@ lru_init_queue(struct lru_q *q, enum lru_q_id qid)
 	q->size = 0;
 }
 
+/**
+ * @brief Initialize the ghost stripes of the ARC policy
+ *
+ * All stripes together remember about as many entries as the cache holds.
+ */
+static inline void
+lru_init_ghosts(void)
+{
+	uint64_t size = lru_ghosts_size(lru_state.entries_hiwat /
+					LRU_N_Q_LANES);
+	int ix;
+
+	for (ix = 0; ix < LRU_N_Q_LANES; ++ix) {
+		PTHREAD_MUTEX_init(&LRU_GHOSTS[ix].mtx, NULL);
+		LRU_GHOSTS[ix].g.slots = gsh_calloc(size, sizeof(uint64_t));
+		LRU_GHOSTS[ix].g.mask = size - 1;
+	}
+}
+
 static inline void
 lru_init_queues(void)
 {
@@ -366,6 +442,46 @@ lru_lane_of(void *entry)
 				% LRU_N_Q_LANES);
 }
 
+/**
+ * @brief Get the ghost stripe of a key hash
+ */
+static inline struct lru_ghost_stripe *
+lru_ghost_stripe_of(uint64_t hk)
+{
+	return &LRU_GHOSTS[hk % LRU_N_Q_LANES];
+}
+
+/**
+ * @brief Remember an entry reaped with the ARC policy
+ *
+ * @param[in] hk   Hash of the key of the entry
+ * @param[in] qid  The queue it was reaped from
+ */
+static inline void lru_ghost_record(uint64_t hk, enum lru_q_id qid)
+{
+	struct lru_ghost_stripe *stripe = lru_ghost_stripe_of(hk);
+
+	PTHREAD_MUTEX_lock(&stripe->mtx);
+	lru_ghost_add(&stripe->g, hk,
+		      qid == LRU_ENTRY_L1 ? LRU_GHOST_L1 : LRU_GHOST_L2);
+	PTHREAD_MUTEX_unlock(&stripe->mtx);
+}
+
+/**
+ * @brief Number of objects in L2 of all lanes
+ *
+ * The lanes are not locked, so this is only a hint.
+ */
+static inline uint64_t lru_l2_size(struct lru_q_lane *lanes)
+{
+	uint64_t size = 0;
+	int ix;
+
+	for (ix = 0; ix < LRU_N_Q_LANES; ++ix)
+		size += atomic_fetch_uint64_t(&lanes[ix].L2.size);
+	return size;
+}
+
 /**
  * @brief Insert an entry into the specified queue and lane
  *
@@ -677,6 +793,7 @@ lru_reap_impl(enum lru_q_id qid)
 			if (LRU_ENTRY_RECLAIMABLE(entry, refcnt)) {
 				/* it worked */
 				struct lru_q *q = lru_queue_of(entry);
+				enum lru_q_id from = lru->qid;
 
 #ifdef USE_LTTNG
 				tracepoint(mdcache, mdc_lru_reap, __func__,
@@ -686,6 +803,9 @@ lru_reap_impl(enum lru_q_id qid)
 				LRU_DQ_SAFE(lru, q);
 				entry->lru.qid = LRU_ENTRY_NONE;
 				QUNLOCK(qlane);
+				if (LRU_ARC)
+					lru_ghost_record(entry->fh_hk.key.hk,
+							 from);
 				cih_remove_latched(entry, &latch,
 						   CIH_REMOVE_UNLOCK);
 				/* Note, we're not releasing our ref here.
@@ -723,6 +843,15 @@ lru_try_reap_entry(void)
 	if (lru_state.entries_used < lru_state.entries_hiwat)
 		return NULL;
 
+	if (LRU_ARC &&
+	    !lru_arc_reap_l2_first(lru_l2_size(LRU),
+				   atomic_fetch_uint64_t(&lru_state.arc_target))) {
+		lru = lru_reap_impl(LRU_ENTRY_L1);
+		if (!lru)
+			lru = lru_reap_impl(LRU_ENTRY_L2);
+		return lru;
+	}
+
 	/* XXX dang why not start with the cleanup list? */
 	lru = lru_reap_impl(LRU_ENTRY_L2);
 	if (!lru)
@@ -886,12 +1015,21 @@ struct dir_chunk *mdcache_get_chunk(mdcache_entry_t *parent,
 {
 	mdcache_lru_t *lru = NULL;
 	struct dir_chunk *chunk = NULL;
+	enum lru_q_id first = LRU_ENTRY_L2, second = LRU_ENTRY_L1;
 
 	if (lru_state.chunks_used >= lru_state.chunks_hiwat) {
-		lru = lru_reap_chunk_impl(LRU_ENTRY_L2, parent, prev_chunk);
+		if (LRU_ARC &&
+		    !lru_arc_reap_l2_first(
+				lru_l2_size(CHUNK_LRU),
+				atomic_fetch_uint64_t(&lru_state.arc_target) *
+				lru_state.chunks_hiwat /
+				lru_state.entries_hiwat)) {
+			first = LRU_ENTRY_L1;
+			second = LRU_ENTRY_L2;
+		}
+		lru = lru_reap_chunk_impl(first, parent, prev_chunk);
 		if (!lru)
-			lru = lru_reap_chunk_impl(
-					LRU_ENTRY_L1, parent, prev_chunk);
+			lru = lru_reap_chunk_impl(second, parent, prev_chunk);
 	}
 
 	if (lru) {
@@ -929,6 +1067,7 @@ struct dir_chunk *mdcache_get_chunk(mdcache_entry_t *parent,
 	chunk->chunk_lru.refcnt = 0;
 	chunk->chunk_lru.cf = 0;
 	chunk->chunk_lru.lane = lru_lane_of(chunk);
+	LRU_POLICY_STAT(chunk->chunk_lru.lane, chunk_miss);
 
 	/* Enqueue into MRU of L2.
 	 *
@@ -1567,6 +1706,58 @@ void lru_cleanup_entries(void)
 	}
 }
 
+/**
+ * @brief Take references on the most recently used entries
+ *
+ * Walk L1, then L2, of each lane from the MRU end, and return up to @a max
+ * entries with a reference held, spread evenly over the lanes.  Entries of
+ * an export going away are skipped.
+ *
+ * @param[out] entries  Array of at least @a max entries
+ * @param[in]  max      Largest number of entries to return
+ *
+ * @return the number of entries returned, each to be put by the caller
+ */
+size_t mdcache_lru_hot(mdcache_entry_t **entries, size_t max)
+{
+	size_t per_lane = (max + LRU_N_Q_LANES - 1) / LRU_N_Q_LANES;
+	size_t count = 0;
+	size_t lane;
+
+	for (lane = 0; lane < LRU_N_Q_LANES && count < max; ++lane) {
+		struct lru_q_lane *qlane = &LRU[lane];
+		struct lru_q *qs[] = { &qlane->L1, &qlane->L2 };
+		size_t taken = 0;
+		int i;
+
+		QLOCK(qlane);
+		for (i = 0; i < 2; ++i) {
+			struct glist_head *glist;
+
+			for (glist = qs[i]->q.prev;
+			     glist != &qs[i]->q && taken < per_lane &&
+			     count < max;
+			     glist = glist->prev) {
+				mdcache_entry_t *entry =
+				    container_of(glist, mdcache_entry_t, lru.q);
+
+				if (atomic_fetch_int32_t(
+					&entry->first_export_id) < 0)
+					continue;
+
+				/* Safe under the lane lock, as in
+				 * lru_run_lane() */
+				(void) atomic_inc_int32_t(&entry->lru.refcnt);
+				entries[count++] = entry;
+				++taken;
+			}
+		}
+		QUNLOCK(qlane);
+	}
+
+	return count;
+}
+
 void init_fds_limit(void)
 {
 	int code = 0;
@@ -1702,6 +1893,10 @@ mdcache_lru_pkginit(void)
 	lru_state.chunks_hiwat = mdcache_param.chunks_hwmark;
 	lru_state.chunks_used = 0;
 
+	/* ARC starts with L2 and L1 splitting the cache evenly */
+	lru_state.arc_target = lru_state.entries_hiwat / 2;
+	if (LRU_ARC)
+		lru_init_ghosts();
 
 	/* init queue complex */
 	lru_init_queues();
@@ -1822,6 +2017,38 @@ mdcache_entry_t *mdcache_lru_get(struct fsal_obj_handle *sub_handle)
 	return nentry;
 }
 
+/**
+ * @brief Insert a new entry into the LRU with the ARC policy
+ *
+ * The entry goes on probation at the MRU of L2, unless it was reaped
+ * recently, in which case the target of L2 adapts to the miss and the entry
+ * goes straight to the MRU of L1.  Stripes adapt the target without a common
+ * lock, so that racing adaptations may lose a step.
+ *
+ * @param [in] entry  Entry to insert.
+ */
+static void lru_arc_insert_entry(mdcache_entry_t *entry)
+{
+	uint64_t hk = entry->fh_hk.key.hk;
+	struct lru_ghost_stripe *stripe = lru_ghost_stripe_of(hk);
+	enum lru_ghost_list list;
+	uint64_t target;
+
+	PTHREAD_MUTEX_lock(&stripe->mtx);
+	target = atomic_fetch_uint64_t(&lru_state.arc_target);
+	list = lru_arc_miss(&stripe->g, hk, &target, lru_state.entries_hiwat);
+	if (list != LRU_GHOST_NONE)
+		atomic_store_uint64_t(&lru_state.arc_target, target);
+	PTHREAD_MUTEX_unlock(&stripe->mtx);
+
+	if (list == LRU_GHOST_NONE) {
+		lru_insert_entry(entry, &LRU[entry->lru.lane].L2, LRU_MRU);
+	} else {
+		LRU_POLICY_STAT(entry->lru.lane, ghost_hit);
+		lru_insert_entry(entry, &LRU[entry->lru.lane].L1, LRU_MRU);
+	}
+}
+
 /**
  * @brief Insert a new entry into the LRU.
  *
@@ -1837,6 +2064,11 @@ void mdcache_lru_insert(mdcache_entry_t *entry, mdc_reason_t reason)
 	/* Enqueue. */
 	switch (reason) {
 	case MDC_REASON_DEFAULT:
+		LRU_POLICY_STAT(entry->lru.lane, entry_miss);
+		if (LRU_ARC) {
+			lru_arc_insert_entry(entry);
+			break;
+		}
 		lru_insert_entry(entry, &LRU[entry->lru.lane].L1, LRU_LRU);
 		break;
 	case MDC_REASON_SCAN:
@@ -1888,18 +2120,21 @@ _mdcache_lru_ref(mdcache_entry_t *entry, uint32_t flags, const char *func,
 
 		switch (lru->qid) {
 		case LRU_ENTRY_L1:
+			LRU_POLICY_STAT(lru->lane, entry_hit);
 			q = lru_queue_of(entry);
 			/* advance entry to MRU (of L1) */
 			LRU_DQ_SAFE(lru, q);
 			lru_insert(lru, q, LRU_MRU);
 			break;
 		case LRU_ENTRY_L2:
+			LRU_POLICY_STAT(lru->lane, entry_hit);
 			q = lru_queue_of(entry);
-			/* move entry to LRU of L1 */
+			/* move entry to LRU of L1, or to its MRU with ARC as
+			 * it leaves probation */
 			glist_del(&lru->q);	/* skip L1 fixups */
 			--(q->size);
 			q = &qlane->L1;
-			lru_insert(lru, q, LRU_LRU);
+			lru_insert(lru, q, LRU_ARC ? LRU_MRU : LRU_LRU);
 			break;
 		default:
 			/* do nothing */
@@ -2066,6 +2301,8 @@ void lru_bump_chunk(struct dir_chunk *chunk)
 	struct lru_q_lane *qlane = &CHUNK_LRU[lru->lane];
 	struct lru_q *q;
 
+	LRU_POLICY_STAT(lru->lane, chunk_hit);
+
 	QLOCK(qlane);
 	q = chunk_lru_queue_of(chunk);
 
@@ -2076,11 +2313,11 @@ void lru_bump_chunk(struct dir_chunk *chunk)
 		lru_insert(lru, q, LRU_MRU);
 		break;
 	case LRU_ENTRY_L2:
-		/* move chunk to LRU of L1 */
+		/* move chunk to LRU of L1, or to its MRU with ARC */
 		glist_del(&lru->q);	/* skip L1 fixups */
 		--(q->size);
 		q = &qlane->L1;
-		lru_insert(lru, q, LRU_LRU);
+		lru_insert(lru, q, LRU_ARC ? LRU_MRU : LRU_LRU);
 		break;
 	default:
 		/* do nothing */
@@ -89,10 +89,28 @@ struct lru_state {
 	uint64_t prev_fd_count;	/* previous # of open fds */
 	time_t prev_time;	/* previous time the gc thread was run. */
 	uint32_t fd_state;
+	/** Target number of entries in L2 with the ARC policy */
+	uint64_t arc_target;
 };
 
 extern struct lru_state lru_state;
 
+/**
+ * Hits and misses of the replacement policy.  An entry miss is a new entry
+ * looked up, a ghost hit one that was reaped recently; a chunk miss is a
+ * chunk of dirents loaded, and a chunk hit a use of a loaded chunk,
+ * including the one that loaded it.
+ */
+struct lru_policy_stats {
+	uint64_t entry_hit;
+	uint64_t entry_miss;
+	uint64_t ghost_hit;
+	uint64_t chunk_hit;
+	uint64_t chunk_miss;
+};
+
+void lru_policy_stats_get(struct lru_policy_stats *st);
+
 /** Cache entries pool */
 extern pool_t *mdcache_entry_pool;
 
@@ -157,6 +175,7 @@ fsal_status_t _mdcache_lru_ref(mdcache_entry_t *entry, uint32_t flags,
 void mdcache_lru_kill(mdcache_entry_t *entry);
 void mdcache_lru_cleanup_push(mdcache_entry_t *entry);
 void mdcache_lru_cleanup_try_push(mdcache_entry_t *entry);
+size_t mdcache_lru_hot(mdcache_entry_t **entries, size_t max);
 
 #define mdcache_lru_unref(e) _mdcache_lru_unref(e, LRU_FLAG_NONE, \
 						__func__, __LINE__)
@@ -0,0 +1,184 @@
+/*
+ * vim:noexpandtab:shiftwidth=8:tabstop=8:
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ * -------------
+ */
+
+/**
+ * @addtogroup FSAL_MDCACHE
+ * @{
+ */
+
+/**
+ * @file mdcache_lru_policy.h
+ * @brief Bookkeeping of the adaptive replacement policy of the LRU
+ *
+ * With the ARC policy [Megiddo and Modha 2003], L2 holds entries seen once
+ * (ARC's T1, "probation") and L1 entries seen again (ARC's T2).  The cache
+ * remembers the keys of entries it reaped recently, and from which queue, in
+ * a ghost table; a miss on a key reaped from L2 means probation was too
+ * short and raises the target size of L2, one on a key reaped from L1 lowers
+ * it.  Entries are then reaped from L2 while it is above its target.
+ *
+ * The ghost table is direct-mapped on the hash of the key: a key replaces
+ * whatever older key maps to the same slot.  This keeps it constant-time and
+ * bounded, at the price of forgetting some keys earlier than ARC would.
+ *
+ * Nothing here locks or allocates, so that the trace simulator in
+ * src/test can run the very same code.
+ */
+
+#ifndef MDCACHE_LRU_POLICY_H
+#define MDCACHE_LRU_POLICY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/** Ghost lists, by the queue the entry was reaped from */
+enum lru_ghost_list {
+	LRU_GHOST_NONE = -1,
+	LRU_GHOST_L2 = 0,	/* ARC's B1 */
+	LRU_GHOST_L1 = 1,	/* ARC's B2 */
+};
+
+struct lru_ghosts {
+	/** Hash of the key with the low bit replaced by the list, 0 if free */
+	uint64_t *slots;
+	uint64_t mask;
+	/** Number of slots held by each list */
+	uint64_t n[2];
+};
+
+/**
+ * @brief Size a ghost table for at least @a nkeys keys
+ *
+ * @return the number of slots, to be allocated zeroed by the caller
+ */
+static inline uint64_t lru_ghosts_size(uint64_t nkeys)
+{
+	uint64_t size = 64;
+
+	while (size < nkeys)
+		size <<= 1;
+	return size;
+}
+
+static inline uint64_t lru_ghost_slot(const struct lru_ghosts *g, uint64_t hk)
+{
+	return (hk >> 1) & g->mask;
+}
+
+/**
+ * @brief Remember that the entry with key hash @a hk was reaped from @a list
+ */
+static inline void lru_ghost_add(struct lru_ghosts *g, uint64_t hk,
+				 enum lru_ghost_list list)
+{
+	uint64_t *slot = &g->slots[lru_ghost_slot(g, hk)];
+
+	if (*slot != 0)
+		g->n[*slot & 1]--;
+	/* A key hashing to 0 or 1 would look free and is just not kept */
+	*slot = (hk & ~1ULL) | list;
+	if (*slot != 0)
+		g->n[list]++;
+}
+
+/**
+ * @brief Find and forget the key hash @a hk
+ *
+ * @return the list @a hk was reaped from, LRU_GHOST_NONE if not a ghost
+ */
+static inline enum lru_ghost_list lru_ghost_take(struct lru_ghosts *g,
+						 uint64_t hk)
+{
+	uint64_t *slot = &g->slots[lru_ghost_slot(g, hk)];
+	enum lru_ghost_list list;
+
+	if (*slot == 0 || (*slot & ~1ULL) != (hk & ~1ULL))
+		return LRU_GHOST_NONE;
+	list = *slot & 1;
+	g->n[list]--;
+	*slot = 0;
+	return list;
+}
+
+/**
+ * @brief Adapt the target size of L2 to a ghost hit, as ARC does
+ *
+ * A hit in the ghosts of L2 grows the target by the ratio of the ghosts of
+ * L1 to those of L2, at least by one; a hit in the ghosts of L1 shrinks it
+ * the other way round.
+ *
+ * @param[in,out] target  Target size of L2
+ * @param[in]     list    The list the ghost hit was in
+ * @param[in]     n       Sizes of the ghost lists, before the hit
+ * @param[in]     max     Largest target, the size of the cache
+ */
+static inline void lru_arc_adapt(uint64_t *target, enum lru_ghost_list list,
+				 const uint64_t n[2], uint64_t max)
+{
+	uint64_t delta;
+
+	if (list == LRU_GHOST_L2) {
+		delta = n[LRU_GHOST_L1] > n[LRU_GHOST_L2] && n[LRU_GHOST_L2]
+			? n[LRU_GHOST_L1] / n[LRU_GHOST_L2] : 1;
+		*target = *target + delta < max ? *target + delta : max;
+	} else {
+		delta = n[LRU_GHOST_L2] > n[LRU_GHOST_L1] && n[LRU_GHOST_L1]
+			? n[LRU_GHOST_L2] / n[LRU_GHOST_L1] : 1;
+		*target = *target > delta ? *target - delta : 0;
+	}
+}
+
+/**
+ * @brief Account for a miss on the key hash @a hk
+ *
+ * @param[in,out] g       Ghost table of the key
+ * @param[in]     hk      Hash of the key that missed
+ * @param[in,out] target  Target size of L2
+ * @param[in]     max     Largest target, the size of the cache
+ *
+ * @return the list @a hk was a ghost of, LRU_GHOST_NONE if it was not one
+ */
+static inline enum lru_ghost_list lru_arc_miss(struct lru_ghosts *g,
+					       uint64_t hk, uint64_t *target,
+					       uint64_t max)
+{
+	uint64_t n[2] = { g->n[0], g->n[1] };
+	enum lru_ghost_list list = lru_ghost_take(g, hk);
+
+	if (list != LRU_GHOST_NONE)
+		lru_arc_adapt(target, list, n, max);
+	return list;
+}
+
+/**
+ * @brief Whether to reap from L2 before L1
+ *
+ * @param[in] l2      Number of entries in L2
+ * @param[in] target  Target size of L2
+ */
+static inline bool lru_arc_reap_l2_first(uint64_t l2, uint64_t target)
+{
+	return l2 > target;
+}
+
+#endif /* MDCACHE_LRU_POLICY_H */
+
+/** @} */
@@ -47,6 +47,7 @@
 #include "FSAL/fsal_commonlib.h"
 #include "mdcache_hash.h"
 #include "mdcache_lru.h"
+#include "mdcache.h"
 
 pool_t *mdcache_entry_pool;
 
@@ -321,10 +322,47 @@ fsal_status_t mdcache_pkginit(void)
 
 	cih_pkginit();
 
+	/* A snapshot that can't be reloaded only leaves the cache cold */
+	(void) mdcache_snapshot_pkginit();
+
 	return status;
 }
 
 #ifdef USE_DBUS
+/**
+ * @brief Append the hits and misses of the LRU policy in use
+ *
+ * "lru_policy" is the policy, a value of enum mdcache_lru_policy, and
+ * "arc_target" the target number of entries in L2 with ARC.
+ */
+static void mdcache_dbus_show_policy(DBusMessageIter *struct_iter)
+{
+	struct lru_policy_stats st;
+	uint64_t policy = mdcache_param.lru_policy;
+	uint64_t target = lru_state.arc_target;
+	struct {
+		char *type;
+		uint64_t *value;
+	} rows[] = {
+		{ "lru_policy", &policy },
+		{ "entry_hit", &st.entry_hit },
+		{ "entry_miss", &st.entry_miss },
+		{ "ghost_hit", &st.ghost_hit },
+		{ "chunk_hit", &st.chunk_hit },
+		{ "chunk_miss", &st.chunk_miss },
+		{ "arc_target", &target },
+	};
+	size_t i;
+
+	lru_policy_stats_get(&st);
+	for (i = 0; i < sizeof(rows) / sizeof(rows[0]); i++) {
+		dbus_message_iter_append_basic(struct_iter, DBUS_TYPE_STRING,
+					       &rows[i].type);
+		dbus_message_iter_append_basic(struct_iter, DBUS_TYPE_UINT64,
+					       rows[i].value);
+	}
+}
+
 void mdcache_dbus_show(DBusMessageIter *iter)
 {
 	struct timespec timestamp;
@@ -360,6 +398,7 @@ void mdcache_dbus_show(DBusMessageIter *iter)
 	dbus_message_iter_append_basic(&struct_iter, DBUS_TYPE_STRING, &type);
 	dbus_message_iter_append_basic(&struct_iter, DBUS_TYPE_UINT64,
 					&cache_st.inode_mapping);
+	mdcache_dbus_show_policy(&struct_iter);
 
 	dbus_message_iter_close_container(iter, &struct_iter);
 }
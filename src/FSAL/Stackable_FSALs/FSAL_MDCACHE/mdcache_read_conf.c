@@ -52,6 +52,12 @@
 
 struct mdcache_parameter mdcache_param;
 
+static struct config_item_list lru_policies[] = {
+	CONFIG_LIST_TOK("LRU", MDCACHE_LRU_POLICY_LRU),
+	CONFIG_LIST_TOK("ARC", MDCACHE_LRU_POLICY_ARC),
+	CONFIG_LIST_EOL
+};
+
 static struct config_item mdcache_params[] = {
 	CONF_ITEM_UI32("NParts", 1, 32633, 7,
 		       mdcache_parameter, nparts),
@@ -85,6 +91,16 @@ static struct config_item mdcache_params[] = {
 		       mdcache_parameter, required_progress),
 	CONF_ITEM_UI32("Futility_Count", 1, 50, 8,
 		       mdcache_parameter, futility_count),
+	CONF_ITEM_TOKEN("LRU_Policy", MDCACHE_LRU_POLICY_LRU, lru_policies,
+			mdcache_parameter, lru_policy),
+	CONF_ITEM_PATH("Snapshot_Path", 1, MAXPATHLEN, NULL,
+		       mdcache_parameter, snapshot_path),
+	CONF_ITEM_UI32("Snapshot_Interval", 0, 24 * 3600, 300,
+		       mdcache_parameter, snapshot_interval),
+	CONF_ITEM_UI32("Snapshot_Entries", 1, UINT32_MAX, 10000,
+		       mdcache_parameter, snapshot_entries),
+	CONF_ITEM_UI32("Snapshot_Reload_Threads", 1, 64, 4,
+		       mdcache_parameter, snapshot_reload_threads),
 	CONFIG_EOL
 };
 
@@ -0,0 +1,662 @@
+/*
+ * vim:noexpandtab:shiftwidth=8:tabstop=8:
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/**
+ * @addtogroup FSAL_MDCACHE
+ * @{
+ */
+
+/**
+ * @file mdcache_snapshot.c
+ * @brief Warm-start snapshot of the hot entries of the cache
+ *
+ * With Snapshot_Path set, the handles of the most recently used entries,
+ * the parent handles of directories and the number of their cached dirents
+ * are saved every Snapshot_Interval seconds and at shutdown.  At startup, a
+ * thread waits for the exports to be set up and reloads them on
+ * Snapshot_Reload_Threads threads, so that the cache is warm again by the
+ * time the clients come back from the grace period.
+ *
+ * Nothing is trusted from the file but the handles: each one is looked up
+ * again through the sub-FSAL, and dirents are re-read from it.  A handle
+ * that went stale is just skipped.
+ *
+ * The file holds a struct mdcache_snapshot_header followed by its records,
+ * each a struct mdcache_snapshot_record followed by the handle and the
+ * parent handle, each padded to 8 bytes.  Integers are in host order: the
+ * file is only meant to be read back by the same server.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "log.h"
+#include "fsal.h"
+#include "fridgethr.h"
+#include "export_mgr.h"
+#include "nfs_init.h"
+#include "sal_functions.h"
+#include "mdcache_int.h"
+#include "mdcache_lru.h"
+#include "mdcache.h"
+
+#define MDCACHE_SNAPSHOT_MAGIC "MDCSNAP1"
+#define MDCACHE_SNAPSHOT_VERSION 1
+#define MDCACHE_SNAPSHOT_ALIGN(len) (((len) + 7) & ~(size_t)7)
+
+struct mdcache_snapshot_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t count;
+};
+
+struct mdcache_snapshot_record {
+	int32_t export_id;
+	uint16_t handle_len;
+	uint16_t parent_len;
+	/** Dirents cached for a directory */
+	uint32_t dirents;
+	uint8_t type;
+	uint8_t pad[3];
+};
+
+/** A record read back, pointing into the loaded file */
+struct mdcache_snapshot_item {
+	struct mdcache_snapshot_record rec;
+	struct gsh_buffdesc handle;
+	struct gsh_buffdesc parent;
+};
+
+struct mdcache_snapshot_reload {
+	struct mdcache_snapshot_item *items;
+	uint32_t count;
+	/** Next item to reload, shared by the workers */
+	uint32_t next;
+	uint32_t reloaded;
+};
+
+/** Progress of the reload, under snapshot_mtx */
+static enum {
+	SNAPSHOT_WAITING,	/* for the server to be initialized */
+	SNAPSHOT_RELOADING,
+	SNAPSHOT_DONE,
+	SNAPSHOT_STOPPED,	/* by shutdown, before the end */
+} snapshot_state;
+
+static pthread_mutex_t snapshot_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t snapshot_cond = PTHREAD_COND_INITIALIZER;
+static uint32_t snapshot_stop;
+static struct fridgethr *snapshot_fridge;
+
+/**
+ * @brief Append one entry to a snapshot
+ *
+ * @param[in] f      File being written
+ * @param[in] entry  Entry with a reference, released here
+ *
+ * @return true if the entry was written.
+ */
+static bool mdcache_snapshot_write_entry(FILE *f, mdcache_entry_t *entry)
+{
+	static const char zeros[8];
+	char handle[NFS4_FHSIZE];
+	struct gsh_buffdesc fh_desc = { handle, sizeof(handle) };
+	struct gsh_buffdesc parent = { NULL, 0 };
+	struct mdcache_snapshot_record rec;
+	struct root_op_context ctx;
+	struct gsh_export *export;
+	int32_t export_id;
+	fsal_status_t status;
+	bool written = false;
+
+	export_id = atomic_fetch_int32_t(&entry->first_export_id);
+	export = export_id < 0 ? NULL : get_gsh_export(export_id);
+
+	if (export == NULL) {
+		/* Unexported since; as in lru_run_lane(), this unref is ok
+		 * without an op_ctx. */
+		mdcache_put(entry);
+		return false;
+	}
+
+	init_root_op_context(&ctx, export, export->fsal_export, 0, 0,
+			     UNKNOWN_REQUEST);
+
+	if (export->fsal_export->fsal != &MDCACHE.module)
+		goto out;
+
+	subcall_raw(mdc_cur_export(),
+		    status = entry->sub_handle->obj_ops->handle_to_wire(
+				entry->sub_handle, FSAL_DIGEST_NFSV4, &fh_desc)
+		   );
+	if (FSAL_IS_ERROR(status))
+		goto out;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.export_id = export_id;
+	rec.handle_len = fh_desc.len;
+	rec.type = entry->obj_handle.type;
+
+	if (entry->obj_handle.type == DIRECTORY) {
+		struct glist_head *glist;
+
+		PTHREAD_RWLOCK_rdlock(&entry->content_lock);
+
+		if (entry->fsobj.fsdir.parent.len != 0)
+			mdcache_copy_fh(&parent, &entry->fsobj.fsdir.parent);
+
+		glist_for_each(glist, &entry->fsobj.fsdir.chunks) {
+			struct dir_chunk *chunk =
+			    glist_entry(glist, struct dir_chunk, chunks);
+
+			rec.dirents += chunk->num_entries;
+		}
+
+		PTHREAD_RWLOCK_unlock(&entry->content_lock);
+
+		rec.parent_len = parent.len;
+	}
+
+	written = fwrite(&rec, sizeof(rec), 1, f) == 1 &&
+		  fwrite(fh_desc.addr, fh_desc.len, 1, f) == 1 &&
+		  fwrite(zeros, MDCACHE_SNAPSHOT_ALIGN(fh_desc.len) -
+			 fh_desc.len, 1, f) <= 1 &&
+		  (parent.len == 0 ||
+		   (fwrite(parent.addr, parent.len, 1, f) == 1 &&
+		    fwrite(zeros, MDCACHE_SNAPSHOT_ALIGN(parent.len) -
+			   parent.len, 1, f) <= 1));
+
+	if (parent.addr != NULL)
+		mdcache_free_fh(&parent);
+
+out:
+	mdcache_put(entry);
+	release_root_op_context();
+	put_gsh_export(export);
+
+	return written;
+}
+
+/**
+ * @brief Save the hot entries of the cache to Snapshot_Path
+ *
+ * The snapshot is written next to the old one and renamed over it, so
+ * that a crash never leaves a truncated file behind.
+ *
+ * @return 0 on success, a POSIX error otherwise.
+ */
+static int mdcache_snapshot_save(void)
+{
+	const char *path = mdcache_param.snapshot_path;
+	struct mdcache_snapshot_header hdr;
+	mdcache_entry_t **entries;
+	char *tmp;
+	size_t n, i;
+	FILE *f;
+	int rc = 0;
+
+	tmp = gsh_malloc(strlen(path) + sizeof(".tmp"));
+	sprintf(tmp, "%s.tmp", path);
+
+	f = fopen(tmp, "w");
+	if (f == NULL) {
+		rc = errno;
+		LogCrit(COMPONENT_CACHE_INODE,
+			"Could not create cache snapshot %s: %s",
+			tmp, strerror(rc));
+		gsh_free(tmp);
+		return rc;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, MDCACHE_SNAPSHOT_MAGIC, sizeof(hdr.magic));
+	hdr.version = MDCACHE_SNAPSHOT_VERSION;
+	if (fwrite(&hdr, sizeof(hdr), 1, f) != 1)
+		rc = EIO;
+
+	entries = gsh_calloc(mdcache_param.snapshot_entries,
+			     sizeof(*entries));
+	n = mdcache_lru_hot(entries, mdcache_param.snapshot_entries);
+
+	/* Every entry must be written, or at least put, whatever happens */
+	for (i = 0; i < n; ++i) {
+		if (rc != 0) {
+			mdcache_put(entries[i]);
+			continue;
+		}
+		if (mdcache_snapshot_write_entry(f, entries[i]))
+			hdr.count++;
+		else if (ferror(f))
+			rc = EIO;
+	}
+	gsh_free(entries);
+
+	/* Now that the count is known */
+	if (rc == 0 &&
+	    (fseek(f, 0, SEEK_SET) != 0 ||
+	     fwrite(&hdr, sizeof(hdr), 1, f) != 1 ||
+	     fflush(f) != 0 ||
+	     fsync(fileno(f)) != 0))
+		rc = errno ? errno : EIO;
+
+	if (fclose(f) != 0 && rc == 0)
+		rc = errno;
+
+	if (rc == 0 && rename(tmp, path) != 0)
+		rc = errno;
+
+	if (rc != 0) {
+		LogCrit(COMPONENT_CACHE_INODE,
+			"Could not write cache snapshot %s: %s",
+			path, strerror(rc));
+		(void) unlink(tmp);
+	} else {
+		LogDebug(COMPONENT_CACHE_INODE,
+			 "Saved %"PRIu32" entries in cache snapshot %s",
+			 hdr.count, path);
+	}
+
+	gsh_free(tmp);
+	return rc;
+}
+
+/**
+ * @brief Read and check a snapshot
+ *
+ * @param[in]  path   Snapshot to read
+ * @param[out] buf    Contents of the file, to be freed by the caller
+ * @param[out] items  Records, pointing into @a buf, to be freed by the caller
+ *
+ * @return the number of records, 0 if there is no valid snapshot.
+ */
+static uint32_t mdcache_snapshot_load(const char *path, char **buf,
+				      struct mdcache_snapshot_item **items)
+{
+	struct mdcache_snapshot_header hdr;
+	struct stat st;
+	size_t off, done = 0;
+	uint32_t i;
+	ssize_t len;
+	int fd;
+
+	*buf = NULL;
+	*items = NULL;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		if (errno != ENOENT)
+			LogCrit(COMPONENT_CACHE_INODE,
+				"Could not open cache snapshot %s: %s",
+				path, strerror(errno));
+		return 0;
+	}
+
+	if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(hdr)) {
+		close(fd);
+		goto invalid;
+	}
+
+	*buf = gsh_malloc(st.st_size);
+	while (done < st.st_size) {
+		len = read(fd, *buf + done, st.st_size - done);
+		if (len <= 0)
+			break;
+		done += len;
+	}
+	close(fd);
+
+	if (done != st.st_size)
+		goto invalid;
+
+	memcpy(&hdr, *buf, sizeof(hdr));
+	if (memcmp(hdr.magic, MDCACHE_SNAPSHOT_MAGIC, sizeof(hdr.magic)) != 0
+	    || hdr.version != MDCACHE_SNAPSHOT_VERSION)
+		goto invalid;
+
+	/* Snapshot_Entries was lowered since; the hottest entries come first */
+	if (hdr.count > mdcache_param.snapshot_entries) {
+		LogInfo(COMPONENT_CACHE_INODE,
+			"Loading the first %"PRIu32" of the %"PRIu32
+			" entries of cache snapshot %s",
+			mdcache_param.snapshot_entries, hdr.count, path);
+		hdr.count = mdcache_param.snapshot_entries;
+	}
+
+	*items = gsh_calloc(hdr.count, sizeof(**items));
+
+	for (off = sizeof(hdr), i = 0; i < hdr.count; ++i) {
+		struct mdcache_snapshot_item *item = &(*items)[i];
+
+		if (st.st_size - off < sizeof(item->rec))
+			goto invalid;
+		memcpy(&item->rec, *buf + off, sizeof(item->rec));
+		off += sizeof(item->rec);
+
+		if (item->rec.handle_len == 0 ||
+		    item->rec.handle_len > NFS4_FHSIZE ||
+		    item->rec.parent_len > NFS4_FHSIZE ||
+		    st.st_size - off <
+			MDCACHE_SNAPSHOT_ALIGN(item->rec.handle_len) +
+			MDCACHE_SNAPSHOT_ALIGN(item->rec.parent_len))
+			goto invalid;
+
+		item->handle.addr = *buf + off;
+		item->handle.len = item->rec.handle_len;
+		off += MDCACHE_SNAPSHOT_ALIGN(item->rec.handle_len);
+		item->parent.addr = *buf + off;
+		item->parent.len = item->rec.parent_len;
+		off += MDCACHE_SNAPSHOT_ALIGN(item->rec.parent_len);
+	}
+
+	return hdr.count;
+
+invalid:
+	LogCrit(COMPONENT_CACHE_INODE,
+		"Ignoring invalid cache snapshot %s", path);
+	gsh_free(*items);
+	gsh_free(*buf);
+	*items = NULL;
+	*buf = NULL;
+	return 0;
+}
+
+static enum fsal_dir_result
+mdcache_snapshot_readdir_cb(const char *name, struct fsal_obj_handle *obj,
+			    struct attrlist *attrs, void *dir_state,
+			    fsal_cookie_t cookie)
+{
+	uint32_t *left = dir_state;
+
+	/* Put the ref on obj that readdir took */
+	obj->obj_ops->put_ref(obj);
+
+	return --(*left) == 0 ? DIR_TERMINATE : DIR_CONTINUE;
+}
+
+/**
+ * @brief Look up the handle of @a item again
+ *
+ * The parent of a directory is looked up too, but its link is left for
+ * mdc_get_parent() to set: the directory may have moved since.  As many
+ * dirents as were cached are then read again.
+ *
+ * @return true if the entry is in the cache.
+ */
+static bool mdcache_snapshot_reload_item(struct mdcache_snapshot_item *item)
+{
+	struct root_op_context ctx;
+	struct gsh_export *export;
+	mdcache_entry_t *entry;
+	fsal_status_t status;
+
+	export = get_gsh_export(item->rec.export_id);
+	if (export == NULL)
+		return false;
+
+	init_root_op_context(&ctx, export, export->fsal_export, 0, 0,
+			     UNKNOWN_REQUEST);
+
+	if (export->fsal_export->fsal != &MDCACHE.module) {
+		status = fsalstat(ERR_FSAL_STALE, 0);
+		goto out;
+	}
+
+	status = mdcache_locate_host(&item->handle, mdc_cur_export(), &entry,
+				     NULL);
+	if (FSAL_IS_ERROR(status))
+		goto out;
+
+	if (entry->obj_handle.type == DIRECTORY) {
+		mdcache_entry_t *parent;
+		uint32_t left = item->rec.dirents;
+		bool eod;
+
+		if (item->parent.len != 0 &&
+		    !FSAL_IS_ERROR(mdcache_locate_host(&item->parent,
+						       mdc_cur_export(),
+						       &parent, NULL)))
+			mdcache_put(parent);
+
+		if (left != 0 && mdcache_param.dir.avl_chunk != 0)
+			(void) entry->obj_handle.obj_ops->readdir(
+					&entry->obj_handle, NULL, &left,
+					mdcache_snapshot_readdir_cb, 0, &eod);
+	}
+
+	mdcache_put(entry);
+
+out:
+	release_root_op_context();
+	put_gsh_export(export);
+
+	return !FSAL_IS_ERROR(status);
+}
+
+static void *mdcache_snapshot_reload_worker(void *arg)
+{
+	struct mdcache_snapshot_reload *reload = arg;
+	uint32_t i;
+
+	SetNameFunction("mdc_snap_rl");
+
+	while (!atomic_fetch_uint32_t(&snapshot_stop) &&
+	       (i = atomic_postinc_uint32_t(&reload->next)) < reload->count) {
+		if (mdcache_snapshot_reload_item(&reload->items[i]))
+			(void) atomic_inc_uint32_t(&reload->reloaded);
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief Reload the snapshot once the exports are set up
+ */
+static void *mdcache_snapshot_reload_thread(void *arg)
+{
+	struct mdcache_snapshot_reload reload;
+	pthread_t *workers;
+	uint32_t nworkers, i;
+	char *buf;
+
+	SetNameFunction("mdc_snap");
+
+	nfs_init_wait();
+
+	PTHREAD_MUTEX_lock(&snapshot_mtx);
+	snapshot_state = SNAPSHOT_RELOADING;
+	PTHREAD_MUTEX_unlock(&snapshot_mtx);
+
+	memset(&reload, 0, sizeof(reload));
+	reload.count = mdcache_snapshot_load(mdcache_param.snapshot_path,
+					     &buf, &reload.items);
+
+	nworkers = mdcache_param.snapshot_reload_threads;
+	if (nworkers > reload.count)
+		nworkers = reload.count;
+
+	workers = gsh_calloc(nworkers, sizeof(*workers));
+	for (i = 0; i < nworkers; ++i) {
+		if (pthread_create(&workers[i], NULL,
+				   mdcache_snapshot_reload_worker,
+				   &reload) != 0)
+			break;
+	}
+	nworkers = i;
+
+	/* With no worker at all, reload here */
+	if (nworkers == 0)
+		(void) mdcache_snapshot_reload_worker(&reload);
+
+	for (i = 0; i < nworkers; ++i)
+		pthread_join(workers[i], NULL);
+
+	if (reload.count != 0)
+		LogEvent(COMPONENT_CACHE_INODE,
+			 "Reloaded %"PRIu32" of %"PRIu32
+			 " entries from cache snapshot %s %s the grace period ended",
+			 reload.reloaded, reload.count,
+			 mdcache_param.snapshot_path,
+			 nfs_in_grace() ? "before" : "after");
+
+	gsh_free(workers);
+	gsh_free(reload.items);
+	gsh_free(buf);
+
+	PTHREAD_MUTEX_lock(&snapshot_mtx);
+	snapshot_state = reload.next < reload.count ? SNAPSHOT_STOPPED
+						    : SNAPSHOT_DONE;
+	pthread_cond_broadcast(&snapshot_cond);
+	PTHREAD_MUTEX_unlock(&snapshot_mtx);
+
+	return NULL;
+}
+
+static bool mdcache_snapshot_reloaded(void)
+{
+	bool done;
+
+	PTHREAD_MUTEX_lock(&snapshot_mtx);
+	done = snapshot_state == SNAPSHOT_DONE;
+	PTHREAD_MUTEX_unlock(&snapshot_mtx);
+
+	return done;
+}
+
+static void mdcache_snapshot_run(struct fridgethr_context *ctx)
+{
+	SetNameFunction("mdc_snap_save");
+
+	/* Never replace a snapshot with a cache not warmed from it yet */
+	if (mdcache_snapshot_reloaded())
+		(void) mdcache_snapshot_save();
+}
+
+/**
+ * @brief Start reloading the snapshot, and saving it periodically
+ *
+ * Nothing is done unless Snapshot_Path is set.
+ *
+ * @return 0 on success, a POSIX error otherwise.
+ */
+int mdcache_snapshot_pkginit(void)
+{
+	struct fridgethr_params frp;
+	pthread_attr_t attr;
+	pthread_t thrid;
+	int rc;
+
+	if (mdcache_param.snapshot_path == NULL)
+		return 0;
+
+	snapshot_state = SNAPSHOT_WAITING;
+	atomic_store_uint32_t(&snapshot_stop, 0);
+
+	rc = pthread_attr_init(&attr);
+	if (rc == 0) {
+		(void) pthread_attr_setdetachstate(&attr,
+						   PTHREAD_CREATE_DETACHED);
+		rc = pthread_create(&thrid, &attr,
+				    mdcache_snapshot_reload_thread, NULL);
+		pthread_attr_destroy(&attr);
+	}
+	if (rc != 0) {
+		LogMajor(COMPONENT_CACHE_INODE,
+			 "Unable to start cache snapshot reload, error code %d.",
+			 rc);
+		return rc;
+	}
+
+	if (mdcache_param.snapshot_interval == 0)
+		return 0;
+
+	memset(&frp, 0, sizeof(struct fridgethr_params));
+	frp.thr_max = 1;
+	frp.thr_min = 1;
+	frp.thread_delay = mdcache_param.snapshot_interval;
+	frp.flavor = fridgethr_flavor_looper;
+
+	rc = fridgethr_init(&snapshot_fridge, "MDC_snap_fridge", &frp);
+	if (rc != 0) {
+		LogMajor(COMPONENT_CACHE_INODE,
+			 "Unable to initialize cache snapshot fridge, error code %d.",
+			 rc);
+		return rc;
+	}
+
+	rc = fridgethr_submit(snapshot_fridge, mdcache_snapshot_run, NULL);
+	if (rc != 0) {
+		LogMajor(COMPONENT_CACHE_INODE,
+			 "Unable to start cache snapshot thread, error code %d.",
+			 rc);
+		return rc;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Stop the snapshot threads and save a last snapshot
+ *
+ * To be called at shutdown, while the exports are still there.
+ */
+void mdcache_snapshot_shutdown(void)
+{
+	bool reloaded;
+	int rc;
+
+	if (mdcache_param.snapshot_path == NULL)
+		return;
+
+	if (snapshot_fridge != NULL) {
+		rc = fridgethr_sync_command(snapshot_fridge,
+					    fridgethr_comm_stop, 120);
+		if (rc == ETIMEDOUT) {
+			LogMajor(COMPONENT_CACHE_INODE,
+				 "Shutdown timed out, cancelling threads.");
+			fridgethr_cancel(snapshot_fridge);
+		} else if (rc != 0) {
+			LogMajor(COMPONENT_CACHE_INODE,
+				 "Failed shutting down cache snapshot thread: %d",
+				 rc);
+		}
+		fridgethr_destroy(snapshot_fridge);
+		snapshot_fridge = NULL;
+	}
+
+	/* Cut the reload short and wait for its workers */
+	atomic_store_uint32_t(&snapshot_stop, 1);
+
+	PTHREAD_MUTEX_lock(&snapshot_mtx);
+	while (snapshot_state == SNAPSHOT_RELOADING)
+		pthread_cond_wait(&snapshot_cond, &snapshot_mtx);
+	reloaded = snapshot_state == SNAPSHOT_DONE;
+	PTHREAD_MUTEX_unlock(&snapshot_mtx);
+
+	if (reloaded)
+		(void) mdcache_snapshot_save();
+}
+
+/** @} */
@@ -20,6 +20,7 @@
  */
 
 #include "log.h"
+#include "txn_logger.h"
 #include "txnfs_methods.h"
 #include <assert.h>
 #include <fsal_convert.h>
@@ -96,11 +97,12 @@ struct fsal_obj_handle *query_backup_root(struct fsal_obj_handle *txn_root)
 struct fsal_obj_handle *query_txn_backup(struct fsal_obj_handle *backup_root,
 					 uint64_t txnid)
 {
+	struct txnfs_cache *cache = op_ctx->txn_cache;
 	struct fsal_obj_handle *backup_dir = NULL;
 	fsal_status_t ret;
 	char dir_name[BKP_FN_LEN];
 
-	if (op_ctx->txn_bkp_folder) return op_ctx->txn_bkp_folder;
+	if (cache && cache->bkp_folder) return cache->bkp_folder;
 
 	/* construct backup folder name */
 	snprintf(dir_name, BKP_FN_LEN, "%lu", txnid);
@@ -108,7 +110,7 @@ struct fsal_obj_handle *query_txn_backup(struct fsal_obj_handle *backup_root,
 	ret = fsal_lookup(backup_root, dir_name, &backup_dir, NULL);
 
 	if (FSAL_IS_SUCCESS(ret)) {
-		op_ctx->txn_bkp_folder = backup_dir;
+		if (cache) cache->bkp_folder = backup_dir;
 		return backup_dir;
 	} else if (ret.major == ERR_FSAL_NOENT) {
 		return NULL;
@@ -119,19 +121,229 @@ struct fsal_obj_handle *query_txn_backup(struct fsal_obj_handle *backup_root,
 	return NULL;
 }
 
+/**
+ * @brief Take a free backup slot, creating a new one if the pool allows
+ *
+ * NOTE: This function assumes LOWER fsal.
+ *
+ * @param[in] exp		TXNFS's export
+ * @param[in] backup_root	TXNFS's global backup directory (sub handle)
+ *
+ * @return A slot for exclusive use by the ongoing transaction, or NULL if
+ * 	   all @c BackupSlots slots are in use.
+ */
+static struct txnfs_bkp_slot *get_backup_slot(struct txnfs_fsal_export *exp,
+					      struct fsal_obj_handle *backup_root)
+{
+	struct txnfs_bkp_slot *slot;
+	struct attrlist attrs = {0};
+	char slot_name[BKP_FN_LEN];
+	fsal_status_t status;
+	int index;
+
+	PTHREAD_MUTEX_lock(&exp->slot_lock);
+	slot = exp->free_slots;
+	if (slot) {
+		exp->free_slots = slot->next;
+		PTHREAD_MUTEX_unlock(&exp->slot_lock);
+		return slot;
+	}
+	if (exp->n_slots >= (int)TXNFS.backup_slots) {
+		PTHREAD_MUTEX_unlock(&exp->slot_lock);
+		return NULL;
+	}
+	index = exp->n_slots++;
+	PTHREAD_MUTEX_unlock(&exp->slot_lock);
+
+	/* Grow the pool. The directory may be left from a previous run;
+	 * txnfs_recover_backup_slots() has emptied it at startup then. */
+	slot = gsh_calloc(1, sizeof(*slot));
+	slot->index = index;
+	snprintf(slot_name, BKP_FN_LEN, TXN_SLOT_FMT, index);
+	status = fsal_lookup(backup_root, slot_name, &slot->dir, NULL);
+	if (status.major == ERR_FSAL_NOENT) {
+		FSAL_SET_MASK(attrs.valid_mask,
+			      ATTR_MODE | ATTR_OWNER | ATTR_GROUP);
+		attrs.mode = 0777;
+		attrs.owner = 0;
+		attrs.group = 0;
+		status = fsal_create(backup_root, slot_name, DIRECTORY, &attrs,
+				     NULL, &slot->dir, NULL);
+	}
+	if (FSAL_IS_ERROR(status)) {
+		LogWarn(COMPONENT_FSAL, "cannot set up backup slot %d: %d",
+			index, status.major);
+		gsh_free(slot);
+		return NULL;
+	}
+	return slot;
+}
+
+/**
+ * @brief Name the txn a backup slot is taken by
+ *
+ * The empty file "txn-<txnid>" in the slot tells, after a crash, whose
+ * backups the slot holds (see txnfs_recover_backup_slots()). Emptying the
+ * slot removes it.
+ *
+ * NOTE: This function assumes LOWER fsal.
+ *
+ * @return 0 on success, the FSAL error otherwise.
+ */
+static int mark_backup_slot(struct txnfs_bkp_slot *slot, uint64_t txnid)
+{
+	struct fsal_obj_handle *marker = NULL;
+	struct attrlist attrs = {0};
+	char name[BKP_FN_LEN];
+	fsal_status_t status;
+
+	FSAL_SET_MASK(attrs.valid_mask, ATTR_MODE | ATTR_OWNER | ATTR_GROUP);
+	attrs.mode = 0600;
+	attrs.owner = 0;
+	attrs.group = 0;
+	snprintf(name, BKP_FN_LEN, TXN_SLOT_OWNER_PREFIX "%lu", txnid);
+	status = fsal_create(slot->dir, name, REGULAR_FILE, &attrs, NULL,
+			     &marker, NULL);
+	if (FSAL_IS_ERROR(status)) {
+		LogWarn(COMPONENT_FSAL, "cannot mark backup slot %d: %d",
+			slot->index, status.major);
+		return status.major;
+	}
+	marker->obj_ops->release(marker);
+	return 0;
+}
+
+/**
+ * @brief Return an emptied backup slot to the pool
+ */
+void txnfs_put_backup_slot(struct txnfs_fsal_export *exp,
+			   struct txnfs_bkp_slot *slot)
+{
+	PTHREAD_MUTEX_lock(&exp->slot_lock);
+	slot->next = exp->free_slots;
+	exp->free_slots = slot;
+	PTHREAD_MUTEX_unlock(&exp->slot_lock);
+}
+
+static enum fsal_dir_result record_slot_dirent(const char *name,
+					       struct fsal_obj_handle *obj,
+					       struct attrlist *attrs,
+					       void *dir_state,
+					       fsal_cookie_t cookie)
+{
+	struct glist_head *slots = dir_state;
+	struct txnfs_file_entry *entry;
+	int index;
+
+	if (sscanf(name, TXN_SLOT_FMT, &index) != 1) {
+		obj->obj_ops->release(obj);
+		return DIR_CONTINUE;
+	}
+	entry = gsh_malloc(sizeof(*entry));
+	entry->name = gsh_strdup(name);
+	entry->obj = obj;
+	glist_add(slots, &entry->glist);
+	return DIR_CONTINUE;
+}
+
+static enum fsal_dir_result find_slot_owner(const char *name,
+					    struct fsal_obj_handle *obj,
+					    struct attrlist *attrs,
+					    void *dir_state,
+					    fsal_cookie_t cookie)
+{
+	uint64_t *owner = dir_state;
+
+	obj->obj_ops->release(obj);
+	if (sscanf(name, TXN_SLOT_OWNER_PREFIX "%" SCNu64, owner) == 1)
+		return DIR_TERMINATE;
+	return DIR_CONTINUE;
+}
+
+/**
+ * @brief Deal with the backup slots a previous run left
+ *
+ * A slot still marked by a txn whose log is in the database holds the
+ * backups of a txn the crash interrupted. It is renamed to the txnid, the
+ * backup directory of a txn that got no slot, so that the backups survive
+ * for undoing that txn and the slot name is free again. The other slots are
+ * emptied for reuse. Must run after txnfs_recover(), before any txn takes a
+ * slot.
+ *
+ * @param[in] exp	The export being created; op_ctx points to it
+ */
+void txnfs_recover_backup_slots(struct txnfs_fsal_export *exp)
+{
+	struct fsal_obj_handle *bkp_root;
+	struct glist_head slots, *node, *tmp;
+	struct txnfs_file_entry *ent;
+	char txnid_name[BKP_FN_LEN];
+	fsal_status_t status;
+	uint64_t owner;
+	bool eof;
+	int pending;
+
+	glist_init(&slots);
+
+	/* ---- switch export ---- */
+	op_ctx->fsal_export = exp->export.sub_export;
+
+	bkp_root = query_backup_root(exp->root);
+	if (bkp_root == NULL)
+		goto out;
+
+	status = bkp_root->obj_ops->readdir(bkp_root, NULL, &slots,
+					    record_slot_dirent, 0, &eof);
+	if (FSAL_IS_ERROR(status))
+		LogFatal(COMPONENT_FSAL, "cannot list backup slots: %d",
+			 status.major);
+
+	glist_for_each_safe(node, tmp, &slots) {
+		ent = glist_entry(node, struct txnfs_file_entry, glist);
+		owner = 0;
+		status = ent->obj->obj_ops->readdir(ent->obj, NULL, &owner,
+						    find_slot_owner, 0, &eof);
+		if (FSAL_IS_ERROR(status))
+			LogFatal(COMPONENT_FSAL, "cannot read backup slot %s: %d",
+				 ent->name, status.major);
+
+		/* keep the backups unless the txn is known to be over */
+		pending = owner != 0 ? txn_log_exists(TXNFS.db, owner) : 0;
+		if (pending != 0) {
+			snprintf(txnid_name, BKP_FN_LEN, "%" PRIu64, owner);
+			status = ent->obj->obj_ops->rename(
+			    ent->obj, bkp_root, ent->name, bkp_root, txnid_name);
+			if (FSAL_IS_ERROR(status))
+				LogFatal(COMPONENT_FSAL,
+					 "cannot keep backup slot %s of txn %s: %d",
+					 ent->name, txnid_name, status.major);
+			LogEvent(COMPONENT_FSAL,
+				 "backup slot %s renamed after its pending txn %s",
+				 ent->name, txnid_name);
+		} else {
+			txnfs_empty_backup_dir(ent->obj);
+		}
+		ent->obj->obj_ops->release(ent->obj);
+		gsh_free(ent->name);
+		glist_del(node);
+		gsh_free(ent);
+	}
+
+out:
+	/* ---- restore export ---- */
+	op_ctx->fsal_export = &exp->export;
+}
+
 /**
  * @brief Find the individual backup directory for the ongoing transaction
  *
  * This function will look up the individual backup folder for the transaction
- * that is being performed. If the folder does not exist, it will try to
- * create one.
+ * that is being performed. If there is none yet, it takes a reusable backup
+ * slot, or creates a directory named after the txnid if no slot is free.
  *
  * Note, that this function does not require @c txnid parameter because it
  * retrieves this from the context variable @c op_ctx.
  *
- * TODO: store backup root directory in @c txnfs_fsal_export so that we
- * won't have to look it up every time this is called.
- *
  * @param[out] bkp_handle	The @c fsal_obj_handle of the backup folder
  *
  * @return The FSAL status code.
@@ -143,11 +355,21 @@ fsal_status_t txnfs_create_or_lookup_backup_dir(
 	/* create txn backup directory */
 	struct fsal_obj_handle *root_entry = NULL;
 	struct fsal_obj_handle *txn_handle = NULL;
+	struct txnfs_bkp_slot *slot = NULL;
+	struct txnfs_cache *cache = op_ctx->txn_cache;
 	struct attrlist attrs = {0};
 	uint64_t txnid = op_ctx->txnid;
 	char txnid_name[BKP_FN_LEN] = {'\0'};
 	fsal_status_t status = {ERR_FSAL_NO_ERROR, 0};
 
+	/* already set up for this transaction */
+	PTHREAD_MUTEX_lock(&cache->lock);
+	if (cache->bkp_folder) {
+		*bkp_handle = cache->bkp_folder;
+		PTHREAD_MUTEX_unlock(&cache->lock);
+		return status;
+	}
+
 	/* get txnfs root directory handle */
 	get_txn_root(&root_entry, &attrs);
 
@@ -183,6 +405,18 @@ fsal_status_t txnfs_create_or_lookup_backup_dir(
 		exp->bkproot = txn_handle;
 	}
 
+	if (TXNFS.backup_slots > 0) slot = get_backup_slot(exp, txn_handle);
+	if (slot && mark_backup_slot(slot, txnid) != 0) {
+		txnfs_put_backup_slot(exp, slot);
+		slot = NULL;
+	}
+	if (slot) {
+		cache->bkp_slot = slot;
+		cache->bkp_folder = slot->dir;
+		*bkp_handle = slot->dir;
+		goto out;
+	}
+
 	*bkp_handle = query_txn_backup(txn_handle, txnid);
 
 	if (*bkp_handle == NULL) {
@@ -194,10 +428,22 @@ fsal_status_t txnfs_create_or_lookup_backup_dir(
 				     NULL, bkp_handle, NULL);
 		assert(FSAL_IS_SUCCESS(status));
 		assert(*bkp_handle);
-		op_ctx->txn_bkp_folder = *bkp_handle;
+		cache->bkp_folder = *bkp_handle;
 	}
 
+out:
+	/* before anything is backed up there: from now on, the txn cannot be
+	 * undone from its log alone (see recovery.c). A slot that still
+	 * holds the backups of a pending txn is renamed after it. */
+	snprintf(txnid_name, BKP_FN_LEN, "%lu", txnid);
+	if (add_txn_backup_dir(TXNFS.db, txnid, cache->n_undo_records,
+			       txnid_name) != 0)
+		LogFatal(COMPONENT_FSAL,
+			 "can't log backup directory. txnid=%lu", txnid);
+	cache->n_undo_records++;
+
 	op_ctx->fsal_export = &exp->export;
+	PTHREAD_MUTEX_unlock(&cache->lock);
 
 	return status;
 }
@@ -237,6 +483,7 @@ fsal_status_t txnfs_backup_file(unsigned int opidx,
 	/* size to be cloned/copied */
 	size_t sz = 0;
 	char backup_name[BKP_FN_LEN];
+	uint64_t start = txnfs_phase_now();
 
 	fsal_status_t status = txnfs_create_or_lookup_backup_dir(&bkp_folder);
 	assert(FSAL_IS_SUCCESS(status));
@@ -299,11 +546,460 @@ fsal_status_t txnfs_backup_file(unsigned int opidx,
 	/* Release the created fsal_obj_handle to prevent leak */
 	dst_hdl->obj_ops->release(dst_hdl);
 	op_ctx->fsal_export = &exp->export;
+	txnfs_phase_record(TXNFS_PHASE_BACKUP, txnfs_phase_now() - start);
 	txnfs_tracepoint(done_backup_file, opidx, src_hdl->type,
 			 object_file_type_to_str(src_hdl->type), sz);
 	return status;
 }
 
+/* Same as txnfs_find_bkp_object, with the cache lock held */
+static struct txnfs_bkp_object *find_bkp_object(struct txnfs_cache *cache,
+						uint64_t fileid)
+{
+	struct txnfs_bkp_object *obj;
+
+	for (obj = cache->bkp_objects; obj; obj = obj->next)
+		if (obj->fileid == fileid) return obj;
+	return NULL;
+}
+
+/**
+ * @brief Find the range backup of a file in the ongoing transaction
+ *
+ * @param[in] fileid	File ID of the sub handle of the file
+ *
+ * @return The backup object, or NULL if the file has not been backed up by
+ * 	   range in this transaction.
+ */
+struct txnfs_bkp_object *txnfs_find_bkp_object(uint64_t fileid)
+{
+	struct txnfs_bkp_object *obj;
+
+	PTHREAD_MUTEX_lock(&op_ctx->txn_cache->lock);
+	obj = find_bkp_object(op_ctx->txn_cache, fileid);
+	PTHREAD_MUTEX_unlock(&op_ctx->txn_cache->lock);
+	return obj;
+}
+
+/**
+ * @brief Start the range backup of a file
+ *
+ * NOTE: This function assumes the txn cache lock held.
+ */
+static struct txnfs_bkp_object *new_bkp_object(struct fsal_obj_handle *src_hdl,
+					       uint64_t filesize)
+{
+	struct txnfs_bkp_object *obj;
+
+	obj = gsh_calloc(1, sizeof(*obj));
+	obj->fileid = src_hdl->fileid;
+	obj->orig_size = filesize;
+
+	obj->next = op_ctx->txn_cache->bkp_objects;
+	op_ctx->txn_cache->bkp_objects = obj;
+	return obj;
+}
+
+/**
+ * @brief Create the backup file of a range backup
+ *
+ * The backup file is created empty and then extended to the original size of
+ * the source file, which is what rollback truncates the file back to.
+ *
+ * NOTE: This function assumes LOWER fsal and the txn cache lock held.
+ */
+static void new_bkp_file(struct txnfs_bkp_object *obj,
+			 struct fsal_obj_handle *bkp_folder)
+{
+	struct attrlist attrs = {0};
+	char backup_name[BKP_FN_LEN];
+	fsal_status_t status;
+
+	snprintf(backup_name, BKP_FN_LEN, "%lx.ext", obj->fileid);
+	FSAL_CLEAR_MASK(attrs.valid_mask);
+	FSAL_SET_MASK(attrs.valid_mask, ATTR_MODE | ATTR_OWNER | ATTR_GROUP);
+	attrs.mode = 0666;
+	attrs.owner = 0;
+	attrs.group = 0;
+	status = fsal_create(bkp_folder, backup_name, REGULAR_FILE, &attrs,
+			     NULL, &obj->bkp_hdl, NULL);
+	assert(FSAL_IS_SUCCESS(status));
+
+	if (obj->orig_size > 0) {
+		FSAL_CLEAR_MASK(attrs.valid_mask);
+		FSAL_SET_MASK(attrs.valid_mask, ATTR_SIZE);
+		attrs.filesize = obj->orig_size;
+		status = obj->bkp_hdl->obj_ops->setattr2(obj->bkp_hdl, true,
+							 NULL, &attrs);
+		assert(FSAL_IS_SUCCESS(status));
+		fsal_close(obj->bkp_hdl);
+	}
+}
+
+/**
+ * @brief Record [start, end) as backed up
+ *
+ * The range must not overlap the ones already saved. A range of the backup
+ * file (@c data is NULL) is merged with the ranges of the backup file it
+ * touches; @c data is owned by the extent.
+ */
+static void add_extent(struct txnfs_bkp_object *obj, uint64_t start,
+		       uint64_t end, char *data)
+{
+	struct txnfs_extent *prev, *next;
+	int i;
+
+	/* first extent after the new one */
+	for (i = 0; i < obj->n_extents && obj->extents[i].start < start; i++)
+		;
+	prev = i > 0 ? &obj->extents[i - 1] : NULL;
+	next = i < obj->n_extents ? &obj->extents[i] : NULL;
+
+	if (data == NULL && prev && prev->data == NULL && prev->end == start) {
+		prev->end = end;
+		if (next && next->data == NULL && next->start == end) {
+			prev->end = next->end;
+			memmove(next, next + 1,
+				(obj->n_extents - i - 1) * sizeof(*next));
+			obj->n_extents--;
+		}
+		return;
+	}
+	if (data == NULL && next && next->data == NULL && next->start == end) {
+		next->start = start;
+		return;
+	}
+
+	if (obj->n_extents == obj->max_extents) {
+		obj->max_extents = obj->max_extents ? 2 * obj->max_extents : 8;
+		obj->extents = gsh_realloc(
+		    obj->extents, obj->max_extents * sizeof(*obj->extents));
+	}
+	memmove(&obj->extents[i + 1], &obj->extents[i],
+		(obj->n_extents - i) * sizeof(*obj->extents));
+	obj->n_extents++;
+	obj->extents[i].start = start;
+	obj->extents[i].end = end;
+	obj->extents[i].data = data;
+}
+
+/**
+ * @brief Find the parts of [start, end) that have not been backed up yet
+ *
+ * @param[out] gaps	Room for n_extents + 1 ranges
+ *
+ * @return The number of ranges in @c gaps
+ */
+static int find_gaps(struct txnfs_bkp_object *obj, uint64_t start,
+		     uint64_t end, struct txnfs_extent *gaps)
+{
+	uint64_t pos = start;
+	int i, n = 0;
+
+	for (i = 0; i < obj->n_extents && obj->extents[i].start < end; i++) {
+		if (obj->extents[i].end <= pos) continue;
+		if (obj->extents[i].start > pos) {
+			gaps[n].start = pos;
+			gaps[n++].end = obj->extents[i].start;
+		}
+		pos = obj->extents[i].end;
+	}
+	if (pos < end) {
+		gaps[n].start = pos;
+		gaps[n++].end = end;
+	}
+	return n;
+}
+
+/**
+ * @brief Clone (or copy, if cloning is not supported) a range between two
+ * files at the same offset
+ *
+ * NOTE: This function assumes LOWER fsal.
+ */
+static fsal_status_t copy_range(struct fsal_obj_handle *src,
+				struct fsal_obj_handle *dst, uint64_t start,
+				uint64_t end)
+{
+	loff_t src_offset = start, dst_offset = start;
+	uint64_t copied = 0;
+	fsal_status_t status;
+
+	status = src->obj_ops->clone2(src, &src_offset, dst, &dst_offset,
+				      end - start, 0);
+	if (!FSAL_IS_SUCCESS(status)) {
+		LogDebug(COMPONENT_FSAL, "clone failed (%d, %d), try copy",
+			 status.major, status.minor);
+		status = fsal_copy(src, start, dst, start, end - start, &copied);
+	}
+	return status;
+}
+
+static void sub_io_cb(struct fsal_obj_handle *obj, fsal_status_t ret,
+		      void *io_data, void *caller_data)
+{
+	*(fsal_status_t *)caller_data = ret;
+}
+
+/**
+ * @brief Read or write a range of a file synchronously
+ *
+ * Like 9P, this relies on the Sub-FSAL calling the completion callback
+ * before read2/write2 return, which FSAL_VFS does. Writes are stable.
+ *
+ * NOTE: This function assumes LOWER fsal.
+ */
+fsal_status_t txnfs_sub_io(struct fsal_obj_handle *sub_hdl, bool write,
+			   uint64_t offset, void *buf, size_t len)
+{
+	struct fsal_io_arg *io_arg =
+	    alloca(sizeof(*io_arg) + sizeof(struct iovec));
+	fsal_status_t status = {ERR_FSAL_NO_ERROR, 0};
+
+	io_arg->info = NULL;
+	io_arg->state = NULL;
+	io_arg->offset = offset;
+	io_arg->iov_count = 1;
+	io_arg->iov[0].iov_len = len;
+	io_arg->iov[0].iov_base = buf;
+	io_arg->io_amount = 0;
+	if (write) {
+		io_arg->fsal_stable = true;
+		sub_hdl->obj_ops->write2(sub_hdl, true, sub_io_cb, io_arg,
+					 &status);
+	} else {
+		io_arg->end_of_file = false;
+		sub_hdl->obj_ops->read2(sub_hdl, true, sub_io_cb, io_arg,
+					&status);
+	}
+	if (FSAL_IS_SUCCESS(status) && io_arg->io_amount != len)
+		status = fsalstat(ERR_FSAL_IO, 0);
+	return status;
+}
+
+/**
+ * @brief Add the undos of one WRITE to the txn log as a record of its own
+ *
+ * The log is synced before this returns.
+ */
+static void log_undos(struct InlineUndo *undos, int n)
+{
+	uint64_t start;
+	int ret;
+
+	PTHREAD_MUTEX_lock(&op_ctx->txn_cache->lock);
+	start = txnfs_phase_now();
+	ret = add_txn_undos(TXNFS.db, op_ctx->txnid,
+			    op_ctx->txn_cache->n_undo_records, undos, n);
+	if (ret == 0)
+		op_ctx->txn_cache->n_undo_records++;
+	txnfs_phase_record(TXNFS_PHASE_LOG, txnfs_phase_now() - start);
+	PTHREAD_MUTEX_unlock(&op_ctx->txn_cache->lock);
+	if (ret != 0) {
+		LogFatal(COMPONENT_FSAL, "can't log undo records. txnid=%lu",
+			 op_ctx->txnid);
+	}
+}
+
+/**
+ * @brief Log the original size of a file that a WRITE extends
+ *
+ * A WRITE at or past the original EOF has no data to back up, but undoing it
+ * must still truncate the file, so an undo without data carries the size.
+ */
+static void backup_orig_size(struct txnfs_bkp_object *obj, const uuid_t uuid)
+{
+	struct InlineUndo undo = {0};
+
+	uuid_copy(undo.file_id.id, uuid);
+	undo.file_id.file_type = ft_File;
+	undo.offset = obj->orig_size;
+	undo.orig_size = obj->orig_size;
+	undo.data = "";
+	undo.len = 0;
+
+	log_undos(&undo, 1);
+	obj->size_logged = true;
+}
+
+/**
+ * @brief Save the original data of ranges in memory and in the txn log
+ *
+ * The log is synced before this returns, so the WRITE can then overwrite the
+ * ranges safely.
+ *
+ * NOTE: This function assumes LOWER fsal.
+ */
+static fsal_status_t backup_inline(struct txnfs_bkp_object *obj,
+				   struct fsal_obj_handle *src_hdl,
+				   const uuid_t uuid, struct txnfs_extent *gaps,
+				   int n_gaps)
+{
+	struct InlineUndo *undos = gsh_malloc(n_gaps * sizeof(*undos));
+	fsal_status_t status = {ERR_FSAL_NO_ERROR, 0};
+	int i;
+
+	for (i = 0; i < n_gaps; i++) {
+		gaps[i].data = gsh_malloc(gaps[i].end - gaps[i].start);
+		status = txnfs_sub_io(src_hdl, false, gaps[i].start,
+				      gaps[i].data, gaps[i].end - gaps[i].start);
+		assert(FSAL_IS_SUCCESS(status));
+
+		uuid_copy(undos[i].file_id.id, uuid);
+		undos[i].file_id.file_type = ft_File;
+		undos[i].offset = gaps[i].start;
+		undos[i].orig_size = obj->orig_size;
+		undos[i].data = gaps[i].data;
+		undos[i].len = gaps[i].end - gaps[i].start;
+	}
+
+	log_undos(undos, n_gaps);
+	gsh_free(undos);
+	/* the undos carry the original size */
+	obj->size_logged = true;
+
+	for (i = 0; i < n_gaps; i++)
+		add_extent(obj, gaps[i].start, gaps[i].end, gaps[i].data);
+	return status;
+}
+
+/**
+ * @brief Backup a range of a regular file before it is overwritten
+ *
+ * The original data of a WRITE of at most InlineUndoMaxSize bytes is saved in
+ * the txn log; larger ranges of a file backed up in one transaction go to the
+ * same backup file, at their original offsets. Ranges that have already been
+ * backed up in this transaction are skipped, since the backup must keep the
+ * data as it was before the transaction.
+ *
+ * @params[in] src_hdl	The @c fsal_obj_handle of the source file
+ * @params[in] uuid	The uuid of the source file
+ * @params[in] offset	The offset beginning to backup.
+ * @params[in] length	The size of data to backup.
+ *
+ * NOTE: Same as @c txnfs_backup_file, @c src_hdl is a sub-handle but the
+ * current FSAL export should be TXNFS's export.
+ *
+ * @return FSAL status code
+ */
+fsal_status_t txnfs_backup_extent(struct fsal_obj_handle *src_hdl,
+				  const uuid_t uuid, loff_t offset,
+				  size_t length)
+{
+	struct fsal_obj_handle *bkp_folder = NULL;
+	struct txnfs_bkp_object *obj;
+	struct txnfs_extent *gaps;
+	struct attrlist attrs_out = {0};
+	fsal_status_t status = {ERR_FSAL_NO_ERROR, 0};
+	uint64_t start, end, sz = 0;
+	uint64_t phase_start;
+	bool inline_undo = length <= TXNFS.inline_undo_max;
+	int i, n_gaps;
+
+	/* WRITE fails on anything else, so there is nothing to undo */
+	if (src_hdl->type != REGULAR_FILE) return status;
+
+	phase_start = txnfs_phase_now();
+
+	/* only large ranges need the backup folder */
+	if (!inline_undo) {
+		status = txnfs_create_or_lookup_backup_dir(&bkp_folder);
+		assert(FSAL_IS_SUCCESS(status));
+	}
+
+	struct txnfs_fsal_export *exp =
+	    container_of(op_ctx->fsal_export, struct txnfs_fsal_export, export);
+
+	op_ctx->fsal_export = exp->export.sub_export;
+
+	/* The extents of a file are only changed by the WRITEs to that file,
+	 * which never run concurrently; the list of files is shared with the
+	 * rest of the compound. */
+	PTHREAD_MUTEX_lock(&op_ctx->txn_cache->lock);
+	obj = find_bkp_object(op_ctx->txn_cache, src_hdl->fileid);
+	if (obj == NULL) {
+		attrs_out.request_mask = ATTR_SIZE;
+		status = get_optional_attrs(src_hdl, &attrs_out);
+		assert(FSAL_IS_SUCCESS(status));
+		obj = new_bkp_object(src_hdl, attrs_out.filesize);
+	}
+	if (!inline_undo && obj->bkp_hdl == NULL) new_bkp_file(obj, bkp_folder);
+	PTHREAD_MUTEX_unlock(&op_ctx->txn_cache->lock);
+
+	/* Only data that existed before the transaction needs a backup. The
+	 * range of a backup file is aligned to 4K so that ioctl_FICLONERANGE
+	 * accepts it. */
+	if (inline_undo) {
+		start = offset;
+		end = offset + length;
+	} else {
+		start = round_down(offset, 4096);
+		end = round_up(offset + length, 4096);
+	}
+	if (end > obj->orig_size) end = obj->orig_size;
+	if (start >= end) goto out;
+
+	/* back up the gaps between the extents already saved */
+	gaps = gsh_malloc((obj->n_extents + 1) * sizeof(*gaps));
+	n_gaps = find_gaps(obj, start, end, gaps);
+	for (i = 0; i < n_gaps; i++) sz += gaps[i].end - gaps[i].start;
+
+	if (n_gaps == 0) {
+		/* all saved already */
+	} else if (inline_undo) {
+		status = backup_inline(obj, src_hdl, uuid, gaps, n_gaps);
+	} else {
+		for (i = 0; i < n_gaps; i++) {
+			status = copy_range(src_hdl, obj->bkp_hdl,
+					    gaps[i].start, gaps[i].end);
+			assert(FSAL_IS_SUCCESS(status));
+			add_extent(obj, gaps[i].start, gaps[i].end, NULL);
+		}
+	}
+	gsh_free(gaps);
+
+out:
+	/* the first WRITE to extend the file logs its size, unless an undo of
+	 * its data already has */
+	if (offset + length > obj->orig_size && !obj->size_logged)
+		backup_orig_size(obj, uuid);
+	op_ctx->fsal_export = &exp->export;
+	txnfs_phase_record(TXNFS_PHASE_BACKUP, txnfs_phase_now() - phase_start);
+	txnfs_tracepoint(done_backup_file, op_ctx->opidx, src_hdl->type,
+			 object_file_type_to_str(src_hdl->type), sz);
+	return status;
+}
+
+/**
+ * @brief Release the range backups of the ongoing transaction
+ *
+ * This drops the in-memory extent maps, pre-images and backup file handles;
+ * the backup files themselves are removed with the transaction's backup
+ * folder.
+ */
+void txnfs_release_bkp_objects(void)
+{
+	struct txnfs_bkp_object *obj, *next;
+	int i;
+	struct txnfs_fsal_export *exp =
+	    container_of(op_ctx->fsal_export, struct txnfs_fsal_export, export);
+
+	if (op_ctx->txn_cache->bkp_objects == NULL) return;
+
+	op_ctx->fsal_export = exp->export.sub_export;
+	for (obj = op_ctx->txn_cache->bkp_objects; obj; obj = next) {
+		next = obj->next;
+		if (obj->bkp_hdl)
+			obj->bkp_hdl->obj_ops->release(obj->bkp_hdl);
+		for (i = 0; i < obj->n_extents; i++)
+			gsh_free(obj->extents[i].data);
+		gsh_free(obj->extents);
+		gsh_free(obj);
+	}
+	op_ctx->txn_cache->bkp_objects = NULL;
+	op_ctx->fsal_export = &exp->export;
+}
+
 /**
  * @brief Rollback a transaction
  *
@@ -312,18 +1008,22 @@ fsal_status_t txnfs_backup_file(unsigned int opidx,
  * what have been done successfully, and try to undo these operations given
  * the backup files.
  *
+ * A compound that failed validation (see txnfs_occ_validate) is rolled back
+ * even though all of its ops succeeded.
+ *
  * @param[in] txnid	Transaction ID
  * @param[in] res	NFSv4 Compound object
+ * @param[in] conflict	Whether the compound failed validation
  *
  * @return Status code. Will return 0 if done successfully.
  */
-int txnfs_compound_restore(uint64_t txnid, COMPOUND4res *res)
+int txnfs_compound_restore(uint64_t txnid, COMPOUND4res *res, bool conflict)
 {
 	UDBG;
 	int ret = 0;
 
 	/* it makes no sense to call this if compound operation is completed */
-	assert(res->status != NFS4_OK);
+	assert(conflict || res->status != NFS4_OK);
 
 	/* call the payload function */
 	ret = do_txn_rollback(txnid, res);
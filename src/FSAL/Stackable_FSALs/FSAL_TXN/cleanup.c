@@ -33,15 +33,25 @@
  */
 int cleanup_queue_init(struct cleanup_queue *q, size_t capacity)
 {
+	int err;
+
+	if (capacity == 0) capacity = CLEANUP_QUEUE_LEN;
 	/* If this fails, the whole system will terminate */
 	q->vec = gsh_calloc(capacity, sizeof(*q->vec));
 	q->head = 0;
 	q->tail = 0;
 	q->size = 0;
 	q->capacity = capacity;
+	q->stopping = false;
+	memset(&q->stats, 0, sizeof(q->stats));
 
-	int err = pthread_spin_init(&q->lock, PTHREAD_PROCESS_SHARED);
+	err = pthread_mutex_init(&q->lock, NULL);
 	if (err) goto fail;
+	err = pthread_cond_init(&q->not_empty, NULL);
+	if (err) {
+		pthread_mutex_destroy(&q->lock);
+		goto fail;
+	}
 	return 0;
 
 fail:
@@ -56,27 +66,32 @@ fail:
  * @param[in] q		The pointer to the task queue
  * @param[in] txnid	The transaction ID
  * @param[in] bkp_folder The fsal_obj_handle of backup folder
+ * @param[in] slot	The backup slot of the folder, or NULL
  *
  * @return 0 for success, ENOSPC if the queue is full
  */
 int cleanup_push_txnid(struct cleanup_queue *q, uint64_t txnid,
-		       struct fsal_obj_handle *bkp_folder)
+		       struct fsal_obj_handle *bkp_folder,
+		       struct txnfs_bkp_slot *slot)
 {
-	int err = 0;
-	err = pthread_spin_lock(&q->lock);
-	if (err) {
-		/* EDEADLOCK? */
-		return err;
-	}
+	struct timespec submitted;
+
+	now(&submitted);
+	PTHREAD_MUTEX_lock(&q->lock);
 	if (q->size >= q->capacity) {
-		pthread_spin_unlock(&q->lock);
+		PTHREAD_MUTEX_unlock(&q->lock);
 		return ENOSPC;
 	}
 	q->vec[q->head].txnid = txnid;
 	q->vec[q->head].bkp_folder = bkp_folder;
+	q->vec[q->head].slot = slot;
+	q->vec[q->head].submitted = submitted;
 	q->head = (q->head + 1) % q->capacity;
 	q->size += 1;
-	pthread_spin_unlock(&q->lock);
+	q->stats.submitted += 1;
+	if (q->size > q->stats.max_depth) q->stats.max_depth = q->size;
+	pthread_cond_signal(&q->not_empty);
+	PTHREAD_MUTEX_unlock(&q->lock);
 	return 0;
 }
 
@@ -90,20 +105,22 @@ int cleanup_push_txnid(struct cleanup_queue *q, uint64_t txnid,
  */
 int cleanup_pop_txnid(struct cleanup_queue *q, struct cleanup_arg *arg)
 {
-	int err = 0;
-	err = pthread_spin_lock(&q->lock);
-	if (err) return err;
+	return cleanup_pop_many(q, 1, arg) == 1 ? 0 : ENODATA;
+}
 
-	if (q->size == 0) {
-		pthread_spin_unlock(&q->lock);
-		return ENODATA;
-	}
+/* Pop up to num tasks; the caller holds q->lock */
+static size_t pop_many_locked(struct cleanup_queue *q, size_t num,
+			      struct cleanup_arg *buf)
+{
+	size_t remaining = num;
 
-	*arg = q->vec[q->tail];
-	q->tail += (q->tail + 1) % q->capacity;
-	q->size -= 1;
-	pthread_spin_unlock(&q->lock);
-	return 0;
+	while (remaining > 0 && q->size > 0) {
+		buf[num - remaining] = q->vec[q->tail];
+		q->tail = (q->tail + 1) % q->capacity;
+		q->size -= 1;
+		remaining -= 1;
+	}
+	return num - remaining;
 }
 
 /**
@@ -114,24 +131,96 @@ int cleanup_pop_txnid(struct cleanup_queue *q, struct cleanup_arg *arg)
  * @param[out] buf	The buffer to output the txnids
  *
  * @return A positive number indicates the actual number of txnids
- * 	retrieved; 0 indicates that the queue is empty; negative number
- * 	indicates error.
+ * 	retrieved; 0 indicates that the queue is empty.
  */
 ssize_t cleanup_pop_many(struct cleanup_queue *q, size_t num,
 			 struct cleanup_arg *buf)
 {
-	ssize_t ret = 0;
-	ret = pthread_spin_lock(&q->lock);
-	if (ret) return -ret;
-	size_t remaining = num;
-	while (remaining > 0 && q->size > 0) {
-		buf[num - remaining] = q->vec[q->tail];
-		q->tail = (q->tail + 1) % q->capacity;
-		q->size -= 1;
-		remaining -= 1;
-	}
-	pthread_spin_unlock(&q->lock);
-	return num - remaining;
+	size_t count;
+
+	PTHREAD_MUTEX_lock(&q->lock);
+	count = pop_many_locked(q, num, buf);
+	PTHREAD_MUTEX_unlock(&q->lock);
+	return count;
+}
+
+/**
+ * @brief Wait for tasks and pop a number of them
+ *
+ * Same as @c cleanup_pop_many, but blocks until at least one task is queued,
+ * the queue is stopped or @c timeout_ms milliseconds have passed.
+ *
+ * @return Number of txnids retrieved; 0 if the wait timed out or the queue
+ *	   is stopped and empty.
+ */
+ssize_t cleanup_wait_many(struct cleanup_queue *q, size_t num,
+			  struct cleanup_arg *buf, uint32_t timeout_ms)
+{
+	struct timespec deadline;
+	size_t count;
+	int err = 0;
+
+	now(&deadline);
+	timespec_add_nsecs((nsecs_elapsed_t)timeout_ms * NS_PER_MSEC,
+			   &deadline);
+
+	PTHREAD_MUTEX_lock(&q->lock);
+	while (q->size == 0 && !q->stopping && err == 0)
+		err = pthread_cond_timedwait(&q->not_empty, &q->lock,
+					     &deadline);
+	count = pop_many_locked(q, num, buf);
+	PTHREAD_MUTEX_unlock(&q->lock);
+	return count;
+}
+
+/**
+ * @brief Account for a finished cleanup task
+ */
+void cleanup_task_done(struct cleanup_queue *q, const struct cleanup_arg *arg)
+{
+	struct timespec done;
+	uint64_t lag;
+
+	now(&done);
+	lag = timespec_diff(&arg->submitted, &done);
+
+	PTHREAD_MUTEX_lock(&q->lock);
+	q->stats.cleaned += 1;
+	q->stats.total_lag_ns += lag;
+	if (lag > q->stats.max_lag_ns) q->stats.max_lag_ns = lag;
+	PTHREAD_MUTEX_unlock(&q->lock);
+}
+
+/**
+ * @brief Get a snapshot of the queue depth and cleanup lag counters
+ */
+void cleanup_get_stats(struct cleanup_queue *q, struct cleanup_stats *st)
+{
+	PTHREAD_MUTEX_lock(&q->lock);
+	*st = q->stats;
+	st->depth = q->size;
+	PTHREAD_MUTEX_unlock(&q->lock);
+}
+
+/**
+ * @brief Make the workers exit once the queue is empty
+ */
+void cleanup_queue_stop(struct cleanup_queue *q)
+{
+	PTHREAD_MUTEX_lock(&q->lock);
+	q->stopping = true;
+	pthread_cond_broadcast(&q->not_empty);
+	PTHREAD_MUTEX_unlock(&q->lock);
+}
+
+bool cleanup_queue_stopping(struct cleanup_queue *q)
+{
+	bool stopping;
+
+	PTHREAD_MUTEX_lock(&q->lock);
+	stopping = q->stopping && q->size == 0;
+	PTHREAD_MUTEX_unlock(&q->lock);
+	return stopping;
 }
 
 /**
@@ -144,10 +233,12 @@ ssize_t cleanup_pop_many(struct cleanup_queue *q, size_t num,
  */
 void cleanup_queue_destroy(struct cleanup_queue *q)
 {
-	pthread_spin_destroy(&q->lock);
+	if (q->capacity == 0)
+		return;
+	pthread_cond_destroy(&q->not_empty);
+	pthread_mutex_destroy(&q->lock);
 	gsh_free(q->vec);
 	q->capacity = 0;
-	gsh_free(q);
 }
 
 static enum fsal_dir_result record_dirent(const char *name,
@@ -165,22 +256,130 @@ static enum fsal_dir_result record_dirent(const char *name,
 	return DIR_CONTINUE;
 }
 
+/**
+ * @brief Remove the files in a backup directory
+ *
+ * NOTE: This function assumes LOWER fsal.
+ *
+ * @param[in] dir	The backup directory
+ */
+void txnfs_empty_backup_dir(struct fsal_obj_handle *dir)
+{
+	fsal_status_t status = {0};
+	struct glist_head file_list = {0}, *node, *tmp;
+	struct txnfs_file_entry *ent;
+	bool eof;
+
+	glist_init(&file_list);
+
+	/* Use readdir to retrieve the list of files contained in bkp folder */
+	status = dir->obj_ops->readdir(dir, NULL, &file_list, record_dirent, 0,
+				       &eof);
+	assert(FSAL_IS_SUCCESS(status));
+
+	glist_for_each_safe(node, tmp, &file_list)
+	{
+		ent = glist_entry(node, struct txnfs_file_entry, glist);
+		status = dir->obj_ops->unlink(dir, ent->obj, ent->name);
+		assert(FSAL_IS_SUCCESS(status));
+		gsh_free(ent->name);
+		ent->obj->obj_ops->release(ent->obj);
+		glist_del(node);
+		gsh_free(ent);
+	};
+}
+
+/**
+ * @brief Remove a backup directory and the files in it
+ *
+ * NOTE: This function assumes LOWER fsal.
+ *
+ * @param[in] parent	The directory containing @c dir
+ * @param[in] dir	The backup directory, released by this function
+ * @param[in] name	The name of @c dir in @c parent
+ */
+static void remove_backup_dir(struct fsal_obj_handle *parent,
+			      struct fsal_obj_handle *dir, const char *name)
+{
+	fsal_status_t status;
+
+	txnfs_empty_backup_dir(dir);
+
+	/* remove the backup folder */
+	status = parent->obj_ops->unlink(parent, dir, name);
+	if (!FSAL_IS_SUCCESS(status)) {
+		LogWarn(COMPONENT_FSAL, "cannot remove backup dir %s: %d", name,
+			status.major);
+	}
+	/* Now we should release the folder to prevent mem leak
+	 * MDCACHE won't take care of this because we are operating under it */
+	dir->obj_ops->release(dir);
+}
+
+/**
+ * @brief Find or create the trash directory for deferred cleanup
+ *
+ * NOTE: This function assumes LOWER fsal.
+ *
+ * @return The trash directory, or NULL if it cannot be created.
+ */
+static struct fsal_obj_handle *get_trash_dir(struct txnfs_fsal_export *exp,
+					     struct fsal_obj_handle *bkp_root)
+{
+	struct fsal_obj_handle *trash = NULL;
+	struct attrlist attrs = {0};
+	fsal_status_t status;
+
+	/* set once and never changed, so the lock is only needed to create it;
+	 * sweep_trash holds the lock for a long time */
+	trash = atomic_fetch_voidptr((void **)&exp->trash);
+	if (trash) return trash;
+
+	PTHREAD_MUTEX_lock(&exp->trash_lock);
+	if (exp->trash) goto out;
+
+	status = fsal_lookup(bkp_root, TXN_TRASH_DIR, &trash, NULL);
+	if (status.major == ERR_FSAL_NOENT) {
+		FSAL_SET_MASK(attrs.valid_mask,
+			      ATTR_MODE | ATTR_OWNER | ATTR_GROUP);
+		attrs.mode = 0777;
+		attrs.owner = 0;
+		attrs.group = 0;
+		status = fsal_create(bkp_root, TXN_TRASH_DIR, DIRECTORY, &attrs,
+				     NULL, &trash, NULL);
+	}
+	if (FSAL_IS_SUCCESS(status)) {
+		atomic_store_voidptr((void **)&exp->trash, trash);
+		/* sweep whatever a previous run has left behind */
+		exp->trash_pending = 1;
+	} else {
+		LogWarn(COMPONENT_FSAL, "cannot create trash dir: %d",
+			status.major);
+	}
+out:
+	PTHREAD_MUTEX_unlock(&exp->trash_lock);
+	return exp->trash;
+}
+
 /**
  * @brief the actual payload code to cleanup backup files
+ *
+ * A backup slot is emptied and put back for the next transaction. With
+ * deferred cleanup, any other backup folder is only moved into the trash
+ * directory, which is emptied by @c sweep_trash.
  */
 static void txnfs_cleanup_backup(uint64_t txnid,
-				 struct fsal_obj_handle *bkp_folder)
+				 struct fsal_obj_handle *bkp_folder,
+				 struct txnfs_bkp_slot *slot)
 {
 	struct fsal_obj_handle *txn_root = NULL;
 	struct fsal_obj_handle *bkp_root = NULL;
+	struct fsal_obj_handle *trash = NULL;
 	struct fsal_export *exp = op_ctx->fsal_export;
+	struct txnfs_fsal_export *txn_exp =
+	    container_of(exp, struct txnfs_fsal_export, export);
 	fsal_status_t status = {0};
-	struct glist_head file_list = {0}, *node, *tmp;
-	struct txnfs_file_entry *ent;
 	char name[BKP_FN_LEN] = {'\0'};
-	bool eof;
-
-	glist_init(&file_list);
 
 	get_txn_root(&txn_root, NULL);
 	assert(txn_root);
@@ -188,78 +387,153 @@ static void txnfs_cleanup_backup(uint64_t txnid,
 	/* ---- switch export ---- */
 	op_ctx->fsal_export = exp->sub_export;
 
+	if (slot) {
+		txnfs_empty_backup_dir(slot->dir);
+		txnfs_put_backup_slot(txn_exp, slot);
+		goto end;
+	}
+
 	bkp_root = query_backup_root(txn_root);
 	if (!bkp_root) {
 		LogDebug(COMPONENT_FSAL, "backup root not created");
 		goto end;
 	}
 
-	/* Use readdir to retrieve the list of files contained in bkp folder */
-	status = bkp_folder->obj_ops->readdir(bkp_folder, NULL, &file_list,
-					      record_dirent, 0, &eof);
-	assert(FSAL_IS_SUCCESS(status));
+	snprintf(name, BKP_FN_LEN, "%lu", txnid);
 
-	glist_for_each_safe(node, tmp, &file_list)
+	if (TXNFS.cleanup_deferred) trash = get_trash_dir(txn_exp, bkp_root);
+	if (trash) {
+		status = bkp_folder->obj_ops->rename(bkp_folder, bkp_root, name,
+						     trash, name);
+		if (FSAL_IS_SUCCESS(status)) {
+			bkp_folder->obj_ops->release(bkp_folder);
+			(void)atomic_inc_uint64_t(&txn_exp->trash_pending);
+			goto end;
+		}
+		LogWarn(COMPONENT_FSAL, "cannot move backup dir to trash: %d",
+			status.major);
+	}
+
+	remove_backup_dir(bkp_root, bkp_folder, name);
+end:
+	/* ---- restore export ---- */
+	op_ctx->fsal_export = exp;
+}
+
+/**
+ * @brief Remove every txn backup dir that has been moved into the trash
+ *
+ * Only one worker sweeps at a time; the others keep serving the queue.
+ */
+static void sweep_trash(struct txnfs_fsal_export *txn_exp)
+{
+	struct fsal_export *exp = op_ctx->fsal_export;
+	struct fsal_obj_handle *trash = txn_exp->trash;
+	fsal_status_t status = {0};
+	struct glist_head dir_list = {0}, *node, *tmp;
+	struct txnfs_file_entry *ent;
+	bool eof;
+
+	if (trash == NULL || atomic_fetch_uint64_t(&txn_exp->trash_pending) == 0)
+		return;
+	if (pthread_mutex_trylock(&txn_exp->trash_lock) != 0) return;
+	atomic_store_uint64_t(&txn_exp->trash_pending, 0);
+
+	glist_init(&dir_list);
+
+	/* ---- switch export ---- */
+	op_ctx->fsal_export = exp->sub_export;
+
+	status = trash->obj_ops->readdir(trash, NULL, &dir_list, record_dirent,
+					 0, &eof);
+	if (!FSAL_IS_SUCCESS(status)) {
+		LogWarn(COMPONENT_FSAL, "cannot read trash dir: %d",
+			status.major);
+	}
+
+	glist_for_each_safe(node, tmp, &dir_list)
 	{
 		ent = glist_entry(node, struct txnfs_file_entry, glist);
-		status = bkp_folder->obj_ops->unlink(bkp_folder, ent->obj,
-						     ent->name);
-		assert(FSAL_IS_SUCCESS(status));
+		remove_backup_dir(trash, ent->obj, ent->name);
 		gsh_free(ent->name);
-		ent->obj->obj_ops->release(ent->obj);
 		glist_del(node);
 		gsh_free(ent);
 	};
 
-	/* remove the backup folder */
-	snprintf(name, BKP_FN_LEN, "%lu", txnid);
-	status = bkp_root->obj_ops->unlink(bkp_root, bkp_folder, name);
-	if (!FSAL_IS_SUCCESS(status)) {
-		LogWarn(COMPONENT_FSAL, "cannot remove backup dir: %d",
-			status.major);
-	}
-	/* Now we should release bkp_folder to prevent mem leak
-	 * MDCACHE won't take care of this because we are operating under it */
-	bkp_folder->obj_ops->release(bkp_folder);
-end:
 	/* ---- restore export ---- */
 	op_ctx->fsal_export = exp;
+	PTHREAD_MUTEX_unlock(&txn_exp->trash_lock);
 }
 
 struct worker_arg {
 	struct req_op_context *context;
-	struct cleanup_queue *queue;
+	struct txnfs_fsal_export *exp;
 };
 
 static void *backup_worker(void *ptr)
 {
 	struct worker_arg *args = ptr;
-	struct cleanup_queue *queue = args->queue;
+	struct txnfs_fsal_export *exp = args->exp;
+	struct cleanup_queue *queue = &exp->cqueue;
 	/* n = the max num of txnids to pop from queue */
-	const size_t n = 1024;
-	/* it's ok to put this array on stack because it's userland */
-	struct cleanup_arg ids[n];
+	const size_t n = TXNFS.cleanup_batch ? TXNFS.cleanup_batch : 64;
+	struct cleanup_arg *ids = gsh_calloc(n, sizeof(*ids));
+
 	op_ctx = args->context;
+	gsh_free(args);
 	while (true) {
-		ssize_t count = cleanup_pop_many(queue, n, ids);
-		if (count < 0) {
-			LogFatal(COMPONENT_FSAL, "deadlock? (%ld)", count);
-		}
+		ssize_t count = cleanup_wait_many(queue, n, ids,
+						  CLEANUP_IDLE_MS);
 		for (int i = 0; i < count; ++i) {
-			txnfs_cleanup_backup(ids[i].txnid, ids[i].bkp_folder);
+			txnfs_cleanup_backup(ids[i].txnid, ids[i].bkp_folder,
+					     ids[i].slot);
+			cleanup_task_done(queue, &ids[i]);
 		}
-		sleep(1);
+		/* the queued tasks are all done before exiting */
+		if (count == 0 && cleanup_queue_stopping(queue))
+			break;
+		/* empty the trash when idle, or when it grows too large */
+		if (count == 0 || atomic_fetch_uint64_t(&exp->trash_pending) >=
+				      CLEANUP_TRASH_MAX)
+			sweep_trash(exp);
 	}
+	gsh_free(ids);
 	return NULL;
 }
 
+/* Make a private copy of op_ctx for a worker thread */
+struct req_op_context *txnfs_copy_op_ctx(void)
+{
+	struct req_op_context *new_ctx;
+	int n_callers = op_ctx->creds->caller_glen;
+
+	new_ctx = gsh_malloc(sizeof(*new_ctx));
+	memcpy(new_ctx, op_ctx, sizeof(*new_ctx));
+	/* background threads hold no compound locks */
+	new_ctx->lh = NULL;
+	new_ctx->creds = gsh_malloc(sizeof(*op_ctx->creds));
+	memcpy(new_ctx->creds, op_ctx->creds, sizeof(*op_ctx->creds));
+	new_ctx->creds->caller_garray = gsh_calloc(n_callers, sizeof(gid_t));
+	memcpy(new_ctx->creds->caller_garray, op_ctx->creds->caller_garray,
+	       n_callers * sizeof(gid_t));
+	return new_ctx;
+}
+
+void txnfs_free_op_ctx(struct req_op_context *ctx)
+{
+	gsh_free(ctx->creds->caller_garray);
+	gsh_free(ctx->creds);
+	gsh_free(ctx);
+}
+
 int init_backup_worker(struct txnfs_fsal_export *myself)
 {
 	struct req_op_context *new_ctx;
 	struct worker_arg *args;
+	int n_workers = TXNFS.cleanup_workers ? TXNFS.cleanup_workers : 1;
 	pthread_t tid;
 	int err = 0;
-	int n_callers = op_ctx->creds->caller_glen;
+	int i;
 
 	/* initialize task queue */
 	err = cleanup_queue_init(&myself->cqueue, CLEANUP_QUEUE_LEN);
@@ -268,36 +542,78 @@ int init_backup_worker(struct txnfs_fsal_export *myself)
 			err);
 		return err;
 	}
+	PTHREAD_MUTEX_init(&myself->trash_lock, NULL);
 
-	/* assemble a copy of op_ctx */
-	new_ctx = gsh_malloc(sizeof(*new_ctx));
-	memcpy(new_ctx, op_ctx, sizeof(*new_ctx));
-	new_ctx->creds = gsh_malloc(sizeof(*op_ctx->creds));
-	memcpy(new_ctx->creds, op_ctx->creds, sizeof(*op_ctx->creds));
-	new_ctx->creds->caller_garray = gsh_calloc(n_callers, sizeof(gid_t));
-	memcpy(new_ctx->creds->caller_garray, op_ctx->creds->caller_garray,
-	       n_callers * sizeof(gid_t));
+	myself->cleanup_worker_tids = gsh_calloc(n_workers, sizeof(pthread_t));
+	myself->cleaner_ctxs = gsh_calloc(n_workers, sizeof(*myself->cleaner_ctxs));
 
-	/* assemble args for the worker thread */
-	args = gsh_malloc(sizeof(*args));
-	args->context = new_ctx;
-	args->queue = &myself->cqueue;
+	for (i = 0; i < n_workers; i++) {
+		/* assemble a copy of op_ctx */
+		new_ctx = txnfs_copy_op_ctx();
 
-	/* spawn the thread */
-	err = pthread_create(&tid, NULL, backup_worker, args);
+		/* assemble args for the worker thread */
+		args = gsh_malloc(sizeof(*args));
+		args->context = new_ctx;
+		args->exp = myself;
 
-	if (err) {
-		LogWarn(COMPONENT_FSAL, "backup worker thread failed: %d", err);
-		gsh_free(args);
-		gsh_free(new_ctx->creds->caller_garray);
-		gsh_free(new_ctx->creds);
-		gsh_free(new_ctx);
+		/* spawn the thread */
+		err = pthread_create(&tid, NULL, backup_worker, args);
+		if (err) {
+			LogWarn(COMPONENT_FSAL,
+				"backup worker thread %d failed: %d", i, err);
+			gsh_free(args);
+			txnfs_free_op_ctx(new_ctx);
+			break;
+		}
+		myself->cleanup_worker_tids[i] = tid;
+		myself->cleaner_ctxs[i] = new_ctx;
+	}
+	/* Publish the number of workers last: submit_cleanup_task only
+	 * queues tasks once there is a worker to take them */
+	atomic_store_int32_t(&myself->n_cleanup_workers, i);
+
+	if (i == 0) {
+		gsh_free(myself->cleanup_worker_tids);
+		gsh_free(myself->cleaner_ctxs);
+		myself->cleanup_worker_tids = NULL;
+		myself->cleaner_ctxs = NULL;
 		cleanup_queue_destroy(&myself->cqueue);
-	} else {
-		myself->cleanup_worker_tid = tid;
-		myself->cleaner_ctx = new_ctx;
+		return err;
 	}
-	return err;
+	LogInfo(COMPONENT_FSAL, "backup cleanup: %d workers, batch=%" PRIu32
+		", deferred=%d", i, TXNFS.cleanup_batch,
+		TXNFS.cleanup_deferred);
+	return 0;
+}
+
+/**
+ * @brief Stop the cleanup workers of an export
+ *
+ * Cleanups submitted from now on are done synchronously. The workers finish
+ * the queued ones, then are joined and their contexts freed. The queue is
+ * left for cleanup_queue_destroy(), once GetFSALStats can no longer find
+ * the export.
+ */
+void txnfs_stop_backup_worker(struct txnfs_fsal_export *exp)
+{
+	int n_workers = atomic_fetch_int32_t(&exp->n_cleanup_workers);
+	int i;
+
+	if (n_workers == 0)
+		return;
+	atomic_store_int32_t(&exp->n_cleanup_workers, 0);
+
+	cleanup_queue_stop(&exp->cqueue);
+	for (i = 0; i < n_workers; i++) {
+		pthread_join(exp->cleanup_worker_tids[i], NULL);
+		txnfs_free_op_ctx(exp->cleaner_ctxs[i]);
+	}
+	txnfs_log_cleanup_stats(exp);
+
+	gsh_free(exp->cleanup_worker_tids);
+	gsh_free(exp->cleaner_ctxs);
+	exp->cleanup_worker_tids = NULL;
+	exp->cleaner_ctxs = NULL;
 }
 
 /**
@@ -306,13 +622,15 @@ int init_backup_worker(struct txnfs_fsal_export *myself)
  * @param[in] exp	TXNFS's export structure
  * @param[in] txnid	Transaction ID
  * @param[in] bkp_folder The obj handle pointed to the backup folder
+ * @param[in] slot	The backup slot @c bkp_folder belongs to, or NULL
  *
  * @return 0 if the task is submitted successfully and the cleanup will be
  * 	   performed asynchronously. Otherwise there might be some error and
  * 	   the cleanup has been done by synchronous call.
  */
 int submit_cleanup_task(struct txnfs_fsal_export *exp, uint64_t txnid,
-			struct fsal_obj_handle *bkp_folder)
+			struct fsal_obj_handle *bkp_folder,
+			struct txnfs_bkp_slot *slot)
 {
 	int err = 0;
 
@@ -324,20 +642,79 @@ int submit_cleanup_task(struct txnfs_fsal_export *exp, uint64_t txnid,
 			 txnid);
 		return EINVAL;
 	}
-	if (exp->cleanup_worker_tid == 0) {
+	if (atomic_fetch_int32_t(&exp->n_cleanup_workers) == 0) {
 		LogWarnOnce(COMPONENT_FSAL,
 			    "backup worker thread is not up. "
 			    "Fallback to sync call.");
 		err = ENAVAIL;
 		goto sync;
 	}
-	err = cleanup_push_txnid(&exp->cqueue, txnid, bkp_folder);
+	err = cleanup_push_txnid(&exp->cqueue, txnid, bkp_folder, slot);
 	if (err != 0) {
 		LogWarn(COMPONENT_FSAL, "can't add txnid to queue: %d", err);
 		goto sync;
 	}
 	return 0;
 sync:
-	txnfs_cleanup_backup(txnid, bkp_folder);
+	txnfs_cleanup_backup(txnid, bkp_folder, slot);
 	return err;
 }
+
+/* @brief Dump the queue depth and cleanup lag counters of an export */
+void txnfs_log_cleanup_stats(struct txnfs_fsal_export *exp)
+{
+	struct cleanup_stats st;
+
+	if (exp->cqueue.capacity == 0)
+		return;
+	cleanup_get_stats(&exp->cqueue, &st);
+	if (st.cleaned == 0)
+		return;
+
+	LogInfo(COMPONENT_FSAL,
+		"backup cleanup: %" PRIu64 " of %" PRIu64
+		" txns cleaned, depth %" PRIu64 " (max %" PRIu64
+		"), avg lag %" PRIu64 "ns, max lag %" PRIu64 "ns",
+		st.cleaned, st.submitted, st.depth, st.max_depth,
+		st.total_lag_ns / st.cleaned, st.max_lag_ns);
+}
+
+#ifdef USE_DBUS
+/**
+ * @brief Report the cleanup queues through GetFSALStats
+ *
+ * For every export with cleanup workers, a "CLEANUP_EXPORT" row with the
+ * export id as its count is followed by "CLEANUP_QUEUED", the tasks queued
+ * now with the largest depth seen as its max, "CLEANUP_SUBMITTED", and
+ * "CLEANUP_DONE", the tasks done with their average and max lag in ms.
+ */
+void txnfs_append_cleanup_stats(struct fsal_module *fsal_hdl, void *iter)
+{
+	struct glist_head *glist;
+	struct fsal_export *exp_hdl;
+	struct txnfs_fsal_export *exp;
+	struct cleanup_stats st;
+
+	PTHREAD_RWLOCK_rdlock(&fsal_hdl->lock);
+	glist_for_each(glist, &fsal_hdl->exports) {
+		exp_hdl = glist_entry(glist, struct fsal_export, exports);
+		exp = container_of(exp_hdl, struct txnfs_fsal_export, export);
+		if (atomic_fetch_int32_t(&exp->n_cleanup_workers) == 0)
+			continue;
+		cleanup_get_stats(&exp->cqueue, &st);
+
+		txnfs_append_stats_row(iter, "CLEANUP_EXPORT",
+				       exp_hdl->export_id, 0.0, 0.0, 0.0);
+		txnfs_append_stats_row(iter, "CLEANUP_QUEUED", st.depth, 0.0,
+				       0.0, (double)st.max_depth);
+		txnfs_append_stats_row(iter, "CLEANUP_SUBMITTED", st.submitted,
+				       0.0, 0.0, 0.0);
+		txnfs_append_stats_row(iter, "CLEANUP_DONE", st.cleaned,
+				       st.cleaned ? (double)st.total_lag_ns *
+						    0.000001 / st.cleaned
+						  : 0.0,
+				       0.0, (double)st.max_lag_ns * 0.000001);
+	}
+	PTHREAD_RWLOCK_unlock(&fsal_hdl->lock);
+}
+#endif
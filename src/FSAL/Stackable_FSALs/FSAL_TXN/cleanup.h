@@ -24,19 +24,44 @@
 #include <fsal_types.h>
 #include <log.h>
 #include <pthread.h>
+#include <stdbool.h>
+#include <time.h>
 
 #ifndef _CLEANUP_H_
 #define _CLEANUP_H_
 
 /* message queue data structure */
 #define CLEANUP_QUEUE_LEN 131072
+/* how long an idle worker waits for tasks before sweeping the trash */
+#define CLEANUP_IDLE_MS 1000
+/* number of deferred txn dirs that triggers a trash sweep under load */
+#define CLEANUP_TRASH_MAX 1024
+/* directory under the backup root that deferred txn dirs are moved to */
+#define TXN_TRASH_DIR "trash"
 
 struct fsal_obj_handle;
 struct txnfs_fsal_export;
 
+struct txnfs_bkp_slot;
+
 struct cleanup_arg {
 	uint64_t txnid;
 	struct fsal_obj_handle *bkp_folder;
+	/* set if bkp_folder is a reusable slot rather than a txnid dir */
+	struct txnfs_bkp_slot *slot;
+	/* when the task was submitted, for measuring the cleanup lag */
+	struct timespec submitted;
+};
+
+struct cleanup_stats {
+	/* number of tasks queued right now */
+	uint64_t depth;
+	uint64_t max_depth;
+	uint64_t submitted;
+	uint64_t cleaned;
+	/* time between submission and completion of a cleanup */
+	uint64_t total_lag_ns;
+	uint64_t max_lag_ns;
 };
 
 struct cleanup_queue {
@@ -45,20 +70,42 @@ struct cleanup_queue {
 	size_t tail;
 	size_t size;
 	size_t capacity;
-	pthread_spinlock_t lock;
+	pthread_mutex_t lock;
+	/* signalled when a task is pushed, or when the queue is stopped */
+	pthread_cond_t not_empty;
+	/* set once the workers have to exit; protected by lock */
+	bool stopping;
+	/* protected by lock */
+	struct cleanup_stats stats;
 };
 
 int cleanup_queue_init(struct cleanup_queue *q, size_t capacity);
 int cleanup_push_txnid(struct cleanup_queue *q, uint64_t txnid,
-		       struct fsal_obj_handle *bkp_folder);
+		       struct fsal_obj_handle *bkp_folder,
+		       struct txnfs_bkp_slot *slot);
 int cleanup_pop_txnid(struct cleanup_queue *q, struct cleanup_arg *arg);
 ssize_t cleanup_pop_many(struct cleanup_queue *q, size_t num,
 			 struct cleanup_arg *buf);
+ssize_t cleanup_wait_many(struct cleanup_queue *q, size_t num,
+			  struct cleanup_arg *buf, uint32_t timeout_ms);
+void cleanup_task_done(struct cleanup_queue *q, const struct cleanup_arg *arg);
+void cleanup_get_stats(struct cleanup_queue *q, struct cleanup_stats *st);
+void cleanup_queue_stop(struct cleanup_queue *q);
+bool cleanup_queue_stopping(struct cleanup_queue *q);
 void cleanup_queue_destroy(struct cleanup_queue *q);
 
 /* the worker */
 int init_backup_worker(struct txnfs_fsal_export *);
+void txnfs_stop_backup_worker(struct txnfs_fsal_export *exp);
 int submit_cleanup_task(struct txnfs_fsal_export *exp, uint64_t txnid,
-			struct fsal_obj_handle *bkp_folder);
+			struct fsal_obj_handle *bkp_folder,
+			struct txnfs_bkp_slot *slot);
+void txnfs_empty_backup_dir(struct fsal_obj_handle *dir);
+void txnfs_log_cleanup_stats(struct txnfs_fsal_export *exp);
+#ifdef USE_DBUS
+void txnfs_append_cleanup_stats(struct fsal_module *fsal_hdl, void *iter);
+#endif
+struct req_op_context *txnfs_copy_op_ctx(void);
+void txnfs_free_op_ctx(struct req_op_context *ctx);
 
 #endif  // _CLEANUP_H_
\ No newline at end of file
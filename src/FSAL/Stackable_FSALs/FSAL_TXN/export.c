@@ -59,6 +59,9 @@ static void release(struct fsal_export *exp_hdl)
 	myself = container_of(exp_hdl, struct txnfs_fsal_export, export);
 	sub_fsal = myself->export.sub_export->fsal;
 
+	/* the cleanup workers use the sub_export */
+	txnfs_stop_backup_worker(myself);
+
 	/* Release the sub_export */
 	myself->export.sub_export->exp_ops.release(myself->export.sub_export);
 	fsal_put(sub_fsal);
@@ -69,8 +72,17 @@ static void release(struct fsal_export *exp_hdl)
 	fsal_detach_export(exp_hdl->fsal, &exp_hdl->exports);
 	free_export_ops(exp_hdl);
 
+	/* GetFSALStats no longer sees the export */
+	cleanup_queue_destroy(&myself->cqueue);
+
 	/* free lock manager */
 	free_lock_manager(myself->lm);
+	if (myself->vt)
+		free_version_table(myself->vt);
+	gsh_free(myself->snap_versions);
+
+	txnfs_log_group_commit_stats();
+	txnfs_log_db_cache_stats();
 
 	gsh_free(myself); /* elvis has left the building */
 }
@@ -366,6 +378,9 @@ static void txnfs_prepare_unexport(struct fsal_export *exp_hdl)
  */
 static inline bool txn_context_valid(void) { return (op_ctx->op_args != NULL); }
 
+/* Locks held by the compound the thread runs */
+static __thread lock_handle_t compound_locks;
+
 fsal_status_t txnfs_start_compound(struct fsal_export *exp_hdl, void *data)
 {
 	COMPOUND4args *args = data;
@@ -374,8 +389,10 @@ fsal_status_t txnfs_start_compound(struct fsal_export *exp_hdl, void *data)
 	    container_of(exp_hdl->fsal, struct txnfs_fsal_module, module);
 	struct txnfs_fsal_export *exp =
 	    container_of(exp_hdl, struct txnfs_fsal_export, export);
-	lock_request_t lrs[256];
+	lock_request_t lrs[LM_MAX_LOCKS];
 	lock_manager_t *lm = exp->lm;
+	uint64_t start;
+	int n;
 
 	LogDebug(COMPONENT_FSAL, "Start Compound in FSAL_TXN layer.");
 	LogDebug(COMPONENT_FSAL, "Compound operations: %d",
@@ -383,7 +400,20 @@ fsal_status_t txnfs_start_compound(struct fsal_export *exp_hdl, void *data)
 
 	txnfs_tracepoint(init_start_compound, args->argarray.argarray_len);
 
+	/* locking does not allocate once the thread has its lock handle */
+	op_ctx->lh = &compound_locks;
+
+	start = txnfs_phase_now();
 	op_ctx->txnid = create_txn_log(fs->db, args);
+	if (op_ctx->txnid == TXN_LOG_ERROR) {
+		/* without a log, the compound could not be undone */
+		LogCrit(COMPONENT_FSAL, "cannot log the txn of a compound");
+		op_ctx->txnid = 0;
+		return fsalstat(ERR_FSAL_SERVERFAULT, 0);
+	}
+	/* compounds that cannot change anything have no log */
+	if (op_ctx->txnid != 0)
+		txnfs_phase_record(TXNFS_PHASE_LOG, txnfs_phase_now() - start);
 
 	txnfs_tracepoint(create_txn_log, op_ctx->txnid);
 
@@ -392,22 +422,45 @@ fsal_status_t txnfs_start_compound(struct fsal_export *exp_hdl, void *data)
 
 	txnfs_tracepoint(init_txn_cache, op_ctx->txnid);
 
+	start = txnfs_phase_now();
+
+	/* read-only compounds on a snapshot neither resolve nor lock their
+	 * paths */
+	if (txnfs_snapshot_begin(exp, args))
+		goto locked;
+
 	/* lock all paths involved */
 	/* analyze compound args to compose lock request */
-	int n = find_relevant_handles(args, lrs);
+	n = find_relevant_handles(args, lrs);
 	txnfs_tracepoint(find_relevant_paths, op_ctx->txnid, n,
 			 args->argarray.argarray_len);
-	/* We must remind the paths because we need to free them in the end */
-	op_ctx->locked_paths = gsh_calloc(n, sizeof(char *));
-	op_ctx->paths_count = n;
-	for (int i = 0; i < n; ++i) {
-		op_ctx->locked_paths[i] = lrs[i].path;
+	/* lock, unless the compound can run optimistically; the paths in lrs
+	 * live in a per-thread arena and are not needed once the locks are
+	 * held */
+	if (n < 0 || !exp->optimistic || !txnfs_occ_begin(exp, lrs, n)) {
+		if (n < 0 || lm_lock_r(lm, lrs, n, op_ctx->lh) == NULL) {
+			/* more paths than a lock handle holds: lock the
+			 * whole export instead */
+			LogDebug(COMPONENT_FSAL,
+				 "txnid=%" PRIu64 " locks the whole export",
+				 op_ctx->txnid);
+			lrs[0].path = op_ctx->ctx_export->fullpath;
+			lrs[0].write_lock = true;
+			n = 1;
+			if (lm_lock_r(lm, lrs, n, op_ctx->lh) == NULL)
+				LogFatal(COMPONENT_FSAL,
+					 "can't lock export root %s",
+					 lrs[0].path);
+		}
+		if (exp->vt != NULL)
+			txnfs_occ_pin_writes(exp, lrs, n);
 	}
-	/* lock */
-	op_ctx->lh = lm_lock(lm, lrs, n);
+
+locked:
 	txnfs_tracepoint(locked_paths, op_ctx->txnid);
-	if (n > 0 && op_ctx->lh == NULL)
-		LogFatal(COMPONENT_FSAL, "n_paths: %d, can't lock.", n);
+	op_ctx->txn_cache->exec_start = txnfs_phase_now();
+	txnfs_phase_record(TXNFS_PHASE_LOCK,
+			   op_ctx->txn_cache->exec_start - start);
 
 	op_ctx->op_args = args;
 
@@ -427,6 +480,8 @@ fsal_status_t txnfs_end_compound(struct fsal_export *exp_hdl, void *data)
 {
 	COMPOUND4res *res = data;
 	fsal_status_t ret = {ERR_FSAL_NO_ERROR, 0};
+	uint64_t start = txnfs_phase_now();
+	bool conflict;
 
 	struct txnfs_fsal_export *exp =
 	    container_of(exp_hdl, struct txnfs_fsal_export, export);
@@ -440,29 +495,44 @@ fsal_status_t txnfs_end_compound(struct fsal_export *exp_hdl, void *data)
 	txnfs_tracepoint(called_subfsal_end_compound, op_ctx->txnid,
 			 exp->export.sub_export->fsal->name);
 
-	/* unlock and cleanup */
-	unlock_handle(op_ctx->lh);
-	for (int i = 0; i < op_ctx->paths_count; ++i) {
-		gsh_free(op_ctx->locked_paths[i]);
-	}
-	gsh_free(op_ctx->locked_paths);
-	op_ctx->paths_count = 0;
-
 	LogDebug(COMPONENT_FSAL, "End Compound in FSAL_TXN layer.");
 	LogDebug(COMPONENT_FSAL, "Compound status: %d operations: %d",
 		 res->status, res->resarray.resarray_len);
 
 	/* If txn-related data has neven been properly initialized, don't do
 	 * the following operations. */
-	if (!txn_context_valid()) return ret;
+	if (!txn_context_valid()) {
+		if (op_ctx->lh != NULL)
+			unlock_handle_r(op_ctx->lh);
+		return ret;
+	}
+	txnfs_phase_record(TXNFS_PHASE_EXEC,
+			   start - op_ctx->txn_cache->exec_start);
+
+	/* an optimistic compound that read stale data is rolled back, and a
+	 * snapshot that raced with a writer is retried */
+	if (op_ctx->txn_cache->snapshot)
+		conflict = !txnfs_snapshot_validate(exp);
+	else
+		conflict = op_ctx->txn_cache->optimistic &&
+			   !txnfs_occ_validate(exp);
 
 	txnfs_tracepoint(init_end_compound, res->status, op_ctx->txnid);
-	if (res->status == NFS4_OK) {
+	if (res->status == NFS4_OK && !conflict) {
 		// commit entries to leveldb and remove txnlog entry
+		start = txnfs_phase_now();
 		txnfs_cache_commit();
+		txnfs_phase_record(TXNFS_PHASE_COMMIT,
+				   txnfs_phase_now() - start);
 		txnfs_tracepoint(committed_txn_cache, op_ctx->txnid);
-	} else if (res->status != NFS4_OK && op_ctx->txnid > 0) {
-		int err = txnfs_compound_restore(op_ctx->txnid, res);
+	} else if (op_ctx->txnid > 0) {
+		int err;
+
+		start = txnfs_phase_now();
+		err = txnfs_compound_restore(op_ctx->txnid, res,
+					       conflict);
+		txnfs_phase_record(TXNFS_PHASE_ROLLBACK,
+				   txnfs_phase_now() - start);
 		if (err != 0) {
 			LogWarn(COMPONENT_FSAL, "compound_restore error: %d",
 				err);
@@ -471,13 +541,23 @@ fsal_status_t txnfs_end_compound(struct fsal_export *exp_hdl, void *data)
 		// remove txn log entry
 	}
 
+	if (conflict)
+		txnfs_occ_reply_delay(res);
+
+	/* unlock once the files are committed or restored */
+	txnfs_snapshot_end(exp);
+	vt_end(&op_ctx->txn_cache->vh);
+	unlock_handle_r(op_ctx->lh);
+
+	/* backup folder is per transaction and goes with the cache */
+	txnfs_release_bkp_objects();
+	submit_cleanup_task(exp, op_ctx->txnid, op_ctx->txn_cache->bkp_folder,
+			    op_ctx->txn_cache->bkp_slot);
+	txnfs_tracepoint(cleaned_up_backup, op_ctx->txnid);
+
 	// clear the list of entry in op_ctx->txn_cache
 	txnfs_cache_cleanup();
 	txnfs_tracepoint(cleaned_up_cache, op_ctx->txnid);
-	submit_cleanup_task(exp, op_ctx->txnid, op_ctx->txn_bkp_folder);
-	/* backup folder is per transaction, so we should clear this */
-	op_ctx->txn_bkp_folder = NULL;
-	txnfs_tracepoint(cleaned_up_backup, op_ctx->txnid);
 
 	return ret;
 }
@@ -545,7 +625,10 @@ fsal_status_t txnfs_backup_nfs4_op(struct fsal_export *exp_hdl,
 
 	/* Do not backup if txn-related data has not been initialized or
 	 * this compound is not eligible for transaction */
-	if (!txn_context_valid() || op_ctx->txnid == 0) return status;
+	if (!txn_context_valid()) return status;
+	if (exp->snap_versions != NULL)
+		txnfs_snapshot_track(exp, op, current);
+	if (op_ctx->txnid == 0) return status;
 
 	switch (op->argop) {
 		/**
@@ -590,6 +673,9 @@ fsal_status_t txnfs_backup_nfs4_op(struct fsal_export *exp_hdl,
 					 attrs.filesize);
 
 			if (status.major == ERR_FSAL_NO_ERROR) {
+				if (exp->snap_versions != NULL)
+					txnfs_snapshot_write(exp,
+							     handle->fileid);
 				txnfs_backup_file(opidx, handle, 0,
 						  attrs.filesize);
 				handle->obj_ops->release(handle);
@@ -607,8 +693,8 @@ fsal_status_t txnfs_backup_nfs4_op(struct fsal_export *exp_hdl,
 			wr_len = op->nfs_argop4_u.opwrite.data.data_len;
 			txnfs_tracepoint(backup_write, op_ctx->txnid, wr_offset,
 					 wr_len);
-			txnfs_backup_file(opidx, cur_hdl->sub_handle, wr_offset,
-					  wr_len);
+			txnfs_backup_extent(cur_hdl->sub_handle, cur_hdl->uuid,
+					    wr_offset, wr_len);
 			break;
 
 		default:
@@ -654,6 +740,9 @@ void txnfs_export_ops_init(struct export_ops *ops)
 
 struct txnfsal_args {
 	struct subfsal_args subfsal;
+	bool optimistic;
+	uint32_t occ_max_aborts;
+	bool snapshot_reads;
 };
 
 static struct config_item sub_fsal_params[] = {
@@ -661,6 +750,10 @@ static struct config_item sub_fsal_params[] = {
 
 static struct config_item export_params[] = {
     CONF_ITEM_NOOP("name"),
+    CONF_ITEM_BOOL("Optimistic", false, txnfsal_args, optimistic),
+    CONF_ITEM_UI32("OptimisticMaxAborts", 1, 1024, 8, txnfsal_args,
+		   occ_max_aborts),
+    CONF_ITEM_BOOL("SnapshotReads", false, txnfsal_args, snapshot_reads),
     CONF_RELAX_BLOCK("FSAL", sub_fsal_params, noop_conf_init, subfsal_commit,
 		     txnfsal_args, subfsal),
     CONFIG_EOL};
@@ -737,11 +830,21 @@ fsal_status_t txnfs_create_export(struct fsal_module *fsal_hdl,
 	myself->export.fsal = fsal_hdl;
 	myself->root = NULL;
 	myself->bkproot = NULL;
-	op_ctx->txn_bkp_folder = NULL;
+	PTHREAD_MUTEX_init(&myself->slot_lock, NULL);
 
 	/* init lock manager */
 	myself->lm = new_lock_manager();
 	assert(myself->lm);
+	/* compounds that write always pin their paths, so that optimistic
+	 * ones see the writes */
+	if (txnfsal.optimistic)
+		myself->vt = new_version_table();
+	myself->optimistic = txnfsal.optimistic;
+	myself->occ_max_aborts = txnfsal.occ_max_aborts;
+	myself->snapshot_reads = txnfsal.snapshot_reads;
+	if (txnfsal.snapshot_reads)
+		myself->snap_versions =
+		    gsh_calloc(TXNFS_SNAP_STRIPES, sizeof(uint64_t));
 
 	/* lock myself before attaching to the fsal.
 	 * keep myself locked until done with creating myself.
@@ -749,6 +852,8 @@ fsal_status_t txnfs_create_export(struct fsal_module *fsal_hdl,
 	op_ctx->fsal_export = &myself->export;
 
 	get_txn_root(&myself->root, NULL);
+	txnfs_recover(myself);
+	txnfs_recover_backup_slots(myself);
 	init_backup_worker(myself);
 
 	return fsalstat(ERR_FSAL_NO_ERROR, 0);
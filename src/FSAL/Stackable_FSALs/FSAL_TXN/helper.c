@@ -19,8 +19,10 @@
  * 02110-1301 USA
  */
 
+#include "city.h"
 #include "nfs_proto_tools.h"
 #include "txnfs_methods.h"
+#include "txn_logger.h"
 #include <assert.h>
 
 static inline int txnfs_cache_cmpfh(struct txnfs_cache_entry *ent,
@@ -41,6 +43,31 @@ static inline void *txnfs_cache_copyfh(struct txnfs_cache_entry *ent, void *buf)
 		return memcpy(buf, ent->fh.addr, ent->hdl_size);
 }
 
+/* Slot of the created object with file handle @fh in the index, or the empty
+ * slot it goes to */
+static uint16_t *fh_slot(struct txnfs_cache *cache, struct gsh_buffdesc *fh)
+{
+	uint32_t i = CityHash64(fh->addr, fh->len) & cache->index_mask;
+
+	while (cache->by_fh[i] != 0 &&
+	       txnfs_cache_cmpfh(&cache->entries[cache->by_fh[i] - 1], fh) != 0)
+		i = (i + 1) & cache->index_mask;
+	return &cache->by_fh[i];
+}
+
+/* Same as fh_slot, by uuid in @index */
+static uint16_t *uuid_slot(struct txnfs_cache *cache, uint16_t *index,
+			   const uuid_t uuid)
+{
+	uint32_t i = CityHash64((const char *)uuid, sizeof(uuid_t)) &
+		     cache->index_mask;
+
+	while (index[i] != 0 &&
+	       uuid_compare(cache->entries[index[i] - 1].uuid, uuid) != 0)
+		i = (i + 1) & cache->index_mask;
+	return &index[i];
+}
+
 int txnfs_cache_insert(enum txnfs_cache_entry_type entry_type,
 		       struct gsh_buffdesc *hdl_desc, uuid_t uuid,
 		       struct gsh_buffdesc *path)
@@ -50,7 +77,9 @@ int txnfs_cache_insert(enum txnfs_cache_entry_type entry_type,
 	       (entry_type == txnfs_cache_entry_delete) ||
 	       (entry_type == txnfs_cache_entry_modify && path));
 
-	assert(likely(op_ctx->txn_cache->size <= op_ctx->txn_cache->capacity));
+	PTHREAD_MUTEX_lock(&op_ctx->txn_cache->lock);
+	/* the indexes follow the entries */
+	assert(likely(op_ctx->txn_cache->size < op_ctx->txn_cache->capacity));
 
 	struct txnfs_cache_entry *entry =
 	    op_ctx->txn_cache->entries + op_ctx->txn_cache->size;
@@ -76,69 +105,73 @@ int txnfs_cache_insert(enum txnfs_cache_entry_type entry_type,
 	}
 	op_ctx->txn_cache->size++;
 
+	/* later entries of an object take over its slots */
+	if (entry_type == txnfs_cache_entry_create) {
+		*fh_slot(op_ctx->txn_cache, hdl_desc) = op_ctx->txn_cache->size;
+		*uuid_slot(op_ctx->txn_cache, op_ctx->txn_cache->by_uuid,
+			   uuid) = op_ctx->txn_cache->size;
+	}
+	if (entry_type != txnfs_cache_entry_delete)
+		*uuid_slot(op_ctx->txn_cache, op_ctx->txn_cache->by_path,
+			   uuid) = op_ctx->txn_cache->size;
+	PTHREAD_MUTEX_unlock(&op_ctx->txn_cache->lock);
+
 	return 0;
 }
 
 int txnfs_cache_get_uuid(struct gsh_buffdesc *hdl_desc, uuid_t uuid)
 {
 	UDBG;
-	struct txnfs_cache_entry *entry;
+	struct txnfs_cache *cache = op_ctx->txn_cache;
+	uint16_t slot;
 
-	txnfs_cache_foreach(entry, op_ctx->txn_cache)
-	{
-		if (entry->entry_type == txnfs_cache_entry_create &&
-		    txnfs_cache_cmpfh(entry, hdl_desc) == 0) {
-			uuid_copy(uuid, entry->uuid);
-			return 0;
-		}
-	}
+	PTHREAD_MUTEX_lock(&cache->lock);
+	slot = *fh_slot(cache, hdl_desc);
+	if (slot != 0)
+		uuid_copy(uuid, cache->entries[slot - 1].uuid);
+	PTHREAD_MUTEX_unlock(&cache->lock);
 
-	return -1;
+	return slot != 0 ? 0 : -1;
 }
 
 int txnfs_cache_get_path(uuid_t uuid, struct gsh_buffdesc *path)
 {
-	struct txnfs_cache_entry *entry;
-
-	txnfs_cache_foreach(entry, op_ctx->txn_cache)
-	{
-		if ((entry->entry_type == txnfs_cache_entry_create ||
-		     entry->entry_type == txnfs_cache_entry_modify) &&
-		    memcmp(entry->uuid, uuid, sizeof(uuid_t) == 0)) {
-			/* We assume that entry->abs_path is referenced from
-			 * absolute_path field of fsal_obj_handle. This should
-			 * exist throughout the life cycle of a fsal obj handle
-			 * so we don't need to do deep copy */
-			*path = entry->abs_path;
-			return 0;
-		}
-	}
-	return -1;
+	struct txnfs_cache *cache = op_ctx->txn_cache;
+	uint16_t slot;
+
+	PTHREAD_MUTEX_lock(&cache->lock);
+	slot = *uuid_slot(cache, cache->by_path, uuid);
+	/* We assume that entry->abs_path is referenced from absolute_path
+	 * field of fsal_obj_handle. This should exist throughout the life
+	 * cycle of a fsal obj handle so we don't need to do deep copy */
+	if (slot != 0)
+		*path = cache->entries[slot - 1].abs_path;
+	PTHREAD_MUTEX_unlock(&cache->lock);
+
+	return slot != 0 ? 0 : -1;
 }
 
 int txnfs_cache_get_handle(uuid_t uuid, struct gsh_buffdesc *hdl_desc)
 {
+	struct txnfs_cache *cache = op_ctx->txn_cache;
 	struct txnfs_cache_entry *entry;
-	char *hdl_str;
+	uint16_t slot;
 
-	txnfs_cache_foreach(entry, op_ctx->txn_cache)
-	{
-		/* If a matching entry is found in cache, it will copy the
-		 * content of file handle into a new buffer. BE SURE TO FREE.
-		 * The reason for such design is to make it consistent with
-		 * txnfs_db_get_handle.
-		 */
-		if (entry->entry_type == txnfs_cache_entry_create &&
-		    memcmp(entry->uuid, uuid, sizeof(uuid_t)) == 0) {
-			hdl_str = gsh_malloc(entry->hdl_size);
-			txnfs_cache_copyfh(entry, hdl_str);
-			hdl_desc->addr = hdl_str;
-			hdl_desc->len = entry->hdl_size;
-			return 0;
-		}
+	PTHREAD_MUTEX_lock(&cache->lock);
+	slot = *uuid_slot(cache, cache->by_uuid, uuid);
+	/* If a matching entry is found in cache, it will copy the content of
+	 * file handle into a new buffer. BE SURE TO FREE. The reason for such
+	 * design is to make it consistent with txnfs_db_get_handle.
+	 */
+	if (slot != 0) {
+		entry = &cache->entries[slot - 1];
+		hdl_desc->addr = gsh_malloc(entry->hdl_size);
+		txnfs_cache_copyfh(entry, hdl_desc->addr);
+		hdl_desc->len = entry->hdl_size;
 	}
+	PTHREAD_MUTEX_unlock(&cache->lock);
 
-	return -1;
+	return slot != 0 ? 0 : -1;
 }
 
 int txnfs_cache_delete_uuid(uuid_t uuid)
@@ -161,21 +194,34 @@ int txnfs_cache_delete_uuid(uuid_t uuid)
 void txnfs_cache_init(uint32_t compound_size)
 {
 	size_t cap = MIN(compound_size, TXN_CACHE_CAP);
+	uint32_t n_slots = 2;
+	struct txnfs_cache *cache;
 
 	if (op_ctx->txn_cache)
 		LogFatal(COMPONENT_FSAL,
 			 "txnfs cache has already been initialized");
 	/* Ganesha limits the max number of operations in a compound
 	 * to be 256. Therefore the txnfs cache's size can be fixed
-	 * to min(256, number of ops). */
-	op_ctx->txn_cache =
-	    gsh_calloc(1, sizeof(*op_ctx->txn_cache) +
-			      sizeof(struct txnfs_cache_entry) * cap);
-	op_ctx->txn_cache->capacity = cap;
-	op_ctx->txn_cache->size = 0;
-	op_ctx->txn_cache->entries =
-	    (struct txnfs_cache_entry *)((char *)op_ctx->txn_cache +
-					 sizeof(*op_ctx->txn_cache));
+	 * to min(256, number of ops). The indexes are kept at most half
+	 * full. */
+	while (n_slots < 2 * cap)
+		n_slots <<= 1;
+	cache = gsh_calloc(1, sizeof(*cache) +
+				  sizeof(struct txnfs_cache_entry) * cap +
+				  sizeof(struct txnfs_snap_stripe) * 2 *
+				  compound_size +
+				  3 * sizeof(uint16_t) * n_slots);
+	PTHREAD_MUTEX_init(&cache->lock, NULL);
+	cache->capacity = cap;
+	cache->size = 0;
+	cache->entries = (struct txnfs_cache_entry *)(cache + 1);
+	cache->snap_stripes =
+	    (struct txnfs_snap_stripe *)(cache->entries + cap);
+	cache->index_mask = n_slots - 1;
+	cache->by_fh = (uint16_t *)(cache->snap_stripes + 2 * compound_size);
+	cache->by_uuid = cache->by_fh + n_slots;
+	cache->by_path = cache->by_uuid + n_slots;
+	op_ctx->txn_cache = cache;
 }
 
 static inline void combine_prefix(const char *prefix, const size_t prefix_len,
@@ -192,12 +238,76 @@ static inline void combine_prefix(const char *prefix, const size_t prefix_len,
 	*length = prefix_len + src_len;
 }
 
+/* Keys of the records of a txn cache entry */
+struct txnfs_entry_keys {
+	char *uuid;
+	char *hdl;
+	char *path;
+	size_t hdl_len;
+};
+
+#define UUID_KEY_LEN (PREF_LEN + sizeof(uuid_t))
+
+static inline size_t entry_keys_size(struct txnfs_cache_entry *entry)
+{
+	return 2 * UUID_KEY_LEN + PREF_LEN + entry->hdl_size;
+}
+
+/**
+ * @brief Build the keys of @c entry at @c buf
+ *
+ * @c buf must hold entry_keys_size(entry) bytes.
+ */
+static void build_entry_keys(struct txnfs_cache_entry *entry, char *buf,
+			     struct txnfs_entry_keys *keys)
+{
+	keys->uuid = buf;
+	memcpy(keys->uuid, UUID_KEY_PREFIX, PREF_LEN);
+	memcpy(keys->uuid + PREF_LEN, entry->uuid, sizeof(uuid_t));
+	keys->path = keys->uuid + UUID_KEY_LEN;
+	memcpy(keys->path, PATH_KEY_PREFIX, PREF_LEN);
+	memcpy(keys->path + PREF_LEN, entry->uuid, sizeof(uuid_t));
+	keys->hdl = keys->path + UUID_KEY_LEN;
+	memcpy(keys->hdl, FH_KEY_PREFIX, PREF_LEN);
+	memcpy(keys->hdl + PREF_LEN, TXNCACHE_FH(entry), entry->hdl_size);
+	keys->hdl_len = PREF_LEN + entry->hdl_size;
+}
+
+/**
+ * @brief Apply a txn cache entry to the database record cache
+ *
+ * Called once the entry has been written to the database. Records that were
+ * created or modified are cached with their new value and deleted records
+ * are dropped. If the write failed, every record the entry touches is
+ * dropped since its state in the database is unknown.
+ */
+static void txnfs_db_cache_apply(kv_cache_t *cache,
+				 struct txnfs_cache_entry *entry,
+				 struct txnfs_entry_keys *keys, bool written)
+{
+	if (written && entry->entry_type == txnfs_cache_entry_create) {
+		kv_cache_put(cache, keys->uuid, UUID_KEY_LEN,
+			     TXNCACHE_FH(entry), entry->hdl_size);
+		kv_cache_put(cache, keys->hdl, keys->hdl_len, entry->uuid,
+			     sizeof(uuid_t));
+		kv_cache_put(cache, keys->path, UUID_KEY_LEN,
+			     entry->abs_path.addr, entry->abs_path.len);
+	} else if (written && entry->entry_type == txnfs_cache_entry_modify) {
+		kv_cache_put(cache, keys->path, UUID_KEY_LEN,
+			     entry->abs_path.addr, entry->abs_path.len);
+	} else {
+		kv_cache_invalidate(cache, keys->uuid, UUID_KEY_LEN);
+		if (entry->hdl_size > 0)
+			kv_cache_invalidate(cache, keys->hdl, keys->hdl_len);
+		kv_cache_invalidate(cache, keys->path, UUID_KEY_LEN);
+	}
+}
+
 // commit entries in `op_ctx->txn_cache` and remove txn log
 int txnfs_cache_commit(void)
 {
 	UDBG;
 	int ret = 0;
-	char *err = NULL;
 	char uuid_str[UUID_STR_LEN];
 	struct txnfs_cache_entry *entry;
 
@@ -206,102 +316,153 @@ int txnfs_cache_commit(void)
 	    container_of(fs, struct txnfs_fsal_module, module);
 	db_store_t *db = txnfs->db;
 
-	char *uuid_key = NULL;
-	char *hdl_key = NULL;
-	char *path_key = NULL;
-	size_t uuid_key_len, hdl_key_len, path_key_len;
+	/* the keys of all entries, built once in a single buffer and kept
+	 * for the record cache */
+	struct txnfs_entry_keys *keys;
+	char *arena, *cur;
+	size_t arena_size = 0;
+	uint32_t i;
 	int n_put = 0, n_del = 0;
 
+	txnfs_cache_foreach(entry, op_ctx->txn_cache)
+		arena_size += entry_keys_size(entry);
+	keys = gsh_malloc(sizeof(*keys) * op_ctx->txn_cache->size +
+			  arena_size);
+	arena = (char *)(keys + op_ctx->txn_cache->size);
+
 	leveldb_writebatch_t *commit_batch = leveldb_writebatch_create();
+	cur = arena;
+	i = 0;
 	txnfs_cache_foreach(entry, op_ctx->txn_cache)
 	{
-		uuid_unparse_lower(entry->uuid, uuid_str);
+		struct txnfs_entry_keys *k = &keys[i++];
 
-		/* add prefix to keys */
-		combine_prefix(UUID_KEY_PREFIX, PREF_LEN, entry->uuid,
-			       sizeof(uuid_t), &uuid_key, &uuid_key_len);
-		combine_prefix(FH_KEY_PREFIX, PREF_LEN, TXNCACHE_FH(entry),
-			       entry->hdl_size, &hdl_key, &hdl_key_len);
-		combine_prefix(PATH_KEY_PREFIX, PREF_LEN, entry->uuid,
-			       sizeof(uuid_t), &path_key, &path_key_len);
+		build_entry_keys(entry, cur, k);
+		cur += entry_keys_size(entry);
 
 		if (entry->entry_type == txnfs_cache_entry_create) {
-			leveldb_writebatch_put(commit_batch, uuid_key,
-					       uuid_key_len, TXNCACHE_FH(entry),
+			leveldb_writebatch_put(commit_batch, k->uuid,
+					       UUID_KEY_LEN, TXNCACHE_FH(entry),
 					       entry->hdl_size);
 
-			leveldb_writebatch_put(commit_batch, hdl_key,
-					       hdl_key_len, entry->uuid,
+			leveldb_writebatch_put(commit_batch, k->hdl,
+					       k->hdl_len, entry->uuid,
 					       sizeof(uuid_t));
 
 			leveldb_writebatch_put(
-			    commit_batch, path_key, path_key_len,
+			    commit_batch, k->path, UUID_KEY_LEN,
 			    entry->abs_path.addr, entry->abs_path.len);
 
-			LogDebug(COMPONENT_FSAL, "put_key:%s ", uuid_str);
+			if (isDebug(COMPONENT_FSAL)) {
+				uuid_unparse_lower(entry->uuid, uuid_str);
+				LogDebug(COMPONENT_FSAL, "put_key:%s ",
+					 uuid_str);
+			}
 
 			n_put++;
 		} else if (entry->entry_type == txnfs_cache_entry_delete) {
-			leveldb_writebatch_delete(commit_batch, uuid_key,
-						  uuid_key_len);
+			leveldb_writebatch_delete(commit_batch, k->uuid,
+						  UUID_KEY_LEN);
 			if (entry->hdl_size > 0)
-				leveldb_writebatch_delete(commit_batch, hdl_key,
-							  hdl_key_len);
+				leveldb_writebatch_delete(commit_batch, k->hdl,
+							  k->hdl_len);
 			if (entry->abs_path.len > 0)
 				leveldb_writebatch_delete(
-				    commit_batch, path_key, path_key_len);
+				    commit_batch, k->path, UUID_KEY_LEN);
 
-			LogDebug(COMPONENT_FSAL, "delete_key:%s ", uuid_str);
+			if (isDebug(COMPONENT_FSAL)) {
+				uuid_unparse_lower(entry->uuid, uuid_str);
+				LogDebug(COMPONENT_FSAL, "delete_key:%s ",
+					 uuid_str);
+			}
 
 			n_del++;
 		} else if (entry->entry_type == txnfs_cache_entry_modify) {
 			assert(likely(entry->abs_path.len > 0));
 			leveldb_writebatch_put(
-			    commit_batch, path_key, path_key_len,
+			    commit_batch, k->path, UUID_KEY_LEN,
 			    entry->abs_path.addr, entry->abs_path.len);
 			n_put++;
 		}
-
-		gsh_free(uuid_key);
-		gsh_free(hdl_key);
-		gsh_free(path_key);
 	}
 
-	/* Remove txn log */
+	/* Remove txn log and its undo records */
 	if (op_ctx->txnid > 0) {
-		/* length of RR: len('txn-{uint64}') = 4+20+1 */
-		char rr_key[25] = {'\0'};
-		strncpy(rr_key, "txn-", 4);
-		snprintf(rr_key + 4, 21, "%lu", op_ctx->txnid);
-		leveldb_writebatch_delete(commit_batch, rr_key, sizeof(rr_key));
+		delete_txn_log(commit_batch, op_ctx->txnid,
+			       op_ctx->txn_cache->n_undo_records);
 		n_del++;
 	}
 	txnfs_tracepoint(collected_cache_entries, op_ctx->txnid, n_put, n_del);
 
 	if (n_put + n_del > 0) {
-		leveldb_write(db->db, db->w_options, commit_batch, &err);
+		/* coalesced with other compounds' commits into one fsync */
+		ret = db_group_write(db, commit_batch);
 
-		if (err) {
-			LogDebug(COMPONENT_FSAL, "leveldb error: %s", err);
-			leveldb_free(err);
-			ret = -1;
-		}
+		if (ret != 0)
+			LogDebug(COMPONENT_FSAL, "leveldb group write failed");
 
 		txnfs_tracepoint(committed_cache_to_db, op_ctx->txnid,
-				 err != NULL);
+				 ret != 0);
+
+		/* only now, so that readers cannot cache the old records
+		 * again */
+		if (txnfs->db_cache) {
+			i = 0;
+			txnfs_cache_foreach(entry, op_ctx->txn_cache)
+				txnfs_db_cache_apply(txnfs->db_cache, entry,
+						     &keys[i++], ret == 0);
+		}
 	}
 
 	leveldb_writebatch_destroy(commit_batch);
+	gsh_free(keys);
 
 	return ret;
 }
 
+/* @brief Dump the per-batch group commit counters of the txn database */
+void txnfs_log_group_commit_stats(void)
+{
+	struct db_group_commit_stats st;
+
+	if (!TXNFS.db)
+		return;
+	db_group_commit_get_stats(TXNFS.db, &st);
+	if (st.batches == 0)
+		return;
+
+	LogInfo(COMPONENT_FSAL,
+		"group commit: %" PRIu64 " writes in %" PRIu64
+		" batches (max %" PRIu64 ", full %" PRIu64 "), avg sync %" PRIu64
+		"ns, avg wait %" PRIu64 "ns",
+		st.writes, st.batches, st.max_batch, st.full_batches,
+		st.sync_ns / st.batches, st.wait_ns / st.writes);
+}
+
+/* @brief Dump the hit/miss counters of the database record cache */
+void txnfs_log_db_cache_stats(void)
+{
+	struct kv_cache_stats st;
+
+	if (!TXNFS.db_cache)
+		return;
+	kv_cache_get_stats(TXNFS.db_cache, &st);
+
+	LogInfo(COMPONENT_FSAL,
+		"db cache: %" PRIu64 " hits, %" PRIu64 " misses, %" PRIu64
+		" entries, %" PRIu64 " evictions, %" PRIu64
+		" invalidations, %" PRIu64 " stale fills",
+		st.hits, st.misses, st.entries, st.evictions,
+		st.invalidations, st.stale_fills);
+}
+
 // cleanup txn entries
 void txnfs_cache_cleanup(void)
 {
 	if (!op_ctx->txn_cache)
 		LogFatal(COMPONENT_FSAL, "attempt to destroy null cache");
 	op_ctx->txn_cache->capacity = 0;
+	PTHREAD_MUTEX_destroy(&op_ctx->txn_cache->lock);
 	gsh_free(op_ctx->txn_cache);
 	op_ctx->txn_cache = NULL;
 }
@@ -354,26 +515,53 @@ int txnfs_db_insert_handle(struct gsh_buffdesc *hdl_desc, uuid_t uuid,
 		ret = -1;
 	}
 
+	if (txnfs->db_cache && ret == 0) {
+		kv_cache_put(txnfs->db_cache, uuid_key, uuid_key_len,
+			     hdl_desc->addr, hdl_desc->len);
+		kv_cache_put(txnfs->db_cache, hdl_key, hdl_key_len, uuid,
+			     sizeof(uuid_t));
+		kv_cache_put(txnfs->db_cache, path_key, path_key_len,
+			     path->addr, path->len);
+	} else if (txnfs->db_cache) {
+		kv_cache_invalidate(txnfs->db_cache, uuid_key, uuid_key_len);
+		kv_cache_invalidate(txnfs->db_cache, hdl_key, hdl_key_len);
+		kv_cache_invalidate(txnfs->db_cache, path_key, path_key_len);
+	}
+
 	leveldb_writebatch_destroy(commit_batch);
 	gsh_free(hdl_key);
 	gsh_free(uuid_key);
+	gsh_free(path_key);
 
 	return ret;
 }
 
-/* @brief Query UUID with sub-FSAL host handle ONLY in levelDB */
+/* @brief Query UUID with sub-FSAL host handle ONLY in levelDB
+ *
+ * Committed records are served from the database record cache if enabled;
+ * the txn cache of the ongoing compound is not consulted.
+ */
 int txnfs_db_get_uuid_nocache(struct gsh_buffdesc *hdl_desc, uuid_t uuid)
 {
 	struct fsal_module *fs = op_ctx->fsal_export->fsal;
 	struct txnfs_fsal_module *txnfs =
 	    container_of(fs, struct txnfs_fsal_module, module);
 	db_store_t *db = txnfs->db;
+	uint64_t ticket = 0;
+	size_t cached_len = sizeof(uuid_t);
 
 	char *hdl_key;
 	size_t hdl_key_len;
 	combine_prefix(FH_KEY_PREFIX, PREF_LEN, hdl_desc->addr, hdl_desc->len,
 		       &hdl_key, &hdl_key_len);
 
+	if (txnfs->db_cache &&
+	    kv_cache_get_copy(txnfs->db_cache, hdl_key, hdl_key_len, uuid,
+			      &cached_len, &ticket)) {
+		gsh_free(hdl_key);
+		return 0;
+	}
+
 	char *val;
 	char *err = NULL;
 	size_t val_len;
@@ -384,13 +572,16 @@ int txnfs_db_get_uuid_nocache(struct gsh_buffdesc *hdl_desc, uuid_t uuid)
 		LogFatal(COMPONENT_FSAL, "leveldb error: %s", err);
 	}
 
-	gsh_free(hdl_key);
-
 	if (!val) {
+		gsh_free(hdl_key);
 		return -1;
 	}
 
 	assert(val_len == sizeof(uuid_t));
+	if (txnfs->db_cache)
+		kv_cache_fill(txnfs->db_cache, hdl_key, hdl_key_len, val,
+			      val_len, ticket);
+	gsh_free(hdl_key);
 	uuid_copy(uuid, val);
 	free(val);
 	return 0;
@@ -447,15 +638,23 @@ int txnfs_db_get_path(uuid_t uuid, struct gsh_buffdesc *path,
 	combine_prefix(PATH_KEY_PREFIX, PREF_LEN, uuid, sizeof(uuid_t),
 		       &path_key, &path_key_len);
 
-	char *val;
+	char *val = NULL;
 	size_t length;
 	char *err = NULL;
+	uint64_t ticket = 0;
 
-	val = leveldb_get(db->db, db->r_options, path_key, path_key_len,
-			  &length, &err);
-
-	if (err) {
-		LogFatal(COMPONENT_FSAL, "leveldb error: %s", err);
+	if (txnfs->db_cache)
+		val = kv_cache_get(txnfs->db_cache, path_key, path_key_len,
+				   &length, &ticket);
+	if (!val) {
+		val = leveldb_get(db->db, db->r_options, path_key,
+				  path_key_len, &length, &err);
+		if (err) {
+			LogFatal(COMPONENT_FSAL, "leveldb error: %s", err);
+		}
+		if (val && txnfs->db_cache)
+			kv_cache_fill(txnfs->db_cache, path_key, path_key_len,
+				      val, length, ticket);
 	}
 	gsh_free(path_key);
 
@@ -484,15 +683,23 @@ int txnfs_db_get_handle(uuid_t uuid, struct gsh_buffdesc *hdl_desc)
 	combine_prefix(UUID_KEY_PREFIX, PREF_LEN, uuid, sizeof(uuid_t),
 		       &uuid_key, &uuid_key_len);
 
-	char *val;
+	char *val = NULL;
 	size_t length;
 	char *err = NULL;
+	uint64_t ticket = 0;
 
-	val = leveldb_get(db->db, db->r_options, uuid_key, uuid_key_len,
-			  &length, &err);
-
-	if (err) {
-		LogFatal(COMPONENT_FSAL, "leveldb error: %s", err);
+	if (txnfs->db_cache)
+		val = kv_cache_get(txnfs->db_cache, uuid_key, uuid_key_len,
+				   &length, &ticket);
+	if (!val) {
+		val = leveldb_get(db->db, db->r_options, uuid_key,
+				  uuid_key_len, &length, &err);
+		if (err) {
+			LogFatal(COMPONENT_FSAL, "leveldb error: %s", err);
+		}
+		if (val && txnfs->db_cache)
+			kv_cache_fill(txnfs->db_cache, uuid_key, uuid_key_len,
+				      val, length, ticket);
 	}
 	gsh_free(uuid_key);
 
@@ -549,6 +756,8 @@ int txnfs_db_delete_uuid(uuid_t uuid)
 		leveldb_free(err);
 		ret = -1;
 	}
+	if (txnfs->db_cache)
+		kv_cache_invalidate(txnfs->db_cache, uuid_key, uuid_key_len);
 end:
 	gsh_free(uuid_key);
 	return ret;
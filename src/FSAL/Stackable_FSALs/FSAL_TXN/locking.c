@@ -19,14 +19,17 @@
  * 02110-1301 USA
  */
 
+#include "abstract_atomic.h"
 #include "lock_manager.h"
 #include "log.h"
 #include "opvec.h"
 #include "path_utils.h"
 #include "txnfs_methods.h"
 #include <assert.h>
+#include <pthread.h>
 #include <fsal_api.h>
 #include <hashtable.h>
+#include <nfs_proto_functions.h>
 #include <nfs_proto_tools.h>
 
 /**
@@ -93,12 +96,90 @@ static utf8string *extract_open_name(open_claim4 *claim)
 	return NULL;
 }
 
+/* Lock request paths only have to live until lm_lock_r() returns, so they
+ * are carved out of a per-thread arena that is rewound for every compound.
+ * Chunks are kept for the lifetime of the thread, and freed by the
+ * destructor of path_arena_key when it exits. */
+#define PATH_ARENA_CHUNK_SIZE (16 * PATH_MAX)
+
+struct path_arena_chunk {
+	struct path_arena_chunk *next;
+	size_t used;
+	char data[PATH_ARENA_CHUNK_SIZE];
+};
+
+static __thread struct path_arena_chunk *path_arena_head;
+static __thread struct path_arena_chunk *path_arena_cur;
+static pthread_once_t path_arena_once = PTHREAD_ONCE_INIT;
+static pthread_key_t path_arena_key;
+
+static void path_arena_free(void *arg)
+{
+	struct path_arena_chunk *chunk = arg, *next;
+
+	for (; chunk != NULL; chunk = next) {
+		next = chunk->next;
+		gsh_free(chunk);
+	}
+}
+
+static void path_arena_init(void)
+{
+	if (pthread_key_create(&path_arena_key, path_arena_free) != 0)
+		LogFatal(COMPONENT_FSAL, "Could not create the path arena key");
+}
+
+static void path_arena_reset(void)
+{
+	path_arena_cur = path_arena_head;
+	if (path_arena_cur)
+		path_arena_cur->used = 0;
+}
+
+static char *path_arena_alloc(size_t size)
+{
+	struct path_arena_chunk *chunk = path_arena_cur;
+	char *buf;
+
+	assert(size <= PATH_ARENA_CHUNK_SIZE);
+	if (chunk == NULL || chunk->used + size > PATH_ARENA_CHUNK_SIZE) {
+		struct path_arena_chunk *next = chunk ? chunk->next : NULL;
+
+		if (next == NULL) {
+			next = gsh_malloc(sizeof(*next));
+			next->next = NULL;
+			if (chunk) {
+				chunk->next = next;
+			} else {
+				(void)pthread_once(&path_arena_once,
+						   path_arena_init);
+				path_arena_head = next;
+				(void)pthread_setspecific(path_arena_key,
+							  next);
+			}
+		}
+		next->used = 0;
+		path_arena_cur = chunk = next;
+	}
+	buf = chunk->data + chunk->used;
+	chunk->used += size;
+	return buf;
+}
+
 static void add_lock_request(lock_request_t *lrs, int *pos, const char *path,
 			     bool is_write)
 {
 	size_t pathlen = strnlen(path, PATH_MAX);
-	char *pathbuf = gsh_calloc(1, pathlen + 1);
-	strncpy(pathbuf, path, pathlen);
+	char *pathbuf;
+
+	/* counted, so that the caller sees the overflow */
+	if (*pos >= LM_MAX_LOCKS) {
+		(*pos)++;
+		return;
+	}
+	pathbuf = path_arena_alloc(pathlen + 1);
+	memcpy(pathbuf, path, pathlen);
+	pathbuf[pathlen] = '\0';
 	lrs[*pos].path = pathbuf;
 	lrs[*pos].write_lock = is_write;
 	(*pos)++;
@@ -110,21 +191,26 @@ static void add_lock_request(lock_request_t *lrs, int *pos, const char *path,
  *
  * @param[in] args Compound args
  * @param[in] lr_vec Lock request array: Should have adequate space to hold
- * 	      256 lock requests
+ * 	      LM_MAX_LOCKS lock requests. The paths stay valid until the next
+ * 	      call on the same thread.
  *
- * @return Number of paths to be locked
+ * @return Number of paths to be locked, or -1 if the compound needs more
+ *	   than LM_MAX_LOCKS of them.
  */
 int find_relevant_handles(COMPOUND4args *args, lock_request_t *lr_vec)
 {
 	int i, ret = 0, veclen = 0;
 	/* What we need is the path */
-	char *current_path = gsh_calloc(1, PATH_MAX + 1);
-	char *saved_path = gsh_calloc(1, PATH_MAX + 1);
+	char current_path[PATH_MAX + 1] = {'\0'};
+	char saved_path[PATH_MAX + 1] = {'\0'};
+	char scratch_path[PATH_MAX];
 	struct fsal_obj_handle *current = NULL;
 	struct attrlist cur_attr = {0};
 	utf8string utf8_name;
 	char *name;
 
+	path_arena_reset();
+
 	/* let's start from ROOT */
 	char *root_path = op_ctx->ctx_export->fullpath;
 	strncpy(current_path, root_path, PATH_MAX);
@@ -199,7 +285,7 @@ int find_relevant_handles(COMPOUND4args *args, lock_request_t *lr_vec)
 			case NFS4_OP_OPEN:;
 				utf8string *u8name = extract_open_name(
 				    &curop_arg->nfs_argop4_u.opopen.claim);
-				char *parent_path = gsh_calloc(1, PATH_MAX);
+				char *parent_path = scratch_path;
 
 				/* If the OPEN operation creates new file, we
 				 * should lock the parent directory. If that
@@ -232,8 +318,6 @@ int find_relevant_handles(COMPOUND4args *args, lock_request_t *lr_vec)
 				else
 					add_lock_request(lr_vec, &veclen,
 							 parent_path, false);
-
-				gsh_free(parent_path);
 				break;
 
 			/* Write lock the CURRENT path */
@@ -251,19 +335,17 @@ int find_relevant_handles(COMPOUND4args *args, lock_request_t *lr_vec)
 				/* LINK: lock src and dest dir
 				 * saved_fh: source object
 				 * current_fh: target dir */
-				size_t srclen = strnlen(saved_path, PATH_MAX);
-				char *srcbuf = gsh_calloc(1, srclen + 1);
+				char *srcbuf = scratch_path;
 				char *destbuf = current_path;
-				strncpy(srcbuf, saved_path, srclen);
 				/* We should lock the parent of src, not src
 				 * file */
-				tc_path_join(srcbuf, "..", srcbuf, srclen);
+				tc_path_join(saved_path, "..", srcbuf,
+					     PATH_MAX);
 
 				add_lock_request(lr_vec, &veclen, srcbuf,
 						 false);
 				add_lock_request(lr_vec, &veclen, destbuf,
 						 true);
-				gsh_free(srcbuf);
 				break;
 
 			/* Read/Shared lock the CURRENT path */
@@ -302,7 +384,368 @@ int find_relevant_handles(COMPOUND4args *args, lock_request_t *lr_vec)
 			ret);
 	}
 
-	gsh_free(current_path);
-	gsh_free(saved_path);
+	if (veclen > LM_MAX_LOCKS) {
+		LogDebug(COMPONENT_FSAL, "compound needs %d locks", veclen);
+		return -1;
+	}
+
 	return veclen;
 }
+
+/**
+ * @brief Try to run a compound optimistically
+ *
+ * Only the paths written by the compound are locked, without waiting. They
+ * are marked as being written in the export's version table, and the
+ * versions of the paths the compound only reads are recorded so that
+ * txnfs_occ_validate() can tell whether another compound wrote them in the
+ * meantime.
+ *
+ * While the export has seen occ_max_aborts aborts in a row, compounds are
+ * locked instead; each of them takes one abort off the count.
+ *
+ * @param[in] exp	TXNFS export, with a version table
+ * @param[in] lrs	Lock requests of the compound
+ * @param[in] n		Number of lock requests
+ *
+ * @return true if the compound runs optimistically. Otherwise nothing is
+ *	   held and the compound has to be locked.
+ */
+bool txnfs_occ_begin(struct txnfs_fsal_export *exp, lock_request_t *lrs,
+		     int n)
+{
+	struct txnfs_cache *cache = op_ctx->txn_cache;
+	lock_request_t writes[LM_MAX_LOCKS];
+	int i, n_writes = 0;
+
+	if (atomic_fetch_int32_t(&exp->occ_aborts) >=
+	    (int32_t)exp->occ_max_aborts) {
+		atomic_dec_int32_t(&exp->occ_aborts);
+		return false;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (lrs[i].write_lock)
+			writes[n_writes++] = lrs[i];
+	}
+
+	if (n_writes > 0 &&
+	    lm_try_lock_r(exp->lm, writes, n_writes, op_ctx->lh) == NULL)
+		goto abort;
+
+	if (!vt_begin(exp->vt, lrs, n, &cache->vh)) {
+		unlock_handle_r(op_ctx->lh);
+		goto abort;
+	}
+
+	cache->optimistic = true;
+	return true;
+
+abort:
+	atomic_inc_int32_t(&exp->occ_aborts);
+	LogDebug(COMPONENT_FSAL, "txnid=%" PRIu64 " conflicts, locking it",
+		 op_ctx->txnid);
+	return false;
+}
+
+/**
+ * @brief Mark the paths written by a locked compound in the version table
+ *
+ * Optimistic compounds reading those paths then fail to validate. The
+ * compound must hold its locks.
+ */
+void txnfs_occ_pin_writes(struct txnfs_fsal_export *exp, lock_request_t *lrs,
+			  int n)
+{
+	lock_request_t writes[LM_MAX_LOCKS];
+	int i, n_writes = 0;
+
+	for (i = 0; i < n; i++) {
+		if (lrs[i].write_lock)
+			writes[n_writes++] = lrs[i];
+	}
+
+	if (n_writes > 0 &&
+	    !vt_begin(exp->vt, writes, n_writes, &op_ctx->txn_cache->vh))
+		LogFatal(COMPONENT_FSAL, "txnid=%" PRIu64 " can't pin paths",
+			 op_ctx->txnid);
+}
+
+/**
+ * @brief Check that nothing read by an optimistic compound has been written
+ *	  by another compound since it started
+ *
+ * @return true if the compound can commit.
+ */
+bool txnfs_occ_validate(struct txnfs_fsal_export *exp)
+{
+	if (vt_validate(&op_ctx->txn_cache->vh)) {
+		atomic_store_int32_t(&exp->occ_aborts, 0);
+		return true;
+	}
+
+	atomic_inc_int32_t(&exp->occ_aborts);
+	LogDebug(COMPONENT_FSAL, "txnid=%" PRIu64 " failed validation",
+		 op_ctx->txnid);
+	return false;
+}
+
+/**
+ * @brief Make the client retry a compound that failed validation
+ *
+ * The compound has been rolled back, so the reply stops with NFS4ERR_DELAY
+ * at its first op after SEQUENCE.
+ *
+ * @param[in,out] res	Compound result
+ */
+void txnfs_occ_reply_delay(COMPOUND4res *res)
+{
+	COMPOUND4args *args = op_ctx->op_args;
+	nfs_resop4 *resarray = res->resarray.resarray_val;
+	u_int first = 0, i;
+
+	if (res->resarray.resarray_len > 0 &&
+	    resarray[0].resop == NFS4_OP_SEQUENCE)
+		first = 1;
+
+	if (first >= res->resarray.resarray_len)
+		return;
+
+	for (i = first; i < res->resarray.resarray_len; i++)
+		nfs4_Compound_FreeOne(&resarray[i]);
+
+	resarray[first].resop = args->argarray.argarray_val[first].argop;
+	resarray[first].nfs_resop4_u.opaccess.status = NFS4ERR_DELAY;
+	res->resarray.resarray_len = first + 1;
+	res->status = NFS4ERR_DELAY;
+}
+
+/**
+ * @brief Whether an op only reads
+ *
+ * @param[in] op	The operation
+ */
+static bool op_is_read_only(nfs_opnum4 op)
+{
+	switch (op) {
+		case NFS4_OP_SEQUENCE:
+		case NFS4_OP_PUTFH:
+		case NFS4_OP_PUTROOTFH:
+		case NFS4_OP_PUTPUBFH:
+		case NFS4_OP_GETFH:
+		case NFS4_OP_GETATTR:
+		case NFS4_OP_ACCESS:
+		case NFS4_OP_LOOKUP:
+		case NFS4_OP_LOOKUPP:
+		case NFS4_OP_READ:
+		case NFS4_OP_READDIR:
+		case NFS4_OP_READLINK:
+		case NFS4_OP_SAVEFH:
+		case NFS4_OP_RESTOREFH:
+		case NFS4_OP_VERIFY:
+		case NFS4_OP_NVERIFY:
+		case NFS4_OP_SECINFO:
+		case NFS4_OP_SECINFO_NO_NAME:
+			return true;
+
+		default:
+			return false;
+	}
+}
+
+/**
+ * @brief Whether a compound only reads
+ *
+ * @param[in] args	Compound args
+ */
+static bool compound_is_read_only(COMPOUND4args *args)
+{
+	u_int i;
+
+	for (i = 0; i < args->argarray.argarray_len; i++) {
+		if (!op_is_read_only(args->argarray.argarray_val[i].argop))
+			return false;
+	}
+
+	return true;
+}
+
+/* The version of a stripe counts the running writers of its objects in its
+ * low 32 bits, and the finished writes above them. */
+#define SNAP_WRITERS_MASK 0xffffffffULL
+#define SNAP_WRITE_DONE ((1ULL << 32) - 1)
+
+static inline uint32_t snap_stripe(uint64_t fileid)
+{
+	/* Fibonacci hashing */
+	return (fileid * 0x9E3779B97F4A7C15ULL) >>
+	       (64 - TXNFS_SNAP_STRIPE_BITS);
+}
+
+/* Segments of a compound may run on several threads at once */
+static inline void snap_add(struct txnfs_cache *cache, uint32_t stripe,
+			    uint64_t version)
+{
+	uint32_t i = atomic_postinc_uint32_t(&cache->n_snap_stripes);
+
+	cache->snap_stripes[i].stripe = stripe;
+	cache->snap_stripes[i].version = version;
+}
+
+static inline void snap_write(struct txnfs_fsal_export *exp, uint32_t stripe)
+{
+	atomic_inc_uint64_t(&exp->snap_versions[stripe]);
+	snap_add(op_ctx->txn_cache, stripe, 0);
+}
+
+/**
+ * @brief Try to run a read-only compound on a snapshot
+ *
+ * The compound neither resolves nor locks its paths. Instead, it records
+ * the version of each object it reads as it runs (see txnfs_snapshot_track),
+ * and txnfs_snapshot_validate() checks that none of them has been written
+ * in the meantime.
+ *
+ * While the export has seen TXNFS_SNAPSHOT_MAX_ABORTS snapshots fail in a
+ * row, read-only compounds are locked instead; each of them takes one
+ * failure off the count.
+ *
+ * @param[in] exp	TXNFS export
+ * @param[in] args	Compound args
+ *
+ * @return true if the compound runs on a snapshot, false if it has to be
+ *	   locked.
+ */
+bool txnfs_snapshot_begin(struct txnfs_fsal_export *exp, COMPOUND4args *args)
+{
+	if (!exp->snapshot_reads || !compound_is_read_only(args))
+		return false;
+
+	if (atomic_fetch_int32_t(&exp->snap_aborts) >=
+	    TXNFS_SNAPSHOT_MAX_ABORTS) {
+		atomic_dec_int32_t(&exp->snap_aborts);
+		return false;
+	}
+
+	op_ctx->txn_cache->snapshot = true;
+	return true;
+}
+
+/**
+ * @brief Version what an op is about to read or write
+ *
+ * Called before every op of a compound on an export with snapshot reads.
+ * Objects are versioned by stripe of fileid. A snapshot compound records
+ * the version of the current object, which the op may read. Any other
+ * compound marks the objects an op may change as being written until
+ * txnfs_snapshot_end(). A directory stands for its entries, so that a
+ * snapshot that looks a name up sees the entry being created, removed or
+ * renamed.
+ *
+ * @param[in] exp	TXNFS export with snapshot reads
+ * @param[in] op	The op about to run
+ * @param[in] current	Current object of the op, NULL if none is set
+ */
+void txnfs_snapshot_track(struct txnfs_fsal_export *exp, struct nfs_argop4 *op,
+			  struct fsal_obj_handle *current)
+{
+	struct txnfs_cache *cache = op_ctx->txn_cache;
+	uint32_t stripe;
+
+	if (current == NULL)
+		return;
+
+	stripe = snap_stripe(current->fileid);
+	if (cache->snapshot) {
+		snap_add(cache, stripe,
+			 atomic_fetch_uint64_t(&exp->snap_versions[stripe]));
+		return;
+	}
+
+	switch (op->argop) {
+		case NFS4_OP_SAVEFH:
+			cache->snap_saved = stripe;
+			return;
+
+		/* the saved object is the source directory or file */
+		case NFS4_OP_RENAME:
+		case NFS4_OP_LINK:
+			snap_write(exp, cache->snap_saved);
+			break;
+
+		/* only change the state of the client */
+		case NFS4_OP_CLOSE:
+		case NFS4_OP_COMMIT:
+		case NFS4_OP_DELEGRETURN:
+		case NFS4_OP_LOCK:
+		case NFS4_OP_LOCKT:
+		case NFS4_OP_LOCKU:
+		case NFS4_OP_OPEN_DOWNGRADE:
+			return;
+
+		default:
+			if (op_is_read_only(op->argop))
+				return;
+			break;
+	}
+
+	snap_write(exp, stripe);
+}
+
+/**
+ * @brief Mark an object another op changes as being written
+ *
+ * For objects that are not the current one, such as the file an OPEN
+ * truncates.
+ */
+void txnfs_snapshot_write(struct txnfs_fsal_export *exp, uint64_t fileid)
+{
+	snap_write(exp, snap_stripe(fileid));
+}
+
+/**
+ * @brief Check that nothing a snapshot compound read has been written while
+ *	  it ran
+ *
+ * @return true if the compound saw a consistent view.
+ */
+bool txnfs_snapshot_validate(struct txnfs_fsal_export *exp)
+{
+	struct txnfs_cache *cache = op_ctx->txn_cache;
+	struct txnfs_snap_stripe *s;
+	uint32_t i;
+
+	for (i = 0; i < cache->n_snap_stripes; i++) {
+		s = &cache->snap_stripes[i];
+		if ((s->version & SNAP_WRITERS_MASK) != 0 ||
+		    atomic_fetch_uint64_t(&exp->snap_versions[s->stripe]) !=
+			s->version)
+			goto conflict;
+	}
+
+	atomic_store_int32_t(&exp->snap_aborts, 0);
+	return true;
+
+conflict:
+	atomic_inc_int32_t(&exp->snap_aborts);
+	LogDebug(COMPONENT_FSAL, "snapshot raced with a writer");
+	return false;
+}
+
+/**
+ * @brief Finish the writes of a compound once its files are committed or
+ *	  restored
+ */
+void txnfs_snapshot_end(struct txnfs_fsal_export *exp)
+{
+	struct txnfs_cache *cache = op_ctx->txn_cache;
+	uint32_t i;
+
+	if (exp->snap_versions == NULL || cache->snapshot)
+		return;
+
+	for (i = 0; i < cache->n_snap_stripes; i++)
+		atomic_add_uint64_t(
+		    &exp->snap_versions[cache->snap_stripes[i].stripe],
+		    SNAP_WRITE_DONE);
+}
@@ -74,6 +74,24 @@ static struct config_item txn_items[] = {
 		   db_path),
     /*CONF_MAND_PATH("BackupPath", 1, MAXPATHLEN, "/tmp/txnbackup",
      * txnfs_fsal_module, backup_path),*/
+    CONF_ITEM_UI32("GroupCommitMaxDelay", 0, 100000, 0, txnfs_fsal_module,
+		   gc_max_delay_us),
+    CONF_ITEM_UI32("GroupCommitMaxBatch", 1, 1024, 64, txnfs_fsal_module,
+		   gc_max_batch),
+    CONF_ITEM_UI32("CleanupWorkers", 1, 64, 1, txnfs_fsal_module,
+		   cleanup_workers),
+    CONF_ITEM_UI32("CleanupBatch", 1, 4096, 64, txnfs_fsal_module,
+		   cleanup_batch),
+    CONF_ITEM_BOOL("CleanupDeferred", false, txnfs_fsal_module,
+		   cleanup_deferred),
+    CONF_ITEM_UI32("BackupSlots", 0, 1024, 64, txnfs_fsal_module,
+		   backup_slots),
+    CONF_ITEM_UI32("InlineUndoMaxSize", 0, 1048576, 16384, txnfs_fsal_module,
+		   inline_undo_max),
+    CONF_ITEM_UI32("RecoveryWorkers", 1, 256, 8, txnfs_fsal_module,
+		   recovery_workers),
+    CONF_ITEM_UI32("DbCacheSize", 0, 16777216, 65536, txnfs_fsal_module,
+		   db_cache_size),
     CONFIG_EOL};
 
 static struct config_block txn_block = {
@@ -129,8 +147,17 @@ static fsal_status_t init_config(struct fsal_module *fsal_module,
 	lm = new_lock_manager();
 	db = init_db_store(txnfs_module->db_path, true);
 	assert(db != NULL);
+	if (db_group_commit_init(db, txnfs_module->gc_max_delay_us,
+				 txnfs_module->gc_max_batch) != 0)
+		LogWarn(COMPONENT_FSAL, "failed to enable group commit");
+	LogInfo(COMPONENT_FSAL,
+		"group commit: max_delay=%" PRIu32 "us max_batch=%" PRIu32,
+		txnfs_module->gc_max_delay_us, txnfs_module->gc_max_batch);
 	txnfs_module->db = db;
 	txnfs_module->lm = lm;
+	if (txnfs_module->db_cache_size > 0)
+		txnfs_module->db_cache =
+		    new_kv_cache(txnfs_module->db_cache_size);
 
 	return fsalstat(ERR_FSAL_NO_ERROR, 0);
 }
@@ -164,6 +191,10 @@ MODULE_INIT void txnfs_init(void)
 	}
 	myself->m_ops.create_export = txnfs_create_export;
 	myself->m_ops.init_config = init_config;
+#ifdef USE_DBUS
+	myself->m_ops.fsal_extract_stats = txnfs_extract_stats;
+#endif
+	myself->stats = &txnfs_stats;
 
 	/* Initialize the fsal_obj_handle ops for FSAL NULL */
 	txnfs_handle_ops_init(&TXNFS.handle_ops);
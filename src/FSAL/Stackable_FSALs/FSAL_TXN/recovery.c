@@ -0,0 +1,420 @@
+/*
+ * vim:noexpandtab:shiftwidth=8:tabstop=8:
+ *
+ * Copyright (C) Stony Brook University 2019
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+/**
+ * @file recovery.c
+ * @brief Undo the transactions a crash left pending
+ *
+ * Every txn log still in the database at startup belongs to a transaction
+ * that neither committed nor rolled back. The logs are split into groups
+ * that touch disjoint objects (see txn_recovery.h); groups are undone by
+ * a pool of threads while the txns of one group are undone in order, newest
+ * first, so that each object ends up with its oldest saved content.
+ *
+ * Only the pre-images kept in the log (inline undos) can be restored here.
+ * A txn that kept backups in its backup directory, which includes every txn
+ * type but WRITE and the WRITEs of logs from before txn_record.h, cannot be
+ * undone from its log: its log and those of the older txns of its group are
+ * kept, and so are its backups (see txnfs_recover_backup_slots()). They are
+ * reported at the first start only.
+ */
+
+#include "txnfs_methods.h"
+#include "txn_recovery.h"
+#include <abstract_atomic.h>
+#ifdef USE_DBUS
+#include "gsh_dbus.h"
+#endif
+
+/* Log the progress every that many txns */
+#define RECOVERY_PROGRESS_INTERVAL 4096
+
+struct recovery_stats {
+	uint64_t pending;	/* txns found in the database */
+	uint64_t groups;
+	uint64_t undone;
+	uint64_t failed;	/* their logs are kept for the next start */
+	uint64_t kept;		/* need their backup directory; logs kept */
+	/* time spent undoing txns; protected by recovery_stats_lock */
+	uint64_t undo_ns;
+	uint64_t undo_min_ns;
+	uint64_t undo_max_ns;
+	uint64_t duration_ns;	/* whole recovery; 0 until it is over */
+};
+
+static struct recovery_stats recovery_stats;
+static pthread_mutex_t recovery_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Only set so that GetFSALStats asks us for the recovery stats */
+struct fsal_stats txnfs_stats;
+
+struct recovery_arg {
+	struct req_op_context *context;
+	struct txnfs_fsal_export *exp;
+	txn_recovery_t *rec;
+	int32_t *next_group;
+};
+
+/**
+ * @brief Put back the content an inline undo saved, and the size of the file
+ *
+ * NOTE: This function assumes LOWER fsal.
+ */
+static fsal_status_t undo_inline(struct fsal_export *sub_export,
+				 txn_recovery_t *rec,
+				 const struct InlineUndo *undo)
+{
+	struct fsal_obj_handle *sub_hdl = NULL;
+	struct gsh_buffdesc hdl_desc;
+	struct attrlist attrs;
+	fsal_status_t status;
+
+	hdl_desc.addr = (void *)txn_recovery_handle_key(rec, undo->file_id.id,
+							&hdl_desc.len);
+	if (hdl_desc.addr == NULL) {
+		/* created by the txn itself, so it had nothing to save */
+		LogDebug(COMPONENT_FSAL, "no handle for an undo, skipped");
+		return fsalstat(ERR_FSAL_NO_ERROR, 0);
+	}
+
+	fsal_prepare_attrs(&attrs, ATTR_SIZE);
+	status = sub_export->exp_ops.create_handle(sub_export, &hdl_desc,
+						   &sub_hdl, &attrs);
+	if (FSAL_IS_ERROR(status))
+		goto out;
+
+	/* an undo without data only carries the size of a file that a WRITE
+	 * extended */
+	if (undo->len > 0)
+		status = txnfs_sub_io(sub_hdl, true, undo->offset,
+				      (void *)undo->data, undo->len);
+	/* the saved ranges lie below orig_size, so the writes did not grow
+	 * the file and its size is still the one the txn left */
+	if (FSAL_IS_SUCCESS(status) && attrs.filesize > undo->orig_size) {
+		struct attrlist size = {0};
+
+		size.filesize = undo->orig_size;
+		FSAL_SET_MASK(size.valid_mask, ATTR_SIZE);
+		status = sub_hdl->obj_ops->setattr2(sub_hdl, true, NULL, &size);
+	}
+	sub_hdl->obj_ops->release(sub_hdl);
+out:
+	fsal_release_attrs(&attrs);
+	return status;
+}
+
+static fsal_status_t undo_txn(struct fsal_export *sub_export,
+			      txn_recovery_t *rec, const struct TxnLog *txn)
+{
+	fsal_status_t status = {ERR_FSAL_NO_ERROR, 0};
+	int i;
+
+	/* Each WRITE logs its undos, or the size of the file it extends,
+	 * before it runs: a WRITE txn without undos has changed nothing. */
+	for (i = 0; i < txn->num_inline_undos; i++) {
+		status = undo_inline(sub_export, rec, &txn->inline_undos[i]);
+		if (FSAL_IS_ERROR(status))
+			break;
+	}
+	return status;
+}
+
+/**
+ * @brief Whether the log of a txn holds everything needed to undo it
+ */
+static bool undo_from_log(const struct TxnLog *txn)
+{
+	return txn->backup_dir_path == NULL &&
+	       (txn->compound_type == txn_VNone ||
+		txn->compound_type == txn_VWrite);
+}
+
+static void count_undo(uint64_t ns)
+{
+	PTHREAD_MUTEX_lock(&recovery_stats_lock);
+	recovery_stats.undo_ns += ns;
+	if (ns > recovery_stats.undo_max_ns)
+		recovery_stats.undo_max_ns = ns;
+	if (recovery_stats.undo_min_ns == 0 || ns < recovery_stats.undo_min_ns)
+		recovery_stats.undo_min_ns = ns;
+	PTHREAD_MUTEX_unlock(&recovery_stats_lock);
+}
+
+/**
+ * @brief Leave the txns of a group pending from the i-th one on
+ *
+ * The i-th txn needs its backup directory to be undone. It is reported once
+ * and marked, along with the older txns held back by it, so that the next
+ * starts do not report it again.
+ */
+static void keep_txns(txn_recovery_t *rec,
+		      const struct txn_recovery_group *group, int i)
+{
+	const struct TxnLog *txn = group->txns[i];
+
+	if (txn_recovery_is_kept(rec, txn->txn_id)) {
+		LogDebug(COMPONENT_FSAL,
+			 "txn %" PRIu64 " and %d older txns still pending",
+			 txn->txn_id, group->n_txns - i - 1);
+		return;
+	}
+	LogWarn(COMPONENT_FSAL,
+		"txn %" PRIu64 " of type %d needs its backup directory %s to be undone; it and %d older txns are left pending",
+		txn->txn_id, txn->compound_type,
+		txn->backup_dir_path ? txn->backup_dir_path : "",
+		group->n_txns - i - 1);
+	if (txn_recovery_keep(TXNFS.db, group->txns + i,
+			      group->n_txns - i) != 0)
+		LogCrit(COMPONENT_FSAL, "cannot mark txn %" PRIu64 " as kept",
+			txn->txn_id);
+}
+
+/**
+ * @brief Undo the txns of one group and remove their logs
+ *
+ * Once a txn fails or cannot be undone from its log, the older ones of the
+ * group are not undone either: their logs are kept, as is the one of that
+ * txn, for the next start.
+ */
+static void recover_group(struct txnfs_fsal_export *exp, txn_recovery_t *rec,
+			  const struct txn_recovery_group *group)
+{
+	struct fsal_export *sub_export = exp->export.sub_export;
+	struct timespec start, end;
+	fsal_status_t status;
+	uint64_t done, *skipped = &recovery_stats.failed;
+	int i;
+
+	for (i = 0; i < group->n_txns; i++) {
+		if (!undo_from_log(group->txns[i])) {
+			keep_txns(rec, group, i);
+			skipped = &recovery_stats.kept;
+			break;
+		}
+		now(&start);
+		status = undo_txn(sub_export, rec, group->txns[i]);
+		now(&end);
+		if (FSAL_IS_ERROR(status)) {
+			LogCrit(COMPONENT_FSAL,
+				"cannot undo txn %" PRIu64 ": %d, %d",
+				group->txns[i]->txn_id, status.major,
+				status.minor);
+			break;
+		}
+		count_undo(timespec_diff(&start, &end));
+		done = atomic_inc_uint64_t(&recovery_stats.undone);
+		if (done % RECOVERY_PROGRESS_INTERVAL == 0)
+			LogEvent(COMPONENT_FSAL,
+				 "recovery: %" PRIu64 " of %" PRIu64
+				 " txns undone",
+				 done, recovery_stats.pending);
+	}
+	if (i < group->n_txns)
+		atomic_add_uint64_t(skipped, group->n_txns - i);
+
+	if (i > 0 && txn_recovery_remove(TXNFS.db, group->txns, i) != 0)
+		LogFatal(COMPONENT_FSAL, "cannot remove undone txn logs");
+}
+
+static void *recovery_worker(void *ptr)
+{
+	struct recovery_arg *args = ptr;
+	int n_groups = txn_recovery_num_groups(args->rec);
+	int32_t i;
+
+	op_ctx = args->context;
+	/* ---- switch export ---- */
+	op_ctx->fsal_export = args->exp->export.sub_export;
+
+	/* groups come largest first, so the long ones start early */
+	while ((i = atomic_inc_int32_t(args->next_group) - 1) < n_groups)
+		recover_group(args->exp, args->rec,
+			      txn_recovery_get_group(args->rec, i));
+
+	op_ctx->fsal_export = &args->exp->export;
+	return NULL;
+}
+
+/**
+ * @brief Undo the transactions left pending by a crash
+ *
+ * Blocks until every pending txn is undone, before the export serves any
+ * request. Only the first export does it, as all of them share the txn log.
+ *
+ * @param[in] exp	The export being created; op_ctx points to it
+ */
+void txnfs_recover(struct txnfs_fsal_export *exp)
+{
+	static bool recovered;
+	struct recovery_arg *args;
+	pthread_t *tids;
+	txn_recovery_t *rec;
+	struct timespec start, end;
+	int32_t next_group = 0;
+	int n_workers, n_groups, i, err;
+
+	if (recovered)
+		return;
+	recovered = true;
+
+	now(&start);
+	rec = txn_recovery_load(TXNFS.db, UUID_KEY_PREFIX);
+	if (rec == NULL)
+		LogFatal(COMPONENT_FSAL, "cannot read the txn logs");
+
+	n_groups = txn_recovery_num_groups(rec);
+	recovery_stats.pending = txn_recovery_num_txns(rec);
+	recovery_stats.groups = n_groups;
+	if (txn_recovery_num_corrupt(rec) > 0)
+		LogCrit(COMPONENT_FSAL, "%d txn logs cannot be parsed",
+			txn_recovery_num_corrupt(rec));
+	if (n_groups == 0) {
+		LogInfo(COMPONENT_FSAL, "recovery: no pending txn");
+		goto out;
+	}
+
+	n_workers = MIN(MAX(TXNFS.recovery_workers, 1), n_groups);
+	LogEvent(COMPONENT_FSAL,
+		 "recovery: %" PRIu64 " pending txns in %d groups, %d workers",
+		 recovery_stats.pending, n_groups, n_workers);
+
+	tids = gsh_calloc(n_workers, sizeof(*tids));
+	args = gsh_calloc(n_workers, sizeof(*args));
+	for (i = 0; i < n_workers; i++) {
+		args[i].context = txnfs_copy_op_ctx();
+		args[i].exp = exp;
+		args[i].rec = rec;
+		args[i].next_group = &next_group;
+		err = pthread_create(&tids[i], NULL, recovery_worker, &args[i]);
+		if (err) {
+			LogWarn(COMPONENT_FSAL,
+				"recovery worker thread %d failed: %d", i, err);
+			txnfs_free_op_ctx(args[i].context);
+			break;
+		}
+	}
+	/* without any thread, recover here */
+	if (i == 0) {
+		args[0].context = op_ctx;
+		args[0].exp = exp;
+		args[0].rec = rec;
+		args[0].next_group = &next_group;
+		recovery_worker(&args[0]);
+	}
+	n_workers = i;
+	for (i = 0; i < n_workers; i++) {
+		pthread_join(tids[i], NULL);
+		txnfs_free_op_ctx(args[i].context);
+	}
+	gsh_free(args);
+	gsh_free(tids);
+
+out:
+	txn_recovery_free(rec);
+	now(&end);
+	atomic_store_uint64_t(&recovery_stats.duration_ns,
+			      MAX(timespec_diff(&start, &end), 1));
+	if (recovery_stats.pending > 0)
+		LogEvent(COMPONENT_FSAL,
+			 "recovery: %" PRIu64 " txns undone, %" PRIu64
+			 " failed, %" PRIu64 " left for their backups, in %"
+			 PRIu64 "ms",
+			 recovery_stats.undone, recovery_stats.failed,
+			 recovery_stats.kept,
+			 recovery_stats.duration_ns / NS_PER_MSEC);
+}
+
+#ifdef USE_DBUS
+/**
+ * @brief Append a row of the TXNFS stats to the struct of a GetFSALStats reply
+ */
+void txnfs_append_stats_row(void *iter, const char *name, uint64_t count,
+			    double avg, double min, double max)
+{
+	dbus_message_iter_append_basic(iter, DBUS_TYPE_STRING, &name);
+	dbus_message_iter_append_basic(iter, DBUS_TYPE_UINT64, &count);
+	dbus_message_iter_append_basic(iter, DBUS_TYPE_DOUBLE, &avg);
+	dbus_message_iter_append_basic(iter, DBUS_TYPE_DOUBLE, &min);
+	dbus_message_iter_append_basic(iter, DBUS_TYPE_DOUBLE, &max);
+}
+
+/**
+ * @brief Report the crash recovery through GetFSALStats
+ *
+ * Rows are txns undone (with their undo times in ms), txns that failed,
+ * txns left pending because they need their backup directory, txns still to
+ * undo and groups. The message tells whether the recovery is
+ * over and how long it took. The cleanup queues of the exports (see
+ * cleanup.c) and the latencies of the phases of compounds (see stats.c)
+ * follow.
+ */
+void txnfs_extract_stats(struct fsal_module *fsal_hdl, void *iter)
+{
+	DBusMessageIter struct_iter;
+	DBusMessageIter *iter1 = (DBusMessageIter *)iter;
+	struct timespec timestamp;
+	uint64_t undone, failed, kept, duration;
+	double avg, min, max;
+	char buf[64];
+	char *message;
+
+	now(&timestamp);
+	dbus_append_timestamp(iter, &timestamp);
+	message = "TXNFS";
+	dbus_message_iter_append_basic(iter, DBUS_TYPE_STRING, &message);
+
+	undone = atomic_fetch_uint64_t(&recovery_stats.undone);
+	failed = atomic_fetch_uint64_t(&recovery_stats.failed);
+	kept = atomic_fetch_uint64_t(&recovery_stats.kept);
+	duration = atomic_fetch_uint64_t(&recovery_stats.duration_ns);
+	PTHREAD_MUTEX_lock(&recovery_stats_lock);
+	avg = undone ? (double)recovery_stats.undo_ns * 0.000001 / undone
+		     : 0.0;
+	min = (double)recovery_stats.undo_min_ns * 0.000001;
+	max = (double)recovery_stats.undo_max_ns * 0.000001;
+	PTHREAD_MUTEX_unlock(&recovery_stats_lock);
+
+	dbus_message_iter_open_container(iter1, DBUS_TYPE_STRUCT, NULL,
+					 &struct_iter);
+	txnfs_append_stats_row(&struct_iter, "RECOVERY_UNDONE", undone, avg,
+			       min, max);
+	txnfs_append_stats_row(&struct_iter, "RECOVERY_FAILED", failed, 0.0,
+			       0.0, 0.0);
+	txnfs_append_stats_row(&struct_iter, "RECOVERY_KEPT", kept, 0.0, 0.0,
+			       0.0);
+	txnfs_append_stats_row(&struct_iter, "RECOVERY_PENDING",
+			       recovery_stats.pending - undone - failed - kept,
+			       0.0, 0.0, 0.0);
+	txnfs_append_stats_row(&struct_iter, "RECOVERY_GROUPS",
+			       recovery_stats.groups, 0.0, 0.0, 0.0);
+	txnfs_append_cleanup_stats(fsal_hdl, &struct_iter);
+	txnfs_append_phase_stats(&struct_iter);
+	dbus_message_iter_close_container(iter1, &struct_iter);
+
+	if (duration == 0)
+		snprintf(buf, sizeof(buf), "Recovering");
+	else
+		snprintf(buf, sizeof(buf), "Recovered in %.3fs",
+			 (double)duration * 0.000000001);
+	message = buf;
+	dbus_message_iter_append_basic(iter, DBUS_TYPE_STRING, &message);
+}
+#endif   /* USE_DBUS */
@@ -0,0 +1,215 @@
+/*
+ * vim:noexpandtab:shiftwidth=8:tabstop=8:
+ *
+ * Copyright (C) Stony Brook University 2019
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+/**
+ * @file stats.c
+ * @brief Latency of the phases of transactional compounds
+ *
+ * Every thread counts the phases it times in blocks of its own, one per
+ * export, so that recording a phase takes no lock and shares no cache line
+ * with other threads. Blocks are also linked in a global list, under
+ * phase_blocks_lock, and are kept for the lifetime of the process; readers
+ * sum them up without stopping the writers, so a report may be off by the
+ * phases being recorded meanwhile.
+ *
+ * Latencies are counted in buckets of powers of two: bucket 0 holds those
+ * under 1us, and bucket b those in [2^(b-1), 2^b)us, the last bucket
+ * taking everything longer.
+ */
+
+#include "txnfs_methods.h"
+#include <gsh_list.h>
+#ifdef USE_DBUS
+#include "gsh_dbus.h"
+#endif
+
+#define PHASE_BUCKETS 32
+#define PHASE_BUCKET_SHIFT 10	/* bucket 0 is below 2^10ns */
+
+struct phase_hist {
+	uint64_t count;
+	uint64_t sum_ns;
+	uint64_t min_ns;
+	uint64_t max_ns;
+	uint64_t buckets[PHASE_BUCKETS];
+};
+
+struct phase_block {
+	struct glist_head link;		/* in phase_blocks */
+	struct phase_block *next;	/* next block of the same thread */
+	uint16_t export_id;
+	struct phase_hist hist[TXNFS_PHASE_COUNT];
+};
+
+static struct glist_head phase_blocks = GLIST_HEAD_INIT(phase_blocks);
+static pthread_mutex_t phase_blocks_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread struct phase_block *thread_blocks;
+
+static const char *phase_names[TXNFS_PHASE_COUNT] = {
+	[TXNFS_PHASE_LOG] = "LOG",
+	[TXNFS_PHASE_LOCK] = "LOCK",
+	[TXNFS_PHASE_BACKUP] = "BACKUP",
+	[TXNFS_PHASE_EXEC] = "EXEC",
+	[TXNFS_PHASE_COMMIT] = "COMMIT",
+	[TXNFS_PHASE_ROLLBACK] = "ROLLBACK",
+};
+
+static struct phase_block *get_block(uint16_t export_id)
+{
+	struct phase_block *block;
+	int i;
+
+	for (block = thread_blocks; block != NULL; block = block->next)
+		if (block->export_id == export_id)
+			return block;
+
+	block = gsh_calloc(1, sizeof(*block));
+	block->export_id = export_id;
+	for (i = 0; i < TXNFS_PHASE_COUNT; i++)
+		block->hist[i].min_ns = UINT64_MAX;
+	block->next = thread_blocks;
+	thread_blocks = block;
+
+	PTHREAD_MUTEX_lock(&phase_blocks_lock);
+	glist_add_tail(&phase_blocks, &block->link);
+	PTHREAD_MUTEX_unlock(&phase_blocks_lock);
+	return block;
+}
+
+static inline int bucket_of(uint64_t ns)
+{
+	uint64_t us = ns >> PHASE_BUCKET_SHIFT;
+	int b = us ? 64 - __builtin_clzll(us) : 0;
+
+	return b < PHASE_BUCKETS ? b : PHASE_BUCKETS - 1;
+}
+
+/**
+ * @brief Count @c ns spent in @c phase by the current compound
+ *
+ * The phase is counted for the export of @c op_ctx; a sub-FSAL export has
+ * the same id as its TXNFS export.
+ */
+void txnfs_phase_record(enum txnfs_phase phase, uint64_t ns)
+{
+	struct phase_hist *hist =
+	    &get_block(op_ctx->fsal_export->export_id)->hist[phase];
+
+	hist->count++;
+	hist->sum_ns += ns;
+	if (ns < hist->min_ns)
+		hist->min_ns = ns;
+	if (ns > hist->max_ns)
+		hist->max_ns = ns;
+	hist->buckets[bucket_of(ns)]++;
+}
+
+#ifdef USE_DBUS
+static void sum_hist(struct phase_hist *sum, const struct phase_hist *hist)
+{
+	int i;
+
+	sum->count += hist->count;
+	sum->sum_ns += hist->sum_ns;
+	if (hist->min_ns < sum->min_ns)
+		sum->min_ns = hist->min_ns;
+	if (hist->max_ns > sum->max_ns)
+		sum->max_ns = hist->max_ns;
+	for (i = 0; i < PHASE_BUCKETS; i++)
+		sum->buckets[i] += hist->buckets[i];
+}
+
+static void append_hist(DBusMessageIter *iter, const char *name,
+			const struct phase_hist *hist)
+{
+	double lower, upper;
+	int i;
+
+	if (hist->count == 0) {
+		txnfs_append_stats_row(iter, name, 0, 0.0, 0.0, 0.0);
+		return;
+	}
+	txnfs_append_stats_row(iter, name, hist->count,
+			       (double)hist->sum_ns * 0.000001 / hist->count,
+			       (double)hist->min_ns * 0.000001,
+			       (double)hist->max_ns * 0.000001);
+	for (i = 0; i < PHASE_BUCKETS; i++) {
+		if (hist->buckets[i] == 0)
+			continue;
+		lower = i ? (double)(1ULL << (PHASE_BUCKET_SHIFT + i - 1)) *
+				0.000001
+			  : 0.0;
+		upper = i < PHASE_BUCKETS - 1
+			    ? (double)(1ULL << (PHASE_BUCKET_SHIFT + i)) *
+				  0.000001
+			    : 0.0;
+		txnfs_append_stats_row(iter, "BUCKET", hist->buckets[i], lower,
+				       upper, 0.0);
+	}
+}
+
+/**
+ * @brief Report the phase latencies of every export through GetFSALStats
+ *
+ * For every export that ran a transactional compound, an "EXPORT" row with
+ * the export id as its count is followed by one row per phase with its
+ * count and its average, min and max in ms. Each phase row is followed by
+ * a "BUCKET" row per non-empty bucket, with the number of latencies and
+ * the bounds of the bucket in ms; the upper bound of the last bucket is 0.
+ */
+void txnfs_append_phase_stats(void *iter)
+{
+	struct phase_hist (*sums)[TXNFS_PHASE_COUNT] = NULL;
+	uint16_t *ids = NULL;
+	int n_ids = 0, i, j;
+	struct glist_head *glist;
+	struct phase_block *block;
+
+	PTHREAD_MUTEX_lock(&phase_blocks_lock);
+	glist_for_each(glist, &phase_blocks) {
+		block = glist_entry(glist, struct phase_block, link);
+		for (i = 0; i < n_ids; i++)
+			if (ids[i] == block->export_id)
+				break;
+		if (i == n_ids) {
+			n_ids++;
+			ids = gsh_realloc(ids, n_ids * sizeof(*ids));
+			sums = gsh_realloc(sums, n_ids * sizeof(*sums));
+			ids[i] = block->export_id;
+			memset(sums[i], 0, sizeof(*sums));
+			for (j = 0; j < TXNFS_PHASE_COUNT; j++)
+				sums[i][j].min_ns = UINT64_MAX;
+		}
+		for (j = 0; j < TXNFS_PHASE_COUNT; j++)
+			sum_hist(&sums[i][j], &block->hist[j]);
+	}
+	PTHREAD_MUTEX_unlock(&phase_blocks_lock);
+
+	for (i = 0; i < n_ids; i++) {
+		txnfs_append_stats_row(iter, "EXPORT", ids[i], 0.0, 0.0, 0.0);
+		for (j = 0; j < TXNFS_PHASE_COUNT; j++)
+			append_hist(iter, phase_names[j], &sums[i][j]);
+	}
+	gsh_free(ids);
+	gsh_free(sums);
+}
+#endif
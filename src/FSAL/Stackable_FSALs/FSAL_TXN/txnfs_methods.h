@@ -23,9 +23,11 @@
  */
 #include "cleanup.h"
 #include "fsal_api.h"
+#include "kv_cache.h"
 #include "lock_manager.h"
 #include "lwrapper.h"
 #include "txnfs.h"
+#include "version_table.h"
 #include <uuid/uuid.h>
 
 #ifdef USE_LTTNG
@@ -33,13 +35,63 @@
 #endif
 
 #define TXN_BKP_DIR ".txn"
-#define BKP_FN_LEN 20
+#define TXN_SLOT_FMT "slot-%d"
+/* empty file naming the txn a backup slot is in use by */
+#define TXN_SLOT_OWNER_PREFIX "txn-"
+#define BKP_FN_LEN 24
 #define UUID_KEY_PREFIX "uuid-"
 #define FH_KEY_PREFIX "fhdl-"
 #define PATH_KEY_PREFIX "path-"
 #define RR_KEY_PREFIX "txn-"
 #define PREF_LEN 5
 
+/* Snapshots failed in a row after which read-only compounds are locked */
+#define TXNFS_SNAPSHOT_MAX_ABORTS 8
+/* Objects versioned for snapshot reads are hashed by fileid into this many
+ * stripes */
+#define TXNFS_SNAP_STRIPE_BITS 12
+#define TXNFS_SNAP_STRIPES (1 << TXNFS_SNAP_STRIPE_BITS)
+
+/* A backed-up byte range [start, end) of a file. The original data is either
+ * in @c data, and in the txn log, or in the backup file if @c data is NULL. */
+struct txnfs_extent {
+	uint64_t start;
+	uint64_t end;
+	char *data;
+};
+
+/* Backup of one regular file written by the ongoing transaction.
+ *
+ * Ranges of at most InlineUndoMaxSize bytes are kept in memory and in the txn
+ * log. Larger ones go to the backup file "<fileid>.ext" in the transaction's
+ * backup folder, which is only created for them: it holds the original data
+ * at the original offsets, and its size is set to the size the file had
+ * before it was first written. @c extents lists the ranges saved so far,
+ * sorted and with adjacent ranges of the backup file merged, so that every
+ * range is backed up at most once per transaction. */
+struct txnfs_bkp_object {
+	struct txnfs_bkp_object *next;
+	uint64_t fileid;
+	uint64_t orig_size;
+	/* whether an undo in the txn log carries orig_size */
+	bool size_logged;
+	/* the backup file, NULL until a range is saved in it */
+	struct fsal_obj_handle *bkp_hdl;
+	int n_extents;
+	int max_extents;
+	struct txnfs_extent *extents;
+};
+
+/* A reusable backup directory ".txn/slot-<index>". A transaction takes a free
+ * slot instead of creating its own backup directory, and the slot is emptied
+ * and put back by the cleanup workers when the transaction ends. */
+struct txnfs_bkp_slot {
+	struct txnfs_bkp_slot *next;
+	/* The slot directory (Sub-FSAL handle), kept for the export lifetime */
+	struct fsal_obj_handle *dir;
+	int index;
+};
+
 struct txnfs_file_entry {
 	char *name;
 	struct fsal_obj_handle *obj;
@@ -58,6 +110,30 @@ struct txnfs_fsal_module {
 
 	/** Config - backup path */
 	char *backup_path;
+
+	/** Config - group commit flush window (microseconds) */
+	uint32_t gc_max_delay_us;
+	/** Config - max writes coalesced into one synced db write */
+	uint32_t gc_max_batch;
+
+	/** Config - number of backup cleanup threads */
+	uint32_t cleanup_workers;
+	/** Config - max txn backup dirs a cleanup thread takes at once */
+	uint32_t cleanup_batch;
+	/** Config - move txn backup dirs to the trash and remove them later */
+	bool cleanup_deferred;
+	/** Config - max number of reusable backup directories */
+	uint32_t backup_slots;
+
+	/** Config - max size of a WRITE whose pre-image goes in the txn log */
+	uint32_t inline_undo_max;
+	/** Config - number of threads undoing pending txns at startup */
+	uint32_t recovery_workers;
+
+	/** Config - max records cached in front of the database */
+	uint32_t db_cache_size;
+	/** Cache of handle, uuid and path records; NULL if disabled */
+	kv_cache_t *db_cache;
 };
 
 extern struct txnfs_fsal_module TXNFS;
@@ -121,14 +197,41 @@ struct txnfs_fsal_export {
 	struct fsal_obj_handle *root;
 	/* The handle of backup root (Sub-FSAL handle) */
 	struct fsal_obj_handle *bkproot;
-	/* Cleaner thread ID */
-	pthread_t cleanup_worker_tid;
+	/* Cleaner thread IDs */
+	int32_t n_cleanup_workers;
+	pthread_t *cleanup_worker_tids;
 	/* Cleanup task queue */
 	struct cleanup_queue cqueue;
-	/* A op_ctx dedicated for cleanup thread */
-	struct req_op_context *cleaner_ctx;
+	/* A op_ctx dedicated for each cleanup thread */
+	struct req_op_context **cleaner_ctxs;
+	/* Deferred cleanup: txn backup dirs are moved into this directory
+	 * (Sub-FSAL handle, under bkproot) and removed in bulk */
+	struct fsal_obj_handle *trash;
+	pthread_mutex_t trash_lock;
+	/* number of txn dirs moved into the trash since the last sweep */
+	uint64_t trash_pending;
+	/* Reusable backup directories not used by any transaction, and the
+	 * number of slots created so far; protected by slot_lock */
+	pthread_mutex_t slot_lock;
+	struct txnfs_bkp_slot *free_slots;
+	int n_slots;
   /* Lock manager object (Opaque) */
   lock_manager_t *lm;
+	/* Path versions for optimistic compounds; NULL unless the export is
+	 * Optimistic */
+	version_table_t *vt;
+	/* Whether compounds run optimistically, the optimistic compounds
+	 * aborted in a row, and how many of them make compounds fall back to
+	 * locking */
+	bool optimistic;
+	int32_t occ_aborts;
+	uint32_t occ_max_aborts;
+	/* Whether read-only compounds run on snapshots, the version of each
+	 * stripe of objects (see txnfs_snapshot_track), and the snapshots
+	 * that failed in a row */
+	bool snapshot_reads;
+	uint64_t *snap_versions;
+	int32_t snap_aborts;
 };
 
 fsal_status_t txnfs_lookup_path(struct fsal_export *exp_hdl, const char *path,
@@ -304,6 +407,8 @@ int txnfs_db_delete_uuid(uuid_t uuid);
 void txnfs_cache_init(uint32_t compound_size);
 int txnfs_cache_commit(void);
 void txnfs_cache_cleanup(void);
+void txnfs_log_group_commit_stats(void);
+void txnfs_log_db_cache_stats(void);
 void get_txn_root(struct fsal_obj_handle **root_handle, struct attrlist *attrs);
 
 /* txn backup and restore */
@@ -315,8 +420,64 @@ struct fsal_obj_handle *query_txn_backup(struct fsal_obj_handle *backup_root,
 fsal_status_t txnfs_backup_file(unsigned int opidx,
 				struct fsal_obj_handle *src_hdl, loff_t offset,
 				size_t length);
-int txnfs_compound_restore(uint64_t txnid, COMPOUND4res *res);
+fsal_status_t txnfs_backup_extent(struct fsal_obj_handle *src_hdl,
+				  const uuid_t uuid, loff_t offset,
+				  size_t length);
+fsal_status_t txnfs_sub_io(struct fsal_obj_handle *sub_hdl, bool write,
+			   uint64_t offset, void *buf, size_t len);
+struct txnfs_bkp_object *txnfs_find_bkp_object(uint64_t fileid);
+void txnfs_release_bkp_objects(void);
+void txnfs_put_backup_slot(struct txnfs_fsal_export *exp,
+			   struct txnfs_bkp_slot *slot);
+void txnfs_recover_backup_slots(struct txnfs_fsal_export *exp);
+int txnfs_compound_restore(uint64_t txnid, COMPOUND4res *res, bool conflict);
 int do_txn_rollback(uint64_t txnid, COMPOUND4res *res);
 
+/* crash recovery */
+void txnfs_recover(struct txnfs_fsal_export *exp);
+extern struct fsal_stats txnfs_stats;
+#ifdef USE_DBUS
+void txnfs_extract_stats(struct fsal_module *fsal_hdl, void *iter);
+void txnfs_append_stats_row(void *iter, const char *name, uint64_t count,
+			    double avg, double min, double max);
+#endif
+
+/* phase latencies; phases may nest, e.g. the log write of inline undos is
+ * also part of the backup, and both are part of the execution */
+enum txnfs_phase {
+	TXNFS_PHASE_LOG,	/* writing the txn log */
+	TXNFS_PHASE_LOCK,	/* resolving and locking the paths */
+	TXNFS_PHASE_BACKUP,	/* backing up files before they change */
+	TXNFS_PHASE_EXEC,	/* running the operations of the compound */
+	TXNFS_PHASE_COMMIT,	/* committing the txn cache */
+	TXNFS_PHASE_ROLLBACK,	/* undoing a failed compound */
+	TXNFS_PHASE_COUNT
+};
+
+static inline uint64_t txnfs_phase_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+void txnfs_phase_record(enum txnfs_phase phase, uint64_t ns);
+#ifdef USE_DBUS
+void txnfs_append_phase_stats(void *iter);
+#endif
+
 /* locking */
 int find_relevant_handles(COMPOUND4args *args, lock_request_t *lr_vec);
+bool txnfs_occ_begin(struct txnfs_fsal_export *exp, lock_request_t *lrs,
+		     int n);
+void txnfs_occ_pin_writes(struct txnfs_fsal_export *exp, lock_request_t *lrs,
+			  int n);
+bool txnfs_occ_validate(struct txnfs_fsal_export *exp);
+void txnfs_occ_reply_delay(COMPOUND4res *res);
+bool txnfs_snapshot_begin(struct txnfs_fsal_export *exp, COMPOUND4args *args);
+void txnfs_snapshot_track(struct txnfs_fsal_export *exp, struct nfs_argop4 *op,
+			  struct fsal_obj_handle *current);
+void txnfs_snapshot_write(struct txnfs_fsal_export *exp, uint64_t fileid);
+bool txnfs_snapshot_validate(struct txnfs_fsal_export *exp);
+void txnfs_snapshot_end(struct txnfs_fsal_export *exp);
@@ -72,7 +72,7 @@ static int hdlset_free_func(struct gsh_buffdesc key, struct gsh_buffdesc val)
 	    container_of(op_ctx->fsal_export, struct txnfs_fsal_export, export);
 	struct fsal_obj_handle *hdl = key.addr;
 	if (hdl == NULL || hdl == exp->root || hdl == exp->bkproot ||
-	    hdl == op_ctx->txn_bkp_folder)
+	    (op_ctx->txn_cache && hdl == op_ctx->txn_cache->bkp_folder))
 		return 0;
 	hdl->obj_ops->release(hdl);
 	return 0;
@@ -393,8 +393,7 @@ static bool file_has_uuid(struct fsal_obj_handle *file)
 }
 
 static int restore_data(struct fsal_obj_handle *target, uint64_t txnid,
-			int opidx, bool truncate_dest, loff_t wr_offset,
-			size_t wr_len)
+			int opidx)
 {
 	char backup_name[BKP_FN_LEN] = {'\0'};
 	struct fsal_obj_handle *root, *backup_root, *backup_dir;
@@ -438,17 +437,11 @@ static int restore_data(struct fsal_obj_handle *target, uint64_t txnid,
 	    container_of(target, struct txnfs_fsal_obj_handle, obj_handle);
 	struct fsal_obj_handle *sub_cur = txn_cur->sub_handle;
 
-	/* truncate the source file if requested and the file has been
-	 * expanded by WRITE operation */
-	if (truncate_dest && wr_len > attrs.filesize)
-		truncate_file(sub_cur, wr_offset + attrs.filesize);
-
 	/* if the backup file is empty, there is no point restoring data */
 	if (attrs.filesize == 0) goto end;
 
 	/* overwrite the source file. CFH is the file being written */
 	size = attrs.filesize;
-	out = round_down(wr_offset, 4096);
 	status = backup_file->obj_ops->clone2(backup_file, &in, sub_cur, &out,
 					      size, 0);
 	/* ->clone2 uses FICLONERANGE ioctl which depends on CoW support
@@ -457,7 +450,7 @@ static int restore_data(struct fsal_obj_handle *target, uint64_t txnid,
 	if (FSAL_IS_ERROR(status)) {
 		LogWarn(COMPONENT_FSAL, "clone failed (%d, %d), try copy",
 			status.major, status.minor);
-		out = wr_offset;
+		out = 0;
 		status = backup_file->obj_ops->copy(backup_file, in, sub_cur,
 						    out, size, &copied);
 		LogDebug(COMPONENT_FSAL, "%lu bytes copied", copied);
@@ -471,6 +464,79 @@ end:
 	return ret;
 }
 
+/**
+ * @brief Restore a range of a file from its range backup
+ *
+ * Copies back every backed-up extent that overlaps [wr_offset, wr_offset +
+ * wr_len), from memory or from the backup file, and truncates the file to its
+ * original size if the range went past it. The backup holds the data as it
+ * was before the transaction, so restoring a range more than once (for
+ * several WRITEs to it) is harmless.
+ */
+static int restore_extents(struct fsal_obj_handle *target, loff_t wr_offset,
+			   size_t wr_len)
+{
+	struct txnfs_fsal_export *exp =
+	    container_of(op_ctx->fsal_export, struct txnfs_fsal_export, export);
+	struct txnfs_fsal_obj_handle *txn_cur =
+	    container_of(target, struct txnfs_fsal_obj_handle, obj_handle);
+	struct fsal_obj_handle *sub_cur = txn_cur->sub_handle;
+	struct txnfs_bkp_object *obj;
+	uint64_t start, end, wr_end = wr_offset + wr_len;
+	loff_t in, out;
+	uint64_t copied = 0;
+	fsal_status_t status = {ERR_FSAL_NO_ERROR, 0};
+	int i;
+
+	obj = txnfs_find_bkp_object(sub_cur->fileid);
+	if (obj == NULL) {
+		LogWarn(COMPONENT_FSAL, "no backup for fileid=%lu",
+			sub_cur->fileid);
+		return ERR_FSAL_NOENT;
+	}
+
+	/* switch context */
+	op_ctx->fsal_export = exp->export.sub_export;
+
+	/* truncate the file if the WRITE operation has expanded it */
+	if (wr_end > obj->orig_size)
+		truncate_file(sub_cur, obj->orig_size);
+
+	for (i = 0; i < obj->n_extents; i++) {
+		start = obj->extents[i].start;
+		end = obj->extents[i].end;
+		if (end <= (uint64_t)wr_offset) continue;
+		if (start >= wr_end) break;
+
+		if (obj->extents[i].data) {
+			status = txnfs_sub_io(sub_cur, true, start,
+					      obj->extents[i].data, end - start);
+			if (FSAL_IS_ERROR(status)) break;
+			continue;
+		}
+
+		in = out = start;
+		status = obj->bkp_hdl->obj_ops->clone2(obj->bkp_hdl, &in,
+						       sub_cur, &out,
+						       end - start, 0);
+		/* fall back to ->copy if clone is not supported */
+		if (FSAL_IS_ERROR(status)) {
+			LogWarn(COMPONENT_FSAL, "clone failed (%d, %d), try copy",
+				status.major, status.minor);
+			status = obj->bkp_hdl->obj_ops->copy(
+			    obj->bkp_hdl, start, sub_cur, start, end - start,
+			    &copied);
+			LogDebug(COMPONENT_FSAL, "%lu bytes copied", copied);
+		}
+		if (FSAL_IS_ERROR(status)) break;
+	}
+
+	/* switch context back */
+	op_ctx->fsal_export = &exp->export;
+
+	return status.major;
+}
+
 /**
  * @brief Undo OPEN operation
  *
@@ -527,7 +593,7 @@ static int undo_open(struct nfs_argop4 *arg, struct fsal_obj_handle **cur,
 		ret = status.major;
 	} else if (arg->nfs_argop4_u.opopen.openhow.opentype & OPEN4_CREATE) {
 		/* In this case the file might have been truncated when open */
-		ret = restore_data(target, txnid, opidx, false, 0, SIZE_MAX);
+		ret = restore_data(target, txnid, opidx);
 		/* If there is no backup file then it's because the backup
 		 * function decided that the operation was not a truncation and
 		 * did not create any backup. This is not to be considered an
@@ -680,7 +746,7 @@ static int undo_write(struct nfs_argop4 *arg, struct fsal_obj_handle *cur,
 {
 	loff_t offset = arg->nfs_argop4_u.opwrite.offset;
 	size_t len = arg->nfs_argop4_u.opwrite.data.data_len;
-	return restore_data(cur, txnid, opidx, true, offset, len);
+	return restore_extents(cur, offset, len);
 }
 
 static int dispatch_undoer(struct op_vector *vec)
@@ -757,6 +823,7 @@ int do_txn_rollback(uint64_t txnid, COMPOUND4res *res)
 	fsal_status_t status;
 	struct attrlist cur_attr = {0};
 	struct op_vector vector;
+	bool skip_segment = false;
 
 	/* initialize op vector */
 	opvec_init(&vector, txnid);
@@ -772,8 +839,20 @@ int do_txn_rollback(uint64_t txnid, COMPOUND4res *res)
 		struct nfs_resop4 *curop_res = &res->resarray.resarray_val[i];
 		struct nfs_argop4 *curop_arg = &args->argarray.argarray_val[i];
 
-		/* if we encounter failed op, we can stop */
-		if (!is_op_ok(curop_res)) break;
+		/* If the compound ran sequentially, nothing after a failed op
+		 * has run. If its segments (each starting with PUTFH or
+		 * PUTROOTFH) ran in parallel, the ops following a failed or
+		 * skipped one in the same segment have not run either, but the
+		 * later segments may have. */
+		if (skip_segment && curop_arg->argop != NFS4_OP_PUTFH &&
+		    curop_arg->argop != NFS4_OP_PUTROOTFH)
+			continue;
+		skip_segment = false;
+		if (!is_op_ok(curop_res) ||
+		    curop_res->resop != curop_arg->argop) {
+			skip_segment = true;
+			continue;
+		}
 
 		/* real payload here */
 		int op = curop_res->resop;
@@ -43,9 +43,9 @@
 #include "pnfs_utils.h"
 #include "fsal.h"
 #include "netgroup_cache.h"
+#include "mdcache.h"
 #ifdef USE_DBUS
 #include "gsh_dbus.h"
-#include "mdcache.h"
 #endif
 
 /**
@@ -491,6 +491,9 @@ static void do_shutdown(void)
 		LogEvent(COMPONENT_THREAD, "Reaper thread shut down.");
 	}
 
+	LogEvent(COMPONENT_MAIN, "Saving cache snapshot.");
+	mdcache_snapshot_shutdown();
+
 	LogEvent(COMPONENT_MAIN, "Removing all exports.");
 	remove_all_exports();
 
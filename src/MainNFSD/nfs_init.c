@@ -220,6 +220,7 @@ static void *sigmgr_thread(void *UnusedArg)
 		if (signal_caught == SIGHUP) {
 			LogEvent(COMPONENT_MAIN,
 				 "SIGHUP_HANDLER: Received SIGHUP.... initiating export list reload");
+			reopen_log_facilities();
 			reread_config();
 #ifdef _HAVE_GSSAPI
 			svcauth_gss_release_cred();
@@ -44,12 +44,13 @@
 #include "server_stats.h"
 #include "export_mgr.h"
 #include "sal_functions.h"
+#include "iobuf_pool.h"
 
 static void nfs_read_ok(nfs_res_t *res, char *data, uint32_t read_size,
 			struct fsal_obj_handle *obj, int eof)
 {
 	if ((read_size == 0) && (data != NULL)) {
-		gsh_free(data);
+		iobuf_put(data);
 		data = NULL;
 	}
 
@@ -125,7 +126,7 @@ static void nfs3_read_cb(struct fsal_obj_handle *obj, fsal_status_t ret,
 	}
 
 	for (i = 0; i < read_arg->iov_count; ++i) {
-		gsh_free(read_arg->iov[i].iov_base);
+		iobuf_put(read_arg->iov[i].iov_base);
 	}
 
 	/* If we are here, there was an error */
@@ -286,13 +287,13 @@ int nfs3_read(nfs_arg_t *arg, struct svc_req *req, nfs_res_t *res)
 		goto putref;
 	}
 
-	data = gsh_malloc(size);
+	data = iobuf_get(size);
 
 	/* Check for delegation conflict. */
 	if (state_deleg_conflict(obj, false)) {
 		res->res_read3.status = NFS3ERR_JUKEBOX;
 		read_data.rc = NFS_REQ_OK;
-		gsh_free(data);
+		iobuf_put(data);
 		goto putref;
 	}
 
@@ -333,6 +334,6 @@ void nfs3_read_free(nfs_res_t *res)
 {
 	if ((res->res_read3.status == NFS3_OK)
 	    && (res->res_read3.READ3res_u.resok.data.data_len != 0)) {
-		gsh_free(res->res_read3.READ3res_u.resok.data.data_val);
+		iobuf_put(res->res_read3.READ3res_u.resok.data.data_val);
 	}
 }
@@ -42,6 +42,7 @@
 #include "server_stats.h"
 #include "export_mgr.h"
 #include "nfs_creds.h"
+#include "fridgethr.h"
 
 #ifdef USE_LTTNG
 #include "gsh_lttng/txnfs.h"
@@ -597,6 +598,556 @@ void copy_tag(utf8str_cs *dest, utf8str_cs *src)
 	}
 }
 
+/**
+ * @brief A range of ops of a compound that can run on its own
+ */
+struct nfs4_segment {
+	uint32_t start;		/*< Index of the PUTFH/PUTROOTFH */
+	uint32_t end;		/*< One past the last op */
+	uint32_t done;		/*< One past the last op executed */
+};
+
+/**
+ * @brief State shared by the threads running the segments of a compound
+ *
+ * The structure is reference counted so that helpers that only get to run
+ * after the compound has finished find nothing left to do.
+ */
+struct nfs4_parallel_compound {
+	pthread_mutex_t mtx;
+	pthread_cond_t cv;
+	uint32_t refs;
+	uint32_t next_seg;	/*< Next segment to claim */
+	uint32_t segs_done;	/*< Segments finished */
+	uint32_t n_segs;
+	uint32_t failed_seg;	/*< First segment with a failed op, or n_segs;
+				    the segments after it are cancelled */
+	bool txn_ready;		/*< Whether ops are backed up by FSAL_TXN */
+	struct req_op_context *ctx;	/*< Context of the compound */
+	compound_data_t *data;		/*< State after the first segment */
+	nfs_argop4 *argarray;
+	nfs_resop4 *resarray;
+	uint32_t *op_size;		/*< Response size of each op */
+	struct nfs4_segment segs[];
+};
+
+static struct fridgethr *compound_fridge;
+static pthread_once_t compound_fridge_once = PTHREAD_ONCE_INIT;
+
+static void compound_fridge_init(void)
+{
+	struct fridgethr_params frp;
+	int rc;
+
+	memset(&frp, 0, sizeof(frp));
+	frp.thr_max = nfs_param.nfsv4_param.compound_workers;
+	frp.thr_min = 0;
+	frp.thread_delay = 0;
+	frp.deferment = fridgethr_defer_queue;
+
+	rc = fridgethr_init(&compound_fridge, "Compound", &frp);
+	if (rc != 0) {
+		LogMajor(COMPONENT_NFS_V4,
+			 "Unable to initialize compound fridge, error code %d.",
+			 rc);
+		compound_fridge = NULL;
+	}
+}
+
+/**
+ * @brief Check whether an op can run in a parallel segment
+ *
+ * The ops below only depend on the current and saved filehandles, which a
+ * segment sets up by itself, and not on any client, session or open state
+ * of the compound.
+ *
+ * @param[in]  op       The operation
+ * @param[out] modifies Set if the op modifies a file
+ * @param[out] by_name  Set if the op reaches a file by name
+ */
+static bool nfs4_op_is_parallel(nfs_opnum4 op, bool *modifies, bool *by_name)
+{
+	switch (op) {
+	case NFS4_OP_PUTROOTFH:
+	case NFS4_OP_LOOKUP:
+	case NFS4_OP_LOOKUPP:
+		*by_name = true;
+		return true;
+
+	case NFS4_OP_WRITE:
+	case NFS4_OP_SETATTR:
+		*modifies = true;
+		return true;
+
+	case NFS4_OP_PUTFH:
+	case NFS4_OP_GETFH:
+	case NFS4_OP_GETATTR:
+	case NFS4_OP_ACCESS:
+	case NFS4_OP_READ:
+	case NFS4_OP_READLINK:
+	case NFS4_OP_VERIFY:
+	case NFS4_OP_NVERIFY:
+	case NFS4_OP_SAVEFH:
+	case NFS4_OP_RESTOREFH:
+	case NFS4_OP_COMMIT:
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+/**
+ * @brief Split the tail of a compound into independent segments
+ *
+ * Ops [from, len) are split before every PUTFH and PUTROOTFH. Segments are
+ * independent if each one only uses the filehandles it sets up itself and,
+ * when any of them modifies a file, all of them work on distinct files of
+ * export @a export_id given by PUTFH (files reached by name may alias).
+ *
+ * @param[in]  argarray  Compound arguments
+ * @param[in]  from      First op to split, a PUTFH or PUTROOTFH
+ * @param[in]  len       Number of ops in the compound
+ * @param[in]  export_id Export of the current filehandle
+ * @param[out] segs      Segments, room for len - from entries
+ * @param[out] modifies  Set if any op modifies a file
+ *
+ * @return Number of segments, or 0 if the ops must run sequentially.
+ */
+static uint32_t nfs4_split_compound(nfs_argop4 *argarray, uint32_t from,
+				    uint32_t len, uint16_t export_id,
+				    struct nfs4_segment *segs, bool *modifies)
+{
+	uint32_t i, j, n = 0;
+	bool by_name = false, saved = false;
+	nfs_fh4 *fh, *other;
+	file_handle_v4_t *v4;
+
+	for (i = from; i < len; i++) {
+		nfs_opnum4 op = argarray[i].argop;
+
+		if (!nfs4_op_is_parallel(op, modifies, &by_name))
+			return 0;
+
+		if (op == NFS4_OP_PUTFH || op == NFS4_OP_PUTROOTFH) {
+			if (n > 0)
+				segs[n - 1].end = i;
+			segs[n].start = segs[n].done = i;
+			n++;
+			saved = false;
+		}
+
+		if (op == NFS4_OP_PUTFH) {
+			/* pNFS DS handles carry per-thread state in op_ctx */
+			fh = &argarray[i].nfs_argop4_u.opputfh.object;
+			v4 = (file_handle_v4_t *) fh->nfs_fh4_val;
+			if (nfs4_Is_Fh_Invalid(fh) != NFS4_OK ||
+			    (v4->fhflags1 & FILE_HANDLE_V4_FLAG_DS) != 0)
+				return 0;
+		}
+
+		/* The saved filehandle must come from the same segment */
+		if (op == NFS4_OP_SAVEFH)
+			saved = true;
+		else if (op == NFS4_OP_RESTOREFH && !saved)
+			return 0;
+	}
+
+	if (n < 2)
+		return 0;
+	segs[n - 1].end = len;
+
+	if (!*modifies)
+		return n;
+	if (by_name)
+		return 0;
+
+	for (i = 0; i < n; i++) {
+		fh = &argarray[segs[i].start].nfs_argop4_u.opputfh.object;
+		v4 = (file_handle_v4_t *) fh->nfs_fh4_val;
+		if (ntohs(v4->id.exports) != export_id)
+			return 0;
+
+		for (j = 0; j < i; j++) {
+			other = &argarray[segs[j].start]
+						.nfs_argop4_u.opputfh.object;
+			if (fh->nfs_fh4_len == other->nfs_fh4_len &&
+			    memcmp(fh->nfs_fh4_val, other->nfs_fh4_val,
+				   fh->nfs_fh4_len) == 0)
+				return 0;
+		}
+	}
+
+	return n;
+}
+
+/**
+ * @brief Run one segment on a private copy of the compound state
+ *
+ * The segment gets its own op context, credentials and filehandles, but
+ * shares the export, session and transaction of the compound. It stops
+ * before its next op once a segment before it has failed.
+ */
+static void nfs4_run_segment(struct nfs4_parallel_compound *pc,
+			     struct nfs4_segment *seg)
+{
+	struct req_op_context *saved_ctx = op_ctx;
+	struct req_op_context ctx = *pc->ctx;
+	struct user_cred creds = *pc->ctx->creds;
+	struct export_perms export_perms = *pc->ctx->export_perms;
+	compound_data_t data = *pc->data;
+	nfs_argop4 *argarray = pc->argarray;
+	nfs_resop4 *resarray = pc->resarray;
+	nsecs_elapsed_t op_start_time;
+	struct timespec ts;
+	nfs_opnum4 opcode;
+	int perm_flags;
+	nfsstat4 status = NFS4_OK;
+	uint32_t s = seg - pc->segs;
+	uint32_t i;
+
+	ctx.creds = &creds;
+	ctx.export_perms = &export_perms;
+	ctx.caller_gdata = NULL;
+	ctx.caller_garray_copy = NULL;
+	ctx.managed_garray_copy = NULL;
+	ctx.txn_hdl_set = NULL;
+	if (ctx.ctx_export != NULL)
+		get_gsh_export_ref(ctx.ctx_export);
+	op_ctx = &ctx;
+
+	/* Start from the current object of the compound, like the sequential
+	 * loop would, but with filehandles of our own.
+	 */
+	memset(&data.currentFH, 0, sizeof(data.currentFH));
+	memset(&data.savedFH, 0, sizeof(data.savedFH));
+	data.current_obj = NULL;
+	data.current_ds = NULL;
+	data.saved_obj = NULL;
+	data.saved_ds = NULL;
+	data.saved_export = NULL;
+	data.preserved_clientid = NULL;
+	set_current_entry(&data, pc->data->current_obj);
+
+	for (i = seg->start; i < seg->end; i++) {
+		if (atomic_fetch_uint32_t(&pc->failed_seg) < s)
+			break;
+
+		opcode = argarray[i].argop;
+		data.oppos = i;
+		data.opname = optabv4[opcode].name;
+
+		LogDebug(COMPONENT_NFS_V4, "Request %d: opcode %d is %s", i,
+			 argarray[i].argop, data.opname);
+
+		now(&ts);
+		op_start_time = timespec_diff(&nfs_ServerBootTime, &ts);
+
+		perm_flags =
+		    optabv4[opcode].exp_perm_flags & EXPORT_OPTION_ACCESS_MASK;
+
+		if (perm_flags != 0) {
+			status = nfs4_Is_Fh_Empty(&data.currentFH);
+			if (status == NFS4_OK &&
+			    (op_ctx->export_perms->options & perm_flags) !=
+								perm_flags) {
+				if ((perm_flags & EXPORT_OPTION_MODIFY_ACCESS)
+				    != 0)
+					status = NFS4ERR_ROFS;
+				else
+					status = NFS4ERR_ACCESS;
+			}
+
+			if (status != NFS4_OK) {
+				resarray[i].nfs_resop4_u.opaccess.status =
+									status;
+				resarray[i].resop = argarray[i].argop;
+				pc->op_size[i] = sizeof(nfsstat4);
+				i++;
+				break;
+			}
+		}
+
+		data.op_resp_size = optabv4[opcode].resp_size;
+
+#ifdef USE_LTTNG
+		tracepoint(nfs_rpc, v4op_start, i, argarray[i].argop,
+			   data.opname);
+#endif
+		if (pc->txn_ready) {
+			op_ctx->opidx = i;
+			op_ctx->fsal_export->exp_ops.backup_nfs4_op(
+				op_ctx->fsal_export, i, data.current_obj,
+				&argarray[i], &data);
+#ifdef USE_LTTNG
+			tracepoint(txnfs, end_backup, op_ctx->txnid, i,
+				   argarray[i].argop, data.opname);
+#endif
+		}
+
+		status = (optabv4[opcode].funct) (&argarray[i],
+						  &data,
+						  &resarray[i]);
+
+#ifdef USE_LTTNG
+		tracepoint(nfs_rpc, v4op_end, i, argarray[i].argop,
+			   data.opname, nfsstat4_to_str(status));
+#endif
+
+		LogCompoundFH(&data);
+
+		resarray[i].nfs_resop4_u.opaccess.status = status;
+
+		server_stats_nfsv4_op_done(opcode, op_start_time, status);
+
+		if (status != NFS4_OK &&
+		    (optabv4[opcode].resp_size != VARIABLE_RESP_SIZE ||
+		     data.op_resp_size == VARIABLE_RESP_SIZE))
+			data.op_resp_size = sizeof(nfsstat4);
+
+		pc->op_size[i] = data.op_resp_size;
+
+		LogDebug(COMPONENT_NFS_V4,
+			 "Status of %s in position %d = %s, op response size is %"
+			 PRIu32, data.opname, i, nfsstat4_to_str(status),
+			 data.op_resp_size);
+
+		if (status != NFS4_OK) {
+			i++;
+			break;
+		}
+	}
+
+	seg->done = i;
+
+	/* Cancel the segments after this one */
+	if (status != NFS4_OK) {
+		PTHREAD_MUTEX_lock(&pc->mtx);
+		if (s < pc->failed_seg)
+			atomic_store_uint32_t(&pc->failed_seg, s);
+		PTHREAD_MUTEX_unlock(&pc->mtx);
+	}
+
+	/* Release what the segment set up; the session belongs to the
+	 * compound.
+	 */
+	set_current_entry(&data, NULL);
+	set_saved_entry(&data, NULL);
+
+	if (data.saved_export != NULL)
+		put_gsh_export(data.saved_export);
+
+	if (data.currentFH.nfs_fh4_val != NULL)
+		gsh_free(data.currentFH.nfs_fh4_val);
+
+	if (data.savedFH.nfs_fh4_val != NULL)
+		gsh_free(data.savedFH.nfs_fh4_val);
+
+	clean_credentials();
+
+	if (op_ctx->ctx_export != NULL)
+		put_gsh_export(op_ctx->ctx_export);
+
+	op_ctx = saved_ctx;
+}
+
+static void nfs4_parallel_compound_put(struct nfs4_parallel_compound *pc)
+{
+	uint32_t refs;
+
+	PTHREAD_MUTEX_lock(&pc->mtx);
+	refs = --pc->refs;
+	PTHREAD_MUTEX_unlock(&pc->mtx);
+
+	if (refs == 0) {
+		PTHREAD_MUTEX_destroy(&pc->mtx);
+		PTHREAD_COND_destroy(&pc->cv);
+		gsh_free(pc->op_size);
+		gsh_free(pc);
+	}
+}
+
+/**
+ * @brief Claim and run segments until none is left
+ *
+ * Segments after a failed one are claimed but not run.
+ */
+static void nfs4_run_segments(struct nfs4_parallel_compound *pc)
+{
+	uint32_t seg;
+	bool cancelled = false;
+
+	for (;;) {
+		PTHREAD_MUTEX_lock(&pc->mtx);
+		seg = pc->next_seg;
+		if (seg < pc->n_segs) {
+			pc->next_seg++;
+			cancelled = seg > pc->failed_seg;
+		}
+		PTHREAD_MUTEX_unlock(&pc->mtx);
+
+		if (seg >= pc->n_segs)
+			return;
+
+		if (!cancelled)
+			nfs4_run_segment(pc, &pc->segs[seg]);
+
+		PTHREAD_MUTEX_lock(&pc->mtx);
+		if (++pc->segs_done == pc->n_segs)
+			pthread_cond_signal(&pc->cv);
+		PTHREAD_MUTEX_unlock(&pc->mtx);
+	}
+}
+
+static void nfs4_segment_worker(struct fridgethr_context *ctx)
+{
+	struct nfs4_parallel_compound *pc = ctx->arg;
+
+	nfs4_run_segments(pc);
+	nfs4_parallel_compound_put(pc);
+}
+
+/**
+ * @brief Run the rest of a compound as parallel segments
+ *
+ * Ops [from, len) are split into independent segments (see
+ * nfs4_split_compound) that run on the compound fridge and on the calling
+ * thread. The results are merged in op order: the reply stops at the first
+ * failed op, or at the first op that does not fit in the response. Once an
+ * op fails, the segments after it are cancelled, but some of their ops may
+ * have run already; they are reported in @a exec_len so that FSAL_TXN can
+ * roll them back.
+ *
+ * @param[in,out] data      Compound state after op from - 1
+ * @param[in]     argarray  Compound arguments
+ * @param[in,out] resarray  Compound results
+ * @param[in]     from      First op to run, a PUTFH or PUTROOTFH
+ * @param[in]     len       Number of ops in the compound
+ * @param[in]     txn_ready Whether ops are backed up by FSAL_TXN
+ * @param[out]    reply_len Number of results to reply with
+ * @param[out]    exec_len  Number of results that have been set
+ * @param[out]    trim      Status to give op reply_len - 1 once FSAL_TXN
+ *                          is done with it, or NFS4_OK
+ * @param[out]    status    Status of the compound
+ *
+ * @return true if the ops have been run, false to run them sequentially.
+ */
+static bool nfs4_Compound_parallel(compound_data_t *data, nfs_argop4 *argarray,
+				   nfs_resop4 *resarray, uint32_t from,
+				   uint32_t len, bool txn_ready,
+				   uint32_t *reply_len, uint32_t *exec_len,
+				   nfsstat4 *trim, int *status)
+{
+	struct nfs4_parallel_compound *pc;
+	struct gsh_export *export = op_ctx->ctx_export;
+	uint32_t n_segs, helpers, i, s;
+	bool modifies = false;
+	int rc;
+
+	if (nfs_param.nfsv4_param.compound_workers == 0 || export == NULL ||
+	    op_ctx->fsal_pnfs_ds != NULL || data->sa_cachethis ||
+	    (data->session != NULL &&
+	     data->session->fore_channel_attrs.ca_maxoperations < len))
+		return false;
+
+	pc = gsh_calloc(1, sizeof(*pc) +
+			   (len - from) * sizeof(struct nfs4_segment));
+
+	n_segs = nfs4_split_compound(argarray, from, len, export->export_id,
+				     pc->segs, &modifies);
+
+	/* Only a transaction can undo a partially run compound */
+	if (n_segs == 0 ||
+	    (modifies && (!txn_ready || op_ctx->txnid == 0))) {
+		gsh_free(pc);
+		return false;
+	}
+
+	pthread_once(&compound_fridge_once, compound_fridge_init);
+	if (compound_fridge == NULL) {
+		gsh_free(pc);
+		return false;
+	}
+
+	PTHREAD_MUTEX_init(&pc->mtx, NULL);
+	PTHREAD_COND_init(&pc->cv, NULL);
+	pc->refs = 1;
+	pc->n_segs = n_segs;
+	pc->failed_seg = n_segs;
+	pc->txn_ready = txn_ready;
+	pc->ctx = op_ctx;
+	pc->data = data;
+	pc->argarray = argarray;
+	pc->resarray = resarray;
+	pc->op_size = gsh_calloc(len, sizeof(uint32_t));
+
+	LogDebug(COMPONENT_NFS_V4,
+		 "Running ops %"PRIu32" to %"PRIu32" as %"PRIu32" segments",
+		 from, len - 1, n_segs);
+
+	helpers = MIN(n_segs - 1, nfs_param.nfsv4_param.compound_workers);
+	for (i = 0; i < helpers; i++) {
+		PTHREAD_MUTEX_lock(&pc->mtx);
+		pc->refs++;
+		PTHREAD_MUTEX_unlock(&pc->mtx);
+
+		rc = fridgethr_submit(compound_fridge, nfs4_segment_worker, pc);
+		if (rc != 0) {
+			LogMajor(COMPONENT_NFS_V4,
+				 "Unable to submit compound segment: %d", rc);
+			nfs4_parallel_compound_put(pc);
+			break;
+		}
+	}
+
+	nfs4_run_segments(pc);
+
+	PTHREAD_MUTEX_lock(&pc->mtx);
+	while (pc->segs_done < pc->n_segs)
+		pthread_cond_wait(&pc->cv, &pc->mtx);
+	PTHREAD_MUTEX_unlock(&pc->mtx);
+
+	/* Merge the results in op order */
+	*status = NFS4_OK;
+	*trim = NFS4_OK;
+	*reply_len = len;
+	*exec_len = from;
+
+	for (s = 0; s < n_segs; s++) {
+		struct nfs4_segment *seg = &pc->segs[s];
+
+		*exec_len = MAX(*exec_len, seg->done);
+
+		if (*reply_len != len)
+			continue;
+
+		for (i = seg->start; i < seg->done; i++) {
+			data->oppos = i;
+			data->opname = optabv4[argarray[i].argop].name;
+			*trim = check_resp_room(data, pc->op_size[i]);
+
+			if (*trim != NFS4_OK) {
+				data->resp_size += sizeof(nfs_opnum4) +
+						   sizeof(nfsstat4);
+				*status = *trim;
+				*reply_len = i + 1;
+				break;
+			}
+
+			data->resp_size += sizeof(nfs_opnum4) + pc->op_size[i];
+			*status = resarray[i].nfs_resop4_u.opaccess.status;
+
+			if (*status != NFS4_OK) {
+				*reply_len = i + 1;
+				break;
+			}
+		}
+	}
+
+	nfs4_parallel_compound_put(pc);
+	return true;
+}
+
 /**
  * @brief The NFS PROC4 COMPOUND
  *
@@ -637,6 +1188,9 @@ int nfs4_Compound(nfs_arg_t *arg, struct svc_req *req, nfs_res_t *res)
 	const char *bad_op_state_reason = "";
 	log_components_t alt_component = COMPONENT_NFS_V4;
 	bool txn_ready = false, start_compound_called = false;
+	bool putfh_seen = false, parallel_tried = false, parallel_ran = false;
+	uint32_t reply_len = 0, exec_len = 0, j;
+	nfsstat4 trim = NFS4_OK;
 
 	if (compound4_minor > 2) {
 		LogCrit(COMPONENT_NFS_V4, "Bad Minor Version %d",
@@ -788,6 +1342,28 @@ int nfs4_Compound(nfs_arg_t *arg, struct svc_req *req, nfs_res_t *res)
 	}
 
 	for (i = 0; i < argarray_len; i++) {
+		/* Once the first PUTFH has set up the export and the
+		 * transaction, try to run the rest as independent segments.
+		 */
+		if (argarray[i].argop == NFS4_OP_PUTFH ||
+		    argarray[i].argop == NFS4_OP_PUTROOTFH) {
+			if (putfh_seen && !parallel_tried) {
+				parallel_tried = true;
+				parallel_ran = nfs4_Compound_parallel(
+					&data, argarray, resarray, i,
+					argarray_len, txn_ready, &reply_len,
+					&exec_len, &trim, &status);
+			}
+			if (parallel_ran) {
+				/* FSAL_TXN has to see every op that ran */
+				res->res_compound4.resarray.resarray_len =
+								exec_len;
+				i = reply_len - 1;
+				break;
+			}
+			putfh_seen = true;
+		}
+
 		/* Used to check if OP_SEQUENCE is the first operation */
 		data.oppos = i;
 		data.op_resp_size = sizeof(nfsstat4);
@@ -1040,16 +1616,38 @@ int nfs4_Compound(nfs_arg_t *arg, struct svc_req *req, nfs_res_t *res)
 		}
 
 		if (!start_compound_called && txn_ready) {
+			fsal_status_t txn_status;
+
 #ifdef USE_LTTNG
 			tracepoint(txnfs, before_start_compound, argarray_len);
 #endif
-			op_ctx->fsal_export->exp_ops.start_compound(
+			txn_status = op_ctx->fsal_export->exp_ops.start_compound(
 				op_ctx->fsal_export, &arg->arg_compound4);
 #ifdef USE_LTTNG
 			tracepoint(txnfs, after_start_compound, argarray_len,
 				   op_ctx->txnid);
 #endif
 			start_compound_called = true;
+
+			if (FSAL_IS_ERROR(txn_status)) {
+				/* The transaction could not be set up: fail the
+				 * next op before anything is changed.
+				 */
+				txn_ready = false;
+				if (i + 1 == argarray_len)
+					continue;
+				status = nfs4_Errno_status(txn_status);
+				LogDebug(COMPONENT_NFS_V4,
+					 "Status in position %d due to transaction start is %s",
+					 i + 1, nfsstat4_to_str(status));
+				data.resp_size += sizeof(nfs_opnum4) +
+						  sizeof(nfsstat4);
+				resarray[i + 1].resop = argarray[i + 1].argop;
+				resarray[i + 1].nfs_resop4_u.opaccess.status =
+									status;
+				res->res_compound4.resarray.resarray_len = i + 2;
+				break;
+			}
 		}
 
 	}			/* for */
@@ -1072,6 +1670,25 @@ int nfs4_Compound(nfs_arg_t *arg, struct svc_req *req, nfs_res_t *res)
 #endif
 	}
 
+	/* Unless the FSAL has already cut the reply short, only reply up to
+	 * the op that stopped the compound.
+	 */
+	if (parallel_ran &&
+	    res->res_compound4.resarray.resarray_len == exec_len) {
+		if (trim != NFS4_OK) {
+			nfs4_Compound_FreeOne(&resarray[reply_len - 1]);
+			resarray[reply_len - 1].resop =
+						argarray[reply_len - 1].argop;
+			resarray[reply_len - 1].nfs_resop4_u.opaccess.status =
+									trim;
+		}
+
+		for (j = reply_len; j < exec_len; j++)
+			nfs4_Compound_FreeOne(&resarray[j]);
+
+		res->res_compound4.resarray.resarray_len = reply_len;
+	}
+
 	/* Manage session's DRC: keep NFS4.1 replay for later use, but don't
 	 * save a replayed result again.
 	 */
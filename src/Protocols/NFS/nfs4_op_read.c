@@ -47,6 +47,7 @@
 #include "fsal_pnfs.h"
 #include "server_stats.h"
 #include "export_mgr.h"
+#include "iobuf_pool.h"
 
 struct nfs4_read_data {
 	READ4res *res_READ4;		/**< Results for read */
@@ -77,7 +78,7 @@ static void nfs4_read_cb(struct fsal_obj_handle *obj, fsal_status_t ret,
 
 	if (FSAL_IS_ERROR(ret)) {
 		for (i = 0; i < read_arg->iov_count; ++i) {
-			gsh_free(read_arg->iov[i].iov_base);
+			iobuf_put(read_arg->iov[i].iov_base);
 		}
 		data->res_READ4->READ4res_u.resok4.data.data_val = NULL;
 		goto done;
@@ -172,7 +173,7 @@ static int op_dsread(struct nfs_argop4 *op, compound_data_t *data,
 
 	/* Construct the FSAL file handle */
 
-	buffer = gsh_malloc_aligned(4096, arg_READ4->count);
+	buffer = iobuf_get(arg_READ4->count);
 
 	res_READ4->READ4res_u.resok4.data.data_val = buffer;
 
@@ -187,7 +188,7 @@ static int op_dsread(struct nfs_argop4 *op, compound_data_t *data,
 				&eof);
 
 	if (nfs_status != NFS4_OK) {
-		gsh_free(buffer);
+		iobuf_put(buffer);
 		res_READ4->READ4res_u.resok4.data.data_val = NULL;
 	}
 
@@ -243,7 +244,7 @@ static int op_dsread_plus(struct nfs_argop4 *op, compound_data_t *data,
 
 	/* Construct the FSAL file handle */
 
-	buffer = gsh_malloc_aligned(4096, arg_READ4->count);
+	buffer = iobuf_get(arg_READ4->count);
 
 	nfs_status = data->current_ds->dsh_ops.read_plus(
 				data->current_ds,
@@ -257,7 +258,7 @@ static int op_dsread_plus(struct nfs_argop4 *op, compound_data_t *data,
 
 	res_RPLUS->rpr_status = nfs_status;
 	if (nfs_status != NFS4_OK) {
-		gsh_free(buffer);
+		iobuf_put(buffer);
 		return res_RPLUS->rpr_status;
 	}
 
@@ -268,6 +269,8 @@ static int op_dsread_plus(struct nfs_argop4 *op, compound_data_t *data,
 	if (info->io_content.what == NFS4_CONTENT_HOLE) {
 		contentp->hole.di_offset = info->io_content.hole.di_offset;
 		contentp->hole.di_length = info->io_content.hole.di_length;
+		/* No data to send, nor to free in nfs4_op_read_plus_Free */
+		iobuf_put(buffer);
 	}
 	if (info->io_content.what == NFS4_CONTENT_DATA) {
 		contentp->data.d_offset = info->io_content.data.d_offset;
@@ -541,7 +544,7 @@ static int nfs4_read(struct nfs_argop4 *op, compound_data_t *data,
 	}
 
 	/* Some work is to be done */
-	bufferdata = gsh_malloc_aligned(4096, size);
+	bufferdata = iobuf_get(size);
 
 	if (!anonymous_started && data->minorversion == 0) {
 		owner = get_state_owner_ref(state_found);
@@ -612,7 +615,7 @@ void nfs4_op_read_Free(nfs_resop4 *res)
 
 	if (resp->status == NFS4_OK)
 		if (resp->READ4res_u.resok4.data.data_val != NULL)
-			gsh_free(resp->READ4res_u.resok4.data.data_val);
+			iobuf_put(resp->READ4res_u.resok4.data.data_val);
 }
 
 /**
@@ -654,6 +657,8 @@ int nfs4_op_read_plus(struct nfs_argop4 *op, compound_data_t *data,
 	if (info.io_content.what == NFS4_CONTENT_HOLE) {
 		contentp->hole.di_offset = info.io_content.hole.di_offset;
 		contentp->hole.di_length = info.io_content.hole.di_length;
+		/* No data to send, nor to free in nfs4_op_read_plus_Free */
+		iobuf_put(res_READ4->READ4res_u.resok4.data.data_val);
 	}
 	if (info.io_content.what == NFS4_CONTENT_DATA) {
 		contentp->data.d_offset = info.io_content.data.d_offset;
@@ -672,7 +677,7 @@ void nfs4_op_read_plus_Free(nfs_resop4 *res)
 
 	if (resp->rpr_status == NFS4_OK && conp->what == NFS4_CONTENT_DATA)
 		if (conp->data.d_data.data_val != NULL)
-			gsh_free(conp->data.d_data.data_val);
+			iobuf_put(conp->data.d_data.data_val);
 }
 
 /**
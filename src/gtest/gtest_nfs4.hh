@@ -22,6 +22,9 @@
  * -------------
  */
 
+#include <algorithm>
+#include <vector>
+
 #include "gtest.hh"
 
 extern "C" {
@@ -305,6 +308,37 @@ class GaeshaNFS4BaseTest : public gtest::GaneshaFSALBaseTest {
   nfs_arg_t arg;
   struct nfs_resop4 resp;
 };
+
+// Sends whole compounds through nfs4_Compound(), from a thread with a
+// request context and a transport of its own, for the benchmarks
+class CompoundSender {
+ public:
+  explicit CompoundSender(const struct req_op_context *ctx) {
+    req_ctx = *ctx;
+    memset(&req, 0, sizeof(req));
+    fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    EXPECT_NE(fd, -1);
+    req.rq_msg.cb_cred.oa_flavor = AUTH_NONE;
+    req.rq_xprt =
+        svc_vc_ncreatef(fd, 1024 * 1024, 1024 * 1024,
+                        SVC_CREATE_FLAG_CLOSE | SVC_CREATE_FLAG_LISTEN);
+  }
+
+  virtual ~CompoundSender() { SVC_DESTROY(req.rq_xprt); }
+
+ protected:
+  struct req_op_context req_ctx;
+  struct svc_req req;
+  int fd;
+};
+
+// The p-th quantile of the latencies in v, which get partly reordered
+static inline uint64_t percentile(std::vector<uint64_t> &v, double p) {
+  if (v.empty()) return 0;
+  size_t i = std::min(v.size() - 1, (size_t)(p * v.size()));
+  std::nth_element(v.begin(), v.begin() + i, v.end());
+  return v[i];
+}
 }  // namespace gtest
 
 #endif /* GTEST_GTEST_NFS4_HH */
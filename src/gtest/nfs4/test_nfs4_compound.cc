@@ -22,6 +22,7 @@
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/exception.hpp>
 #include <boost/program_options.hpp>
+#include <atomic>
 #include <chrono>
 #include <iostream>
 #include <map>
@@ -69,6 +70,38 @@ namespace {
 char *event_list = nullptr;
 char *profile_out = nullptr;
 
+/* Builds PUTFH file; WRITE of one byte at offset, followed by PUTFH other;
+ * GETATTR if other is set, so that the compound reads other.
+ */
+void make_write_compound(nfs_arg_t *arg, struct fsal_obj_handle *file,
+                         uint64_t offset, struct fsal_obj_handle *other) {
+  int nops = other != nullptr ? 4 : 2;
+  struct nfs_argop4 *argops =
+      (struct nfs_argop4 *)gsh_calloc(nops, sizeof(struct nfs_argop4));
+
+  memset(arg, 0, sizeof(*arg));
+  arg->arg_compound4.argarray.argarray_len = nops;
+  arg->arg_compound4.argarray.argarray_val = argops;
+
+  argops[0].argop = NFS4_OP_PUTFH;
+  EXPECT_TRUE(nfs4_FSALToFhandle(true, &argops[0].nfs_argop4_u.opputfh.object,
+                                 file, op_ctx->ctx_export));
+
+  argops[1].argop = NFS4_OP_WRITE;
+  WRITE4args *write = &argops[1].nfs_argop4_u.opwrite;
+  write->offset = offset;
+  write->stable = FILE_SYNC4;
+  write->data.data_len = 1;
+  write->data.data_val = gsh_strdup("w");
+
+  if (other == nullptr) return;
+
+  argops[2].argop = NFS4_OP_PUTFH;
+  EXPECT_TRUE(nfs4_FSALToFhandle(true, &argops[2].nfs_argop4_u.opputfh.object,
+                                 other, op_ctx->ctx_export));
+  argops[3].argop = NFS4_OP_GETATTR;
+}
+
 class GaneshaCompoundBaseTest : public gtest::GaeshaNFS4BaseTest {
  protected:
   void init_args(int nops) {
@@ -104,6 +137,45 @@ class GaneshaCompoundBaseTest : public gtest::GaeshaNFS4BaseTest {
 
     gtest::GaneshaFSALBaseTest::TearDown();
   }
+
+  void init_req(struct svc_req *req) {
+    int fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    EXPECT_NE(fd, -1);
+
+    memset(req, 0, sizeof(*req));
+    req->rq_msg.cb_cred.oa_flavor = AUTH_NONE;
+    req->rq_xprt =
+        svc_vc_ncreatef(fd, 1024 * 1024, 1024 * 1024,
+                        SVC_CREATE_FLAG_CLOSE | SVC_CREATE_FLAG_LISTEN);
+  }
+
+  void setup_op(int pos, nfs_opnum4 op) { ops[pos].argop = op; }
+
+  /* Checks that GETFH at pos returned the handle given to PUTFH at putfh */
+  void expect_getfh(nfs_res_t *res, int pos, int putfh) {
+    nfs_fh4 *want = &ops[putfh].nfs_argop4_u.opputfh.object;
+    nfs_resop4 *r = &res->res_compound4.resarray.resarray_val[pos];
+
+    ASSERT_EQ(NFS4_OP_GETFH, r->resop);
+    ASSERT_EQ(NFS4_OK, r->nfs_resop4_u.opgetfh.status);
+    nfs_fh4 *got = &r->nfs_resop4_u.opgetfh.GETFH4res_u.resok4.object;
+    ASSERT_EQ(want->nfs_fh4_len, got->nfs_fh4_len);
+    EXPECT_EQ(0, memcmp(want->nfs_fh4_val, got->nfs_fh4_val,
+                        want->nfs_fh4_len));
+  }
+
+  uint64_t file_size(struct fsal_obj_handle *obj) {
+    struct attrlist attrs_out;
+    fsal_status_t status;
+    uint64_t size;
+
+    fsal_prepare_attrs(&attrs_out, ATTR_SIZE);
+    status = obj->obj_ops->getattrs(obj, &attrs_out);
+    EXPECT_EQ(status.major, 0);
+    size = attrs_out.filesize;
+    fsal_release_attrs(&attrs_out);
+    return size;
+  }
 };
 } /* namespace */
 
@@ -285,6 +357,269 @@ TEST_F(GaneshaCompoundBaseTest, SimpleWrite) {
   disableEvents(event_list);
 }
 
+/*
+ * The parallel compound tests below start with a PUTFH that sets up the
+ * export, so that the ops from the second PUTFH on are split into segments.
+ */
+
+TEST_F(GaneshaCompoundBaseTest, ParallelSplitAtPutfh) {
+  struct fsal_obj_handle *objs[3];
+  struct svc_req req;
+  nfs_res_t res;
+  int rc;
+
+  create_and_prime_many(3, objs);
+  init_req(&req);
+  nfs_param.nfsv4_param.compound_workers = 4;
+
+  init_args(7 /*nops*/);
+  setup_putfh(0, test_root);
+  for (int i = 0; i < 3; ++i) {
+    setup_putfh(1 + 2 * i, objs[i]);
+    setup_op(2 + 2 * i, NFS4_OP_GETFH);
+  }
+
+  rc = nfs4_Compound(&arg, &req, &res);
+
+  EXPECT_EQ(rc, NFS_REQ_OK);
+  EXPECT_EQ(NFS4_OK, res.res_compound4.status);
+  ASSERT_EQ(7, res.res_compound4.resarray.resarray_len);
+  /* Each segment reports the handle of its own PUTFH */
+  for (int i = 0; i < 3; ++i)
+    expect_getfh(&res, 2 + 2 * i, 1 + 2 * i);
+
+  nfs_param.nfsv4_param.compound_workers = 0;
+  nfs4_Compound_Free(&res);
+  SVC_DESTROY(req.rq_xprt);
+  remove_many(3, objs);
+}
+
+TEST_F(GaneshaCompoundBaseTest, ParallelSaveRestore) {
+  struct fsal_obj_handle *objs[2];
+  struct svc_req req;
+  nfs_res_t res;
+  int rc;
+
+  create_and_prime_many(2, objs);
+  init_req(&req);
+  nfs_param.nfsv4_param.compound_workers = 4;
+
+  /* SAVEFH and RESTOREFH in the same segment */
+  init_args(10 /*nops*/);
+  setup_putfh(0, test_root);
+  setup_putfh(1, objs[0]);
+  setup_op(2, NFS4_OP_SAVEFH);
+  setup_op(3, NFS4_OP_LOOKUPP);
+  setup_op(4, NFS4_OP_RESTOREFH);
+  setup_op(5, NFS4_OP_GETFH);
+  setup_putfh(6, objs[1]);
+  setup_op(7, NFS4_OP_SAVEFH);
+  setup_op(8, NFS4_OP_RESTOREFH);
+  setup_op(9, NFS4_OP_GETFH);
+
+  rc = nfs4_Compound(&arg, &req, &res);
+
+  EXPECT_EQ(rc, NFS_REQ_OK);
+  EXPECT_EQ(NFS4_OK, res.res_compound4.status);
+  ASSERT_EQ(10, res.res_compound4.resarray.resarray_len);
+  expect_getfh(&res, 5, 1);
+  expect_getfh(&res, 9, 6);
+  nfs4_Compound_Free(&res);
+
+  /* RESTOREFH of a handle saved by another segment: the compound must not
+   * be split there, so the handle saved before the PUTFH is restored.
+   */
+  setup_putfh(3, objs[1]);
+  arg.arg_compound4.argarray.argarray_len = 6;
+
+  rc = nfs4_Compound(&arg, &req, &res);
+  arg.arg_compound4.argarray.argarray_len = 10;
+
+  EXPECT_EQ(rc, NFS_REQ_OK);
+  EXPECT_EQ(NFS4_OK, res.res_compound4.status);
+  ASSERT_EQ(6, res.res_compound4.resarray.resarray_len);
+  expect_getfh(&res, 5, 1);
+
+  nfs_param.nfsv4_param.compound_workers = 0;
+  nfs4_Compound_Free(&res);
+  SVC_DESTROY(req.rq_xprt);
+  remove_many(2, objs);
+}
+
+TEST_F(GaneshaCompoundBaseTest, ParallelErrorInMiddleSegment) {
+  struct fsal_obj_handle *objs[4];
+  struct svc_req req;
+  nfs_res_t res;
+  int rc;
+
+  create_and_prime_many(4, objs);
+  init_req(&req);
+  op_ctx->export_perms->options = EXPORT_OPTION_ACCESS_MASK;
+  nfs_param.nfsv4_param.compound_workers = 4;
+
+  /* READLINK of a regular file fails in the second segment */
+  init_args(9 /*nops*/);
+  setup_putfh(0, test_root);
+  setup_putfh(1, objs[0]);
+  setup_op(2, NFS4_OP_GETFH);
+  setup_putfh(3, objs[1]);
+  setup_op(4, NFS4_OP_READLINK);
+  setup_putfh(5, objs[2]);
+  setup_write(6, "segment");
+  setup_putfh(7, objs[3]);
+  setup_write(8, "segment");
+
+  rc = nfs4_Compound(&arg, &req, &res);
+
+  EXPECT_EQ(rc, NFS_REQ_OK);
+  EXPECT_EQ(NFS4ERR_INVAL, res.res_compound4.status);
+  /* The reply stops at the failed op */
+  ASSERT_EQ(5, res.res_compound4.resarray.resarray_len);
+  for (int i = 0; i < 4; ++i)
+    EXPECT_EQ(NFS4_OK, res.res_compound4.resarray.resarray_val[i]
+                           .nfs_resop4_u.opaccess.status);
+  expect_getfh(&res, 2, 1);
+  EXPECT_EQ(NFS4_OP_READLINK, res.res_compound4.resarray.resarray_val[4].resop);
+  EXPECT_EQ(NFS4ERR_INVAL, res.res_compound4.resarray.resarray_val[4]
+                               .nfs_resop4_u.opreadlink.status);
+
+  /* The segments after the failed one are cancelled, or rolled back if
+   * they had already started.
+   */
+  EXPECT_EQ(0, file_size(objs[2]));
+  EXPECT_EQ(0, file_size(objs[3]));
+
+  nfs_param.nfsv4_param.compound_workers = 0;
+  nfs4_Compound_Free(&res);
+  SVC_DESTROY(req.rq_xprt);
+  remove_many(4, objs);
+}
+
+TEST_F(GaneshaCompoundBaseTest, ParallelSerialFallback) {
+  struct fsal_obj_handle *objs[2];
+  struct fsal_obj_handle *dir;
+  struct svc_req req;
+  nfs_res_t res;
+  int rc;
+
+  create_and_prime_many(2, objs);
+  init_req(&req);
+
+  /* No compound workers: every compound runs sequentially */
+  nfs_param.nfsv4_param.compound_workers = 0;
+  init_args(5 /*nops*/);
+  setup_putfh(0, test_root);
+  setup_putfh(1, objs[0]);
+  setup_op(2, NFS4_OP_GETFH);
+  setup_putfh(3, objs[1]);
+  setup_op(4, NFS4_OP_GETFH);
+
+  rc = nfs4_Compound(&arg, &req, &res);
+
+  EXPECT_EQ(rc, NFS_REQ_OK);
+  EXPECT_EQ(NFS4_OK, res.res_compound4.status);
+  ASSERT_EQ(5, res.res_compound4.resarray.resarray_len);
+  expect_getfh(&res, 2, 1);
+  expect_getfh(&res, 4, 3);
+  nfs4_Compound_Free(&res);
+  xdr_free((xdrproc_t)xdr_COMPOUND4args, &arg);
+
+  /* CREATE cannot run in a segment, so the LOOKUP of the next PUTFH only
+   * finds the directory if the ops run in order.
+   */
+  nfs_param.nfsv4_param.compound_workers = 4;
+  op_ctx->export_perms->options = EXPORT_OPTION_ACCESS_MASK;
+  init_args(5 /*nops*/);
+  setup_putfh(0, test_root);
+  setup_putfh(1, test_root);
+  setup_create(2, "parallel");
+  setup_putfh(3, test_root);
+  setup_lookup(4, "parallel");
+
+  rc = nfs4_Compound(&arg, &req, &res);
+
+  EXPECT_EQ(rc, NFS_REQ_OK);
+  EXPECT_EQ(NFS4_OK, res.res_compound4.status);
+  EXPECT_EQ(5, res.res_compound4.resarray.resarray_len);
+  EXPECT_EQ(NFS4_OK, res.res_compound4.resarray.resarray_val[4]
+                         .nfs_resop4_u.oplookup.status);
+
+  nfs_param.nfsv4_param.compound_workers = 0;
+  nfs4_Compound_Free(&res);
+  SVC_DESTROY(req.rq_xprt);
+
+  ASSERT_EQ(0, fsal_lookup(test_root, "parallel", &dir, NULL).major);
+  dir->obj_ops->put_ref(dir);
+  EXPECT_EQ(0, fsal_remove(test_root, "parallel").major);
+  remove_many(2, objs);
+}
+
+/*
+ * A compound that fails validation has run all of its ops, so it is rolled
+ * back with an NFS4_OK status before the client is told to retry.
+ *
+ * Conflicts only happen with Optimistic = true in the TXNFS block.
+ */
+TEST_F(GaneshaCompoundBaseTest, OptimisticConflictRollback) {
+  struct fsal_obj_handle *objs[2];
+  std::atomic<bool> stop(false);
+  struct svc_req req;
+  uint64_t written = 0;
+  int delays = 0;
+
+  create_and_prime_many(2, objs);
+  init_req(&req);
+  op_ctx->export_perms->options = EXPORT_OPTION_ACCESS_MASK;
+
+  /* Keeps writing the file the compounds below read */
+  std::thread writer([&]() {
+    struct req_op_context ctx = req_ctx;
+    struct svc_req wreq;
+
+    op_ctx = &ctx;
+    init_req(&wreq);
+    while (!stop.load()) {
+      nfs_arg_t warg;
+      nfs_res_t wres;
+
+      make_write_compound(&warg, objs[1], 0, nullptr);
+      memset(&wres, 0, sizeof(wres));
+      EXPECT_EQ(NFS_REQ_OK, nfs4_Compound(&warg, &wreq, &wres));
+      nfs4_Compound_Free(&wres);
+      xdr_free((xdrproc_t)xdr_COMPOUND4args, &warg);
+    }
+    SVC_DESTROY(wreq.rq_xprt);
+  });
+
+  /* Each compound appends a byte, which a rollback has to take back */
+  for (int i = 0; i < 1000 && delays < 10; ++i) {
+    nfs_res_t res;
+
+    make_write_compound(&arg, objs[0], written, objs[1]);
+    memset(&res, 0, sizeof(res));
+    EXPECT_EQ(NFS_REQ_OK, nfs4_Compound(&arg, &req, &res));
+
+    if (res.res_compound4.status == NFS4_OK) {
+      written++;
+    } else {
+      EXPECT_EQ(NFS4ERR_DELAY, res.res_compound4.status);
+      EXPECT_EQ(1, res.res_compound4.resarray.resarray_len);
+      delays++;
+    }
+    EXPECT_EQ(written, file_size(objs[0]));
+
+    nfs4_Compound_Free(&res);
+    xdr_free((xdrproc_t)xdr_COMPOUND4args, &arg);
+  }
+
+  stop.store(true);
+  writer.join();
+  EXPECT_GT(delays, 0) << "no compound failed validation";
+
+  SVC_DESTROY(req.rq_xprt);
+  remove_many(2, objs);
+}
+
 int main(int argc, char *argv[]) {
   int code = 0;
   char *session_name = NULL;
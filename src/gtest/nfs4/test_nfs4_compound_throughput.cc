@@ -0,0 +1,647 @@
+// -*- mode:C; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Copyright (C) Stony Brook University 2019
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+/*
+ * Throughput of vectorized compounds, run by nfs4_Compound() from several
+ * threads at once. Each thread works in a directory of its own and sends
+ * compounds of --ops operations of one kind:
+ *
+ *   CREATE  {PUTFH(dir) OPEN(create)}...
+ *   WRITE   {PUTFH(file) WRITE}...
+ *   MIXED   {PUTFH(file) READ|WRITE}... with every other op a READ
+ *   REMOVE  PUTFH(dir) REMOVE... of files created before each compound
+ *
+ * CREATE256 and REMOVE256 send compounds of up to 256 ops, the most
+ * Ganesha takes, so that per-compound costs that grow with the number of
+ * ops show.
+ *
+ * A share --fail-ratio of the compounds ends with a LOOKUP of a name that
+ * does not exist, so that the compound fails once all the other ops are
+ * done and TXNFS rolls it back. Compounds/s, ops/s and the p50/p99 latency
+ * of the compounds that succeeded and of those that failed are printed,
+ * and appended as JSON lines to --output if given.
+ *
+ * The FSAL is the one of --export; config_samples/txn-bench.conf has
+ * TXNFS over VFS (77), VFS (78), TXNFS over MEM (79) and MEM (80), and
+ * scripts/run-compound-bench.sh runs them all.
+ */
+
+#include <boost/program_options.hpp>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <sys/types.h>
+#include <thread>
+#include <vector>
+
+#include "gtest_nfs4.hh"
+#include "nfs_creds.h"
+
+extern "C" {
+void nfs_end_grace(void);
+
+clientid_status_t nfs_client_id_confirm(nfs_client_id_t *clientid,
+                                        log_components_t component);
+
+clientid4 new_clientid(void);
+nfs_client_id_t *create_client_id(clientid4 clientid,
+                                  nfs_client_record_t *client_record,
+                                  nfs_client_cred_t *credential,
+                                  uint32_t minorversion);
+
+clientid_status_t nfs_client_id_insert(nfs_client_id_t *clientid);
+
+nfs_client_record_t *get_client_record(const char *const value,
+                                       const size_t len,
+                                       const uint32_t pnfs_flags,
+                                       const uint32_t server_addr);
+}
+
+#define TEST_ROOT "nfs4_compound_throughput"
+#define MISSING_NAME "no-such-file"
+
+namespace {
+
+char *event_list = nullptr;
+char *profile_out = nullptr;
+int n_threads = 4;
+int n_ops = 16;
+int n_compounds = 1000;
+double fail_ratio = 0.1;
+uint32_t io_size = 4096;
+std::string output_path;
+
+enum workload { CREATE, WRITE, MIXED, REMOVE };
+
+const char *workload_name[] = {"create", "write", "mixed", "remove"};
+
+struct thread_result {
+  std::vector<uint64_t> ok_ns;
+  std::vector<uint64_t> failed_ns;
+  uint64_t ops = 0;
+  uint64_t errors = 0;
+};
+
+// Sends the compounds of one thread, with a request context of its own
+class WorkloadSender : public gtest::CompoundSender {
+ public:
+  WorkloadSender(const struct req_op_context *ctx, int id,
+                 struct fsal_obj_handle *dir, clientid4 clientid)
+      : gtest::CompoundSender(ctx), id(id), dir(dir), clientid(clientid),
+        buf(io_size, 'a' + id % 26) {}
+
+  void run(enum workload w, struct fsal_obj_handle **files,
+           thread_result *result) {
+    std::mt19937 rng(id);
+    std::bernoulli_distribution fail(fail_ratio);
+    struct timespec s_time, e_time;
+
+    /* stashed in tls */
+    op_ctx = &req_ctx;
+
+    for (int i = 0; i < n_compounds; ++i) {
+      bool failing = fail(rng);
+      nfs_arg_t arg;
+      nfs_res_t res;
+
+      memset(&arg, 0, sizeof(arg));
+      memset(&res, 0, sizeof(res));
+      if (w == REMOVE) create_victims();
+      build(w, i, files, failing, &arg.arg_compound4);
+
+      now(&s_time);
+      int rc = nfs4_Compound(&arg, &req, &res);
+      now(&e_time);
+
+      EXPECT_EQ(rc, NFS_REQ_OK);
+      uint64_t ns = timespec_diff(&s_time, &e_time);
+      if (res.res_compound4.status == NFS4_OK) {
+        result->ok_ns.push_back(ns);
+      } else if (failing &&
+                 res.res_compound4.status == NFS4ERR_NOENT &&
+                 res.res_compound4.resarray.resarray_len ==
+                     arg.arg_compound4.argarray.argarray_len) {
+        result->failed_ns.push_back(ns);
+      } else {
+        result->errors++;
+      }
+      result->ops += arg.arg_compound4.argarray.argarray_len;
+
+      nfs4_Compound_Free(&res);
+      xdr_free((xdrproc_t)xdr_COMPOUND4args, &arg);
+    }
+  }
+
+  // Removes the files the CREATE and REMOVE compounds may have left
+  void remove_created() {
+    char fname[NAMELEN];
+
+    op_ctx = &req_ctx;
+    for (uint32_t i = 0; i < n_created; ++i) {
+      sprintf(fname, "c-%08x", i);
+      remove_if_exists(fname);
+    }
+    for (uint32_t i = 0; i < n_victims; ++i) {
+      sprintf(fname, "r-%08x", i);
+      remove_if_exists(fname);
+    }
+  }
+
+ private:
+  void build(enum workload w, int n, struct fsal_obj_handle **files,
+             bool failing, COMPOUND4args *args) {
+    /* a failing compound ends with PUTFH(dir) LOOKUP, or with LOOKUP if
+     * the directory is already the current FH */
+    int len = w == REMOVE ? n_ops + 1 + failing : 2 * (n_ops + failing);
+    int pos = 0;
+
+    args->minorversion = 0;
+    args->argarray.argarray_len = len;
+    args->argarray.argarray_val =
+        (struct nfs_argop4 *)gsh_calloc(len, sizeof(struct nfs_argop4));
+    struct nfs_argop4 *ops = args->argarray.argarray_val;
+
+    if (w == REMOVE) add_putfh(&ops[pos++], dir);
+    for (int i = 0; i < n_ops; ++i) {
+      offset4 offset = (uint64_t)((n + i) % 16) * io_size;
+
+      if (w == REMOVE) {
+        add_remove(&ops[pos++], n_victims - n_ops + i);
+      } else if (w == CREATE) {
+        add_putfh(&ops[pos++], dir);
+        add_open_create(&ops[pos++]);
+      } else {
+        add_putfh(&ops[pos++], files[i]);
+        if (w == MIXED && i % 2 == 0)
+          add_read(&ops[pos++], offset);
+        else
+          add_write(&ops[pos++], offset);
+      }
+    }
+    if (failing) {
+      if (w != REMOVE) add_putfh(&ops[pos++], dir);
+      add_lookup(&ops[pos++], MISSING_NAME);
+    }
+    assert(pos == len);
+  }
+
+  /* The files the next REMOVE compound removes, not timed */
+  void create_victims() {
+    struct fsal_obj_handle *obj;
+    struct attrlist attrs;
+    char fname[NAMELEN];
+
+    memset(&attrs, 0, sizeof(attrs));
+    FSAL_SET_MASK(attrs.valid_mask, ATTR_MODE);
+    attrs.mode = 0666;
+    for (int i = 0; i < n_ops; ++i) {
+      sprintf(fname, "r-%08x", n_victims++);
+      fsal_status_t status =
+          fsal_create(dir, fname, REGULAR_FILE, &attrs, NULL, &obj, NULL);
+      ASSERT_EQ(status.major, 0);
+      obj->obj_ops->put_ref(obj);
+    }
+  }
+
+  void remove_if_exists(const char *fname) {
+    fsal_status_t status = fsal_remove(dir, fname);
+    EXPECT_TRUE(status.major == ERR_FSAL_NO_ERROR ||
+                status.major == ERR_FSAL_NOENT);
+  }
+
+  void add_putfh(struct nfs_argop4 *op, struct fsal_obj_handle *entry) {
+    op->argop = NFS4_OP_PUTFH;
+    bool fhres = nfs4_FSALToFhandle(true, &op->nfs_argop4_u.opputfh.object,
+                                    entry, op_ctx->ctx_export);
+    EXPECT_EQ(fhres, true);
+  }
+
+  void add_open_create(struct nfs_argop4 *op) {
+    char fname[NAMELEN];
+    char owner[NAMELEN];
+    OPEN4args *open = &op->nfs_argop4_u.opopen;
+
+    sprintf(fname, "c-%08x", n_created++);
+    sprintf(owner, "owner-%d", id);
+    op->argop = NFS4_OP_OPEN;
+    open->seqid = seqid++;
+    open->share_access = OPEN4_SHARE_ACCESS_BOTH;
+    open->share_deny = OPEN4_SHARE_DENY_NONE;
+    open->openhow.opentype = OPEN4_CREATE;
+    open->openhow.openflag4_u.how.mode = GUARDED4;
+    open->owner.clientid = clientid;
+    open->owner.owner.owner_val = gsh_strdup(owner);
+    open->owner.owner.owner_len = strlen(owner);
+    open->claim.claim = CLAIM_NULL;
+    open->claim.open_claim4_u.file.utf8string_val = gsh_strdup(fname);
+    open->claim.open_claim4_u.file.utf8string_len = strlen(fname);
+    set_mode(&open->openhow.openflag4_u.how.createhow4_u.createattrs);
+  }
+
+  /* Anonymous stateid: the files are not opened */
+  void add_write(struct nfs_argop4 *op, offset4 offset) {
+    op->argop = NFS4_OP_WRITE;
+    op->nfs_argop4_u.opwrite.offset = offset;
+    op->nfs_argop4_u.opwrite.stable = DATA_SYNC4;
+    op->nfs_argop4_u.opwrite.data.data_len = buf.size();
+    op->nfs_argop4_u.opwrite.data.data_val =
+        (char *)gsh_memdup(buf.data(), buf.size());
+  }
+
+  void add_read(struct nfs_argop4 *op, offset4 offset) {
+    op->argop = NFS4_OP_READ;
+    op->nfs_argop4_u.opread.offset = offset;
+    op->nfs_argop4_u.opread.count = io_size;
+  }
+
+  void add_remove(struct nfs_argop4 *op, uint32_t victim) {
+    char fname[NAMELEN];
+
+    sprintf(fname, "r-%08x", victim);
+    op->argop = NFS4_OP_REMOVE;
+    op->nfs_argop4_u.opremove.target.utf8string_len = strlen(fname);
+    op->nfs_argop4_u.opremove.target.utf8string_val = gsh_strdup(fname);
+  }
+
+  void add_lookup(struct nfs_argop4 *op, const char *name) {
+    op->argop = NFS4_OP_LOOKUP;
+    op->nfs_argop4_u.oplookup.objname.utf8string_len = strlen(name);
+    op->nfs_argop4_u.oplookup.objname.utf8string_val = gsh_strdup(name);
+  }
+
+  void set_mode(struct fattr4 *fattr) {
+    struct xdr_attrs_args args;
+    struct attrlist attrs;
+    XDR attr_body;
+
+    memset(&args, 0, sizeof(args));
+    memset(&attrs, 0, sizeof(attrs));
+    attrs.mode = 0666;
+    args.attrs = &attrs;
+
+    set_attribute_in_bitmap(&fattr->attrmask, FATTR4_MODE);
+    fattr->attr_vals.attrlist4_val = (char *)gsh_malloc(NFS4_ATTRVALS_BUFFLEN);
+    xdrmem_create(&attr_body, fattr->attr_vals.attrlist4_val,
+                  NFS4_ATTRVALS_BUFFLEN, XDR_ENCODE);
+    EXPECT_EQ(FATTR_XDR_SUCCESS,
+              fattr4tab[FATTR4_MODE].encode(&attr_body, &args));
+    fattr->attr_vals.attrlist4_len = xdr_getpos(&attr_body);
+    xdr_destroy(&attr_body);
+  }
+
+  int id;
+  struct fsal_obj_handle *dir;
+  clientid4 clientid;
+  std::string buf;
+  seqid4 seqid = 0;
+  uint32_t n_created = 0;
+  uint32_t n_victims = 0;
+};
+
+class CompoundThroughputTest : public gtest::GaneshaFSALBaseTest {
+ protected:
+  virtual void SetUp() {
+    gtest::GaneshaFSALBaseTest::SetUp();
+
+    op_ctx->export_perms->options = EXPORT_OPTION_ACCESS_MASK;
+    req_ctx.client = get_gsh_client((sockaddr_t *)&caller_addr, false);
+
+    /* the clients of the OPENs */
+    clientid = new_clientid();
+    nfs_client_record_t *client_record = get_client_record("client", 6, 0, 0);
+    nfs_client_cred_t credential;
+    memset(&credential, 0, sizeof(credential));
+    nfs_client_id_t *unconf =
+        create_client_id(clientid, client_record, &credential, 0);
+    nfs_client_id_insert(unconf);
+    nfs_client_id_confirm(unconf, COMPONENT_CLIENTID);
+    nfs_end_grace();
+
+    dirs.resize(n_threads);
+    files.resize(n_threads);
+    for (int t = 0; t < n_threads; ++t) {
+      char dname[NAMELEN];
+      struct attrlist attrs_out;
+
+      sprintf(dname, "t-%d", t);
+      fsal_prepare_attrs(&attrs_out, 0);
+      fsal_status_t status = fsal_create(test_root, dname, DIRECTORY, &attrs,
+                                         NULL, &dirs[t], &attrs_out);
+      ASSERT_EQ(status.major, 0);
+      fsal_release_attrs(&attrs_out);
+
+      files[t].resize(n_ops);
+      create_and_prime_many(n_ops, files[t].data(), dirs[t]);
+    }
+  }
+
+  virtual void TearDown() {
+    for (int t = 0; t < n_threads; ++t) {
+      char dname[NAMELEN];
+
+      remove_many(n_ops, files[t].data(), dirs[t]);
+      dirs[t]->obj_ops->put_ref(dirs[t]);
+      sprintf(dname, "t-%d", t);
+      fsal_status_t status = fsal_remove(test_root, dname);
+      EXPECT_EQ(status.major, 0);
+    }
+
+    gtest::GaneshaFSALBaseTest::TearDown();
+  }
+
+  void run(enum workload w, int threads) {
+    std::vector<WorkloadSender *> senders;
+    std::vector<thread_result> results(threads);
+    std::vector<std::thread> workers;
+    struct timespec s_time, e_time;
+
+    for (int t = 0; t < threads; ++t)
+      senders.push_back(new WorkloadSender(&req_ctx, t, dirs[t], clientid));
+
+    enableEvents(event_list);
+    if (profile_out) ProfilerStart(profile_out);
+
+    now(&s_time);
+    for (int t = 0; t < threads; ++t)
+      workers.emplace_back(&WorkloadSender::run, senders[t], w,
+                           files[t].data(), &results[t]);
+    for (auto &worker : workers) worker.join();
+    now(&e_time);
+
+    if (profile_out) ProfilerStop();
+    disableEvents(event_list);
+
+    for (int t = 0; t < threads; ++t) {
+      if (w == CREATE || w == REMOVE) senders[t]->remove_created();
+      delete senders[t];
+    }
+    op_ctx = &req_ctx;
+
+    report(w, threads, timespec_diff(&s_time, &e_time), results);
+  }
+
+  static double average(const std::vector<uint64_t> &v) {
+    double sum = 0;
+    for (uint64_t ns : v) sum += ns;
+    return v.empty() ? 0.0 : sum / v.size();
+  }
+
+  std::string fsal_name() {
+    std::string name;
+    for (struct fsal_export *exp = a_export->fsal_export; exp != NULL;
+         exp = exp->sub_export) {
+      /* MDCACHE is stacked over every export */
+      if (strcmp(exp->fsal->name, "MDCACHE") == 0) continue;
+      if (!name.empty()) name += "/";
+      name += exp->fsal->name;
+    }
+    return name;
+  }
+
+  void report(enum workload w, int threads, uint64_t elapsed_ns,
+              std::vector<thread_result> &results) {
+    thread_result all;
+    char line[1024];
+
+    for (auto &r : results) {
+      all.ok_ns.insert(all.ok_ns.end(), r.ok_ns.begin(), r.ok_ns.end());
+      all.failed_ns.insert(all.failed_ns.end(), r.failed_ns.begin(),
+                           r.failed_ns.end());
+      all.ops += r.ops;
+      all.errors += r.errors;
+    }
+    EXPECT_EQ(0, all.errors);
+
+    double secs = elapsed_ns / 1e9;
+    uint64_t compounds = all.ok_ns.size() + all.failed_ns.size() + all.errors;
+    double avg_ok = average(all.ok_ns);
+    double avg_failed = average(all.failed_ns);
+
+    snprintf(line, sizeof(line),
+             "{\"workload\": \"%s\", \"fsal\": \"%s\", \"threads\": %d, "
+             "\"ops_per_compound\": %.1f, \"io_size\": %u, "
+             "\"compounds\": %" PRIu64 ", \"seconds\": %.6f, "
+             "\"compounds_per_sec\": %.1f, \"ops_per_sec\": %.1f, "
+             "\"p50_us\": %.1f, \"p99_us\": %.1f, "
+             "\"failed\": %zu, \"failed_p50_us\": %.1f, "
+             "\"failed_p99_us\": %.1f, \"rollback_cost_us\": %.1f, "
+             "\"errors\": %" PRIu64 "}",
+             workload_name[w], fsal_name().c_str(), threads,
+             compounds ? (double)all.ops / compounds : 0.0, io_size,
+             compounds, secs, compounds / secs, all.ops / secs,
+             gtest::percentile(all.ok_ns, 0.5) / 1e3,
+             gtest::percentile(all.ok_ns, 0.99) / 1e3, all.failed_ns.size(),
+             gtest::percentile(all.failed_ns, 0.5) / 1e3,
+             gtest::percentile(all.failed_ns, 0.99) / 1e3,
+             all.failed_ns.empty() ? 0.0 : (avg_failed - avg_ok) / 1e3,
+             all.errors);
+
+    fprintf(stderr, "%s\n", line);
+    if (!output_path.empty()) {
+      std::ofstream out(output_path, std::ios::app);
+      out << line << std::endl;
+    }
+  }
+
+  clientid4 clientid;
+  std::vector<struct fsal_obj_handle *> dirs;
+  std::vector<std::vector<struct fsal_obj_handle *>> files;
+};
+
+} /* namespace */
+
+TEST_F(CompoundThroughputTest, SIMPLE) {
+  int saved_compounds = n_compounds;
+
+  /* one of each, to check that the compounds are well formed */
+  n_compounds = 4;
+  run(CREATE, 1);
+  run(WRITE, 1);
+  run(MIXED, 1);
+  run(REMOVE, 1);
+  n_compounds = saved_compounds;
+}
+
+TEST_F(CompoundThroughputTest, CREATE) { run(CREATE, n_threads); }
+
+TEST_F(CompoundThroughputTest, WRITE) { run(WRITE, n_threads); }
+
+TEST_F(CompoundThroughputTest, MIXED) { run(MIXED, n_threads); }
+
+TEST_F(CompoundThroughputTest, REMOVE) { run(REMOVE, n_threads); }
+
+/* {PUTFH OPEN} x 127, and PUTFH LOOKUP if it fails */
+TEST_F(CompoundThroughputTest, CREATE256) {
+  int saved_ops = n_ops;
+
+  n_ops = 127;
+  run(CREATE, n_threads);
+  n_ops = saved_ops;
+}
+
+/* PUTFH REMOVE x 254, and LOOKUP if it fails */
+TEST_F(CompoundThroughputTest, REMOVE256) {
+  int saved_ops = n_ops;
+
+  n_ops = 254;
+  run(REMOVE, n_threads);
+  n_ops = saved_ops;
+}
+
+int main(int argc, char *argv[]) {
+  int code = 0;
+  char *session_name = NULL;
+  char *ganesha_conf = nullptr;
+  char *lpath = nullptr;
+  int dlevel = -1;
+  uint16_t export_id = 77;
+
+  using namespace std;
+  using namespace std::literals;
+  namespace po = boost::program_options;
+
+  po::options_description opts("program options");
+  po::variables_map vm;
+
+  try {
+
+    opts.add_options()
+      ("config", po::value<string>(),
+       "path to Ganesha conf file")
+
+      ("logfile", po::value<string>(),
+       "log to the provided file path")
+
+      ("export", po::value<uint16_t>(),
+       "id of export on which to operate (must exist)")
+
+      ("debug", po::value<string>(),
+       "ganesha debug level")
+
+      ("session", po::value<string>(),
+       "LTTng session name")
+
+      ("event-list", po::value<string>(),
+       "LTTng event list, comma separated")
+
+      ("profile", po::value<string>(),
+       "Enable profiling and set output file.")
+
+      ("threads", po::value<int>(),
+       "number of threads sending compounds")
+
+      ("ops", po::value<int>(),
+       "number of files each compound creates, writes or reads")
+
+      ("compounds", po::value<int>(),
+       "number of compounds each thread sends")
+
+      ("fail-ratio", po::value<double>(),
+       "share of the compounds that fail at their last op")
+
+      ("io-size", po::value<uint32_t>(),
+       "size of each READ and WRITE")
+
+      ("output", po::value<string>(),
+       "append the results to this file as JSON lines")
+      ;
+
+    po::variables_map::iterator vm_iter;
+    po::command_line_parser parser{argc, argv};
+    parser.options(opts).allow_unregistered();
+    po::store(parser.run(), vm);
+    po::notify(vm);
+
+    // use config vars--leaves them on the stack
+    vm_iter = vm.find("config");
+    if (vm_iter != vm.end()) {
+      ganesha_conf = (char *)vm_iter->second.as<std::string>().c_str();
+    }
+    vm_iter = vm.find("logfile");
+    if (vm_iter != vm.end()) {
+      lpath = (char *)vm_iter->second.as<std::string>().c_str();
+    }
+    vm_iter = vm.find("debug");
+    if (vm_iter != vm.end()) {
+      dlevel =
+          ReturnLevelAscii((char *)vm_iter->second.as<std::string>().c_str());
+    }
+    vm_iter = vm.find("export");
+    if (vm_iter != vm.end()) {
+      export_id = vm_iter->second.as<uint16_t>();
+    }
+    vm_iter = vm.find("session");
+    if (vm_iter != vm.end()) {
+      session_name = (char *)vm_iter->second.as<std::string>().c_str();
+    }
+    vm_iter = vm.find("event-list");
+    if (vm_iter != vm.end()) {
+      event_list = (char *)vm_iter->second.as<std::string>().c_str();
+    }
+    vm_iter = vm.find("profile");
+    if (vm_iter != vm.end()) {
+      profile_out = (char *)vm_iter->second.as<std::string>().c_str();
+    }
+    vm_iter = vm.find("threads");
+    if (vm_iter != vm.end()) {
+      n_threads = vm_iter->second.as<int>();
+    }
+    vm_iter = vm.find("ops");
+    if (vm_iter != vm.end()) {
+      n_ops = vm_iter->second.as<int>();
+    }
+    vm_iter = vm.find("compounds");
+    if (vm_iter != vm.end()) {
+      n_compounds = vm_iter->second.as<int>();
+    }
+    vm_iter = vm.find("fail-ratio");
+    if (vm_iter != vm.end()) {
+      fail_ratio = vm_iter->second.as<double>();
+    }
+    vm_iter = vm.find("io-size");
+    if (vm_iter != vm.end()) {
+      io_size = vm_iter->second.as<uint32_t>();
+    }
+    vm_iter = vm.find("output");
+    if (vm_iter != vm.end()) {
+      output_path = vm_iter->second.as<std::string>();
+    }
+
+    ::testing::InitGoogleTest(&argc, argv);
+    gtest::env = new gtest::Environment(ganesha_conf, lpath, dlevel,
+                                        session_name, TEST_ROOT, export_id);
+    ::testing::AddGlobalTestEnvironment(gtest::env);
+
+    code = RUN_ALL_TESTS();
+  }
+
+  catch (po::error &e) {
+    cout << "Error parsing opts " << e.what() << endl;
+  }
+
+  catch (...) {
+    cout << "Unhandled exception in main()" << endl;
+  }
+
+  return code;
+}
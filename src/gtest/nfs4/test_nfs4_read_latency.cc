@@ -0,0 +1,362 @@
+// -*- mode:C; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+/*
+ * Latency of PUTFH READ compounds, with and without the READ buffer pool.
+ *
+ * Each of --threads threads reads --io-size bytes at a time from a file of
+ * its own, for --compounds compounds.  UNPOOLED runs with
+ * IO_Buffer_Pool_Size set to 0, so that every READ buffer is allocated
+ * and freed, then POOLED with the configured pool.  Each run prints the
+ * compounds/s, the p50/p99 latency, the resident memory of the process and
+ * the pool counters.
+ */
+
+#include <boost/program_options.hpp>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <sys/types.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "gtest_nfs4.hh"
+
+extern "C" {
+#include "nfs_core.h"
+#include "iobuf_pool.h"
+}
+
+#define TEST_ROOT "nfs4_read_latency"
+#define FILE_CHUNKS 16
+
+namespace {
+
+char *event_list = nullptr;
+char *profile_out = nullptr;
+int n_threads = 4;
+int n_compounds = 10000;
+uint32_t io_size = 1024 * 1024;
+
+uint64_t resident_bytes() {
+  std::ifstream statm("/proc/self/statm");
+  uint64_t size = 0, resident = 0;
+
+  statm >> size >> resident;
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
+// Sends the compounds of one thread, with a request context of its own
+class ReadSender : public gtest::CompoundSender {
+ public:
+  ReadSender(const struct req_op_context *ctx, struct fsal_obj_handle *file)
+      : gtest::CompoundSender(ctx), file(file) {}
+
+  /* Fills the file, so that no READ is short */
+  void fill() {
+    std::string buf(io_size, 'r');
+
+    op_ctx = &req_ctx;
+    for (int i = 0; i < FILE_CHUNKS; ++i) {
+      COMPOUND4args *args;
+      nfs_arg_t arg;
+      nfs_res_t res;
+
+      memset(&arg, 0, sizeof(arg));
+      memset(&res, 0, sizeof(res));
+      args = start(&arg);
+      args->argarray.argarray_val[1].argop = NFS4_OP_WRITE;
+      WRITE4args *write = &args->argarray.argarray_val[1].nfs_argop4_u.opwrite;
+      write->offset = (uint64_t)i * io_size;
+      write->stable = FILE_SYNC4;
+      write->data.data_len = buf.size();
+      write->data.data_val = (char *)gsh_memdup(buf.data(), buf.size());
+
+      EXPECT_EQ(nfs4_Compound(&arg, &req, &res), NFS_REQ_OK);
+      EXPECT_EQ(res.res_compound4.status, NFS4_OK);
+
+      nfs4_Compound_Free(&res);
+      xdr_free((xdrproc_t)xdr_COMPOUND4args, &arg);
+    }
+  }
+
+  void run(std::vector<uint64_t> *latencies, uint64_t *errors) {
+    struct timespec s_time, e_time;
+
+    /* stashed in tls */
+    op_ctx = &req_ctx;
+
+    for (int i = 0; i < n_compounds; ++i) {
+      COMPOUND4args *args;
+      nfs_arg_t arg;
+      nfs_res_t res;
+
+      memset(&arg, 0, sizeof(arg));
+      memset(&res, 0, sizeof(res));
+      args = start(&arg);
+      args->argarray.argarray_val[1].argop = NFS4_OP_READ;
+      READ4args *read = &args->argarray.argarray_val[1].nfs_argop4_u.opread;
+      read->offset = (uint64_t)(i % FILE_CHUNKS) * io_size;
+      read->count = io_size;
+
+      now(&s_time);
+      int rc = nfs4_Compound(&arg, &req, &res);
+      /* The reply is sent before its buffer is freed */
+      nfs4_Compound_Free(&res);
+      now(&e_time);
+
+      if (rc == NFS_REQ_OK && res.res_compound4.status == NFS4_OK)
+        latencies->push_back(timespec_diff(&s_time, &e_time));
+      else
+        (*errors)++;
+
+      xdr_free((xdrproc_t)xdr_COMPOUND4args, &arg);
+    }
+  }
+
+ private:
+  /* PUTFH(file) and room for one more op */
+  COMPOUND4args *start(nfs_arg_t *arg) {
+    COMPOUND4args *args = &arg->arg_compound4;
+
+    args->minorversion = 0;
+    args->argarray.argarray_len = 2;
+    args->argarray.argarray_val =
+        (struct nfs_argop4 *)gsh_calloc(2, sizeof(struct nfs_argop4));
+    args->argarray.argarray_val[0].argop = NFS4_OP_PUTFH;
+    bool fhres = nfs4_FSALToFhandle(
+        true, &args->argarray.argarray_val[0].nfs_argop4_u.opputfh.object,
+        file, op_ctx->ctx_export);
+    EXPECT_EQ(fhres, true);
+    return args;
+  }
+
+  struct fsal_obj_handle *file;
+};
+
+class ReadLatencyTest : public gtest::GaneshaFSALBaseTest {
+ protected:
+  virtual void SetUp() {
+    gtest::GaneshaFSALBaseTest::SetUp();
+
+    op_ctx->export_perms->options = EXPORT_OPTION_ACCESS_MASK;
+    req_ctx.client = get_gsh_client((sockaddr_t *)&caller_addr, false);
+
+    files.resize(n_threads);
+    create_and_prime_many(n_threads, files.data());
+    for (int t = 0; t < n_threads; ++t) {
+      ReadSender sender(&req_ctx, files[t]);
+
+      sender.fill();
+    }
+    op_ctx = &req_ctx;
+  }
+
+  virtual void TearDown() {
+    remove_many(n_threads, files.data());
+
+    gtest::GaneshaFSALBaseTest::TearDown();
+  }
+
+  void run(const char *name, bool pooled) {
+    uint32_t saved_pool_size = nfs_param.core_param.iobuf_pool_size;
+    std::vector<ReadSender *> senders;
+    std::vector<std::vector<uint64_t>> latencies(n_threads);
+    std::vector<uint64_t> errors(n_threads);
+    std::vector<std::thread> workers;
+    struct iobuf_stats before, after;
+    struct timespec s_time, e_time;
+
+    if (!pooled)
+      nfs_param.core_param.iobuf_pool_size = 0;
+
+    for (int t = 0; t < n_threads; ++t)
+      senders.push_back(new ReadSender(&req_ctx, files[t]));
+
+    iobuf_get_stats(&before);
+    enableEvents(event_list);
+    if (profile_out) ProfilerStart(profile_out);
+
+    now(&s_time);
+    for (int t = 0; t < n_threads; ++t)
+      workers.emplace_back(&ReadSender::run, senders[t], &latencies[t],
+                           &errors[t]);
+    for (auto &worker : workers) worker.join();
+    now(&e_time);
+
+    if (profile_out) ProfilerStop();
+    disableEvents(event_list);
+    iobuf_get_stats(&after);
+
+    for (auto sender : senders) delete sender;
+    op_ctx = &req_ctx;
+    nfs_param.core_param.iobuf_pool_size = saved_pool_size;
+
+    std::vector<uint64_t> all;
+    uint64_t n_errors = 0;
+    for (int t = 0; t < n_threads; ++t) {
+      all.insert(all.end(), latencies[t].begin(), latencies[t].end());
+      n_errors += errors[t];
+    }
+    EXPECT_EQ(0, n_errors);
+
+    uint64_t gets = after.gets - before.gets;
+    uint64_t hits = after.thread_hits - before.thread_hits +
+                    after.depot_hits - before.depot_hits;
+    double secs = timespec_diff(&s_time, &e_time) / 1e9;
+
+    fprintf(stderr,
+            "%-8s threads %d io_size %u: %.1f compounds/s, p50 %.1f us, "
+            "p99 %.1f us, rss %.1f MiB, pool hits %.2f%%, "
+            "pool idle %.1f MiB\n",
+            name, n_threads, io_size, all.size() / secs,
+            gtest::percentile(all, 0.5) / 1e3,
+            gtest::percentile(all, 0.99) / 1e3,
+            resident_bytes() / 1048576.0,
+            gets ? 100.0 * hits / gets : 0.0,
+            after.idle_bytes / 1048576.0);
+  }
+
+  std::vector<struct fsal_obj_handle *> files;
+};
+
+} /* namespace */
+
+/* Without the pool first, so that it does not start with a full depot */
+TEST_F(ReadLatencyTest, UNPOOLED) { run("unpooled", false); }
+
+TEST_F(ReadLatencyTest, POOLED) { run("pooled", true); }
+
+int main(int argc, char *argv[]) {
+  int code = 0;
+  char *session_name = NULL;
+  char *ganesha_conf = nullptr;
+  char *lpath = nullptr;
+  int dlevel = -1;
+  uint16_t export_id = 77;
+
+  using namespace std;
+  using namespace std::literals;
+  namespace po = boost::program_options;
+
+  po::options_description opts("program options");
+  po::variables_map vm;
+
+  try {
+
+    opts.add_options()
+      ("config", po::value<string>(),
+       "path to Ganesha conf file")
+
+      ("logfile", po::value<string>(),
+       "log to the provided file path")
+
+      ("export", po::value<uint16_t>(),
+       "id of export on which to operate (must exist)")
+
+      ("debug", po::value<string>(),
+       "ganesha debug level")
+
+      ("session", po::value<string>(),
+       "LTTng session name")
+
+      ("event-list", po::value<string>(),
+       "LTTng event list, comma separated")
+
+      ("profile", po::value<string>(),
+       "Enable profiling and set output file.")
+
+      ("threads", po::value<int>(),
+       "number of threads sending compounds")
+
+      ("compounds", po::value<int>(),
+       "number of compounds each thread sends")
+
+      ("io-size", po::value<uint32_t>(),
+       "size of each READ")
+      ;
+
+    po::variables_map::iterator vm_iter;
+    po::command_line_parser parser{argc, argv};
+    parser.options(opts).allow_unregistered();
+    po::store(parser.run(), vm);
+    po::notify(vm);
+
+    // use config vars--leaves them on the stack
+    vm_iter = vm.find("config");
+    if (vm_iter != vm.end()) {
+      ganesha_conf = (char *)vm_iter->second.as<std::string>().c_str();
+    }
+    vm_iter = vm.find("logfile");
+    if (vm_iter != vm.end()) {
+      lpath = (char *)vm_iter->second.as<std::string>().c_str();
+    }
+    vm_iter = vm.find("debug");
+    if (vm_iter != vm.end()) {
+      dlevel =
+          ReturnLevelAscii((char *)vm_iter->second.as<std::string>().c_str());
+    }
+    vm_iter = vm.find("export");
+    if (vm_iter != vm.end()) {
+      export_id = vm_iter->second.as<uint16_t>();
+    }
+    vm_iter = vm.find("session");
+    if (vm_iter != vm.end()) {
+      session_name = (char *)vm_iter->second.as<std::string>().c_str();
+    }
+    vm_iter = vm.find("event-list");
+    if (vm_iter != vm.end()) {
+      event_list = (char *)vm_iter->second.as<std::string>().c_str();
+    }
+    vm_iter = vm.find("profile");
+    if (vm_iter != vm.end()) {
+      profile_out = (char *)vm_iter->second.as<std::string>().c_str();
+    }
+    vm_iter = vm.find("threads");
+    if (vm_iter != vm.end()) {
+      n_threads = vm_iter->second.as<int>();
+    }
+    vm_iter = vm.find("compounds");
+    if (vm_iter != vm.end()) {
+      n_compounds = vm_iter->second.as<int>();
+    }
+    vm_iter = vm.find("io-size");
+    if (vm_iter != vm.end()) {
+      io_size = vm_iter->second.as<uint32_t>();
+    }
+
+    ::testing::InitGoogleTest(&argc, argv);
+    gtest::env = new gtest::Environment(ganesha_conf, lpath, dlevel,
+                                        session_name, TEST_ROOT, export_id);
+    ::testing::AddGlobalTestEnvironment(gtest::env);
+
+    code = RUN_ALL_TESTS();
+  }
+
+  catch (po::error &e) {
+    cout << "Error parsing opts " << e.what() << endl;
+  }
+
+  catch (...) {
+    cout << "Unhandled exception in main()" << endl;
+  }
+
+  return code;
+}
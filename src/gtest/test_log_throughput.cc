@@ -0,0 +1,198 @@
+// -*- mode:C; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ * -------------
+ */
+
+/*
+ * LogDebug throughput under contention
+ *
+ * Sets up, from a LOG block, a synchronous file facility and two
+ * asynchronous ones, dropping or blocking when a ring is full.  For each
+ * facility and for 1, 2, 4... up to --threads threads, every thread sends
+ * --messages LogDebug(COMPONENT_FSAL) messages, then the run reports the
+ * messages/s and how many of them made it to the file.
+ *
+ * usage: test_log_throughput [--threads n] [--messages n] [--dir path]
+ */
+
+#include <sys/types.h>
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <thread>
+#include "gtest/gtest.h"
+#include <boost/program_options.hpp>
+
+extern "C" {
+/* Ganesha headers */
+#include "log.h"
+#include "common_utils.h"
+#include "config_parsing.h"
+}
+
+namespace {
+
+  unsigned int max_threads = 16;
+  uint64_t num_messages = 100000;
+  std::string log_dir = "/tmp";
+
+  const char *facilities[] = { "BENCH_FILE", "BENCH_DROP", "BENCH_BLOCK" };
+
+  std::string log_path(const char *facility)
+  {
+    return log_dir + "/test_log_throughput." + facility + ".log";
+  }
+
+  uint64_t count_lines(const std::string &path)
+  {
+    std::ifstream in(path);
+    std::string line;
+    uint64_t lines = 0;
+
+    while (std::getline(in, line))
+      lines++;
+    return lines;
+  }
+
+  void log_worker(unsigned int id)
+  {
+    SetNameFunction("bench");
+    for (uint64_t i = 0; i < num_messages; i++)
+      LogDebug(COMPONENT_FSAL, "thread %u message %" PRIu64
+	       " of a LogDebug throughput run", id, i);
+  }
+
+  void run_facility(const char *facility)
+  {
+    std::string path = log_path(facility);
+
+    ASSERT_EQ(enable_log_facility(facility), 0);
+
+    for (unsigned int threads = 1; threads <= max_threads; threads *= 2) {
+      std::vector<std::thread> workers;
+      struct timespec s_time, e_time;
+
+      ASSERT_EQ(truncate(path.c_str(), 0), 0);
+
+      now(&s_time);
+      for (unsigned int i = 0; i < threads; i++)
+	workers.emplace_back(log_worker, i);
+      for (auto &worker : workers)
+	worker.join();
+      now(&e_time);
+
+      /* Write out what the rings still hold before counting */
+      Cleanup();
+
+      uint64_t dt = timespec_diff(&s_time, &e_time);
+      uint64_t sent = threads * num_messages;
+      uint64_t written = count_lines(path);
+
+      fprintf(stderr, "%-12s threads %3u: %10.0f msgs/s, %" PRIu64
+	      " of %" PRIu64 " written\n", facility, threads,
+	      sent / (double(dt) / 1000000000), written, sent);
+    }
+
+    ASSERT_EQ(disable_log_facility(facility), 0);
+  }
+
+} /* namespace */
+
+TEST(LOG_THROUGHPUT, INIT)
+{
+  std::string conf = log_dir + "/test_log_throughput.conf";
+  std::ofstream out(conf);
+  struct config_error_type err_type;
+  config_file_t config;
+
+  out << "LOG {\n"
+      << " FACILITY { name = BENCH_FILE; destination = \""
+      << log_path("BENCH_FILE") << "\"; }\n"
+      << " FACILITY { name = BENCH_DROP; destination = \""
+      << log_path("BENCH_DROP") << "\"; async = true;"
+      << " async_overflow = drop; }\n"
+      << " FACILITY { name = BENCH_BLOCK; destination = \""
+      << log_path("BENCH_BLOCK") << "\"; async = true;"
+      << " async_overflow = block; }\n"
+      << "}\n";
+  out.close();
+
+  init_logging(NULL, -1);
+
+  config = config_ParseFile((char *) conf.c_str(), &err_type);
+  ASSERT_NE(config, nullptr);
+  ASSERT_GE(read_log_config(config, &err_type), 0);
+  config_Free(config);
+
+  /* Only the facilities under test see the debug messages */
+  ASSERT_EQ(set_log_level("SYSLOG", NIV_EVENT), 0);
+  SetComponentLogLevel(COMPONENT_FSAL, NIV_DEBUG);
+}
+
+TEST(LOG_THROUGHPUT, FILE)
+{
+  run_facility(facilities[0]);
+}
+
+TEST(LOG_THROUGHPUT, ASYNC_DROP)
+{
+  run_facility(facilities[1]);
+}
+
+TEST(LOG_THROUGHPUT, ASYNC_BLOCK)
+{
+  run_facility(facilities[2]);
+}
+
+int main(int argc, char *argv[])
+{
+  namespace po = boost::program_options;
+
+  po::options_description opts("program options");
+  po::variables_map vm;
+
+  try {
+    opts.add_options()
+      ("threads", po::value<unsigned int>(),
+	   "largest number of logging threads")
+      ("messages", po::value<uint64_t>(),
+	   "messages per thread")
+      ("dir", po::value<std::string>(),
+	   "directory of the log files")
+      ;
+
+    po::store(po::command_line_parser(argc, argv).options(opts)
+	      .allow_unregistered().run(), vm);
+    po::notify(vm);
+
+    if (vm.count("threads"))
+      max_threads = vm["threads"].as<unsigned int>();
+    if (vm.count("messages"))
+      num_messages = vm["messages"].as<uint64_t>();
+    if (vm.count("dir"))
+      log_dir = vm["dir"].as<std::string>();
+  } catch (po::error &e) {
+    std::cout << "Error parsing opts " << e.what() << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -423,15 +423,12 @@ struct req_op_context {
 	uint64_t txnid;
 	int opidx;
 	COMPOUND4args *op_args;
-	struct fsal_obj_handle *txn_bkp_folder;
 	/* a set of obj handles used by undo executor for release after use */
 	struct hash_table *txn_hdl_set;
   	/* the FSAL export object for MDCACHE */
   	struct fsal_export *mdc_export;
-  	/* locked paths - an array of char* strings */
-  	char **locked_paths;
-  	size_t paths_count;
-  	/* lock handle */
+  	/* locks held by the current compound; they belong to the thread
+  	 * that runs it, the contexts of its parallel segments share them */
   	lock_handle_t *lh;
 };
 
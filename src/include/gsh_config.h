@@ -394,6 +394,13 @@ typedef struct nfs_core_param {
 	    ganesha instance. If this is set, dbus name will be
 	    <prefix>.org.ganesha.nfsd */
 	char *dbus_name_prefix;
+	/** Most memory, in MiB, kept by the shared depot of the READ
+	    buffer pool.  Set to 0 to free every buffer after use.
+	    Settable with IO_Buffer_Pool_Size. */
+	uint32_t iobuf_pool_size;
+	/** Most memory, in KiB, kept by each thread for its own READ
+	    buffers.  Settable with IO_Buffer_Thread_Cache. */
+	uint32_t iobuf_thread_cache;
 } nfs_core_parameter_t;
 
 /** @} */
@@ -434,6 +441,11 @@ typedef struct nfs_core_param {
  */
 #define RECOVERY_BACKEND_DEFAULT "fs"
 
+/**
+ * @brief Default value of compound_workers.
+ */
+#define COMPOUND_WORKERS_DEFAULT 0
+
 /**
  * @brief NFSv4 minor versions
  */
@@ -490,6 +502,11 @@ typedef struct nfs_version4_parameter {
 	unsigned int minor_versions;
 	/** Number of allowed slots in the 4.1 slot table */
 	uint32_t nb_slots;
+	/** Number of threads running the independent segments of a
+	    compound in parallel, 0 to run every compound sequentially.
+	    Defaults to COMPOUND_WORKERS_DEFAULT and is settable with
+	    Compound_Workers. */
+	uint32_t compound_workers;
 } nfs_version4_parameter_t;
 
 /** @} */
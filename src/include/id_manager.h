@@ -27,6 +27,10 @@ int initialize_id_manager(const db_store_t* db);
 // This buffer may contain null bytes
 char* generate_file_id(const db_store_t* db);
 
+// Same as generate_file_id() but writes the file ID into |buf|, which should
+// be at least |TXN_UUID_LEN| bytes. Returns 0 upon success.
+int generate_file_id_r(const db_store_t* db, char* buf);
+
 // Returns a file ID that represents the root of the file system.
 char* get_root_id(const db_store_t* db);
 
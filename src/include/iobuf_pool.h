@@ -0,0 +1,72 @@
+/*
+ * vim:noexpandtab:shiftwidth=8:tabstop=8:
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ * -------------
+ */
+
+/**
+ * @file iobuf_pool.h
+ * @brief Recycled, page aligned buffers for READ payloads
+ *
+ * Buffers come in power of two size classes from IOBUF_ALIGN to
+ * IOBUF_MAX_SIZE.  A freed buffer is kept by the freeing thread, up to
+ * IO_Buffer_Thread_Cache bytes, then in a depot shared by all threads, up
+ * to IO_Buffer_Pool_Size bytes, and only then given back to the system.
+ * Larger buffers are allocated and freed every time.
+ *
+ * Buffers must be freed with iobuf_put(), never with gsh_free().
+ */
+
+#ifndef IOBUF_POOL_H
+#define IOBUF_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef USE_DBUS
+#include "gsh_dbus.h"
+#endif
+
+#define IOBUF_ALIGN 4096
+#define IOBUF_CLASSES 9
+#define IOBUF_MAX_SIZE ((size_t) IOBUF_ALIGN << (IOBUF_CLASSES - 1))
+
+/**
+ * @brief Buffer pool counters, over all threads
+ */
+
+struct iobuf_stats {
+	uint64_t gets;		/*< Buffers asked for */
+	uint64_t thread_hits;	/*< Found in the thread's cache */
+	uint64_t depot_hits;	/*< Found in the depot */
+	uint64_t allocs;	/*< Allocated for a size class */
+	uint64_t frees;		/*< Given back to the system over the caps */
+	uint64_t unpooled;	/*< Too large to be pooled */
+	uint64_t idle_bytes;	/*< Held by the thread caches and the depot */
+	uint64_t used_bytes;	/*< Handed out and not freed yet */
+};
+
+void *iobuf_get(size_t size);
+void iobuf_put(void *buf);
+void iobuf_get_stats(struct iobuf_stats *st);
+
+#ifdef USE_DBUS
+void iobuf_dbus_show(DBusMessageIter *iter);
+#endif
+
+#endif /* IOBUF_POOL_H */
@@ -0,0 +1,76 @@
+// vim:noexpandtab:shiftwidth=8:tabstop=8:
+#ifndef __KV_CACHE_H__
+#define __KV_CACHE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * A bounded, sharded, thread-safe LRU cache of byte-string keys and values,
+ * used to keep hot database records in memory. Each shard is protected by
+ * its own mutex and evicts its least recently used entries once it holds
+ * more than its share of the capacity.
+ *
+ * Only records known to be in the database should be cached. To fill the
+ * cache from a database read without racing with writers, take a ticket
+ * with the failed lookup before reading the database and pass it to
+ * kv_cache_fill(): the fill is dropped if the key's shard has been
+ * invalidated in between.
+ */
+typedef struct kv_cache kv_cache_t;
+
+struct kv_cache_stats {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t fills;		/* entries added by kv_cache_fill/kv_cache_put */
+	uint64_t stale_fills;	/* fills dropped because of invalidations */
+	uint64_t invalidations;
+	uint64_t evictions;
+	uint64_t entries;	/* entries cached right now */
+};
+
+/* kv_cache_t must be freed with free_kv_cache() */
+kv_cache_t *new_kv_cache(size_t capacity);
+void free_kv_cache(kv_cache_t *cache);
+
+/*
+ * Look up |key|. On a hit, copies the value into |buf| (which can hold
+ * |*len| bytes), stores the value length in |*len| and returns true. If the
+ * value does not fit, only |*len| is set and false is returned.
+ *
+ * On a miss, returns false and, if |ticket| is not NULL, stores a ticket to
+ * pass to kv_cache_fill().
+ */
+bool kv_cache_get_copy(kv_cache_t *cache, const char *key, size_t key_len,
+		       void *buf, size_t *len, uint64_t *ticket);
+
+/*
+ * Same as kv_cache_get_copy() but returns a copy of the value allocated with
+ * malloc(), like leveldb_get(). Returns NULL on a miss.
+ */
+char *kv_cache_get(kv_cache_t *cache, const char *key, size_t key_len,
+		   size_t *len, uint64_t *ticket);
+
+/* Cache a value read from the database after a miss that returned |ticket| */
+void kv_cache_fill(kv_cache_t *cache, const char *key, size_t key_len,
+		   const void *val, size_t len, uint64_t ticket);
+
+/* Cache a value that has just been written to the database */
+void kv_cache_put(kv_cache_t *cache, const char *key, size_t key_len,
+		  const void *val, size_t len);
+
+/* Drop |key|, which has been changed or deleted in the database */
+void kv_cache_invalidate(kv_cache_t *cache, const char *key, size_t key_len);
+
+void kv_cache_get_stats(kv_cache_t *cache, struct kv_cache_stats *st);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // __KV_CACHE_H__
@@ -0,0 +1,124 @@
+/*
+ * vim:noexpandtab:shiftwidth=8:tabstop=8:
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ * -------------
+ */
+
+/**
+ * @file latency_histogram.h
+ * @brief Log-linear latency histograms
+ *
+ * Latencies are counted in units of 2^LAT_HISTO_UNIT_SHIFT nanoseconds.
+ * Each power of two of units is split in 2^LAT_HISTO_SUB_BITS buckets of
+ * equal width, so that a bucket is never wider than 1/8th of the values it
+ * holds, whatever their magnitude.  Latencies above 2^LAT_HISTO_MAX_MSB
+ * units, about 18 minutes, all land in the last bucket.
+ *
+ * Only the bucket arithmetic is here; counting and locking are up to the
+ * caller.
+ */
+
+#ifndef LATENCY_HISTOGRAM_H
+#define LATENCY_HISTOGRAM_H
+
+#include <stdint.h>
+
+#define LAT_HISTO_UNIT_SHIFT 7
+#define LAT_HISTO_SUB_BITS 3
+#define LAT_HISTO_SUB (1 << LAT_HISTO_SUB_BITS)
+#define LAT_HISTO_MAX_MSB 33
+#define LAT_HISTO_BUCKETS \
+	((LAT_HISTO_MAX_MSB - LAT_HISTO_SUB_BITS + 2) * LAT_HISTO_SUB)
+
+struct lat_histo {
+	uint64_t count[LAT_HISTO_BUCKETS];
+};
+
+/**
+ * @brief Bucket of a latency
+ *
+ * @param[in] nsecs  Latency in nanoseconds
+ */
+static inline unsigned int lat_histo_bucket(uint64_t nsecs)
+{
+	uint64_t units = nsecs >> LAT_HISTO_UNIT_SHIFT;
+	unsigned int msb;
+
+	if (units < LAT_HISTO_SUB)
+		return units;
+
+	msb = 63 - __builtin_clzll(units);
+	if (msb > LAT_HISTO_MAX_MSB)
+		return LAT_HISTO_BUCKETS - 1;
+
+	return (msb - LAT_HISTO_SUB_BITS + 1) * LAT_HISTO_SUB +
+	       ((units >> (msb - LAT_HISTO_SUB_BITS)) & (LAT_HISTO_SUB - 1));
+}
+
+/**
+ * @brief Upper bound, in nanoseconds, of the latencies in a bucket
+ */
+static inline uint64_t lat_histo_upper(unsigned int bucket)
+{
+	unsigned int group = bucket / LAT_HISTO_SUB;
+	unsigned int shift;
+
+	if (group == 0)
+		return (uint64_t) (bucket + 1) << LAT_HISTO_UNIT_SHIFT;
+
+	shift = group - 1;
+	return (uint64_t) (bucket - (group - 1) * LAT_HISTO_SUB + 1)
+	       << (shift + LAT_HISTO_UNIT_SHIFT);
+}
+
+/**
+ * @brief Latency below which a fraction of the counts lie
+ *
+ * @param[in] count     Counts of the histogram
+ * @param[in] per_mille Fraction, in thousandths: 500 for the median, 999
+ *                      for the 99.9th percentile
+ *
+ * @return the upper bound of the bucket holding the percentile, 0 if the
+ *         histogram is empty.
+ */
+static inline uint64_t lat_histo_percentile(const uint64_t *count,
+					    unsigned int per_mille)
+{
+	uint64_t total = 0, rank, seen = 0;
+	unsigned int i;
+
+	for (i = 0; i < LAT_HISTO_BUCKETS; i++)
+		total += count[i];
+	if (total == 0)
+		return 0;
+
+	/* Smallest rank with at least per_mille of the counts at or below */
+	rank = (total * per_mille + 999) / 1000;
+	if (rank == 0)
+		rank = 1;
+
+	for (i = 0; i < LAT_HISTO_BUCKETS; i++) {
+		seen += count[i];
+		if (seen >= rank)
+			break;
+	}
+	return lat_histo_upper(i < LAT_HISTO_BUCKETS ? i
+				 : LAT_HISTO_BUCKETS - 1);
+}
+
+#endif /* LATENCY_HISTOGRAM_H */
@@ -2,6 +2,7 @@
 #define _LOCK_MANAGER_H
 
 #include <stdbool.h>
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -16,6 +17,18 @@ struct lock_request {
 // Opaque types for C interface
 typedef struct lock_request lock_request_t;
 typedef struct lock_manager lock_manager_t;
+
+// Most distinct paths a single lock_handle_t can hold
+#define LM_MAX_LOCKS 256
+
+// The locks held on behalf of one request. The fields are private to the
+// lock manager; the struct is exposed only so that callers can embed it
+// (for example in a request context) and lock without allocating.
+struct lock_handle {
+        lock_manager_t *lm;
+        int n_locks;
+        uintptr_t locks[LM_MAX_LOCKS];
+};
 typedef struct lock_handle lock_handle_t;
 
 //  lock_manager_t must be freed with free_lock_manager()
@@ -27,11 +40,27 @@ void free_lock_manager(lock_manager_t *lm);
 // Caller maintains ownership of `files` and all of the contents
 // lm_try_lock() returns a nullptr if the lock cannot be acquired
 // In this case, unlock_handle() should not be called.
+// lm_lock() sleeps until the paths are available; waiters are served in
+// FIFO order. lm_lock_timeout() gives up and returns a nullptr after
+// `timeout_ms` milliseconds.
 lock_handle_t *lm_lock(lock_manager_t* lm, lock_request_t *files, int n);
+lock_handle_t *lm_lock_timeout(lock_manager_t *lm, lock_request_t *files,
+                               int n, unsigned int timeout_ms);
 lock_handle_t *lm_try_lock(lock_manager_t* lm, lock_request_t *files, int n);
 
 void unlock_handle(lock_handle_t *lh);
 
+// Same as lm_lock() and lm_try_lock(), but the locks are kept in the
+// caller-provided `lh`, which is returned on success. Paths in `files` only
+// need to stay valid until the call returns. Nothing is allocated once the
+// calling thread has warmed up. Release with unlock_handle_r(), which does
+// not free `lh` and does nothing if `lh` holds no locks.
+lock_handle_t *lm_lock_r(lock_manager_t *lm, lock_request_t *files, int n,
+                         lock_handle_t *lh);
+lock_handle_t *lm_try_lock_r(lock_manager_t *lm, lock_request_t *files, int n,
+                             lock_handle_t *lh);
+void unlock_handle_r(lock_handle_t *lh);
+
 #ifdef __cplusplus
 }
 #endif
@@ -198,6 +198,19 @@ int enable_log_facility(const char *name);
 int disable_log_facility(const char *name);
 int set_log_destination(const char *name, char *dest);
 int set_log_level(const char *name, log_levels_t max_level);
+
+/* Asynchronous log files, see log_async.c */
+
+struct async_log;
+
+int log_to_async(log_header_t headers, void *priv, log_levels_t level,
+		 struct display_buffer *buffer, char *compstr, char *message);
+int async_log_create(const char *path, uint32_t ring_size, bool block,
+		     struct async_log **al);
+void async_log_set_path(struct async_log *al, const char *path);
+uint64_t async_log_dropped(struct async_log *al);
+void async_log_release(struct async_log *al);
+void reopen_log_facilities(void);
 void set_const_log_str(void);
 
 struct log_component_info {
@@ -4,11 +4,14 @@
 
 #include <leveldb/c.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+struct db_group_commit;
+
 /* Contains default levelDB options */
 struct db_store {
 	leveldb_options_t* init_options;
@@ -18,6 +21,8 @@ struct db_store {
 	leveldb_env_t* env;
 	leveldb_filterpolicy_t* filter;
 	leveldb_t* db;
+	/* Group commit stage; NULL if every write is synced on its own */
+	struct db_group_commit* gc;
 };
 typedef struct db_store db_store_t;
 
@@ -37,6 +42,45 @@ db_store_t* init_db_store(const char* db_dir_path, bool is_creation);
  */
 void destroy_db_store(db_store_t*);
 
+/*
+ * Per-store group commit statistics. A "batch" is one synced leveldb_write
+ * that carries the writes of one or more concurrent callers.
+ */
+struct db_group_commit_stats {
+	uint64_t batches;	/* synced leveldb_write calls issued */
+	uint64_t writes;	/* caller write batches folded into them */
+	uint64_t max_batch;	/* most caller writes seen in one batch */
+	uint64_t full_batches;	/* batches flushed because they were full */
+	uint64_t sync_ns;	/* total time spent in synced leveldb_write */
+	uint64_t wait_ns;	/* total time callers waited for durability */
+};
+
+/*
+ * Enable group commit on an initialized store. Concurrent db_group_write()
+ * callers are coalesced into a single synced leveldb_write. The first
+ * waiting caller becomes the leader and holds the flush window open for at
+ * most |max_delay_us| microseconds or until |max_batch| writes are queued.
+ *
+ * max_batch <= 1 leaves group commit disabled.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+int db_group_commit_init(db_store_t* db_st, uint32_t max_delay_us,
+			 uint32_t max_batch);
+
+/*
+ * Durably apply |batch|. Blocks until the batch is on stable storage. Falls
+ * back to a plain synced leveldb_write when group commit is disabled.
+ * The caller keeps ownership of |batch|.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+int db_group_write(const db_store_t* db_st, leveldb_writebatch_t* batch);
+
+/* Snapshot the group commit counters. All zero if group commit is off. */
+void db_group_commit_get_stats(const db_store_t* db_st,
+			       struct db_group_commit_stats* stats);
+
 /* Encapsulates the key and value together */
 struct db_kvpair {
 	const char* key;
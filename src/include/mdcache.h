@@ -51,6 +51,10 @@ fsal_status_t mdcache_pkginit(void);
 int mdcache_set_param_from_conf(config_file_t parse_tree,
 				struct config_error_type *err_type);
 
+/* Warm-start snapshot of the cache */
+int mdcache_snapshot_pkginit(void);
+void mdcache_snapshot_shutdown(void);
+
 bool mdcache_lru_fds_available(void);
 void init_fds_limit(void);
 #endif /* MDCACHE_H */
@@ -174,6 +174,14 @@ struct export_stats {
 	.direction = "out"   \
 }
 
+/* Per op: protocol, op name, ops counted, p50, p99 and p999 latency */
+#define OP_LATENCIES_REPLY   \
+{                            \
+	.name = "op_latency", \
+	.type = "a(sstttt)", \
+	.direction = "out"   \
+}
+
 /* We are passing back FSAL name so that ganesha_stats can show it as per
  * the FSAL name
  * The fsal_stats is an array with below items in it
@@ -279,6 +287,7 @@ void server_dbus_total_ops(struct export_stats *export_st,
 			   DBusMessageIter *iter);
 void global_dbus_total_ops(DBusMessageIter *iter);
 void server_dbus_fast_ops(DBusMessageIter *iter);
+void server_dbus_op_latencies(DBusMessageIter *iter);
 void mdcache_dbus_show(DBusMessageIter *iter);
 void reset_server_stats(void);
 void reset_export_stats(void);
@@ -38,4 +38,11 @@ void init_ldbtxn_backend(const char* root, const char* prefix,
 //  Transaction file is stored at /{root}/txn_{id}/{filename}
 void init_fstxn_backend(const char* root, const char* filename,
 			struct txn_backend** txn_backend);
+
+//  TxnBackend appending to preallocated log segments
+//  Segments of `segment_size` bytes are stored at /{root}/seg-{n} and are
+//  recycled rather than deleted; removing a txn appends a marker.
+//  Creates and removes return once durable, sharing fdatasync()s.
+void init_segtxn_backend(const char* root, size_t segment_size,
+			 struct txn_backend** txn_backend);
 #endif
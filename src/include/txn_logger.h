@@ -70,23 +70,80 @@ struct RenameId {
 
 typedef struct RenameId RenameId;
 
+/**
+ * The original content of a small range overwritten by a VWrite, stored in
+ * the txn log instead of a backup file.
+ */
+struct InlineUndo {
+	struct ObjectId file_id;
+	uint64_t offset;
+	uint64_t orig_size; /* file size before the transaction */
+	const char *data;
+	size_t len;
+};
+
+typedef struct InlineUndo InlineUndo;
+
 struct TxnLog {
 	uint64_t txn_id;
 	struct CreatedObject *created_file_ids;
 	struct UnlinkId *created_unlink_ids;
 	struct SymlinkId *created_symlink_ids;
 	struct RenameId *created_rename_ids;
+	struct InlineUndo *inline_undos;
 	int num_files;
 	int num_unlinks;
 	int num_symlinks;
 	int num_renames;
+	int num_inline_undos;
 	enum CompoundType compound_type;
 	const char *backup_dir_path;
 };
 
 typedef struct TxnLog TxnLog;
+
+/* Returned by create_txn_log() when the log cannot be written */
+#define TXN_LOG_ERROR UINT64_MAX
+
+/**
+ * Write the log of a new txn for the compound |arg| and return its id. Returns
+ * 0 if the compound cannot change anything and needs no log, and
+ * TXN_LOG_ERROR if the log cannot be written.
+ */
 uint64_t create_txn_log(const db_store_t *db, const COMPOUND4args *arg);
 
+/**
+ * Add |undos| to the log of txn |txn_id| created by create_txn_log(), as its
+ * undo record |seq|; the records of a txn are numbered from 0. Each record is
+ * a key of its own, "txn-<id>/u<seq>", so the log is never read back or
+ * rewritten. The record is synced before this returns, so the data of the
+ * ranges can be overwritten afterwards. Returns 0 on success.
+ */
+int add_txn_undos(const db_store_t *db, uint64_t txn_id, uint32_t seq,
+		  const struct InlineUndo *undos, int n);
+
+/**
+ * Record in the log of txn |txn_id|, as its undo record |seq|, that the txn
+ * keeps backups in the directory |path|: such a txn cannot be undone from its
+ * log alone. Synced before this returns. Returns 0 on success.
+ */
+int add_txn_backup_dir(const db_store_t *db, uint64_t txn_id, uint32_t seq,
+		       const char *path);
+
+/**
+ * Add to |batch| the deletion of the log of txn |txn_id| and of its first
+ * |n_undo_records| undo records.
+ */
+void delete_txn_log(leveldb_writebatch_t *batch, uint64_t txn_id,
+		    uint32_t n_undo_records);
+
+/**
+ * Whether the log of txn |txn_id| is still in |db|, i.e. the txn has neither
+ * committed nor been undone. Returns 1 if it is, 0 if not, and -1 if the
+ * database cannot be read.
+ */
+int txn_log_exists(const db_store_t *db, uint64_t txn_id);
+
 #ifdef __cplusplus
 }
 #endif
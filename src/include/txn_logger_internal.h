@@ -15,4 +15,11 @@ int txn_log_from_pb(proto::TransactionLog *txnpb, struct TxnLog *txn_log);
 int txn_log_to_pb(struct TxnLog *txn_log, proto::TransactionLog *txnpb);
 void txn_log_free(struct TxnLog *txn_log);
 
+// Converters between the records kept in the database (see txn_record.h) and
+// protobuf, for tooling. txn_record_from_pb() returns a buffer of the calling
+// thread as txn_record_encode() does, or NULL on failure.
+int txn_record_to_pb(const char *rec, size_t len,
+                     proto::TransactionLog *txnpb);
+const char *txn_record_from_pb(proto::TransactionLog *txnpb, size_t *len);
+
 #endif
@@ -0,0 +1,111 @@
+// vim:noexpandtab:shiftwidth=8:tabstop=8:
+#ifndef _TXN_RECORD_H
+#define _TXN_RECORD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "txn_logger.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Binary layout of the txn log records kept in the database.
+ *
+ * A record is a header followed by |n_entries| entries. Every entry starts
+ * with a struct txn_record_entry, then its fixed fields and its variable
+ * part (strings, data), and is padded to a multiple of 8 bytes. Strings are
+ * stored NUL-terminated so that they can be used where they are. Integers
+ * are in host byte order: records never leave the server that wrote them.
+ *
+ * Records can be read in place from any buffer, aligned or not, without
+ * allocating: the fixed fields are copied out and the pointers returned
+ * point into the buffer.
+ */
+#define TXN_RECORD_MAGIC 0x524e5854 /* "TXNR" */
+#define TXN_RECORD_VERSION 1
+
+struct txn_record_header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t type;		/* enum CompoundType */
+	uint64_t txn_id;
+	uint32_t n_entries;
+	uint32_t size;		/* of the whole record, header included */
+};
+
+enum txn_record_kind {
+	txn_rec_backup_dir = 1,
+	txn_rec_created,
+	txn_rec_unlink,
+	txn_rec_symlink,
+	txn_rec_rename,
+	txn_rec_inline_undo,
+};
+
+struct txn_record_entry {
+	uint16_t kind;		/* enum txn_record_kind */
+	uint16_t flags;
+	uint32_t size;		/* header and padding included */
+};
+
+/* An entry read from a record; pointers point into the record */
+struct txn_record_item {
+	enum txn_record_kind kind;
+	union {
+		const char *backup_dir;
+		struct InlineUndo undo;
+		struct {
+			struct ObjectId base_id;
+			struct ObjectId allocated_id;
+			const char *path;
+		} created;
+		/* txn_rec_unlink and txn_rec_symlink; no src_path for unlinks */
+		struct {
+			struct ObjectId parent_id;
+			const char *name;
+			const char *src_path;
+		} link;
+		struct RenameId rename;
+	} u;
+};
+
+struct txn_record_reader {
+	const char *pos;
+	const char *end;
+	uint32_t left;		/* entries not read yet */
+};
+
+/*
+ * Check the record in |buf| and get ready to read its entries. Returns 0 on
+ * success, -1 if |buf| does not hold a record of this version.
+ */
+int txn_record_open(const char *buf, size_t len,
+		    struct txn_record_header *hdr,
+		    struct txn_record_reader *reader);
+
+/* Read the next entry. Returns 1 if read, 0 at the end, -1 if corrupt. */
+int txn_record_next(struct txn_record_reader *reader,
+		    struct txn_record_item *item);
+
+/*
+ * Encode |log| into a buffer owned by the calling thread, which stays valid
+ * until the thread encodes again.
+ */
+const char *txn_record_encode(const struct TxnLog *log, size_t *len);
+
+/*
+ * Fill |log| from a record. The arrays of |log| are allocated and must be
+ * released with txn_log_free(); everything else points into |buf|, which
+ * must outlive |log|. Returns 0 on success, -1 if the record is corrupt or
+ * has entries its type cannot hold.
+ */
+int txn_record_decode(const char *buf, size_t len, struct TxnLog *log);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,84 @@
+// vim:noexpandtab:shiftwidth=8:tabstop=8:
+#ifndef _TXN_RECOVERY_H
+#define _TXN_RECOVERY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "lwrapper.h"
+#include "txn_logger.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * The transactions left pending in the database by a crash, as needed to
+ * undo them at startup.
+ *
+ * The pending txns are split into groups such that no two groups touch the
+ * same object, so that groups can be undone concurrently. The txns of one
+ * group must be undone one at a time, newest first.
+ */
+typedef struct txn_recovery txn_recovery_t;
+
+struct txn_recovery_group {
+	struct TxnLog **txns;	/* newest first */
+	int n_txns;
+};
+
+/*
+ * Read the logs of every pending txn in |db| and group them. The Sub-FSAL
+ * handle keys of the objects to restore are read at the same time, in key
+ * order from a single iterator, from the records named |uuid_prefix|
+ * followed by the uuid.
+ *
+ * Returns NULL if the database cannot be read. Must be freed with
+ * txn_recovery_free().
+ */
+txn_recovery_t *txn_recovery_load(const db_store_t *db,
+				  const char *uuid_prefix);
+void txn_recovery_free(txn_recovery_t *rec);
+
+int txn_recovery_num_txns(const txn_recovery_t *rec);
+
+/* Logs that could not be parsed; they are left in the database */
+int txn_recovery_num_corrupt(const txn_recovery_t *rec);
+
+/* Groups are sorted by decreasing number of txns */
+int txn_recovery_num_groups(const txn_recovery_t *rec);
+const struct txn_recovery_group *txn_recovery_get_group(
+    const txn_recovery_t *rec, int i);
+
+/*
+ * The handle key of the object |uuid| refers to, or NULL if the database
+ * does not know it. The key stays valid until txn_recovery_free().
+ */
+const char *txn_recovery_handle_key(const txn_recovery_t *rec,
+				    const uuid_t uuid, size_t *len);
+
+/*
+ * Whether txn_recovery_keep() marked |txn_id| at an earlier start
+ */
+bool txn_recovery_is_kept(const txn_recovery_t *rec, uint64_t txn_id);
+
+/*
+ * Durably mark |txns| as left pending on purpose, so that later starts know
+ * they were already reported. The mark goes with txn_recovery_remove().
+ */
+int txn_recovery_keep(const db_store_t *db, struct TxnLog *const *txns,
+		      int n);
+
+/*
+ * Durably delete the logs of |txns|, undo records included, once they have
+ * been undone
+ */
+int txn_recovery_remove(const db_store_t *db, struct TxnLog *const *txns,
+			int n);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,4 +1,7 @@
+#include <pthread.h>
+#include <stdbool.h>
 #include <uuid/uuid.h>
+#include "version_table.h"
 /* TXNFS data structures that needs to be exported */
 
 #ifndef _TXNFS_H_
@@ -10,14 +13,55 @@
 /* Default vector capacity */
 #define TXN_CACHE_CAP 256
 
+/* A version stripe read by a snapshot compound, with the version it had
+ * before the read; or a stripe marked as being written by another compound */
+struct txnfs_snap_stripe {
+	uint32_t stripe;
+	uint64_t version;
+};
+
 /* TXN cache. This is a continuously allocated vector
  * that buffers file handle insertion or removal.
  * @c entries is an array whose size and capacity are
- * given by the struct. */
+ * given by the struct.
+ *
+ * The cache also keeps the backups made so far by the compound. Independent
+ * parts of a compound may run on several threads at once, so all of it is
+ * protected by @c lock. */
 struct txnfs_cache {
+	pthread_mutex_t lock;
 	uint32_t size;
 	uint32_t capacity;
 	struct txnfs_cache_entry *entries;
+	/* backup folder of the transaction */
+	struct fsal_obj_handle *bkp_folder;
+	/* the reusable slot bkp_folder belongs to, if any */
+	struct txnfs_bkp_slot *bkp_slot;
+	/* files backed up by range in the transaction */
+	struct txnfs_bkp_object *bkp_objects;
+	/* undo records added to the txn log, under lock */
+	uint32_t n_undo_records;
+	/* whether the compound runs without locking the paths it reads */
+	bool optimistic;
+	/* paths pinned in the export's version table, if it has one */
+	vt_handle_t vh;
+	/* whether the compound is read-only and runs on a snapshot */
+	bool snapshot;
+	/* On an export with snapshot reads, the version stripes the snapshot
+	 * read or the other compounds marked as written; room for two per op.
+	 * Also the stripe of the saved filehandle, for RENAME and LINK. */
+	struct txnfs_snap_stripe *snap_stripes;
+	uint32_t n_snap_stripes;
+	uint32_t snap_saved;
+	/* when the operations of the compound started (txnfs_phase_now()) */
+	uint64_t exec_start;
+	/* Open-addressed indexes of the entries: the created objects by file
+	 * handle and by uuid, and the latest path of an object by uuid. A
+	 * slot holds the index of an entry plus one, 0 if it is empty. */
+	uint32_t index_mask;
+	uint16_t *by_fh;
+	uint16_t *by_uuid;
+	uint16_t *by_path;
 };
 
 enum txnfs_cache_entry_type {
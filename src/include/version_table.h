@@ -0,0 +1,66 @@
+#ifndef _VERSION_TABLE_H
+#define _VERSION_TABLE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "lock_manager.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Per-path version counters used to run transactions optimistically.
+//
+// A path's version is even while nobody writes it and odd while a request
+// that writes it is running. A request that only reads a path records the
+// version it saw when it started and checks, once it is done, that the path
+// has not been written since. Writers must hold the write lock of the path
+// in the lock manager, so that there is at most one writer per path.
+//
+// Reading a path also reads its ancestors, since creating, removing or
+// renaming an entry only writes the directory it is in: writing a directory
+// conflicts with reading any path below it. Unlike locks, writing a path does
+// not conflict with reading its ancestors.
+typedef struct version_table version_table_t;
+
+// One path pinned by a vt_handle_t. The fields are private to the version
+// table.
+struct vt_entry {
+        uintptr_t node;         // node pointer, lowest bit set for writes
+        uint64_t version;       // version seen by vt_begin()
+};
+
+// The paths pinned on behalf of one request. Like lock_handle_t, the struct
+// is exposed only so that callers can embed it.
+struct vt_handle {
+        version_table_t *vt;
+        int n_entries;
+        struct vt_entry entries[LM_MAX_LOCKS];
+};
+typedef struct vt_handle vt_handle_t;
+
+//  version_table_t must be freed with free_version_table()
+version_table_t *new_version_table();
+void free_version_table(version_table_t *vt);
+
+// Pin the paths in `files`. Paths with write_lock set are marked as being
+// written until vt_end(); the versions of the others and of their ancestors
+// are recorded for vt_validate(). Returns false, with nothing pinned, if one
+// of the paths to read is being written by another request, or if there are
+// more than LM_MAX_LOCKS paths to pin. Paths in `files` only need to stay
+// valid until the call returns.
+bool vt_begin(version_table_t *vt, lock_request_t *files, int n,
+              vt_handle_t *vh);
+
+// Whether none of the paths read has been written since vt_begin()
+bool vt_validate(const vt_handle_t *vh);
+
+// Finish the writes and unpin every path. Does nothing if `vh` pins nothing.
+void vt_end(vt_handle_t *vh);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // _VERSION_TABLE_H
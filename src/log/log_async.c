@@ -0,0 +1,682 @@
+/*
+ * vim:noexpandtab:shiftwidth=8:tabstop=8:
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ * -------------
+ */
+
+/**
+ * @file  log_async.c
+ * @brief Asynchronous log file facility
+ *
+ * Each thread that logs to an asynchronous facility copies its formatted
+ * messages into a ring of its own, with no lock taken.  A writer thread per
+ * facility drains all the rings with writev() to a file descriptor it keeps
+ * open, and reopens the file when asked to, e.g. on SIGHUP after logrotate
+ * moved it away.
+ *
+ * A ring is only written by its thread and only read by the writer.  The
+ * thread advances lr_tail once a record is copied, the writer advances
+ * lr_head once the record is on disk.  A record is a 32 bit length, padded
+ * to 8 bytes, followed by the message and its newline; a record never wraps
+ * around the end of the ring, a LR_WRAP length sends the reader back to the
+ * start instead.
+ *
+ * When a ring is full the message is either dropped and counted, or the
+ * thread waits for the writer, as the facility was configured.
+ */
+
+#include "config.h"
+
+#include <pthread.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "log.h"
+#include "gsh_list.h"
+#include "gsh_intrinsic.h"
+#include "common_utils.h"
+#include "abstract_mem.h"
+#include "abstract_atomic.h"
+
+/** Record header size, records are aligned on it */
+#define LR_HDR 8
+#define LR_WRAP UINT32_MAX
+#define LR_RECLEN(len) (((len) + LR_HDR + LR_HDR - 1) & ~(uint64_t)(LR_HDR - 1))
+
+/** Most records gathered by a single writev */
+#define ASYNC_LOG_IOV 256
+
+/** How long the writer sleeps when no ring fills up */
+#define ASYNC_LOG_WAIT_NS (50 * NS_PER_MSEC)
+
+/** Seconds between two reports of dropped messages */
+#define ASYNC_LOG_REPORT_SEC 10
+
+struct async_log;
+
+/**
+ * @brief Per thread ring of formatted messages
+ */
+
+struct log_ring {
+	struct glist_head lr_list;	/*< On al_rings */
+	struct async_log *lr_log;	/*< Facility the ring belongs to */
+	char *lr_data;			/*< Records */
+	uint64_t lr_mask;		/*< Ring size - 1 */
+	uint64_t lr_scan;		/*< End of the records being written */
+	bool lr_orphan;			/*< Its thread exited */
+	GSH_CACHE_PAD(0);
+	uint64_t lr_head;		/*< Advanced by the writer */
+	GSH_CACHE_PAD(1);
+	uint64_t lr_tail;		/*< Advanced by the owning thread */
+	GSH_CACHE_PAD(2);
+};
+
+/**
+ * @brief An asynchronous log file
+ */
+
+struct async_log {
+	struct glist_head al_list;	/*< On async_logs */
+	pthread_mutex_t al_mutex;	/*< Protects the fields below, but for
+					    al_dropped */
+	pthread_cond_t al_cond;		/*< Wakes the writer */
+	pthread_cond_t al_space;	/*< Wakes threads waiting for room */
+	struct glist_head al_rings;	/*< Rings of the logging threads */
+	pthread_key_t al_key;		/*< Ring of the calling thread */
+	pthread_t al_writer;
+	char *al_path;
+	int al_fd;
+	uint32_t al_ring_size;
+	uint32_t al_waiters;		/*< Threads waiting on al_space */
+	bool al_block;			/*< Wait for room rather than drop */
+	bool al_reopen;
+	bool al_stop;
+	uint64_t al_dropped;		/*< Messages dropped, atomic */
+	uint64_t al_reported;		/*< al_dropped when last reported */
+	time_t al_report_time;
+};
+
+static struct glist_head async_logs = GLIST_HEAD_INIT(async_logs);
+static pthread_mutex_t async_logs_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** The facility whose writer is the calling thread */
+static __thread struct async_log *async_writer;
+
+static int async_log_mask = S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
+
+/**
+ * @brief Copy a message into a ring
+ *
+ * @return false if there is no room for it.
+ */
+
+static bool ring_put(struct log_ring *ring, const char *msg, uint32_t len,
+		     uint64_t *used)
+{
+	uint64_t size = ring->lr_mask + 1;
+	uint64_t tail = ring->lr_tail;
+	uint64_t head = atomic_fetch_uint64_t(&ring->lr_head);
+	uint64_t off = tail & ring->lr_mask;
+	uint64_t need = LR_RECLEN(len + 1);
+	uint64_t skip = 0;
+	char *rec;
+
+	if (off + need > size)
+		skip = size - off;
+	if (tail + skip + need - head > size)
+		return false;
+
+	if (skip != 0) {
+		*(uint32_t *)(ring->lr_data + off) = LR_WRAP;
+		off = 0;
+	}
+	rec = ring->lr_data + off;
+	memcpy(rec + LR_HDR, msg, len);
+	rec[LR_HDR + len] = '\n';
+	*(uint32_t *)rec = len + 1;
+
+	*used = tail + skip + need - head;
+	atomic_store_uint64_t(&ring->lr_tail, tail + skip + need);
+	return true;
+}
+
+/**
+ * @brief Forget a ring when its thread exits
+ *
+ * The writer frees it once it is drained.
+ */
+
+static void async_log_ring_exit(void *arg)
+{
+	struct log_ring *ring = arg;
+	struct async_log *al = ring->lr_log;
+
+	PTHREAD_MUTEX_lock(&al->al_mutex);
+	ring->lr_orphan = true;
+	PTHREAD_MUTEX_unlock(&al->al_mutex);
+}
+
+static struct log_ring *async_log_ring(struct async_log *al)
+{
+	struct log_ring *ring;
+
+	ring = gsh_calloc(1, sizeof(*ring));
+	ring->lr_data = gsh_malloc(al->al_ring_size);
+	ring->lr_mask = al->al_ring_size - 1;
+	ring->lr_log = al;
+
+	PTHREAD_MUTEX_lock(&al->al_mutex);
+	glist_add_tail(&al->al_rings, &ring->lr_list);
+	PTHREAD_MUTEX_unlock(&al->al_mutex);
+
+	(void)pthread_setspecific(al->al_key, ring);
+	return ring;
+}
+
+static void async_log_ring_free(struct log_ring *ring)
+{
+	glist_del(&ring->lr_list);
+	gsh_free(ring->lr_data);
+	gsh_free(ring);
+}
+
+/**
+ * @brief Write out a batch of records
+ *
+ * Short writes are resumed, errors are reported on stderr like the log
+ * file facility does, and the batch is then given up.
+ */
+
+static void async_log_write(struct async_log *al, struct iovec *iov, int cnt)
+{
+	ssize_t rc;
+
+	while (cnt > 0) {
+		if (al->al_fd < 0) {
+			(void)atomic_add_uint64_t(&al->al_dropped, cnt);
+			return;
+		}
+		rc = writev(al->al_fd, iov, cnt);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr,
+				"Error: couldn't complete write to the log file %s status=%d (%s), %d messages lost\n",
+				al->al_path, errno, strerror(errno), cnt);
+			(void)atomic_add_uint64_t(&al->al_dropped, cnt);
+			return;
+		}
+		while (cnt > 0 && (size_t)rc >= iov->iov_len) {
+			rc -= iov->iov_len;
+			iov++;
+			cnt--;
+		}
+		if (cnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + rc;
+			iov->iov_len -= rc;
+		}
+	}
+}
+
+/**
+ * @brief Write a batch and give its room back to the rings
+ */
+
+static void async_log_commit(struct async_log *al, struct iovec *iov, int cnt)
+{
+	struct glist_head *glist;
+	struct log_ring *ring;
+
+	async_log_write(al, iov, cnt);
+
+	glist_for_each(glist, &al->al_rings) {
+		ring = glist_entry(glist, struct log_ring, lr_list);
+		if (ring->lr_head != ring->lr_scan)
+			atomic_store_uint64_t(&ring->lr_head, ring->lr_scan);
+	}
+}
+
+/**
+ * @brief Write out everything the rings hold
+ *
+ * Called by the writer with al_mutex held.
+ *
+ * @return true if anything was written.
+ */
+
+static bool async_log_drain(struct async_log *al)
+{
+	struct iovec iov[ASYNC_LOG_IOV];
+	struct glist_head *glist;
+	struct log_ring *ring;
+	uint64_t tail;
+	uint32_t len;
+	char *rec;
+	int cnt = 0;
+	bool wrote = false;
+
+	glist_for_each(glist, &al->al_rings) {
+		ring = glist_entry(glist, struct log_ring, lr_list);
+		tail = atomic_fetch_uint64_t(&ring->lr_tail);
+
+		while (ring->lr_scan != tail) {
+			rec = ring->lr_data + (ring->lr_scan & ring->lr_mask);
+			len = *(uint32_t *)rec;
+			if (len == LR_WRAP) {
+				ring->lr_scan += ring->lr_mask + 1 -
+					(ring->lr_scan & ring->lr_mask);
+				continue;
+			}
+			if (cnt == ASYNC_LOG_IOV) {
+				async_log_commit(al, iov, cnt);
+				cnt = 0;
+			}
+			iov[cnt].iov_base = rec + LR_HDR;
+			iov[cnt].iov_len = len;
+			cnt++;
+			ring->lr_scan += LR_RECLEN(len);
+			wrote = true;
+		}
+	}
+
+	if (wrote)
+		async_log_commit(al, iov, cnt);
+
+	return wrote;
+}
+
+static bool async_log_empty(struct async_log *al)
+{
+	struct glist_head *glist;
+	struct log_ring *ring;
+
+	glist_for_each(glist, &al->al_rings) {
+		ring = glist_entry(glist, struct log_ring, lr_list);
+		if (ring->lr_head != atomic_fetch_uint64_t(&ring->lr_tail))
+			return false;
+	}
+	return true;
+}
+
+/**
+ * @brief (Re)open the log file
+ *
+ * On failure the previous descriptor, if any, is kept.
+ */
+
+static int async_log_open(struct async_log *al)
+{
+	int fd;
+
+	fd = open(al->al_path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC,
+		  async_log_mask);
+	if (fd < 0)
+		return -errno;
+
+	if (al->al_fd >= 0)
+		(void)close(al->al_fd);
+	al->al_fd = fd;
+	return 0;
+}
+
+static void *async_log_writer(void *arg)
+{
+	struct async_log *al = arg;
+	struct glist_head *glist, *glistn;
+	struct log_ring *ring;
+	struct timespec then;
+	uint64_t dropped, lost;
+	time_t now;
+	bool wrote;
+	int rc;
+
+	SetNameFunction("log_writer");
+	async_writer = al;
+
+	PTHREAD_MUTEX_lock(&al->al_mutex);
+
+	while (true) {
+		if (al->al_reopen) {
+			al->al_reopen = false;
+			rc = async_log_open(al);
+			if (rc != 0)
+				fprintf(stderr,
+					"Error: couldn't reopen the log file %s status=%d (%s)\n",
+					al->al_path, -rc, strerror(-rc));
+		}
+
+		wrote = async_log_drain(al);
+
+		if (al->al_waiters != 0)
+			pthread_cond_broadcast(&al->al_space);
+
+		if (wrote)
+			continue;
+
+		glist_for_each_safe(glist, glistn, &al->al_rings) {
+			ring = glist_entry(glist, struct log_ring, lr_list);
+			if (ring->lr_orphan &&
+			    ring->lr_head == atomic_fetch_uint64_t(
+							&ring->lr_tail))
+				async_log_ring_free(ring);
+		}
+
+		dropped = atomic_fetch_uint64_t(&al->al_dropped);
+		now = time(NULL);
+		if (dropped != al->al_reported &&
+		    (al->al_stop ||
+		     now - al->al_report_time >= ASYNC_LOG_REPORT_SEC)) {
+			lost = dropped - al->al_reported;
+			al->al_reported = dropped;
+			al->al_report_time = now;
+			PTHREAD_MUTEX_unlock(&al->al_mutex);
+			LogWarn(COMPONENT_LOG,
+				"Dropped %" PRIu64
+				" messages for log file %s, %" PRIu64
+				" since startup",
+				lost, al->al_path, dropped);
+			PTHREAD_MUTEX_lock(&al->al_mutex);
+			continue;
+		}
+
+		if (al->al_stop)
+			break;
+
+		clock_gettime(CLOCK_REALTIME, &then);
+		timespec_add_nsecs(ASYNC_LOG_WAIT_NS, &then);
+		(void)pthread_cond_timedwait(&al->al_cond, &al->al_mutex,
+					     &then);
+	}
+
+	PTHREAD_MUTEX_unlock(&al->al_mutex);
+	return NULL;
+}
+
+/**
+ * @brief Wait for the writer to make room in a ring
+ */
+
+static void async_log_wait(struct async_log *al)
+{
+	PTHREAD_MUTEX_lock(&al->al_mutex);
+	al->al_waiters++;
+	pthread_cond_signal(&al->al_cond);
+	pthread_cond_wait(&al->al_space, &al->al_mutex);
+	al->al_waiters--;
+	PTHREAD_MUTEX_unlock(&al->al_mutex);
+}
+
+/**
+ * @brief Wait for the writer to write out all the rings
+ */
+
+static void async_log_flush(struct async_log *al)
+{
+	struct timespec then;
+
+	PTHREAD_MUTEX_lock(&al->al_mutex);
+	al->al_waiters++;
+	while (!al->al_stop && !async_log_empty(al)) {
+		pthread_cond_signal(&al->al_cond);
+		clock_gettime(CLOCK_REALTIME, &then);
+		timespec_add_nsecs(ASYNC_LOG_WAIT_NS, &then);
+		(void)pthread_cond_timedwait(&al->al_space, &al->al_mutex,
+					     &then);
+	}
+	al->al_waiters--;
+	PTHREAD_MUTEX_unlock(&al->al_mutex);
+}
+
+/**
+ * @brief Flush all the asynchronous log files at exit
+ */
+
+static void async_log_cleanup(void)
+{
+	struct glist_head *glist;
+	struct async_log *al;
+
+	PTHREAD_MUTEX_lock(&async_logs_mutex);
+	glist_for_each(glist, &async_logs) {
+		al = glist_entry(glist, struct async_log, al_list);
+		if (al != async_writer)
+			async_log_flush(al);
+	}
+	PTHREAD_MUTEX_unlock(&async_logs_mutex);
+}
+
+static struct cleanup_list_element async_log_cleanup_element = {
+	.clean = async_log_cleanup,
+};
+
+/**
+ * @brief Log facility function of the asynchronous log files
+ *
+ * Headers are always written, as for the log file facility.
+ */
+
+int log_to_async(log_header_t headers, void *private,
+		 log_levels_t level,
+		 struct display_buffer *buffer, char *compstr,
+		 char *message)
+{
+	struct async_log *al = private;
+	struct log_ring *ring;
+	uint32_t len = display_buffer_len(buffer);
+	uint64_t used;
+
+	if (al == async_writer) {
+		/* The writer cannot wait on itself, it writes its own
+		 * messages out directly.
+		 */
+		struct iovec iov[2] = {
+			{ .iov_base = buffer->b_start, .iov_len = len },
+			{ .iov_base = "\n", .iov_len = 1 }
+		};
+
+		async_log_write(al, iov, 2);
+		return 0;
+	}
+
+	ring = pthread_getspecific(al->al_key);
+	if (ring == NULL)
+		ring = async_log_ring(al);
+
+	while (!ring_put(ring, buffer->b_start, len, &used)) {
+		if (!al->al_block) {
+			(void)atomic_inc_uint64_t(&al->al_dropped);
+			return -ENOSPC;
+		}
+		async_log_wait(al);
+	}
+
+	/* Let the writer catch up before the ring overflows, rather than
+	 * wait for its next round.
+	 */
+	if (used > al->al_ring_size / 2)
+		pthread_cond_signal(&al->al_cond);
+
+	return 0;
+}
+
+/**
+ * @brief Create an asynchronous log file
+ *
+ * The file is opened and the writer started right away.
+ *
+ * @param[in] path      Path of the log file
+ * @param[in] ring_size Size of each thread's ring, rounded up to a power
+ *                      of two
+ * @param[in] block     Make threads wait for room in their ring rather than
+ *                      drop their messages
+ * @param[out] al       The new log file
+ *
+ * @return 0 on success, -errno on failure.
+ */
+
+int async_log_create(const char *path, uint32_t ring_size, bool block,
+		     struct async_log **al)
+{
+	static bool registered;
+	struct async_log *new;
+	uint32_t size = 1;
+	int rc;
+
+	while (size < ring_size || size < 2 * LR_RECLEN(LOG_BUFF_LEN + 1))
+		size <<= 1;
+
+	new = gsh_calloc(1, sizeof(*new));
+	new->al_path = gsh_strdup(path);
+	new->al_fd = -1;
+	new->al_ring_size = size;
+	new->al_block = block;
+	new->al_report_time = time(NULL);
+	glist_init(&new->al_rings);
+
+	rc = async_log_open(new);
+	if (rc != 0)
+		goto free;
+
+	rc = -pthread_key_create(&new->al_key, async_log_ring_exit);
+	if (rc != 0)
+		goto close;
+
+	PTHREAD_MUTEX_init(&new->al_mutex, NULL);
+	PTHREAD_COND_init(&new->al_cond, NULL);
+	PTHREAD_COND_init(&new->al_space, NULL);
+
+	rc = -pthread_create(&new->al_writer, NULL, async_log_writer, new);
+	if (rc != 0) {
+		PTHREAD_COND_destroy(&new->al_space);
+		PTHREAD_COND_destroy(&new->al_cond);
+		PTHREAD_MUTEX_destroy(&new->al_mutex);
+		(void)pthread_key_delete(new->al_key);
+		goto close;
+	}
+
+	PTHREAD_MUTEX_lock(&async_logs_mutex);
+	glist_add_tail(&async_logs, &new->al_list);
+	if (!registered) {
+		RegisterCleanup(&async_log_cleanup_element);
+		registered = true;
+	}
+	PTHREAD_MUTEX_unlock(&async_logs_mutex);
+
+	*al = new;
+	return 0;
+
+close:
+	(void)close(new->al_fd);
+free:
+	gsh_free(new->al_path);
+	gsh_free(new);
+	return rc;
+}
+
+/**
+ * @brief Point an asynchronous log file at another path
+ *
+ * The writer switches files once it is done with its current batch.
+ */
+
+void async_log_set_path(struct async_log *al, const char *path)
+{
+	PTHREAD_MUTEX_lock(&al->al_mutex);
+	if (strcmp(al->al_path, path) != 0) {
+		gsh_free(al->al_path);
+		al->al_path = gsh_strdup(path);
+		al->al_reopen = true;
+		pthread_cond_signal(&al->al_cond);
+	}
+	PTHREAD_MUTEX_unlock(&al->al_mutex);
+}
+
+/**
+ * @brief Messages an asynchronous log file dropped since it was created
+ */
+
+uint64_t async_log_dropped(struct async_log *al)
+{
+	return atomic_fetch_uint64_t(&al->al_dropped);
+}
+
+/**
+ * @brief Stop the writer and free an asynchronous log file
+ *
+ * The facility must no longer be in use: everything already in the rings
+ * is written out first.
+ */
+
+void async_log_release(struct async_log *al)
+{
+	struct glist_head *glist, *glistn;
+
+	PTHREAD_MUTEX_lock(&async_logs_mutex);
+	glist_del(&al->al_list);
+	PTHREAD_MUTEX_unlock(&async_logs_mutex);
+
+	PTHREAD_MUTEX_lock(&al->al_mutex);
+	al->al_stop = true;
+	pthread_cond_signal(&al->al_cond);
+	PTHREAD_MUTEX_unlock(&al->al_mutex);
+
+	(void)pthread_join(al->al_writer, NULL);
+	(void)pthread_key_delete(al->al_key);
+
+	glist_for_each_safe(glist, glistn, &al->al_rings)
+		async_log_ring_free(glist_entry(glist, struct log_ring,
+						lr_list));
+
+	PTHREAD_COND_destroy(&al->al_space);
+	PTHREAD_COND_destroy(&al->al_cond);
+	PTHREAD_MUTEX_destroy(&al->al_mutex);
+	if (al->al_fd >= 0)
+		(void)close(al->al_fd);
+	gsh_free(al->al_path);
+	gsh_free(al);
+}
+
+/**
+ * @brief Reopen all the asynchronous log files
+ *
+ * Called on SIGHUP, so that logrotate can move the files away.
+ */
+
+void reopen_log_facilities(void)
+{
+	struct glist_head *glist;
+	struct async_log *al;
+
+	PTHREAD_MUTEX_lock(&async_logs_mutex);
+	glist_for_each(glist, &async_logs) {
+		al = glist_entry(glist, struct async_log, al_list);
+		PTHREAD_MUTEX_lock(&al->al_mutex);
+		al->al_reopen = true;
+		pthread_cond_signal(&al->al_cond);
+		PTHREAD_MUTEX_unlock(&al->al_mutex);
+	}
+	PTHREAD_MUTEX_unlock(&async_logs_mutex);
+}
@@ -837,6 +837,8 @@ void release_log_facility(const char *name)
 	if (facility->lf_func == log_to_file &&
 	    facility->lf_private != NULL)
 		gsh_free(facility->lf_private);
+	else if (facility->lf_func == log_to_async)
+		async_log_release(facility->lf_private);
 	gsh_free(facility->lf_name);
 	gsh_free(facility);
 }
@@ -1035,6 +1037,8 @@ int set_log_destination(const char *name, char *dest)
 		logfile = gsh_strdup(dest);
 		gsh_free(facility->lf_private);
 		facility->lf_private = logfile;
+	} else if (facility->lf_func == log_to_async) {
+		async_log_set_path(facility->lf_private, dest);
 	} else if (facility->lf_func == log_to_stream) {
 		FILE *out;
 
@@ -1909,6 +1913,11 @@ enum facility_state {
 	FAC_DEFAULT
 };
 
+enum facility_overflow {
+	FAC_DROP,
+	FAC_BLOCK
+};
+
 struct facility_config {
 	struct glist_head fac_list;
 	char *facility_name;
@@ -1917,6 +1926,9 @@ struct facility_config {
 	lf_function_t *func;
 	log_header_t headers;
 	log_levels_t max_level;
+	bool async;
+	uint32_t ring_size;
+	enum facility_overflow overflow;
 	void *lf_private;
 };
 
@@ -2267,6 +2279,12 @@ static struct config_item_list enable_options[] = {
 	CONFIG_LIST_EOL
 };
 
+static struct config_item_list overflow_options[] = {
+	CONFIG_LIST_TOK("drop", FAC_DROP),
+	CONFIG_LIST_TOK("block", FAC_BLOCK),
+	CONFIG_LIST_EOL
+};
+
 static struct config_item facility_params[] = {
 	CONF_ITEM_STR("name", 1, 20, NULL,
 		      facility_config, facility_name),
@@ -2278,6 +2296,12 @@ static struct config_item facility_params[] = {
 			facility_config, headers),
 	CONF_ITEM_TOKEN("enable", FAC_IDLE, enable_options,
 			facility_config, state),
+	CONF_ITEM_BOOL("async", false,
+		       facility_config, async),
+	CONF_ITEM_UI32("async_ring_size", 65536, 64 * 1024 * 1024, 1048576,
+		       facility_config, ring_size),
+	CONF_ITEM_TOKEN("async_overflow", FAC_DROP, overflow_options,
+			facility_config, overflow),
 	CONFIG_EOL
 };
 
@@ -2361,11 +2385,15 @@ static int facility_commit(void *node, void *link_mem, void *self_struct,
 			if (conf->headers == NB_LH_TYPES)
 				conf->headers = LH_COMPONENT;
 		} else {
-			conf->func = log_to_file;
+			conf->func = conf->async ? log_to_async : log_to_file;
 			conf->lf_private = conf->dest;
 			if (conf->headers == NB_LH_TYPES)
 				conf->headers = LH_ALL;
 		}
+		if (conf->async && conf->func != log_to_async)
+			LogWarn(COMPONENT_CONFIG,
+				"Facility %s logs to %s, async only applies to files",
+				conf->facility_name, conf->dest);
 	} else {
 		LogCrit(COMPONENT_LOG,
 			"No facility destination given for (%s)",
@@ -2425,6 +2453,71 @@ static void *log_conf_init(void *link_mem, void *self_struct)
 	return NULL;
 }
 
+/**
+ * @brief Apply the async setting of a config block to an existing facility
+ *
+ * A facility writing to a file switches between synchronous and
+ * asynchronous writes.  Loggers only call a facility under log_rwlock, so
+ * the writer of an asynchronous facility can be released once swapped out.
+ *
+ * @return 0 on success, -errno on errors
+ */
+
+static int set_log_async(struct facility_config *conf)
+{
+	struct log_facility *facility;
+	struct async_log *al = NULL;
+	lf_function_t *old_func = NULL;
+	void *old_private = NULL;
+	bool needed;
+	int rc;
+
+	PTHREAD_RWLOCK_rdlock(&log_rwlock);
+	facility = find_log_facility(conf->facility_name);
+	needed = facility != NULL &&
+		 (facility->lf_func == log_to_file ||
+		  facility->lf_func == log_to_async) &&
+		 facility->lf_func != conf->func;
+	PTHREAD_RWLOCK_unlock(&log_rwlock);
+	if (!needed)
+		return 0;
+
+	if (conf->func == log_to_async) {
+		rc = async_log_create(conf->dest, conf->ring_size,
+				      conf->overflow == FAC_BLOCK, &al);
+		if (rc != 0)
+			return rc;
+	}
+
+	PTHREAD_RWLOCK_wrlock(&log_rwlock);
+	facility = find_log_facility(conf->facility_name);
+	if (facility != NULL && facility->lf_func != conf->func) {
+		old_func = facility->lf_func;
+		old_private = facility->lf_private;
+		facility->lf_func = conf->func;
+		if (al != NULL)
+			facility->lf_private = al;
+		else
+			facility->lf_private = gsh_strdup(conf->dest);
+		al = NULL;
+	}
+	PTHREAD_RWLOCK_unlock(&log_rwlock);
+
+	if (al != NULL)
+		async_log_release(al);
+	if (old_func == log_to_async)
+		async_log_release(old_private);
+	else if (old_func == log_to_file)
+		gsh_free(old_private);
+	if (old_func != NULL)
+		LogEvent(COMPONENT_CONFIG,
+			 "Facility %s now writes %s",
+			 conf->facility_name,
+			 conf->func == log_to_async ? "asynchronously"
+						    : "synchronously");
+	return 0;
+}
+
 static int log_conf_commit(void *node, void *link_mem, void *self_struct,
 			   struct config_error_type *err_type)
 {
@@ -2445,11 +2538,42 @@ static int log_conf_commit(void *node, void *link_mem, void *self_struct,
 				 conf->facility_name);
 			goto done;
 		}
+		if (conf->func == log_to_async) {
+			/* Only start a writer for a new facility */
+			PTHREAD_RWLOCK_rdlock(&log_rwlock);
+			facility_exists =
+				find_log_facility(conf->facility_name) != NULL;
+			PTHREAD_RWLOCK_unlock(&log_rwlock);
+			if (!facility_exists) {
+				struct async_log *al;
+
+				rc = async_log_create(conf->dest,
+						      conf->ring_size,
+						      conf->overflow ==
+								FAC_BLOCK,
+						      &al);
+				if (rc == 0)
+					conf->lf_private = al;
+				else {
+					LogCrit(COMPONENT_CONFIG,
+						"Cannot open log file (%s) for facility (%s), (%s)",
+						conf->dest,
+						conf->facility_name,
+						strerror(-rc));
+					err_type->resource = true;
+					errcnt++;
+					goto done;
+				}
+			}
+		}
 		rc = create_log_facility(conf->facility_name,
 					 conf->func,
 					 conf->max_level,
 					 conf->headers,
 					 conf->lf_private);
+		if (rc != 0 && conf->func == log_to_async &&
+		    conf->lf_private != conf->dest)
+			async_log_release(conf->lf_private);
 		if (rc != 0 && rc != -EEXIST) {
 			LogCrit(COMPONENT_CONFIG,
 				"Failed to create facility (%s), (%s)",
@@ -2460,6 +2584,21 @@ static int log_conf_commit(void *node, void *link_mem, void *self_struct,
 			goto done;
 		}
 		facility_exists = (rc == -EEXIST);
+		if (facility_exists &&
+		    (conf->func == log_to_file || conf->func == log_to_async)) {
+			rc = set_log_async(conf);
+			if (rc != 0) {
+				LogCrit(COMPONENT_CONFIG,
+					"Could not switch (%s) to %s writes because (%s)",
+					conf->facility_name,
+					conf->async ? "asynchronous"
+						    : "synchronous",
+					strerror(-rc));
+				err_type->resource = true;
+				errcnt++;
+				goto done;
+			}
+		}
 		if (facility_exists && conf->dest != NULL) {
 			rc = set_log_destination(conf->facility_name,
 						 conf->dest);
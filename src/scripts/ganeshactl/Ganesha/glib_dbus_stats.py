@@ -40,11 +40,21 @@ class RetrieveExportStats():
         stats_op = self.exportmgrobj.get_dbus_method("GetGlobalOPS",
                                  self.dbus_exportstats_name)
         return GlobalStats(stats_op())
+    # NFSv3/NFSv4 latency percentiles per op over all exports
+    def latency_stats(self):
+        stats_op = self.exportmgrobj.get_dbus_method("GetOpLatencies",
+                                 self.dbus_exportstats_name)
+        return LatencyStats(stats_op())
     # cache inode stats
     def inode_stats(self):
         stats_op = self.exportmgrobj.get_dbus_method("ShowCacheInode",
                                  self.dbus_exportstats_name)
         return InodeStats(stats_op())
+    # READ buffer pool stats
+    def iobuf_stats(self):
+        stats_op = self.exportmgrobj.get_dbus_method("ShowIOBufferPool",
+                                 self.dbus_exportstats_name)
+        return IOBufferPoolStats(stats_op())
     # list of all exports
     def export_stats(self):
         stats_op = self.exportmgrobj.get_dbus_method("ShowExports",
@@ -249,6 +259,27 @@ class GlobalStats():
                 "\nTotal NFSv4.2 ops: " + str(self.nfsv42_total))
         return output
 
+class LatencyStats():
+    def __init__(self, stats):
+        self.success = stats[0]
+        self.status = stats[1]
+        if self.success:
+            self.timestamp = (stats[2][0], stats[2][1])
+            self.ops = stats[3]
+    def __str__(self):
+        output = ""
+        if not self.success:
+            return "No NFS activity, GANESHA RESPONSE STATUS: " + self.status
+        if self.status != "OK":
+            output += self.status + "\n"
+        output += ("Timestamp: " + time.ctime(self.timestamp[0]) + str(self.timestamp[1]) + " nsecs" +
+                   "\nLatency (usecs):\n" +
+                   "%-6s %-20s %12s %12s %12s %12s" % ("", "op", "total", "p50", "p99", "p99.9"))
+        for (version, op, total, p50, p99, p999) in self.ops:
+            output += "\n%-6s %-20s %12d %12.1f %12.1f %12.1f" % (
+                version, op, total, p50 / 1000.0, p99 / 1000.0, p999 / 1000.0)
+        return output
+
 class InodeStats():
     def __init__(self, stats):
         self.status = stats[1]
@@ -261,6 +292,31 @@ class InodeStats():
         self.cache_conflict = stats[3][7]
         self.cache_add = stats[3][9]
         self.cache_mapping = stats[3][11]
+        # Replacement policy rows, from servers that report them
+        self.policy = {}
+        for i in range(12, len(stats[3]) - 1, 2):
+            self.policy[str(stats[3][i])] = stats[3][i + 1]
+    def ratio(self, hits, misses):
+        if hits + misses == 0:
+            return "-"
+        return "%.2f%%" % (100.0 * hits / (hits + misses))
+    def policy_str(self):
+        if not self.policy:
+            return ""
+        p = self.policy
+        name = ["LRU", "ARC"][p["lru_policy"]] if p["lru_policy"] < 2 else str(p["lru_policy"])
+        output = ("\nLRU Policy: " + name +
+                  "\nLRU Entry Hits: " + str(p["entry_hit"]) +
+                  "\nLRU Entry Misses: " + str(p["entry_miss"]) +
+                  "\nLRU Entry Hit Ratio: " + self.ratio(p["entry_hit"], p["entry_miss"]) +
+                  "\nLRU Chunk Uses: " + str(p["chunk_hit"]) +
+                  "\nLRU Chunk Loads: " + str(p["chunk_miss"]) +
+                  "\nLRU Chunk Hit Ratio: " +
+                  self.ratio(max(p["chunk_hit"] - p["chunk_miss"], 0), p["chunk_miss"]))
+        if name == "ARC":
+            output += ("\nARC Ghost Hits: " + str(p["ghost_hit"]) +
+                       "\nARC L2 Target: " + str(p["arc_target"]))
+        return output
     def __str__(self):
         if self.status != "OK":
             return "No NFS activity, GANESHA RESPONSE STATUS: " + self.status
@@ -270,7 +326,40 @@ class InodeStats():
                  "\nInode Cache Misses: " + str(self.cache_miss) +
                  "\nInode Cache Conflicts:: " + str(self.cache_conflict) +
                  "\nInode Cache Adds: " + str(self.cache_add) +
-                 "\nInode Cache Mapping: " + str(self.cache_mapping) )
+                 "\nInode Cache Mapping: " + str(self.cache_mapping) +
+                 self.policy_str() )
+
+class IOBufferPoolStats():
+    def __init__(self, stats):
+        self.status = stats[1]
+        self.timestamp = (stats[2][0], stats[2][1])
+        self.counters = {}
+        for i in range(0, len(stats[3]) - 1, 2):
+            self.counters[str(stats[3][i])] = stats[3][i + 1]
+    def mib(self, nbytes):
+        return "%.1f MiB" % (nbytes / 1048576.0)
+    def __str__(self):
+        c = self.counters
+        hits = c["thread_hits"] + c["depot_hits"]
+        pooled = c["gets"] - c["unpooled"]
+        if pooled == 0:
+            ratio = "-"
+        else:
+            ratio = "%.2f%%" % (100.0 * hits / pooled)
+        output = ""
+        if self.status != "OK":
+            output = self.status + "\n"
+        return ( output +
+                 "Timestamp: " + time.ctime(self.timestamp[0]) + str(self.timestamp[1]) + " nsecs" +
+                 "\nBuffer Gets: " + str(c["gets"]) +
+                 "\nThread Cache Hits: " + str(c["thread_hits"]) +
+                 "\nDepot Hits: " + str(c["depot_hits"]) +
+                 "\nHit Ratio: " + ratio +
+                 "\nAllocations: " + str(c["allocs"]) +
+                 "\nFrees Over Caps: " + str(c["frees"]) +
+                 "\nUnpooled Gets: " + str(c["unpooled"]) +
+                 "\nIdle Memory: " + self.mib(c["idle_bytes"]) +
+                 "\nIn Use Memory: " + self.mib(c["used_bytes"]) )
 
 class FastStats():
     def __init__(self, stats):
@@ -438,7 +527,56 @@ class DumpFSALStats():
 	    	    	output += " %12.6f" % (self.stats[4][i+3])
 	    	    	output += " %12.6f" % (self.stats[4][i+4])
 	    	    	i += 5
-	    	    return output
+	    elif self.stats[3] == "TXNFS":
+		output += "FSAL Name - TXNFS\n"
+		output += "Crash recovery: " + self.stats[5] + "\n"
+		rows = self.stats[4]
+		phases = []
+		i = 0
+		while (i+5) <= len(rows):
+		    name = rows[i+0]
+		    if name.startswith("RECOVERY_"):
+			output += "\t%s %s" % (name.ljust(20), str(rows[i+1]).rjust(8))
+			if name == "RECOVERY_UNDONE":
+			    output += " (undo ms avg %.6f min %.6f max %.6f)" % (rows[i+2], rows[i+3], rows[i+4])
+			output += "\n"
+		    elif name == "CLEANUP_EXPORT":
+			output += "Export id: %d - backup cleanup queue:\n" % (rows[i+1])
+		    elif name == "CLEANUP_QUEUED":
+			output += "\t%s %s (max %d)\n" % (name.ljust(20), str(rows[i+1]).rjust(8), rows[i+4])
+		    elif name == "CLEANUP_DONE":
+			output += "\t%s %s (lag ms avg %.6f max %.6f)\n" % (name.ljust(20), str(rows[i+1]).rjust(8), rows[i+2], rows[i+4])
+		    elif name.startswith("CLEANUP_"):
+			output += "\t%s %s\n" % (name.ljust(20), str(rows[i+1]).rjust(8))
+		    elif name == "EXPORT":
+			phases.append((rows[i+1], []))
+		    elif name == "BUCKET":
+			phases[-1][1][-1][5].append((rows[i+1], rows[i+3]))
+		    else:
+			phases[-1][1].append((name, rows[i+1], rows[i+2], rows[i+3], rows[i+4], []))
+		    i += 5
+		for export_id, export_phases in phases:
+		    output += "\nExport id: %d - compound phases (latency in milliseconds):\n" % (export_id)
+		    output += "\tPhase          Total          Avg          p50          p90          p99          Max\n"
+		    for (name, count, avg, mn, mx, buckets) in export_phases:
+			output += "\t" + name.ljust(10) + " %s" % (str(count).rjust(9))
+			output += " %12.6f" % (avg)
+			for pct in (0.5, 0.9, 0.99):
+			    output += " %12.6f" % (self.percentile(buckets, count, pct, mx))
+			output += " %12.6f\n" % (mx)
+	    return output
+
+    # Upper bound of the bucket that holds the given percentile; the last
+    # bucket, which has no bound, and any bound above the max give the max
+    def percentile(self, buckets, count, pct, mx):
+	seen = 0
+	for (n, upper) in buckets:
+	    seen += n
+	    if seen >= count * pct:
+		if upper == 0 or upper > mx:
+		    return mx
+		return upper
+	return mx
 
 class StatsEnable():
     def __init__(self, status):
@@ -19,8 +19,8 @@ def usage():
     message += "To display stat counters use \n"
     message += "%s [list_clients | deleg <ip address> | " % (sys.argv[0])
     message += "inode | iov3 [export id] | iov4 [export id] | export |"
-    message += " total [export id] | fast | pnfs [export id] |"
-    message += " fsal <fsal name> ] \n"
+    message += " total [export id] | fast | latency | pnfs [export id] |"
+    message += " fsal <fsal name> | pool ] \n"
     message += "To reset stat counters use \n"
     message += "%s reset \n" % (sys.argv[0])
     message += "To enable/disable stat counters use \n"
@@ -34,7 +34,7 @@ else:
 
 # check arguments
 commands = ('help', 'list_clients', 'deleg', 'global', 'inode', 'iov3', 'iov4',
-	    'export', 'total', 'fast', 'pnfs', 'fsal', 'reset', 'enable',
+	    'export', 'total', 'fast', 'latency', 'pnfs', 'fsal', 'reset', 'enable',
 	    'disable', 'pool')
 if command not in commands:
     print("Option \"%s\" is not correct." % (command))
@@ -79,8 +79,12 @@ elif command == "export":
     print(exp_interface.export_stats())
 elif command == "inode":
     print(exp_interface.inode_stats())
+elif command == "pool":
+    print(exp_interface.iobuf_stats())
 elif command == "fast":
     print(exp_interface.fast_stats())
+elif command == "latency":
+    print(exp_interface.latency_stats())
 elif command == "list_clients":
     print(cl_interface.list_clients())
 elif command == "deleg":
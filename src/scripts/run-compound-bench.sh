@@ -0,0 +1,27 @@
+#!/bin/bash -
+# Run the compound throughput benchmark on TXNFS and on the bare FSALs
+#
+# Usage, from the build directory:
+#
+#       <root-to-nfs-ganesha>/src/scripts/run-compound-bench.sh \
+#               [output.json] [benchmark options...]
+#
+# Every run appends one JSON line per workload to the output file (default
+# compound-bench.json), for instance --threads 16 --ops 32 --fail-ratio 0.2.
+# /vfs0 and /vfs1 must exist.
+
+set -e
+
+DIR="$( cd "$( dirname "${BASH_SOURCE[0]}" )" && pwd )"
+CONFFILE=${DIR}/../config_samples/txn-bench.conf
+BENCH=./gtest/nfs4/test_nfs4_compound_throughput
+
+OUTPUT="${1:-compound-bench.json}"
+shift || true
+
+for export_id in 77 78 79 80; do
+  rm -rf /vfs0/* /vfs1/* /tmp/txndb
+  ${BENCH} --config=${CONFFILE} --export=${export_id} \
+    --logfile=/tmp/compound-bench-${export_id}.log \
+    --gtest_filter='-*SIMPLE*' --output="${OUTPUT}" "$@"
+done
@@ -64,6 +64,7 @@
 #include "nfs_exports.h"
 #include "nfs_proto_functions.h"
 #include "pnfs_utils.h"
+#include "iobuf_pool.h"
 
 struct timespec nfs_stats_time;
 struct timespec fsal_stats_time;
@@ -1910,6 +1911,26 @@ static bool get_nfsv_global_fast_ops(DBusMessageIter *args,
 	return true;
 }
 
+static bool get_nfsv_global_op_latencies(DBusMessageIter *args,
+					 DBusMessage *reply,
+					 DBusError *error)
+{
+	bool success = true;
+	char *errormsg = "OK";
+	DBusMessageIter iter;
+
+	dbus_message_iter_init_append(reply, &iter);
+	if (!nfs_param.core_param.enable_NFSSTATS)
+		errormsg = "NFS stat counting disabled";
+	else if (nfs_param.core_param.enable_FASTSTATS)
+		errormsg = "Latencies are not counted with fast stats";
+	dbus_status_reply(&iter, success, errormsg);
+	if (success)
+		server_dbus_op_latencies(&iter);
+
+	return true;
+}
+
 static bool show_cache_inode_stats(DBusMessageIter *args,
 				   DBusMessage *reply,
 				   DBusError *error)
@@ -1926,6 +1947,24 @@ static bool show_cache_inode_stats(DBusMessageIter *args,
 	return true;
 }
 
+static bool show_iobuf_pool_stats(DBusMessageIter *args,
+				  DBusMessage *reply,
+				  DBusError *error)
+{
+	bool success = true;
+	char *errormsg = "OK";
+	DBusMessageIter iter;
+
+	dbus_message_iter_init_append(reply, &iter);
+	if (nfs_param.core_param.iobuf_pool_size == 0)
+		errormsg = "I/O buffer pool disabled";
+	dbus_status_reply(&iter, success, errormsg);
+
+	iobuf_dbus_show(&iter);
+
+	return true;
+}
+
 static struct gsh_dbus_method export_show_v41_layouts = {
 	.name = "GetNFSv41Layouts",
 	.method = get_nfsv41_export_layouts,
@@ -2332,6 +2371,15 @@ static struct gsh_dbus_method global_show_fast_ops = {
 		 END_ARG_LIST}
 };
 
+static struct gsh_dbus_method global_show_op_latencies = {
+	.name = "GetOpLatencies",
+	.method = get_nfsv_global_op_latencies,
+	.args = {STATUS_REPLY,
+		 TIMESTAMP_REPLY,
+		 OP_LATENCIES_REPLY,
+		 END_ARG_LIST}
+};
+
 static struct gsh_dbus_method cache_inode_show = {
 	.name = "ShowCacheInode",
 	.method = show_cache_inode_stats,
@@ -2341,6 +2389,15 @@ static struct gsh_dbus_method cache_inode_show = {
 		 END_ARG_LIST}
 };
 
+static struct gsh_dbus_method iobuf_pool_show = {
+	.name = "ShowIOBufferPool",
+	.method = show_iobuf_pool_stats,
+	.args = {STATUS_REPLY,
+		 TIMESTAMP_REPLY,
+		 TOTAL_OPS_REPLY,
+		 END_ARG_LIST}
+};
+
 /**
  * @brief Report all IO stats of all exports in one call
  *
@@ -2409,7 +2466,9 @@ static struct gsh_dbus_method *export_stats_methods[] = {
 #endif
 	&global_show_total_ops,
 	&global_show_fast_ops,
+	&global_show_op_latencies,
 	&cache_inode_show,
+	&iobuf_pool_show,
 	&export_show_all_io,
 	&reset_statistics,
 	&fsal_statistics,
@@ -0,0 +1,406 @@
+/*
+ * vim:noexpandtab:shiftwidth=8:tabstop=8:
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ * -------------
+ */
+
+/**
+ * @file iobuf_pool.c
+ * @brief Recycled, page aligned buffers for READ payloads
+ *
+ * Each buffer is preceded by a page whose end holds a struct iobuf_hdr, so
+ * that iobuf_put() finds the size class of any buffer while the payload
+ * stays page aligned.  That page is only touched once per allocation from
+ * the system, which recycling makes rare.
+ *
+ * Thread caches are only used by their thread.  Their counters are read
+ * unlocked by iobuf_get_stats(), which only needs a snapshot.  The depot
+ * has a list and a lock per size class.
+ */
+
+#include "config.h"
+
+#include <pthread.h>
+#include <assert.h>
+#include "log.h"
+#include "abstract_mem.h"
+#include "abstract_atomic.h"
+#include "common_utils.h"
+#include "gsh_list.h"
+#include "nfs_core.h"
+#include "iobuf_pool.h"
+
+#define IOBUF_MAGIC 0x696f6275
+#define IOBUF_UNPOOLED UINT32_MAX
+
+struct iobuf_hdr {
+	struct iobuf_hdr *next;		/*< On a free list */
+	uint32_t magic;
+	uint32_t cls;			/*< Size class, or IOBUF_UNPOOLED */
+	size_t size;			/*< Payload size */
+};
+
+#define IOBUF_HDR(buf) \
+	((struct iobuf_hdr *)((char *)(buf) - sizeof(struct iobuf_hdr)))
+#define IOBUF_BUF(hdr) ((void *)((char *)(hdr) + sizeof(struct iobuf_hdr)))
+
+/**
+ * @brief Per thread cache
+ */
+
+struct iobuf_cache {
+	struct glist_head ic_list;	/*< On iobuf_caches */
+	struct iobuf_hdr *ic_free[IOBUF_CLASSES];
+	uint64_t ic_bytes;		/*< Bytes in ic_free */
+	int64_t ic_used;		/*< Got minus put by this thread */
+	uint64_t ic_gets;
+	uint64_t ic_hits;
+	uint64_t ic_depot_hits;
+	uint64_t ic_allocs;
+	uint64_t ic_frees;
+	uint64_t ic_unpooled;
+};
+
+struct iobuf_depot {
+	pthread_mutex_t id_mutex;
+	struct iobuf_hdr *id_free;
+};
+
+static struct iobuf_depot iobuf_depot[IOBUF_CLASSES];
+static uint64_t iobuf_depot_bytes;	/*< Atomic */
+
+/** Caches of the live threads, and the counters of the exited ones */
+static struct glist_head iobuf_caches = GLIST_HEAD_INIT(iobuf_caches);
+static struct iobuf_cache iobuf_retired;
+static pthread_mutex_t iobuf_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_once_t iobuf_once = PTHREAD_ONCE_INIT;
+static pthread_key_t iobuf_key;
+static __thread struct iobuf_cache *thread_cache;
+
+static inline size_t iobuf_class_size(unsigned int cls)
+{
+	return (size_t) IOBUF_ALIGN << cls;
+}
+
+static inline unsigned int iobuf_class(size_t size)
+{
+	unsigned int cls = 0;
+
+	while (iobuf_class_size(cls) < size)
+		cls++;
+	return cls;
+}
+
+static struct iobuf_hdr *iobuf_alloc(size_t size, uint32_t cls)
+{
+	char *base = gsh_malloc_aligned(IOBUF_ALIGN, IOBUF_ALIGN + size);
+	struct iobuf_hdr *hdr = IOBUF_HDR(base + IOBUF_ALIGN);
+
+	hdr->next = NULL;
+	hdr->magic = IOBUF_MAGIC;
+	hdr->cls = cls;
+	hdr->size = size;
+	return hdr;
+}
+
+static void iobuf_free(struct iobuf_hdr *hdr)
+{
+	gsh_free((char *)IOBUF_BUF(hdr) - IOBUF_ALIGN);
+}
+
+/**
+ * @brief Hand a buffer to the depot
+ *
+ * @return false if the depot is full.
+ */
+
+static bool iobuf_depot_put(struct iobuf_hdr *hdr)
+{
+	struct iobuf_depot *depot = &iobuf_depot[hdr->cls];
+	uint64_t cap = (uint64_t) nfs_param.core_param.iobuf_pool_size << 20;
+
+	if (atomic_add_uint64_t(&iobuf_depot_bytes, hdr->size) > cap) {
+		(void)atomic_sub_uint64_t(&iobuf_depot_bytes, hdr->size);
+		return false;
+	}
+
+	PTHREAD_MUTEX_lock(&depot->id_mutex);
+	hdr->next = depot->id_free;
+	atomic_store_voidptr((void **)&depot->id_free, hdr);
+	PTHREAD_MUTEX_unlock(&depot->id_mutex);
+	return true;
+}
+
+static struct iobuf_hdr *iobuf_depot_get(unsigned int cls)
+{
+	struct iobuf_depot *depot = &iobuf_depot[cls];
+	struct iobuf_hdr *hdr;
+
+	/* Skip the lock when the depot has nothing for us */
+	if (atomic_fetch_voidptr((void **)&depot->id_free) == NULL)
+		return NULL;
+
+	PTHREAD_MUTEX_lock(&depot->id_mutex);
+	hdr = depot->id_free;
+	if (hdr != NULL)
+		atomic_store_voidptr((void **)&depot->id_free, hdr->next);
+	PTHREAD_MUTEX_unlock(&depot->id_mutex);
+
+	if (hdr != NULL)
+		(void)atomic_sub_uint64_t(&iobuf_depot_bytes, hdr->size);
+	return hdr;
+}
+
+/**
+ * @brief Give the cache of an exiting thread back
+ *
+ * Its buffers go to the depot, or to the system, and its counters to
+ * iobuf_retired.
+ */
+
+static void iobuf_cache_exit(void *arg)
+{
+	struct iobuf_cache *ic = arg;
+	struct iobuf_hdr *hdr;
+	unsigned int cls;
+
+	for (cls = 0; cls < IOBUF_CLASSES; cls++) {
+		while ((hdr = ic->ic_free[cls]) != NULL) {
+			ic->ic_free[cls] = hdr->next;
+			if (!iobuf_depot_put(hdr)) {
+				iobuf_free(hdr);
+				ic->ic_frees++;
+			}
+		}
+	}
+
+	PTHREAD_MUTEX_lock(&iobuf_mutex);
+	glist_del(&ic->ic_list);
+	iobuf_retired.ic_used += ic->ic_used;
+	iobuf_retired.ic_gets += ic->ic_gets;
+	iobuf_retired.ic_hits += ic->ic_hits;
+	iobuf_retired.ic_depot_hits += ic->ic_depot_hits;
+	iobuf_retired.ic_allocs += ic->ic_allocs;
+	iobuf_retired.ic_frees += ic->ic_frees;
+	iobuf_retired.ic_unpooled += ic->ic_unpooled;
+	PTHREAD_MUTEX_unlock(&iobuf_mutex);
+
+	gsh_free(ic);
+}
+
+static void iobuf_init(void)
+{
+	unsigned int cls;
+
+	for (cls = 0; cls < IOBUF_CLASSES; cls++)
+		PTHREAD_MUTEX_init(&iobuf_depot[cls].id_mutex, NULL);
+
+	if (pthread_key_create(&iobuf_key, iobuf_cache_exit) != 0)
+		LogFatal(COMPONENT_INIT,
+			 "Could not create the I/O buffer cache key");
+}
+
+static struct iobuf_cache *iobuf_thread_cache(void)
+{
+	struct iobuf_cache *ic = thread_cache;
+
+	if (likely(ic != NULL))
+		return ic;
+
+	(void)pthread_once(&iobuf_once, iobuf_init);
+
+	ic = gsh_calloc(1, sizeof(*ic));
+	PTHREAD_MUTEX_lock(&iobuf_mutex);
+	glist_add_tail(&iobuf_caches, &ic->ic_list);
+	PTHREAD_MUTEX_unlock(&iobuf_mutex);
+	(void)pthread_setspecific(iobuf_key, ic);
+
+	thread_cache = ic;
+	return ic;
+}
+
+/**
+ * @brief Get a page aligned buffer
+ *
+ * @param[in] size  Size of the buffer, which may be larger
+ *
+ * @return the buffer, to be freed with iobuf_put().
+ */
+
+void *iobuf_get(size_t size)
+{
+	struct iobuf_cache *ic = iobuf_thread_cache();
+	struct iobuf_hdr *hdr;
+	unsigned int cls;
+
+	ic->ic_gets++;
+
+	if (size > IOBUF_MAX_SIZE) {
+		hdr = iobuf_alloc(size, IOBUF_UNPOOLED);
+		ic->ic_unpooled++;
+		ic->ic_used += size;
+		return IOBUF_BUF(hdr);
+	}
+
+	cls = iobuf_class(size);
+	hdr = ic->ic_free[cls];
+	if (hdr != NULL) {
+		ic->ic_free[cls] = hdr->next;
+		ic->ic_bytes -= hdr->size;
+		ic->ic_hits++;
+	} else {
+		hdr = iobuf_depot_get(cls);
+		if (hdr != NULL) {
+			ic->ic_depot_hits++;
+		} else {
+			hdr = iobuf_alloc(iobuf_class_size(cls), cls);
+			ic->ic_allocs++;
+		}
+	}
+
+	ic->ic_used += hdr->size;
+	return IOBUF_BUF(hdr);
+}
+
+/**
+ * @brief Free a buffer from iobuf_get()
+ *
+ * It is kept for reuse unless the pool is disabled or full.
+ *
+ * @param[in] buf  The buffer, may be NULL
+ */
+
+void iobuf_put(void *buf)
+{
+	struct iobuf_cache *ic;
+	struct iobuf_hdr *hdr;
+	uint64_t thread_max;
+
+	if (buf == NULL)
+		return;
+
+	hdr = IOBUF_HDR(buf);
+	assert(hdr->magic == IOBUF_MAGIC);
+
+	ic = iobuf_thread_cache();
+	ic->ic_used -= hdr->size;
+
+	if (hdr->cls == IOBUF_UNPOOLED) {
+		iobuf_free(hdr);
+		return;
+	}
+
+	if (nfs_param.core_param.iobuf_pool_size != 0) {
+		thread_max = (uint64_t)
+			nfs_param.core_param.iobuf_thread_cache << 10;
+		if (ic->ic_bytes + hdr->size <= thread_max) {
+			hdr->next = ic->ic_free[hdr->cls];
+			ic->ic_free[hdr->cls] = hdr;
+			ic->ic_bytes += hdr->size;
+			return;
+		}
+		if (iobuf_depot_put(hdr))
+			return;
+	}
+
+	iobuf_free(hdr);
+	ic->ic_frees++;
+}
+
+/**
+ * @brief Sum the counters of all the threads
+ */
+
+void iobuf_get_stats(struct iobuf_stats *st)
+{
+	struct glist_head *glist;
+	struct iobuf_cache *ic;
+	int64_t used;
+
+	memset(st, 0, sizeof(*st));
+
+	PTHREAD_MUTEX_lock(&iobuf_mutex);
+	st->gets = iobuf_retired.ic_gets;
+	st->thread_hits = iobuf_retired.ic_hits;
+	st->depot_hits = iobuf_retired.ic_depot_hits;
+	st->allocs = iobuf_retired.ic_allocs;
+	st->frees = iobuf_retired.ic_frees;
+	st->unpooled = iobuf_retired.ic_unpooled;
+	used = iobuf_retired.ic_used;
+
+	glist_for_each(glist, &iobuf_caches) {
+		ic = glist_entry(glist, struct iobuf_cache, ic_list);
+		st->gets += ic->ic_gets;
+		st->thread_hits += ic->ic_hits;
+		st->depot_hits += ic->ic_depot_hits;
+		st->allocs += ic->ic_allocs;
+		st->frees += ic->ic_frees;
+		st->unpooled += ic->ic_unpooled;
+		st->idle_bytes += ic->ic_bytes;
+		used += ic->ic_used;
+	}
+	PTHREAD_MUTEX_unlock(&iobuf_mutex);
+
+	st->idle_bytes += atomic_fetch_uint64_t(&iobuf_depot_bytes);
+	st->used_bytes = used > 0 ? used : 0;
+}
+
+#ifdef USE_DBUS
+/**
+ * @brief Append the buffer pool counters as (name, value) pairs
+ *
+ * A get is a hit when served by a thread cache or by the depot.
+ */
+
+void iobuf_dbus_show(DBusMessageIter *iter)
+{
+	struct iobuf_stats st;
+	struct timespec timestamp;
+	DBusMessageIter struct_iter;
+	struct {
+		char *type;
+		uint64_t *value;
+	} rows[] = {
+		{ "gets", &st.gets },
+		{ "thread_hits", &st.thread_hits },
+		{ "depot_hits", &st.depot_hits },
+		{ "allocs", &st.allocs },
+		{ "frees", &st.frees },
+		{ "unpooled", &st.unpooled },
+		{ "idle_bytes", &st.idle_bytes },
+		{ "used_bytes", &st.used_bytes },
+	};
+	size_t i;
+
+	iobuf_get_stats(&st);
+
+	now(&timestamp);
+	dbus_append_timestamp(iter, &timestamp);
+
+	dbus_message_iter_open_container(iter, DBUS_TYPE_STRUCT, NULL,
+					 &struct_iter);
+	for (i = 0; i < sizeof(rows) / sizeof(rows[0]); i++) {
+		dbus_message_iter_append_basic(&struct_iter, DBUS_TYPE_STRING,
+					       &rows[i].type);
+		dbus_message_iter_append_basic(&struct_iter, DBUS_TYPE_UINT64,
+					       rows[i].value);
+	}
+	dbus_message_iter_close_container(iter, &struct_iter);
+}
+#endif /* USE_DBUS */
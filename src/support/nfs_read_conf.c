@@ -187,6 +187,10 @@ static struct config_item core_params[] = {
 		       nfs_core_param, mount_path_pseudo),
 	CONF_ITEM_STR("Dbus_Name_Prefix", 1, 255, NULL,
 		       nfs_core_param, dbus_name_prefix),
+	CONF_ITEM_UI32("IO_Buffer_Pool_Size", 0, 64*1024, 256,
+		       nfs_core_param, iobuf_pool_size),
+	CONF_ITEM_UI32("IO_Buffer_Thread_Cache", 0, 64*1024, 1024,
+		       nfs_core_param, iobuf_thread_cache),
 	CONFIG_EOL
 };
 
@@ -277,6 +281,8 @@ static struct config_item version4_params[] = {
 		       minor_versions, nfs_version4_parameter, minor_versions),
 	CONF_ITEM_UI32("slot_table_size", 1, 1024, NFS41_NB_SLOTS_DEF,
 		       nfs_version4_parameter, nb_slots),
+	CONF_ITEM_UI32("Compound_Workers", 0, 256, COMPOUND_WORKERS_DEFAULT,
+		       nfs_version4_parameter, compound_workers),
 	CONFIG_EOL
 };
 
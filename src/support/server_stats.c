@@ -60,6 +60,8 @@
 #include "server_stats.h"
 #include <abstract_atomic.h>
 #include "nfs_proto_functions.h"
+#include "gsh_intrinsic.h"
+#include "latency_histogram.h"
 
 #define NFS_V3_NB_COMMAND (NFSPROC3_COMMIT + 1)
 #define NFS_V4_NB_COMMAND 2
@@ -433,7 +435,26 @@ struct deleg_stats {
 	uint32_t num_revokes;	    /* Num revokes for the client */
 };
 
-static struct global_stats global_st;
+/* Global stats are split in shards, each thread counting in its own so
+ * that workers do not all write the same cache lines on every op.  They are
+ * folded together when read.  Per-client and per-export stats are already
+ * spread over clients and exports, and are not sharded.
+ */
+
+#define STATS_SHARDS 32
+
+struct global_shard {
+	struct global_stats st;
+	/* Latency histograms, allocated on first use of each op */
+	struct lat_histo *v3_histo[NFS_V3_NB_COMMAND];
+	struct lat_histo *v4_histo[NFS4_OP_LAST_ONE];
+	GSH_CACHE_PAD(0);
+};
+
+static struct global_shard global_shards[STATS_SHARDS];
+static uint32_t global_shard_next;
+static __thread struct global_shard *thread_shard;
+static pthread_mutex_t global_histo_mtx = PTHREAD_MUTEX_INITIALIZER;
 
 /* include the top level server_stats struct definition
  */
@@ -558,6 +579,44 @@ static struct _9p_stats *get_9p(struct gsh_stats *stats, pthread_rwlock_t *lock)
 /* Functions for recording statistics
  */
 
+/**
+ * @brief Get the global stats shard of this thread
+ *
+ * Threads are given shards round-robin on their first op.
+ */
+
+static inline struct global_shard *get_global_shard(void)
+{
+	if (unlikely(thread_shard == NULL))
+		thread_shard = &global_shards[
+			atomic_postinc_uint32_t(&global_shard_next) %
+			STATS_SHARDS];
+	return thread_shard;
+}
+
+/**
+ * @brief Count a latency in a histogram
+ *
+ * @param histo   [IN] the histogram, allocated here on first use
+ * @param latency [IN] time consumed by the op
+ */
+
+static void record_histo(struct lat_histo **histo, nsecs_elapsed_t latency)
+{
+	struct lat_histo *h = atomic_fetch_voidptr((void **)histo);
+
+	if (unlikely(h == NULL)) {
+		PTHREAD_MUTEX_lock(&global_histo_mtx);
+		h = *histo;
+		if (h == NULL) {
+			h = gsh_calloc(1, sizeof(struct lat_histo));
+			atomic_store_voidptr((void **)histo, h);
+		}
+		PTHREAD_MUTEX_unlock(&global_histo_mtx);
+	}
+	(void)atomic_inc_uint64_t(&h->count[lat_histo_bucket(latency)]);
+}
+
 /**
  * @brief Record latency stats
  *
@@ -1031,6 +1090,8 @@ static void record_stats(struct gsh_stats *gsh_st, pthread_rwlock_t *lock,
 	struct svc_req *req = &reqdata->r_u.req.svc;
 	uint32_t proto_op = req->rq_msg.cb_proc;
 	uint32_t program_op = req->rq_msg.cb_prog;
+	struct global_stats *global_st = global ? &get_global_shard()->st
+						: NULL;
 
 	if (program_op == NFS_program[P_NFS]) {
 		if (proto_op == 0)
@@ -1040,7 +1101,7 @@ static void record_stats(struct gsh_stats *gsh_st, pthread_rwlock_t *lock,
 
 			/* record stuff */
 			if (global)
-				record_op(&global_st.nfsv3.cmds, request_time,
+				record_op(&global_st->nfsv3.cmds, request_time,
 					  qwait_time, success, dup);
 			switch (nfsv3_optype[proto_op]) {
 			case READ_OP:
@@ -1063,10 +1124,10 @@ static void record_stats(struct gsh_stats *gsh_st, pthread_rwlock_t *lock,
 		struct mnt_stats *sp = get_mnt(gsh_st, lock);
 
 		if (global && req->rq_msg.cb_vers == MOUNT_V1)
-			record_op(&global_st.mnt.v1_ops, request_time,
+			record_op(&global_st->mnt.v1_ops, request_time,
 				  qwait_time, success, dup);
 		else if (global)
-			record_op(&global_st.mnt.v3_ops, request_time,
+			record_op(&global_st->mnt.v3_ops, request_time,
 				  qwait_time, success, dup);
 
 		/* record stuff */
@@ -1080,7 +1141,7 @@ static void record_stats(struct gsh_stats *gsh_st, pthread_rwlock_t *lock,
 		struct nlmv4_stats *sp = get_nlm4(gsh_st, lock);
 
 		if (global)
-			record_op(&global_st.nlm4.ops, request_time,
+			record_op(&global_st->nlm4.ops, request_time,
 				  qwait_time, success, dup);
 		/* record stuff */
 		record_op(&sp->ops, request_time, qwait_time, success, dup);
@@ -1088,7 +1149,7 @@ static void record_stats(struct gsh_stats *gsh_st, pthread_rwlock_t *lock,
 		struct rquota_stats *sp = get_rquota(gsh_st, lock);
 
 		if (global)
-			record_op(&global_st.rquota.ops, request_time,
+			record_op(&global_st->rquota.ops, request_time,
 				  qwait_time, success, dup);
 		/* record stuff */
 		if (req->rq_msg.cb_vers == RQUOTAVERS)
@@ -1195,23 +1256,30 @@ void server_stats_nfs_done(request_data_t *reqdata, int rc, bool dup)
 	struct svc_req *req = &reqdata->r_u.req.svc;
 	uint32_t proto_op = req->rq_msg.cb_proc;
 	uint32_t program_op = req->rq_msg.cb_prog;
+	struct global_shard *shard;
+	bool is_v3;
 
 	if (!nfs_param.core_param.enable_NFSSTATS)
 		return;
-	if (program_op == NFS_PROGRAM && op_ctx->nfs_vers == NFS_V3)
-		global_st.v3.op[proto_op]++;
+	shard = get_global_shard();
+	is_v3 = program_op == NFS_PROGRAM && op_ctx->nfs_vers == NFS_V3;
+	if (is_v3)
+		(void)atomic_inc_uint64_t(&shard->st.v3.op[proto_op]);
 	else if (program_op == NFS_program[P_NLM])
-		global_st.lm.op[proto_op]++;
+		(void)atomic_inc_uint64_t(&shard->st.lm.op[proto_op]);
 	else if (program_op == NFS_program[P_MNT])
-		global_st.mn.op[proto_op]++;
+		(void)atomic_inc_uint64_t(&shard->st.mn.op[proto_op]);
 	else if (program_op == NFS_program[P_RQUOTA])
-		global_st.qt.op[proto_op]++;
+		(void)atomic_inc_uint64_t(&shard->st.qt.op[proto_op]);
 
 	if (nfs_param.core_param.enable_FASTSTATS)
 		return;
 
 	now(&current_time);
 	stop_time = timespec_diff(&nfs_ServerBootTime, &current_time);
+	if (is_v3 && !dup)
+		record_histo(&shard->v3_histo[proto_op],
+			     stop_time - op_ctx->start_time);
 	if (client != NULL) {
 		struct server_stats *server_st;
 
@@ -1248,17 +1316,22 @@ void server_stats_nfsv4_op_done(int proto_op,
 	struct gsh_client *client = op_ctx->client;
 	struct timespec current_time;
 	nsecs_elapsed_t stop_time;
+	struct global_shard *shard;
 
 	if (!nfs_param.core_param.enable_NFSSTATS)
 		return;
+	shard = get_global_shard();
 	if (op_ctx->nfs_vers == NFS_V4)
-		global_st.v4.op[proto_op]++;
+		(void)atomic_inc_uint64_t(&shard->st.v4.op[proto_op]);
 
 	if (nfs_param.core_param.enable_FASTSTATS)
 		return;
 
 	now(&current_time);
 	stop_time = timespec_diff(&nfs_ServerBootTime, &current_time);
+	if (op_ctx->nfs_vers == NFS_V4)
+		record_histo(&shard->v4_histo[proto_op],
+			     stop_time - start_time);
 
 	if (client != NULL) {
 		struct server_stats *server_st;
@@ -1271,13 +1344,13 @@ void server_stats_nfsv4_op_done(int proto_op,
 	}
 
 	if (op_ctx->nfs_minorvers == 0)
-		record_op(&global_st.nfsv40.compounds, stop_time - start_time,
+		record_op(&shard->st.nfsv40.compounds, stop_time - start_time,
 			  op_ctx->queue_wait, status == NFS4_OK, false);
 	else if (op_ctx->nfs_minorvers == 1)
-		record_op(&global_st.nfsv41.compounds, stop_time - start_time,
+		record_op(&shard->st.nfsv41.compounds, stop_time - start_time,
 			  op_ctx->queue_wait, status == NFS4_OK, false);
 	else if (op_ctx->nfs_minorvers == 2)
-		record_op(&global_st.nfsv42.compounds, stop_time - start_time,
+		record_op(&shard->st.nfsv42.compounds, stop_time - start_time,
 			  op_ctx->queue_wait, status == NFS4_OK, false);
 
 	if (op_ctx->ctx_export != NULL) {
@@ -1627,10 +1700,178 @@ void server_dbus_total(struct export_stats *export_st, DBusMessageIter *iter)
 	dbus_message_iter_close_container(iter, &struct_iter);
 }
 
+/**
+ * @brief Fold the latency of a shard into a sum
+ */
+
+static void fold_latency(struct op_latency *sum, struct op_latency *lat)
+{
+	uint64_t min = atomic_fetch_uint64_t(&lat->min);
+	uint64_t max = atomic_fetch_uint64_t(&lat->max);
+
+	sum->latency += atomic_fetch_uint64_t(&lat->latency);
+	if (min != 0 && (sum->min == 0 || min < sum->min))
+		sum->min = min;
+	if (max > sum->max)
+		sum->max = max;
+}
+
+static void fold_op(struct proto_op *sum, struct proto_op *op)
+{
+	sum->total += atomic_fetch_uint64_t(&op->total);
+	sum->errors += atomic_fetch_uint64_t(&op->errors);
+	sum->dups += atomic_fetch_uint64_t(&op->dups);
+	fold_latency(&sum->latency, &op->latency);
+	fold_latency(&sum->dup_latency, &op->dup_latency);
+	fold_latency(&sum->queue_latency, &op->queue_latency);
+}
+
+static void fold_op_counts(uint64_t *sum, uint64_t *op, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		sum[i] += atomic_fetch_uint64_t(&op[i]);
+}
+
+/**
+ * @brief Fold the shards of the global stats together
+ *
+ * Only what record_stats() and the *_done() functions count globally is
+ * folded: the op counts and the proto_op of each protocol.
+ *
+ * @param sum [OUT] the global stats
+ */
+
+static void fold_global_stats(struct global_stats *sum)
+{
+	int i;
+
+	memset(sum, 0, sizeof(*sum));
+	for (i = 0; i < STATS_SHARDS; i++) {
+		struct global_stats *st = &global_shards[i].st;
+
+		fold_op(&sum->nfsv3.cmds, &st->nfsv3.cmds);
+		fold_op(&sum->mnt.v1_ops, &st->mnt.v1_ops);
+		fold_op(&sum->mnt.v3_ops, &st->mnt.v3_ops);
+		fold_op(&sum->nlm4.ops, &st->nlm4.ops);
+		fold_op(&sum->rquota.ops, &st->rquota.ops);
+		fold_op(&sum->rquota.ext_ops, &st->rquota.ext_ops);
+		fold_op(&sum->nfsv40.compounds, &st->nfsv40.compounds);
+		fold_op(&sum->nfsv41.compounds, &st->nfsv41.compounds);
+		fold_op(&sum->nfsv42.compounds, &st->nfsv42.compounds);
+		fold_op_counts(sum->v3.op, st->v3.op, NFS_V3_NB_COMMAND);
+		fold_op_counts(sum->v4.op, st->v4.op, NFS4_OP_LAST_ONE);
+		fold_op_counts(sum->lm.op, st->lm.op, NLM_V4_NB_OPERATION);
+		fold_op_counts(sum->mn.op, st->mn.op, MNT_V3_NB_COMMAND);
+		fold_op_counts(sum->qt.op, st->qt.op, RQUOTA_NB_COMMAND);
+	}
+}
+
+/**
+ * @brief Fold the shards of the latency histogram of an op
+ *
+ * @param v4     [IN] NFSv4 op, or else NFSv3
+ * @param op     [IN] the op
+ * @param count  [OUT] the histogram
+ *
+ * @return the number of latencies counted
+ */
+
+static uint64_t fold_histo(bool v4, int op, uint64_t *count)
+{
+	uint64_t total = 0;
+	int i, j;
+
+	memset(count, 0, LAT_HISTO_BUCKETS * sizeof(uint64_t));
+	for (i = 0; i < STATS_SHARDS; i++) {
+		struct lat_histo **h = v4 ? &global_shards[i].v4_histo[op]
+					  : &global_shards[i].v3_histo[op];
+		struct lat_histo *histo = atomic_fetch_voidptr((void **)h);
+
+		if (histo == NULL)
+			continue;
+		for (j = 0; j < LAT_HISTO_BUCKETS; j++)
+			count[j] += atomic_fetch_uint64_t(&histo->count[j]);
+	}
+	for (j = 0; j < LAT_HISTO_BUCKETS; j++)
+		total += count[j];
+	return total;
+}
+
+/**
+ * @brief Report the latency percentiles of each op
+ *
+ * array of (
+ *	string protocol ("NFSv3" or "NFSv4")
+ *	string op name
+ *	uint64 ops counted
+ *	uint64 p50, p99 and p999 latency in nsecs
+ * )
+ *
+ * A percentile is the upper bound of the histogram bucket holding it, at
+ * most 1/8th above the exact value.
+ */
+
+static void global_dbus_op_latencies(DBusMessageIter *iter)
+{
+	static const struct {
+		char *version;
+		bool v4;
+		const struct op_name *names;
+		int nops;
+	} protos[] = {
+		{ "NFSv3", false, optabv3, NFS_V3_NB_COMMAND },
+		{ "NFSv4", true, optabv4, NFS4_OP_LAST_ONE },
+	};
+	uint64_t count[LAT_HISTO_BUCKETS];
+	DBusMessageIter array_iter, struct_iter;
+	size_t p;
+	int i;
+
+	dbus_message_iter_open_container(iter, DBUS_TYPE_ARRAY, "(sstttt)",
+					 &array_iter);
+	for (p = 0; p < sizeof(protos) / sizeof(protos[0]); p++) {
+		for (i = 0; i < protos[p].nops; i++) {
+			uint64_t total = fold_histo(protos[p].v4, i, count);
+			uint64_t p50, p99, p999;
+			char *op = protos[p].names[i].name;
+
+			if (total == 0 || op == NULL)
+				continue;
+			p50 = lat_histo_percentile(count, 500);
+			p99 = lat_histo_percentile(count, 990);
+			p999 = lat_histo_percentile(count, 999);
+
+			dbus_message_iter_open_container(&array_iter,
+							 DBUS_TYPE_STRUCT, NULL,
+							 &struct_iter);
+			dbus_message_iter_append_basic(&struct_iter,
+					DBUS_TYPE_STRING, &protos[p].version);
+			dbus_message_iter_append_basic(&struct_iter,
+					DBUS_TYPE_STRING, &op);
+			dbus_message_iter_append_basic(&struct_iter,
+					DBUS_TYPE_UINT64, &total);
+			dbus_message_iter_append_basic(&struct_iter,
+					DBUS_TYPE_UINT64, &p50);
+			dbus_message_iter_append_basic(&struct_iter,
+					DBUS_TYPE_UINT64, &p99);
+			dbus_message_iter_append_basic(&struct_iter,
+					DBUS_TYPE_UINT64, &p999);
+			dbus_message_iter_close_container(&array_iter,
+							  &struct_iter);
+		}
+	}
+	dbus_message_iter_close_container(iter, &array_iter);
+}
+
 void global_dbus_total(DBusMessageIter *iter)
 {
 	DBusMessageIter struct_iter;
 	char *version;
+	struct global_stats global_st;
+
+	fold_global_stats(&global_st);
 
 	dbus_message_iter_open_container(iter, DBUS_TYPE_STRUCT, NULL,
 					 &struct_iter);
@@ -1684,6 +1925,9 @@ void global_dbus_fast(DBusMessageIter *iter)
 	char *version;
 	char *op;
 	int i;
+	struct global_stats global_st;
+
+	fold_global_stats(&global_st);
 
 	dbus_message_iter_open_container(iter, DBUS_TYPE_STRUCT, NULL,
 					 &struct_iter);
@@ -1889,36 +2133,57 @@ void reset_gsh_stats(struct gsh_stats *st)
 #endif
 }
 
-void reset_global_stats(void)
+static void reset_histo(struct lat_histo *histo)
 {
 	int i;
+
+	if (histo == NULL)
+		return;
+	for (i = 0; i < LAT_HISTO_BUCKETS; i++)
+		(void)atomic_store_uint64_t(&histo->count[i], 0);
+}
+
+static void reset_global_shard(struct global_shard *shard)
+{
+	struct global_stats *st = &shard->st;
+	int i;
 	/* Reset all ops counters of nfsv3 */
-	for (i = 0; i < NFSPROC3_COMMIT; i++) {
-		(void)atomic_store_uint64_t(&global_st.v3.op[i], 0);
+	for (i = 0; i < NFS_V3_NB_COMMAND; i++) {
+		(void)atomic_store_uint64_t(&st->v3.op[i], 0);
+		reset_histo(atomic_fetch_voidptr((void **)&shard->v3_histo[i]));
 	}
 	/* Reset all ops counters of nfsv4 */
 	for (i = 0; i < NFS4_OP_LAST_ONE; i++) {
-		(void)atomic_store_uint64_t(&global_st.v4.op[i], 0);
+		(void)atomic_store_uint64_t(&st->v4.op[i], 0);
+		reset_histo(atomic_fetch_voidptr((void **)&shard->v4_histo[i]));
 	}
 	/* Reset all ops counters of lock manager */
 	for (i = 0; i < NLM4_FAILED; i++) {
-		(void)atomic_store_uint64_t(&global_st.lm.op[i], 0);
+		(void)atomic_store_uint64_t(&st->lm.op[i], 0);
 	}
 	/* Reset all ops counters of mountd */
 	for (i = 0; i < MOUNTPROC3_EXPORT; i++) {
-		(void)atomic_store_uint64_t(&global_st.mn.op[i], 0);
+		(void)atomic_store_uint64_t(&st->mn.op[i], 0);
 	}
 	/* Reset all ops counters of rquotad */
 	for (i = 0; i < RQUOTAPROC_SETACTIVEQUOTA; i++) {
-		(void)atomic_store_uint64_t(&global_st.qt.op[i], 0);
+		(void)atomic_store_uint64_t(&st->qt.op[i], 0);
 	}
-	reset_nfsv3_stats(&global_st.nfsv3);
-	reset_nfsv40_stats(&global_st.nfsv40);
-	reset_nfsv41_stats(&global_st.nfsv41);
-	reset_nfsv41_stats(&global_st.nfsv42);  /* Uses v41 stats */
-	reset_mnt_stats(&global_st.mnt);
-	reset_rquota_stats(&global_st.rquota);
-	reset_nlmv4_stats(&global_st.nlm4);
+	reset_nfsv3_stats(&st->nfsv3);
+	reset_nfsv40_stats(&st->nfsv40);
+	reset_nfsv41_stats(&st->nfsv41);
+	reset_nfsv41_stats(&st->nfsv42);  /* Uses v41 stats */
+	reset_mnt_stats(&st->mnt);
+	reset_rquota_stats(&st->rquota);
+	reset_nlmv4_stats(&st->nlm4);
+}
+
+void reset_global_stats(void)
+{
+	int i;
+
+	for (i = 0; i < STATS_SHARDS; i++)
+		reset_global_shard(&global_shards[i]);
 }
 
 void server_dbus_total_ops(struct export_stats *export_st,
@@ -1949,6 +2214,15 @@ void global_dbus_total_ops(DBusMessageIter *iter)
 	global_dbus_total(iter);
 }
 
+void server_dbus_op_latencies(DBusMessageIter *iter)
+{
+	struct timespec timestamp;
+
+	now(&timestamp);
+	dbus_append_timestamp(iter, &timestamp);
+	global_dbus_op_latencies(iter);
+}
+
 void reset_server_stats(void)
 {
 	reset_global_stats();
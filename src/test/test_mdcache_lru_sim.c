@@ -0,0 +1,381 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * ---------------------------------------
+ */
+
+/*
+ * Trace-driven simulator of the MDCACHE replacement policies
+ *
+ * Replays a trace of lookups against a cache of a given size for each
+ * LRU_Policy, moving entries between L1 and L2 as mdcache_lru.c does, and
+ * prints the hit ratio of each.  The ARC bookkeeping is the one of
+ * mdcache_lru_policy.h.  The simulated cache is a single lane, and the LRU
+ * thread, which only demotes entries when file descriptors run short, is
+ * left out.
+ *
+ * A trace has one key per line, in decimal or 0x-prefixed hex; a key
+ * prefixed with "S " is looked up by readdir, which inserts it as
+ * MDC_REASON_SCAN.  Without a trace, a synthetic one is generated:
+ *
+ *   hot   lookups of a hot set, a tenth of the keys, 90% of the time
+ *   scan  lookups of the hot set, interrupted by readdir of new keys
+ *   shift lookups of a hot set that moves to new keys every tenth of the
+ *         trace, among lookups of other keys
+ *   loop  a loop over more keys than the cache holds
+ *
+ * usage: test_mdcache_lru_sim [-c cache size] [-t trace | -w workload]
+ *                             [-n lookups] [-k keys] [-s scan length]
+ */
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "gsh_list.h"
+#include "mdcache_lru_policy.h"
+
+enum sim_policy {
+	SIM_LRU,
+	SIM_ARC,
+	SIM_POLICIES
+};
+
+static const char *policy_names[SIM_POLICIES] = { "LRU", "ARC" };
+
+enum sim_qid {
+	SIM_NONE,
+	SIM_L1,
+	SIM_L2
+};
+
+struct sim_entry {
+	struct glist_head q;	/* LRU is at HEAD, MRU at tail */
+	struct sim_entry *next;	/* in its hash bucket */
+	uint64_t key;
+	enum sim_qid qid;
+};
+
+struct sim_cache {
+	enum sim_policy policy;
+	struct glist_head L1, L2;
+	uint64_t l1_size, l2_size;
+	struct sim_entry *entries;
+	uint64_t used, size;
+	struct sim_entry **buckets;
+	uint64_t bucket_mask;
+	struct lru_ghosts ghosts;
+	uint64_t target;
+	uint64_t hits, misses, ghost_hits;
+};
+
+struct sim_ref {
+	uint64_t key;
+	bool scan;
+};
+
+/* The key hash, as mdcache keys have one */
+static uint64_t hash_key(uint64_t key)
+{
+	key += 0x9e3779b97f4a7c15ULL;
+	key = (key ^ (key >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	key = (key ^ (key >> 27)) * 0x94d049bb133111ebULL;
+	return key ^ (key >> 31);
+}
+
+static void sim_init(struct sim_cache *c, enum sim_policy policy,
+		     uint64_t size)
+{
+	uint64_t nbuckets = lru_ghosts_size(2 * size);
+
+	memset(c, 0, sizeof(*c));
+	c->policy = policy;
+	glist_init(&c->L1);
+	glist_init(&c->L2);
+	c->size = size;
+	c->entries = calloc(size, sizeof(*c->entries));
+	c->buckets = calloc(nbuckets, sizeof(*c->buckets));
+	c->bucket_mask = nbuckets - 1;
+	c->ghosts.slots = calloc(lru_ghosts_size(size), sizeof(uint64_t));
+	c->ghosts.mask = lru_ghosts_size(size) - 1;
+	c->target = size / 2;
+	if (!c->entries || !c->buckets || !c->ghosts.slots) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+}
+
+static void sim_destroy(struct sim_cache *c)
+{
+	free(c->entries);
+	free(c->buckets);
+	free(c->ghosts.slots);
+}
+
+static struct sim_entry **sim_bucket(struct sim_cache *c, uint64_t key)
+{
+	return &c->buckets[hash_key(key) & c->bucket_mask];
+}
+
+static struct sim_entry *sim_find(struct sim_cache *c, uint64_t key)
+{
+	struct sim_entry *e;
+
+	for (e = *sim_bucket(c, key); e != NULL; e = e->next)
+		if (e->key == key)
+			return e;
+	return NULL;
+}
+
+static void sim_unlink(struct sim_cache *c, struct sim_entry *e)
+{
+	struct sim_entry **p = sim_bucket(c, e->key);
+
+	while (*p != e)
+		p = &(*p)->next;
+	*p = e->next;
+}
+
+static void sim_dq(struct sim_cache *c, struct sim_entry *e)
+{
+	glist_del(&e->q);
+	if (e->qid == SIM_L1)
+		c->l1_size--;
+	else
+		c->l2_size--;
+	e->qid = SIM_NONE;
+}
+
+static void sim_q(struct sim_cache *c, struct sim_entry *e, enum sim_qid qid,
+		  bool mru)
+{
+	struct glist_head *q = qid == SIM_L1 ? &c->L1 : &c->L2;
+
+	if (mru)
+		glist_add_tail(q, &e->q);
+	else
+		glist_add(q, &e->q);
+	if (qid == SIM_L1)
+		c->l1_size++;
+	else
+		c->l2_size++;
+	e->qid = qid;
+}
+
+/* lru_try_reap_entry(), with every entry unreferenced */
+static struct sim_entry *sim_reap(struct sim_cache *c)
+{
+	struct glist_head *first = &c->L2, *second = &c->L1;
+	struct sim_entry *e;
+
+	if (c->policy == SIM_ARC &&
+	    !lru_arc_reap_l2_first(c->l2_size, c->target)) {
+		first = &c->L1;
+		second = &c->L2;
+	}
+	e = glist_first_entry(first, struct sim_entry, q);
+	if (e == NULL)
+		e = glist_first_entry(second, struct sim_entry, q);
+	if (c->policy == SIM_ARC)
+		lru_ghost_add(&c->ghosts, hash_key(e->key),
+			      e->qid == SIM_L1 ? LRU_GHOST_L1 : LRU_GHOST_L2);
+	sim_dq(c, e);
+	sim_unlink(c, e);
+	return e;
+}
+
+/* A lookup: _mdcache_lru_ref() on a hit, mdcache_lru_get() and
+ * mdcache_lru_insert() on a miss */
+static void sim_lookup(struct sim_cache *c, uint64_t key, bool scan)
+{
+	struct sim_entry *e = sim_find(c, key);
+	struct sim_entry **bucket;
+
+	if (e != NULL) {
+		c->hits++;
+		if (e->qid == SIM_L1) {
+			sim_dq(c, e);
+			sim_q(c, e, SIM_L1, true);
+		} else {
+			sim_dq(c, e);
+			sim_q(c, e, SIM_L1, c->policy == SIM_ARC);
+		}
+		return;
+	}
+
+	c->misses++;
+	e = c->used < c->size ? &c->entries[c->used++] : sim_reap(c);
+	e->key = key;
+	bucket = sim_bucket(c, key);
+	e->next = *bucket;
+	*bucket = e;
+
+	if (scan) {
+		sim_q(c, e, SIM_L2, true);
+	} else if (c->policy == SIM_LRU) {
+		sim_q(c, e, SIM_L1, false);
+	} else if (lru_arc_miss(&c->ghosts, hash_key(key), &c->target,
+				c->size) != LRU_GHOST_NONE) {
+		c->ghost_hits++;
+		sim_q(c, e, SIM_L1, true);
+	} else {
+		sim_q(c, e, SIM_L2, true);
+	}
+}
+
+static uint64_t rnd_state = 42;
+
+static uint64_t rnd(void)
+{
+	rnd_state ^= rnd_state << 13;
+	rnd_state ^= rnd_state >> 7;
+	rnd_state ^= rnd_state << 17;
+	return rnd_state;
+}
+
+static struct sim_ref *generate(const char *workload, uint64_t n,
+				uint64_t keys, uint64_t scan_len)
+{
+	struct sim_ref *trace = calloc(n, sizeof(*trace));
+	uint64_t hot = keys / 10 ? keys / 10 : 1;
+	uint64_t next_new = keys;
+	uint64_t i, j;
+
+	if (trace == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+
+	for (i = 0; i < n; i++) {
+		if (strcmp(workload, "loop") == 0) {
+			trace[i].key = i % keys;
+		} else if (strcmp(workload, "scan") == 0 &&
+			   i % (4 * scan_len) == 0) {
+			/* readdir of a directory never seen before */
+			for (j = 0; j < scan_len && i < n; j++, i++) {
+				trace[i].key = next_new++;
+				trace[i].scan = true;
+			}
+			i--;
+		} else if (strcmp(workload, "shift") == 0) {
+			trace[i].key = rnd() % 2 ? (i / (n / 10 + 1)) * hot +
+						   rnd() % hot
+						 : 10 * hot + rnd() % keys;
+		} else if (rnd() % 10 != 0) {
+			trace[i].key = rnd() % hot;
+		} else {
+			trace[i].key = hot + rnd() % (keys - hot);
+		}
+	}
+	return trace;
+}
+
+static struct sim_ref *load(const char *path, uint64_t *n)
+{
+	FILE *f = fopen(path, "r");
+	struct sim_ref *trace = NULL;
+	uint64_t len = 0, cap = 0;
+	char line[128];
+	char *p;
+
+	if (f == NULL) {
+		perror(path);
+		exit(1);
+	}
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (len == cap) {
+			cap = cap ? 2 * cap : 4096;
+			trace = realloc(trace, cap * sizeof(*trace));
+			if (trace == NULL) {
+				fprintf(stderr, "out of memory\n");
+				exit(1);
+			}
+		}
+		p = line;
+		trace[len].scan = p[0] == 'S' && p[1] == ' ';
+		if (trace[len].scan)
+			p += 2;
+		if (*p == '\n' || *p == '\0' || *p == '#')
+			continue;
+		trace[len++].key = strtoull(p, NULL, 0);
+	}
+	fclose(f);
+	*n = len;
+	return trace;
+}
+
+int main(int argc, char **argv)
+{
+	uint64_t size = 10000, n = 1000000, keys = 50000, scan_len = 20000;
+	const char *path = NULL, *workload = "scan";
+	struct sim_ref *trace;
+	struct sim_cache c;
+	uint64_t i;
+	int opt, p;
+
+	while ((opt = getopt(argc, argv, "c:t:w:n:k:s:")) != -1) {
+		switch (opt) {
+		case 'c':
+			size = strtoull(optarg, NULL, 0);
+			break;
+		case 't':
+			path = optarg;
+			break;
+		case 'w':
+			workload = optarg;
+			break;
+		case 'n':
+			n = strtoull(optarg, NULL, 0);
+			break;
+		case 'k':
+			keys = strtoull(optarg, NULL, 0);
+			break;
+		case 's':
+			scan_len = strtoull(optarg, NULL, 0);
+			break;
+		default:
+			fprintf(stderr,
+				"usage: %s [-c cache size] [-t trace | -w hot|scan|shift|loop] [-n lookups] [-k keys] [-s scan length]\n",
+				argv[0]);
+			return 1;
+		}
+	}
+	if (size == 0 || keys == 0 || scan_len == 0) {
+		fprintf(stderr, "sizes must be positive\n");
+		return 1;
+	}
+
+	trace = path ? load(path, &n) : generate(workload, n, keys, scan_len);
+
+	printf("trace: %s, %" PRIu64 " lookups, cache of %" PRIu64 "\n",
+	       path ? path : workload, n, size);
+	printf("%-8s %12s %12s %9s %12s %12s\n", "policy", "hits", "misses",
+	       "hit%", "ghost hits", "L2 target");
+	for (p = 0; p < SIM_POLICIES; p++) {
+		sim_init(&c, p, size);
+		for (i = 0; i < n; i++)
+			sim_lookup(&c, trace[i].key, trace[i].scan);
+		printf("%-8s %12" PRIu64 " %12" PRIu64 " %8.2f%% %12" PRIu64
+		       " %12" PRIu64 "\n", policy_names[p], c.hits, c.misses,
+		       n ? 100.0 * c.hits / n : 0.0, c.ghost_hits,
+		       p == SIM_ARC ? c.target : 0);
+		sim_destroy(&c);
+	}
+	free(trace);
+	return 0;
+}
@@ -1,4 +1,6 @@
 #include <algorithm>
+#include <atomic>
+#include <cassert>
 #include <iomanip>
 #include <iostream>
 #include <mutex>
@@ -32,14 +34,50 @@ constexpr absl::uint128 current_file_id = absl::MakeUint128(/*high=*/0, 1);
 // This is an abstract id that represents the id of the saved file handle.
 constexpr absl::uint128 saved_file_id = absl::MakeUint128(/*high=*/0, 2);
 
-// We store a next_file_id and max_reserved_id in memory to prevent constantly
-// hitting the database.
-absl::uint128 next_file_id = absl::MakeUint128(1, 1);
+// Ids are handed out in leases: each thread carves kLeaseSize consecutive ids
+// at a time out of the shared range with a single atomic add, and then
+// allocates from its lease without touching any shared state. Only ids below
+// |reserved_id| (which has been persisted) can be leased, so ids stay unique
+// across restarts. Ids are unique but no longer dense: whatever is left of a
+// lease when its thread exits, or when the id manager is initialized again, is
+// skipped.
+constexpr uint64_t kLeaseSize = 64;
 
-// The max reserved uuid (exclusive).
-absl::uint128 max_reserved_id(0);
+// Once fewer than this many reserved ids are left, the next batch is reserved
+// ahead of time by whichever thread notices first, while the others keep
+// leasing from what is left.
+constexpr uint64_t kLowWatermark = kUUIDReserveBatchSize / 2;
 
-std::mutex uuid_mutex;
+// All ids share the high half of the next file id read from the database at
+// initialization; only the low half is advanced.
+uint64_t id_high = 1;
+
+// Low half of the next id that is not leased to any thread.
+std::atomic<uint64_t> next_id{1};
+
+// Low half of the max reserved id (exclusive).
+std::atomic<uint64_t> reserved_id{0};
+
+// Set while a thread is reserving the next batch ahead of time.
+std::atomic<bool> reserving{false};
+
+// Serializes database writes of the max reserved id and initialization.
+std::mutex reserve_mutex;
+
+// Bumped by initialize_id_manager so that leases taken before are dropped.
+std::atomic<uint64_t> lease_epoch{0};
+
+struct IdLease {
+  uint64_t next;
+  uint64_t end;
+  uint64_t epoch;
+};
+
+thread_local IdLease lease = {0, 0, 0};
+
+void uint128_to_buf(absl::uint128 n, char *buf) {
+  memcpy(buf, (void *)&n, TXN_UUID_LEN);
+}
 
 char *uint128_to_buf(absl::uint128 n) {
   char *s = (char *)malloc(TXN_UUID_LEN);
@@ -47,26 +85,89 @@ char *uint128_to_buf(absl::uint128 n) {
     return nullptr;
   }
 
-  memcpy(s, (void *)&n, TXN_UUID_LEN);
+  uint128_to_buf(n, s);
 
   return s;
 }
 
-int uuid_batch_reserve(const db_store_t *db) {
+// Persists a max reserved id past |need| (exclusive), unless it already is.
+// Must be called with reserve_mutex held.
+int uuid_batch_reserve(const db_store_t *db, uint64_t need) {
+  const uint64_t reserved = reserved_id.load(std::memory_order_relaxed);
+  if (need <= reserved) return 0;
+
+  const uint64_t new_reserved = need + kUUIDReserveBatchSize;
+  // The low half is not expected to wrap around.
+  assert(new_reserved > need);
+
+  char buf[TXN_UUID_LEN];
+  uint128_to_buf(absl::MakeUint128(id_high, new_reserved), buf);
+
   struct db_kvpair lookup;
   lookup.key = NEXT_FILE_ID_KEY;
   lookup.key_len = NEXT_FILE_ID_KEY_LEN;
-
-  max_reserved_id += kUUIDReserveBatchSize;
-  char* buf = uint128_to_buf(max_reserved_id);
   lookup.val = buf;
-  lookup.val_len = NEXT_FILE_ID_KEY_LEN;
+  lookup.val_len = TXN_UUID_LEN;
 
   int ret = put_keys(&lookup, 1, db);
-  free(buf);
+  if (ret == 0) {
+    reserved_id.store(new_reserved, std::memory_order_release);
+  }
   return ret;
 }
 
+// Takes |n| consecutive ids from the shared range and returns the low half of
+// the first one in |*start|.
+int take_ids(const db_store_t *db, uint64_t n, uint64_t *start) {
+  const uint64_t first = next_id.fetch_add(n, std::memory_order_relaxed);
+  const uint64_t end = first + n;
+  const uint64_t reserved = reserved_id.load(std::memory_order_acquire);
+
+  if (end > reserved) {
+    // The reservation ahead of time did not keep up; wait for it.
+    std::lock_guard<std::mutex> l(reserve_mutex);
+    int ret = uuid_batch_reserve(db, end);
+    if (ret != 0) return ret;
+  } else if (reserved - end < kLowWatermark &&
+             !reserving.exchange(true, std::memory_order_acquire)) {
+    {
+      std::lock_guard<std::mutex> l(reserve_mutex);
+      // Failures are retried by whoever runs out of reserved ids.
+      uuid_batch_reserve(db, reserved_id.load(std::memory_order_relaxed) + 1);
+    }
+    reserving.store(false, std::memory_order_release);
+  }
+
+  *start = first;
+  return 0;
+}
+
+// Allocates |n| consecutive ids, from the lease of the calling thread if it
+// has enough left.
+int allocate_ids(const db_store_t *db, uint64_t n, absl::uint128 *first) {
+  // Make sure in-memory next_id has been initialized
+  assert(reserved_id.load(std::memory_order_relaxed) != 0);
+
+  const uint64_t epoch = lease_epoch.load(std::memory_order_acquire);
+  if (lease.epoch != epoch || lease.end - lease.next < n) {
+    uint64_t start;
+    if (n >= kLeaseSize) {
+      // Too large for a lease; keep what is left of the current one.
+      int ret = take_ids(db, n, &start);
+      if (ret != 0) return ret;
+      *first = absl::MakeUint128(id_high, start);
+      return 0;
+    }
+    int ret = take_ids(db, kLeaseSize, &start);
+    if (ret != 0) return ret;
+    lease = {start, start + kLeaseSize, epoch};
+  }
+
+  *first = absl::MakeUint128(id_high, lease.next);
+  lease.next += n;
+  return 0;
+}
+
 absl::uint128 buf_to_uint128(const char *buf) {
   absl::uint128 n(0);
 
@@ -111,32 +212,41 @@ int initialize_id_manager(const db_store_t *db) {
   lookup.key = NEXT_FILE_ID_KEY;
   lookup.key_len = NEXT_FILE_ID_KEY_LEN;
 
-  std::lock_guard<std::mutex> l(uuid_mutex);
+  std::lock_guard<std::mutex> l(reserve_mutex);
   int ret = get_keys(&lookup, 1, db);
   if (ret != 0) return ret;
 
+  absl::uint128 next_file_id = absl::MakeUint128(1, 1);
   if (lookup.val_len > 0) {
     next_file_id = buf_to_uint128((char *)lookup.val);
   }
+  free((void *)lookup.val);
 
-  max_reserved_id = next_file_id;
+  id_high = absl::Uint128High64(next_file_id);
+  next_id.store(absl::Uint128Low64(next_file_id));
+  reserved_id.store(absl::Uint128Low64(next_file_id));
+  lease_epoch.fetch_add(1, std::memory_order_release);
 
-  return uuid_batch_reserve(db);
+  return uuid_batch_reserve(db, absl::Uint128Low64(next_file_id) + 1);
 }
 
-char *generate_file_id(const db_store_t *db) {
-  std::lock_guard<std::mutex> l(uuid_mutex);
-  // Make sure in-memory next_file_id has been initialized
-  assert(max_reserved_id != 0);
+int generate_file_id_r(const db_store_t *db, char *buf) {
+  absl::uint128 id;
+  int ret = allocate_ids(db, 1, &id);
+  if (ret != 0) return ret;
 
-  if (next_file_id == max_reserved_id) {
-    if (uuid_batch_reserve(db) != 0) return nullptr;
-  }
+  uint128_to_buf(id, buf);
+  return 0;
+}
 
-  return uint128_to_buf(next_file_id++);
+char *generate_file_id(const db_store_t *db) {
+  absl::uint128 id;
+  if (allocate_ids(db, 1, &id) != 0) return nullptr;
+
+  return uint128_to_buf(id);
 }
 
-char *get_root_id(const db_store_t *db) { return uint128_to_buf(root_file_id); }
+char *get_root_id(const db_store_t * /* db */) { return uint128_to_buf(root_file_id); }
 
 uuid_t uuid_root() {
   return absl::bit_cast<uuid_t>(root_file_id);
@@ -153,12 +263,9 @@ uuid_t uuid_next(uuid_t current) {
 }
 
 uuid_t uuid_allocate(const db_store_t *db, int n) {
-  std::lock_guard<std::mutex> l(uuid_mutex);
-  const absl::uint128 new_next = next_file_id + n;
-  while (new_next >= max_reserved_id) {
-    if (uuid_batch_reserve(db) != 0) std::abort();
-  }
-  return absl::bit_cast<uuid_t>(std::exchange(next_file_id, new_next));
+  absl::uint128 first;
+  if (allocate_ids(db, n, &first) != 0) std::abort();
+  return absl::bit_cast<uuid_t>(first);
 }
 
 char *uuid_to_buf(uuid_t id) {
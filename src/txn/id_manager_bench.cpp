@@ -20,4 +20,29 @@ static void BM_generate_ids(benchmark::State& state) {
 
 BENCHMARK(BM_generate_ids)->Arg(512);
 
+// Shared by all threads of the multi-threaded runs and opened by whichever
+// thread gets there first.
+static db_store_t* shared_db() {
+  static db_store_t* db = [] {
+    db_store_t* db = init_db_store("testdb_mt", true);
+    initialize_id_manager(db);
+    return db;
+  }();
+  return db;
+}
+
+static void BM_generate_ids_mt(benchmark::State& state) {
+  db_store_t* db = shared_db();
+  char buf[TXN_UUID_LEN];
+
+  while (state.KeepRunning()) {
+    for (int i = 0; i < state.range(0); i++) {
+      generate_file_id_r(db, buf);
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+BENCHMARK(BM_generate_ids_mt)->Arg(512)->ThreadRange(1, 32)->UseRealTime();
+
 BENCHMARK_MAIN();
@@ -2,6 +2,8 @@
 #include <boost/filesystem/operations.hpp>
 #include <boost/filesystem/path.hpp>
 #include <set>
+#include <thread>
+#include <vector>
 #include <stdlib.h>
 #include <string.h>
 
@@ -96,6 +98,43 @@ TEST_F(IdManagerTest, UUIDBasics) {
   EXPECT_TRUE(uuid_is_null(uuid_null()));
 }
 
+TEST_F(IdManagerTest, ConcurrentAllocation) {
+  constexpr int kThreads = 8;
+  constexpr int kIdsPerThread = 10000;
+  std::vector<std::vector<uuid_t>> allocated(kThreads);
+  std::vector<std::thread> threads;
+
+  for (int t = 0; t < kThreads; t++) {
+    threads.emplace_back([this, t, &allocated]() {
+      char buf[TXN_UUID_LEN];
+      for (int i = 0; i < kIdsPerThread; i++) {
+        if (i % 100 == 0) {
+          // Ranges and leased ids must not overlap either.
+          uuid_t first = uuid_allocate(db, 3);
+          allocated[t].push_back(first);
+          allocated[t].push_back(uuid_next(first));
+          allocated[t].push_back(uuid_next(uuid_next(first)));
+        } else {
+          ASSERT_EQ(0, generate_file_id_r(db, buf));
+          allocated[t].push_back(buf_to_uuid(buf));
+        }
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+
+  std::set<std::pair<uint64_t, uint64_t>> ids;
+  for (auto &v : allocated) {
+    for (auto &id : v) {
+      EXPECT_EQ(1ULL, id.hi);
+      EXPECT_NE(0ULL, id.lo);
+      EXPECT_TRUE(ids.emplace(id.hi, id.lo).second);
+    }
+  }
+}
+
 TEST_F(IdManagerTest, SimulateFailure) {
   std::set<char *, IDCompare> ids;
 
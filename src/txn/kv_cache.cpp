@@ -0,0 +1,154 @@
+#include "kv_cache.hpp"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+
+KVCache::Shard::Shard() : lru(), index(), generation(0) {}
+
+KVCache::KVCache(size_t capacity)
+    : shard_capacity(std::max<size_t>(1, capacity / N_SHARDS)),
+      hits(0),
+      misses(0),
+      fills(0),
+      stale_fills(0),
+      invalidations(0),
+      evictions(0) {}
+
+KVCache::Shard &KVCache::shard_of(const std::string &key) {
+  return shards[std::hash<std::string>()(key) % N_SHARDS];
+}
+
+const std::string &KVCache::scratch_key(const char *key, size_t key_len) {
+  static thread_local std::string scratch;
+  scratch.assign(key, key_len);
+  return scratch;
+}
+
+void KVCache::store(Shard &shard, const std::string &key, const void *val,
+                    size_t len) {
+  auto it = shard.index.find(key);
+  if (it != shard.index.end()) {
+    it->second->value.assign(static_cast<const char *>(val), len);
+    shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+    return;
+  }
+
+  if (shard.index.size() >= shard_capacity) {
+    // Reuse the least recently used entry for the new key
+    auto victim = std::prev(shard.lru.end());
+    shard.index.erase(victim->key);
+    shard.lru.splice(shard.lru.begin(), shard.lru, victim);
+    evictions.fetch_add(1, std::memory_order_relaxed);
+  } else {
+    shard.lru.emplace_front();
+  }
+  Entry &entry = shard.lru.front();
+  entry.key = key;
+  entry.value.assign(static_cast<const char *>(val), len);
+  shard.index.emplace(entry.key, shard.lru.begin());
+  fills.fetch_add(1, std::memory_order_relaxed);
+}
+
+void KVCache::fill(const char *key, size_t key_len, const void *val,
+                   size_t len, uint64_t ticket) {
+  const std::string &k = scratch_key(key, key_len);
+  Shard &shard = shard_of(k);
+  std::lock_guard<std::mutex> guard(shard.mutex);
+  if (shard.generation != ticket) {
+    // The key may have changed since the database was read
+    stale_fills.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  store(shard, k, val, len);
+}
+
+void KVCache::put(const char *key, size_t key_len, const void *val,
+                  size_t len) {
+  const std::string &k = scratch_key(key, key_len);
+  Shard &shard = shard_of(k);
+  std::lock_guard<std::mutex> guard(shard.mutex);
+  shard.generation++;
+  store(shard, k, val, len);
+}
+
+void KVCache::invalidate(const char *key, size_t key_len) {
+  const std::string &k = scratch_key(key, key_len);
+  Shard &shard = shard_of(k);
+  std::lock_guard<std::mutex> guard(shard.mutex);
+  shard.generation++;
+  invalidations.fetch_add(1, std::memory_order_relaxed);
+  auto it = shard.index.find(k);
+  if (it == shard.index.end()) return;
+  shard.lru.erase(it->second);
+  shard.index.erase(it);
+}
+
+void KVCache::get_stats(struct kv_cache_stats *st) {
+  st->hits = hits.load(std::memory_order_relaxed);
+  st->misses = misses.load(std::memory_order_relaxed);
+  st->fills = fills.load(std::memory_order_relaxed);
+  st->stale_fills = stale_fills.load(std::memory_order_relaxed);
+  st->invalidations = invalidations.load(std::memory_order_relaxed);
+  st->evictions = evictions.load(std::memory_order_relaxed);
+  st->entries = 0;
+  for (int i = 0; i < N_SHARDS; i++) {
+    std::lock_guard<std::mutex> guard(shards[i].mutex);
+    st->entries += shards[i].index.size();
+  }
+}
+
+// C interface
+
+kv_cache_t *new_kv_cache(size_t capacity) {
+  return (kv_cache_t *)new KVCache(capacity);
+}
+
+void free_kv_cache(kv_cache_t *cache) {
+  delete (KVCache *)cache;
+}
+
+bool kv_cache_get_copy(kv_cache_t *cache, const char *key, size_t key_len,
+                       void *buf, size_t *len, uint64_t *ticket) {
+  KVCache *c = (KVCache *)cache;
+  bool fits = false;
+  size_t cap = *len;
+  bool hit = c->get(key, key_len, ticket, [&](const std::string &value) {
+    *len = value.size();
+    fits = value.size() <= cap;
+    if (fits) memcpy(buf, value.data(), value.size());
+  });
+  return hit && fits;
+}
+
+char *kv_cache_get(kv_cache_t *cache, const char *key, size_t key_len,
+                   size_t *len, uint64_t *ticket) {
+  KVCache *c = (KVCache *)cache;
+  char *copy = nullptr;
+  c->get(key, key_len, ticket, [&](const std::string &value) {
+    // never return NULL for a hit, even if the value is empty
+    copy = static_cast<char *>(malloc(std::max<size_t>(1, value.size())));
+    memcpy(copy, value.data(), value.size());
+    *len = value.size();
+  });
+  return copy;
+}
+
+void kv_cache_fill(kv_cache_t *cache, const char *key, size_t key_len,
+                   const void *val, size_t len, uint64_t ticket) {
+  ((KVCache *)cache)->fill(key, key_len, val, len, ticket);
+}
+
+void kv_cache_put(kv_cache_t *cache, const char *key, size_t key_len,
+                  const void *val, size_t len) {
+  ((KVCache *)cache)->put(key, key_len, val, len);
+}
+
+void kv_cache_invalidate(kv_cache_t *cache, const char *key, size_t key_len) {
+  ((KVCache *)cache)->invalidate(key, key_len);
+}
+
+void kv_cache_get_stats(kv_cache_t *cache, struct kv_cache_stats *st) {
+  ((KVCache *)cache)->get_stats(st);
+}
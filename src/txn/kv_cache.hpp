@@ -0,0 +1,85 @@
+#ifndef _KV_CACHE_HPP
+#define _KV_CACHE_HPP
+
+#include <atomic>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+// Contains C interface
+#include "kv_cache.h"
+
+struct KVCache {
+private:
+        // Number of independently locked partitions of the cache
+        static const int N_SHARDS = 16;
+
+        struct Entry {
+                std::string key;
+                std::string value;
+        };
+
+        struct Shard {
+                std::mutex mutex;
+                // Most recently used first
+                std::list<Entry> lru;
+                std::unordered_map<std::string, std::list<Entry>::iterator> index;
+                // Bumped by every invalidation and put, so that fills based
+                // on database reads that started earlier can be dropped
+                uint64_t generation;
+
+                Shard();
+        };
+
+        Shard shards[N_SHARDS];
+        size_t shard_capacity;
+
+        std::atomic<uint64_t> hits;
+        std::atomic<uint64_t> misses;
+        std::atomic<uint64_t> fills;
+        std::atomic<uint64_t> stale_fills;
+        std::atomic<uint64_t> invalidations;
+        std::atomic<uint64_t> evictions;
+
+        Shard &shard_of(const std::string &key);
+        // Returns the thread's scratch key holding a copy of `key`, so that
+        // lookups do not allocate once the thread has warmed up
+        static const std::string &scratch_key(const char *key, size_t key_len);
+        // Insert or replace a value; the shard mutex must be held
+        void store(Shard &shard, const std::string &key, const void *val,
+                   size_t len);
+
+public:
+        explicit KVCache(size_t capacity);
+
+        // Calls `found(value)` with the shard mutex held on a hit. On a miss,
+        // sets `*ticket` (if not null) for use with fill().
+        template <typename F>
+        bool get(const char *key, size_t key_len, uint64_t *ticket, F found);
+
+        void fill(const char *key, size_t key_len, const void *val, size_t len,
+                  uint64_t ticket);
+        void put(const char *key, size_t key_len, const void *val, size_t len);
+        void invalidate(const char *key, size_t key_len);
+        void get_stats(struct kv_cache_stats *st);
+};
+
+template <typename F>
+bool KVCache::get(const char *key, size_t key_len, uint64_t *ticket, F found) {
+        const std::string &k = scratch_key(key, key_len);
+        Shard &shard = shard_of(k);
+        std::lock_guard<std::mutex> guard(shard.mutex);
+        auto it = shard.index.find(k);
+        if (it == shard.index.end()) {
+                if (ticket != nullptr) *ticket = shard.generation;
+                misses.fetch_add(1, std::memory_order_relaxed);
+                return false;
+        }
+        shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+        hits.fetch_add(1, std::memory_order_relaxed);
+        found(it->second->value);
+        return true;
+}
+
+#endif  //_KV_CACHE_HPP
@@ -0,0 +1,165 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "kv_cache.h"
+
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+static void put(kv_cache_t *cache, const std::string &key,
+                const std::string &val) {
+  kv_cache_put(cache, key.data(), key.size(), val.data(), val.size());
+}
+
+static bool get(kv_cache_t *cache, const std::string &key, std::string *val) {
+  size_t len;
+  char *res = kv_cache_get(cache, key.data(), key.size(), &len, nullptr);
+  if (res == nullptr) return false;
+  val->assign(res, len);
+  free(res);
+  return true;
+}
+
+TEST(KVCacheTest, PutGetInvalidate) {
+  kv_cache_t *cache = new_kv_cache(1024);
+  std::string val;
+
+  ASSERT_FALSE(get(cache, "fhdl-1", &val));
+  put(cache, "fhdl-1", "uuid-a");
+  ASSERT_TRUE(get(cache, "fhdl-1", &val));
+  EXPECT_EQ("uuid-a", val);
+
+  put(cache, "fhdl-1", "uuid-b");
+  ASSERT_TRUE(get(cache, "fhdl-1", &val));
+  EXPECT_EQ("uuid-b", val);
+
+  kv_cache_invalidate(cache, "fhdl-1", 6);
+  ASSERT_FALSE(get(cache, "fhdl-1", &val));
+
+  struct kv_cache_stats st;
+  kv_cache_get_stats(cache, &st);
+  EXPECT_EQ(2, st.hits);
+  EXPECT_EQ(2, st.misses);
+  EXPECT_EQ(1, st.invalidations);
+  EXPECT_EQ(0, st.entries);
+
+  free_kv_cache(cache);
+}
+
+TEST(KVCacheTest, BinaryKeys) {
+  kv_cache_t *cache = new_kv_cache(1024);
+  const char key1[] = {'k', '\0', '1'};
+  const char key2[] = {'k', '\0', '2'};
+  char buf[16];
+  size_t len = sizeof(buf);
+
+  kv_cache_put(cache, key1, sizeof(key1), "one", 3);
+  ASSERT_FALSE(kv_cache_get_copy(cache, key2, sizeof(key2), buf, &len,
+                                 nullptr));
+  len = sizeof(buf);
+  ASSERT_TRUE(kv_cache_get_copy(cache, key1, sizeof(key1), buf, &len,
+                                nullptr));
+  EXPECT_EQ(3, len);
+  EXPECT_EQ(0, memcmp(buf, "one", 3));
+
+  // A value that does not fit is reported but not copied
+  len = 2;
+  ASSERT_FALSE(kv_cache_get_copy(cache, key1, sizeof(key1), buf, &len,
+                                 nullptr));
+  EXPECT_EQ(3, len);
+
+  free_kv_cache(cache);
+}
+
+TEST(KVCacheTest, StaleFillIsDropped) {
+  kv_cache_t *cache = new_kv_cache(1024);
+  std::string val;
+  uint64_t ticket;
+  size_t len = 0;
+
+  // A reader misses and goes to the database ...
+  ASSERT_FALSE(kv_cache_get(cache, "path-1", 6, &len, &ticket));
+  // ... while a writer changes the record
+  kv_cache_invalidate(cache, "path-1", 6);
+  // The value the reader got is out of date and must not be cached
+  kv_cache_fill(cache, "path-1", 6, "/old", 4, ticket);
+  ASSERT_FALSE(get(cache, "path-1", &val));
+
+  ASSERT_FALSE(kv_cache_get(cache, "path-1", 6, &len, &ticket));
+  kv_cache_fill(cache, "path-1", 6, "/new", 4, ticket);
+  ASSERT_TRUE(get(cache, "path-1", &val));
+  EXPECT_EQ("/new", val);
+
+  struct kv_cache_stats st;
+  kv_cache_get_stats(cache, &st);
+  EXPECT_EQ(1, st.stale_fills);
+
+  free_kv_cache(cache);
+}
+
+TEST(KVCacheTest, EvictsLeastRecentlyUsed) {
+  // 16 shards of 4 entries each
+  kv_cache_t *cache = new_kv_cache(64);
+  std::string val;
+  const int n = 1000;
+
+  put(cache, "hot", "1");
+  for (int i = 0; i < n; i++) {
+    put(cache, "key-" + std::to_string(i), std::to_string(i));
+    ASSERT_TRUE(get(cache, "hot", &val));
+  }
+
+  struct kv_cache_stats st;
+  kv_cache_get_stats(cache, &st);
+  EXPECT_LE(st.entries, 64);
+  EXPECT_EQ(n + 1, st.entries + st.evictions);
+  // The most recent key is never the one evicted
+  ASSERT_TRUE(get(cache, "key-" + std::to_string(n - 1), &val));
+  EXPECT_EQ(std::to_string(n - 1), val);
+
+  free_kv_cache(cache);
+}
+
+TEST(KVCacheTest, ConcurrentAccess) {
+  kv_cache_t *cache = new_kv_cache(256);
+  const int n_threads = 8;
+  const int n_ops = 20000;
+  std::vector<std::thread> threads;
+
+  for (int t = 0; t < n_threads; t++) {
+    threads.emplace_back([cache, t]() {
+      std::string val;
+      for (int i = 0; i < n_ops; i++) {
+        std::string key = "key-" + std::to_string((i * 7 + t) % 512);
+        switch (i % 3) {
+          case 0:
+            put(cache, key, key);
+            break;
+          case 1:
+            if (get(cache, key, &val)) {
+              ASSERT_EQ(key, val);
+            }
+            break;
+          case 2:
+            kv_cache_invalidate(cache, key.data(), key.size());
+            break;
+        }
+      }
+    });
+  }
+  for (auto &thread : threads) thread.join();
+
+  struct kv_cache_stats st;
+  kv_cache_get_stats(cache, &st);
+  EXPECT_LE(st.entries, 256);
+
+  free_kv_cache(cache);
+}
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -2,164 +2,484 @@
 
 #include <algorithm>
 #include <linux/limits.h>
+#include <stdint.h>
 #include <stdio.h>
 
 #include "path_utils.h"
 #include "common_types.h"
 #include "util/slice.h"
 
-LockManager::LockRefCount::LockRefCount(bool write_lock)
-    : write_lock(write_lock), refcount(1) {}
+LockManager::LockNode::LockNode(std::string key, int shard, LockNode *parent)
+    : key(std::move(key)),
+      shard(shard),
+      parent(parent),
+      idle_prev(nullptr),
+      idle_next(nullptr),
+      idle(false) {
+  for (int m = 0; m < N_MODES; m++) {
+    holders[m] = 0;
+  }
+}
+
+bool LockManager::LockNode::compatible(LockMode mode) const {
+  switch (mode) {
+    case IS:
+      return holders[X] == 0;
+    case IX:
+      return holders[S] == 0 && holders[X] == 0;
+    case S:
+      return holders[IX] == 0 && holders[X] == 0;
+    case X:
+      return holders[IS] == 0 && holders[IX] == 0 && holders[S] == 0 &&
+             holders[X] == 0;
+    default:
+      assert(false);
+      return false;
+  }
+}
+
+bool LockManager::LockNode::unused() const {
+  return holders[IS] == 0 && holders[IX] == 0 && holders[S] == 0 &&
+         holders[X] == 0;
+}
 
-LockManager::LockManager() : paths() {}
+LockManager::LockShard::LockShard()
+    : nodes(), idle_head(nullptr), idle_tail(nullptr), n_idle(0) {}
 
-std::string clean_path(char *path, bool *success) {
-  char *clean_path = (char *)malloc(PATH_MAX);
-  if (!clean_path) {
-    *success = false;
-    return std::string();
+// Put an unused node at the head of the idle list and evict the least
+// recently used idle node if there are too many. Must be called with the
+// shard mutex held.
+void LockManager::LockShard::make_idle(LockNode *node) {
+  assert(!node->idle && node->unused());
+  node->idle = true;
+  node->idle_prev = nullptr;
+  node->idle_next = idle_head;
+  if (idle_head != nullptr) {
+    idle_head->idle_prev = node;
+  } else {
+    idle_tail = node;
   }
-  int ret = tc_path_normalize(path, clean_path, PATH_MAX);
+  idle_head = node;
+
+  if (++n_idle > IDLE_NODES_PER_SHARD) {
+    LockNode *victim = idle_tail;
+    make_busy(victim);
+    nodes.erase(nodes.find(victim->key));
+  }
+}
+
+// Take a node off the idle list. Must be called with the shard mutex held.
+void LockManager::LockShard::make_busy(LockNode *node) {
+  assert(node->idle);
+  if (node->idle_prev != nullptr) {
+    node->idle_prev->idle_next = node->idle_next;
+  } else {
+    idle_head = node->idle_next;
+  }
+  if (node->idle_next != nullptr) {
+    node->idle_next->idle_prev = node->idle_prev;
+  } else {
+    idle_tail = node->idle_prev;
+  }
+  node->idle = false;
+  node->idle_prev = node->idle_next = nullptr;
+  n_idle--;
+}
+
+LockManager::LockWaiter::LockWaiter(LockPlan *plan)
+    : plan(plan), cv(), granted(false) {}
+
+LockManager::LockManager() : waiters(), n_waiters(0) {}
+
+// Normalize `path` into `clean`, reusing its buffer. Relative paths are
+// locked as if they were relative to the root so that every path lives in
+// the same lock table.
+static bool clean_path(const char *path, std::string *clean) {
+  char buf[PATH_MAX];
+  int ret = tc_path_normalize(path, buf, PATH_MAX);
   if (ret == -1) {
     // Logging or error codes?
-    free(clean_path);
-    *success = false;
-    return std::string();
+    return false;
+  }
+  if (buf[0] == '/') {
+    clean->assign(buf, ret);
+  } else if (ret == 1 && buf[0] == '.') {
+    clean->assign("/");
+  } else {
+    clean->assign("/");
+    clean->append(buf, ret);
+  }
+  return true;
+}
+
+static int shard_of(const char *key, size_t len, int n_shards) {
+  // FNV-1a
+  uint64_t h = 14695981039346656037ULL;
+  for (size_t i = 0; i < len; i++) {
+    h = (h ^ (unsigned char)key[i]) * 1099511628211ULL;
   }
-  *success = true;
-  std::string clean_string(clean_path);
-  free(clean_path);
-  return clean_string;
+  return h % n_shards;
+}
+
+LockManager::LockPlan &LockManager::thread_plan() {
+  static thread_local LockPlan plan;
+  return plan;
 }
 
-bool clean_paths(std::set<CleanLockRequest, CleanLockRequestCompare> *paths,
-                 LockRequest *files, int n) {
+// Clean, sort and deduplicate the request and expand it into the nodes it
+// has to lock: each path in S or X mode and each of its ancestors, up to
+// the root, in IS or IX mode.
+bool LockManager::make_plan(LockRequest *files, int n, LockPlan *plan) {
+  if (plan->requests.size() < (size_t)n) {
+    plan->requests.resize(n);
+  }
   for (int i = 0; i < n; i++) {
-    struct CleanLockRequest clean_lock_request;
-    bool ret;
-    clean_lock_request.clean_path = clean_path(files[i].path, &ret);
-    if (!ret) {
+    if (!clean_path(files[i].path, &plan->requests[i].clean_path)) {
       return false;
     }
-    clean_lock_request.write_lock = files[i].write_lock;
+    plan->requests[i].write_lock = files[i].write_lock;
+  }
 
-    auto it = paths->find(clean_lock_request);
-    if (it != paths->end()) {
-      // If this file has already been locked, we need to check
-      // its write_lock because we may have locked it for reading
-      // but now want to lock it for writing. Write lock requests
-      // supersede any read lock requests, regardless of order.
-      // We can't just modify the write_lock in place because
-      // std::set elements are immutable (even though our
-      // comparison function doesn't check `write_lock` so it
-      // would technically be okay) so we erase and re-insert
+  // Sorting swaps the strings, so their buffers are kept around.
+  auto begin = plan->requests.begin();
+  std::sort(begin, begin + n, CleanLockRequestCompare());
+  size_t n_requests = 0;
+  for (int i = 0; i < n; i++) {
+    if (n_requests > 0 && plan->requests[n_requests - 1].clean_path ==
+                              plan->requests[i].clean_path) {
+      // Write lock requests supersede any read lock requests for the same
+      // path, regardless of order.
+      plan->requests[n_requests - 1].write_lock |= plan->requests[i].write_lock;
+      continue;
+    }
+    if (n_requests != (size_t)i) {
+      std::swap(plan->requests[n_requests], plan->requests[i]);
+    }
+    n_requests++;
+  }
+  plan->n_requests = n_requests;
 
-      clean_lock_request.write_lock =
-          clean_lock_request.write_lock || it->write_lock;
-      paths->erase(it);
+  plan->steps.clear();
+  plan->shard_mask = 0;
+  for (size_t r = 0; r < n_requests; r++) {
+    const std::string &path = plan->requests[r].clean_path;
+    bool write_lock = plan->requests[r].write_lock;
+    int depth = 0;
+    // The root, then every prefix that ends before a '/', then the path
+    for (size_t end = 1; end <= path.size(); end++) {
+      if (end > 1 && end < path.size() && path[end] != '/') {
+        continue;
+      }
+      LockStep step;
+      step.key = path.data();
+      step.len = end;
+      step.depth = depth++;
+      step.shard = shard_of(step.key, step.len, N_SHARDS);
+      if (end == path.size()) {
+        step.mode = write_lock ? X : S;
+      } else {
+        step.mode = write_lock ? IX : IS;
+      }
+      plan->shard_mask |= 1ULL << step.shard;
+      plan->steps.push_back(step);
     }
-    paths->insert(clean_lock_request);
   }
   return true;
 }
 
-void LockManager::unlock(std::vector<std::string> files) {
-  std::lock_guard<std::mutex> lock(paths_mutex);
+// Shards are always locked in ascending order so that requests spanning
+// several shards cannot deadlock.
+void LockManager::lock_shards(uint64_t mask) {
+  for (int i = 0; i < N_SHARDS; i++) {
+    if (mask & (1ULL << i)) {
+      shards[i].mutex.lock();
+    }
+  }
+}
 
-  for (const auto &path : files) {
-    auto it = paths.find(path);
+void LockManager::unlock_shards(uint64_t mask) {
+  for (int i = N_SHARDS - 1; i >= 0; i--) {
+    if (mask & (1ULL << i)) {
+      shards[i].mutex.unlock();
+    }
+  }
+}
 
-    if (it != paths.end()) {
-      std::lock_guard<std::mutex> lock(it->second.refcount_mutex);
-      it->second.refcount--;
+// Must be called with the plan's shards locked. Nodes that are not in the
+// table are unlocked, and so is everything below them.
+bool LockManager::could_lock_all(LockPlan &plan) {
+  for (const auto &step : plan.steps) {
+    auto &nodes = shards[step.shard].nodes;
+    plan.key.assign(step.key, step.len);
+    auto it = nodes.find(plan.key);
+    if (it != nodes.end() && !it->second->compatible(step.mode)) {
+      return false;
+    }
+  }
+  return true;
+}
 
-      if (it->second.refcount == 0) {
-        paths.erase(it);
-      }
-    } else {
-      printf("failed to unlock %s\n", path.c_str());
-      // What should we do if the path DNE or has already been
-      // unlocked?
+// Must be called with the plan's shards locked and only after
+// could_lock_all() returned true for it.
+void LockManager::grant(LockPlan &plan) {
+  plan.locked.clear();
+  LockNode *parent = nullptr;
+  for (const auto &step : plan.steps) {
+    if (step.depth == 0) {
+      parent = nullptr;
+    }
+    plan.key.assign(step.key, step.len);
+    LockShard &shard = shards[step.shard];
+    auto &node = shard.nodes[plan.key];
+    if (!node) {
+      node.reset(new LockNode(plan.key, step.shard, parent));
+    } else if (node->idle) {
+      // Its old parent may have been evicted in the meantime
+      shard.make_busy(node.get());
+      node->parent = parent;
+    }
+    assert(node->parent == parent);
+    node->holders[step.mode]++;
+    if (step.mode == S || step.mode == X) {
+      plan.locked.push_back({node.get(), step.mode == X});
     }
+    parent = node.get();
   }
 }
 
-bool LockManager::could_lock(CleanLockRequest file) {
-  auto it = paths.find(file.clean_path);
-  if (it == paths.end()) {
-    return true;
+bool LockManager::try_grant(LockPlan &plan) {
+  lock_shards(plan.shard_mask);
+  bool ok = could_lock_all(plan);
+  if (ok) {
+    grant(plan);
   }
-  return !file.write_lock && !it->second.write_lock;
+  unlock_shards(plan.shard_mask);
+  return ok;
 }
 
-LockHandle LockManager::lock(LockRequest *files, int n) {
-  std::set<CleanLockRequest, CleanLockRequestCompare> clean_lock_requests;
+// Drop one hold on a node. As long as another holder of the same mode
+// remains, the node cannot become unused and the count is decremented
+// without taking the shard mutex. The last holder of a mode takes the
+// mutex so it can retire the node if nobody else holds it.
+void LockManager::release_node(LockNode *node, LockMode mode) {
+  std::atomic<int> &holders = node->holders[mode];
+  int old = holders.load();
+  while (old > 1) {
+    if (holders.compare_exchange_weak(old, old - 1)) {
+      return;
+    }
+  }
 
-  bool ret = clean_paths(&clean_lock_requests, files, n);
-  if (!ret) {
-    return LockHandle();
+  assert(old == 1);
+  LockShard &shard = shards[node->shard];
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  holders--;
+  if (node->unused()) {
+    shard.make_idle(node);
   }
+}
 
-  LockHandle lock_handle;
-  // Spinlock until try_lock succeeds. Better way to do this?
-  do {
-    lock_handle = try_lock_clean_paths(clean_lock_requests);
-  } while (!lock_handle.success);
+void LockManager::release(const HeldLock *locked, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    LockNode *node = locked[i].node;
+    LockMode mode = locked[i].write_lock ? X : S;
+    LockMode intention = locked[i].write_lock ? IX : IS;
+    while (node != nullptr) {
+      // The node may be gone once released
+      LockNode *parent = node->parent;
+      release_node(node, mode);
+      node = parent;
+      mode = intention;
+    }
+  }
 
-  return lock_handle;
+  if (n_waiters > 0) {
+    std::lock_guard<std::mutex> lock(waiters_mutex);
+    wake_waiters();
+  }
 }
 
-LockHandle LockManager::try_lock(LockRequest *files, int n) {
-  std::set<CleanLockRequest, CleanLockRequestCompare> paths;
+static bool path_covers(const std::string &ancestor, const std::string &path) {
+  if (path.compare(0, ancestor.size(), ancestor) != 0) {
+    return false;
+  }
+  return path.size() == ancestor.size() || ancestor.back() == '/' ||
+         path[ancestor.size()] == '/';
+}
 
-  bool ret = clean_paths(&paths, files, n);
-  if (!ret) {
-    return LockHandle();
+// Two requests conflict if one of them wants to write a path that lies in a
+// subtree locked by the other, or the other way around.
+static bool requests_conflict(const CleanLockRequest *a, size_t na,
+                              const CleanLockRequest *b, size_t nb) {
+  for (size_t i = 0; i < na; i++) {
+    const CleanLockRequest &ra = a[i];
+    for (size_t j = 0; j < nb; j++) {
+      const CleanLockRequest &rb = b[j];
+      if (!ra.write_lock && !rb.write_lock) {
+        continue;
+      }
+      if (path_covers(ra.clean_path, rb.clean_path) ||
+          path_covers(rb.clean_path, ra.clean_path)) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+bool LockManager::conflicts_with_waiters(
+    const LockPlan &plan, std::list<LockWaiter *>::iterator end) {
+  for (auto it = waiters.begin(); it != end; ++it) {
+    const LockPlan &other = *(*it)->plan;
+    if (requests_conflict(plan.requests.data(), plan.n_requests,
+                          other.requests.data(), other.n_requests)) {
+      return true;
+    }
   }
+  return false;
+}
 
-  return try_lock_clean_paths(paths);
+// Hand out locks to queued waiters in FIFO order. A waiter is granted only
+// if all of its paths are free and it does not conflict with an older
+// waiter that is still blocked. Must be called with waiters_mutex held.
+void LockManager::wake_waiters() {
+  auto it = waiters.begin();
+  while (it != waiters.end()) {
+    LockWaiter *waiter = *it;
+    if (!conflicts_with_waiters(*waiter->plan, it) &&
+        try_grant(*waiter->plan)) {
+      waiter->granted = true;
+      waiter->cv.notify_one();
+      it = waiters.erase(it);
+      n_waiters--;
+    } else {
+      ++it;
+    }
+  }
 }
 
-LockHandle LockManager::try_lock_clean_paths(
-    std::set<CleanLockRequest, CleanLockRequestCompare> files) {
-  // Blocks to acquire paths_mutex. Should this do paths_mutex.try_lock()
-  // and return nullptr if it fails? What about LockManager::lock()?
-  std::lock_guard<std::mutex> lock(paths_mutex);
+bool LockManager::lock_paths(
+    LockRequest *files, int n, bool blocking,
+    const std::chrono::steady_clock::time_point *deadline,
+    const std::vector<HeldLock> **locked) {
+  LockPlan &plan = thread_plan();
+  if (!make_plan(files, n, &plan)) {
+    return false;
+  }
+  *locked = &plan.locked;
 
-  bool ready = true;
-  for (const auto &clean_lock_request : files) {
-    ready &= could_lock(clean_lock_request);
+  // Uncontended fast path: only the shards of our paths are touched
+  if (n_waiters == 0 && try_grant(plan)) {
+    return true;
   }
-  if (!ready) {
-    return LockHandle();
+
+  std::unique_lock<std::mutex> lock(waiters_mutex);
+  if (!blocking) {
+    // Don't barge in front of blocked lock() callers
+    return !conflicts_with_waiters(plan, waiters.end()) && try_grant(plan);
   }
-  std::vector<std::string> locked_paths;
-  for (const auto &clean_lock_request : files) {
-    auto it = paths.find(clean_lock_request.clean_path);
-    if (it != paths.end()) {
-      assert(!clean_lock_request.write_lock && !it->second.write_lock);
-      std::lock_guard<std::mutex> lock(it->second.refcount_mutex);
-      it->second.refcount++;
-    } else {
-      paths.emplace(std::piecewise_construct,
-                    std::forward_as_tuple(clean_lock_request.clean_path),
-                    std::forward_as_tuple(clean_lock_request.write_lock));
+
+  // Queue up before checking again, so that an unlock that frees our paths
+  // after the check is guaranteed to see us waiting.
+  LockWaiter waiter(&plan);
+  auto pos = waiters.insert(waiters.end(), &waiter);
+  n_waiters++;
+  if (!conflicts_with_waiters(plan, pos) && try_grant(plan)) {
+    waiter.granted = true;
+    waiters.erase(pos);
+    n_waiters--;
+  }
+
+  // Sleep until an unlock grants us the paths.
+  while (!waiter.granted) {
+    if (deadline == nullptr) {
+      waiter.cv.wait(lock);
+    } else if (waiter.cv.wait_until(lock, *deadline) ==
+                   std::cv_status::timeout &&
+               !waiter.granted) {
+      waiters.erase(pos);
+      n_waiters--;
+      // Younger waiters may have been held back only by us
+      wake_waiters();
+      return false;
     }
-    locked_paths.push_back(clean_lock_request.clean_path);
   }
 
-  return LockHandle(this, locked_paths, true);
+  return true;
+}
+
+LockHandle LockManager::lock(LockRequest *files, int n) {
+  const std::vector<HeldLock> *locked;
+  if (!lock_paths(files, n, true, nullptr, &locked)) {
+    return LockHandle();
+  }
+  return LockHandle(this, *locked, true);
+}
+
+LockHandle LockManager::lock(LockRequest *files, int n,
+                             std::chrono::milliseconds timeout) {
+  const std::vector<HeldLock> *locked;
+  auto deadline = std::chrono::steady_clock::now() + timeout;
+  if (!lock_paths(files, n, true, &deadline, &locked)) {
+    return LockHandle();
+  }
+  return LockHandle(this, *locked, true);
 }
 
-LockHandle::LockHandle() : lock_manager(nullptr), paths(), success(false) {}
+LockHandle LockManager::try_lock(LockRequest *files, int n) {
+  const std::vector<HeldLock> *locked;
+  if (!lock_paths(files, n, false, nullptr, &locked)) {
+    return LockHandle();
+  }
+  return LockHandle(this, *locked, true);
+}
+
+LockHandle::LockHandle() : lock_manager(nullptr), locked(), success(false) {}
 
 LockHandle::LockHandle(LockManager *lock_manager,
-                       std::vector<std::string> paths, bool success)
-    : lock_manager(lock_manager), paths(paths), success(success) {}
+                       std::vector<LockManager::HeldLock> locked, bool success)
+    : lock_manager(lock_manager), locked(std::move(locked)), success(success) {}
 
 void LockHandle::unlock() {
   assert(success);
-  lock_manager->unlock(paths);
+  lock_manager->release(locked.data(), locked.size());
+}
+
+// lock_handle_t stores each held node pointer with the write flag in its
+// lowest bit.
+static bool fill_handle(LockManager *lm,
+                        const std::vector<LockManager::HeldLock> &locked,
+                        lock_handle_t *lh) {
+  if (locked.size() > LM_MAX_LOCKS) {
+    lm->release(locked.data(), locked.size());
+    return false;
+  }
+  lh->lm = (lock_manager_t *)lm;
+  lh->n_locks = locked.size();
+  for (size_t i = 0; i < locked.size(); i++) {
+    lh->locks[i] = (uintptr_t)locked[i].node | (locked[i].write_lock ? 1 : 0);
+  }
+  return true;
+}
+
+static lock_handle_t *lock_r(lock_manager_t *lm, lock_request_t *files, int n,
+                             bool blocking, unsigned int timeout_ms,
+                             lock_handle_t *lh) {
+  LockManager *lm_ = (LockManager *)lm;
+  const std::vector<LockManager::HeldLock> *locked;
+  std::chrono::steady_clock::time_point deadline;
+  if (timeout_ms > 0) {
+    deadline = std::chrono::steady_clock::now() +
+               std::chrono::milliseconds(timeout_ms);
+  }
+  if (!lm_->lock_paths((LockRequest *)files, n, blocking,
+                       timeout_ms > 0 ? &deadline : nullptr, &locked) ||
+      !fill_handle(lm_, *locked, lh)) {
+    lh->lm = nullptr;
+    lh->n_locks = 0;
+    return nullptr;
+  }
+  return lh;
 }
 
 lock_manager_t *new_lock_manager() {
@@ -168,29 +488,55 @@ lock_manager_t *new_lock_manager() {
 
 void free_lock_manager(lock_manager_t *lm) { delete (LockManager *)lm; }
 
-lock_handle_t *lm_lock(lock_manager_t *lm, lock_request_t *files, int n) {
-  LockManager *lm_ = (LockManager *)lm;
-  LockHandle *lh = new LockHandle;
-  *lh = lm_->lock((LockRequest *)files, n);
-  if (!lh->success) {
-    delete lh;
-    return nullptr;
+lock_handle_t *lm_lock_r(lock_manager_t *lm, lock_request_t *files, int n,
+                         lock_handle_t *lh) {
+  return lock_r(lm, files, n, true, 0, lh);
+}
+
+lock_handle_t *lm_try_lock_r(lock_manager_t *lm, lock_request_t *files, int n,
+                             lock_handle_t *lh) {
+  return lock_r(lm, files, n, false, 0, lh);
+}
+
+void unlock_handle_r(lock_handle_t *lh) {
+  if (lh->lm == nullptr) {
+    return;
   }
-  return (lock_handle_t *)lh;
+  LockManager::HeldLock locked[LM_MAX_LOCKS];
+  for (int i = 0; i < lh->n_locks; i++) {
+    locked[i].node = (decltype(locked[i].node))(lh->locks[i] & ~(uintptr_t)1);
+    locked[i].write_lock = lh->locks[i] & 1;
+  }
+  ((LockManager *)lh->lm)->release(locked, lh->n_locks);
+  lh->lm = nullptr;
+  lh->n_locks = 0;
 }
 
-lock_handle_t *lm_try_lock(lock_manager_t *lm, lock_request_t *files, int n) {
-  LockManager *lm_ = (LockManager *)lm;
-  LockHandle *lh = new LockHandle;
-  *lh = lm_->try_lock((LockRequest *)files, n);
-  if (!lh->success) {
+static lock_handle_t *heap_lock(lock_manager_t *lm, lock_request_t *files,
+                                int n, bool blocking, unsigned int timeout_ms) {
+  lock_handle_t *lh = new lock_handle_t;
+  if (!lock_r(lm, files, n, blocking, timeout_ms, lh)) {
     delete lh;
     return nullptr;
   }
-  return (lock_handle_t *)lh;
+  return lh;
+}
+
+lock_handle_t *lm_lock(lock_manager_t *lm, lock_request_t *files, int n) {
+  return heap_lock(lm, files, n, true, 0);
+}
+
+lock_handle_t *lm_lock_timeout(lock_manager_t *lm, lock_request_t *files,
+                               int n, unsigned int timeout_ms) {
+  // A zero timeout would mean "wait forever" to lock_r
+  return heap_lock(lm, files, n, true, timeout_ms > 0 ? timeout_ms : 1);
+}
+
+lock_handle_t *lm_try_lock(lock_manager_t *lm, lock_request_t *files, int n) {
+  return heap_lock(lm, files, n, false, 0);
 }
 
 void unlock_handle(lock_handle_t *lh) {
-  ((LockHandle *)lh)->unlock();
-  delete (LockHandle *)lh;
+  unlock_handle_r(lh);
+  delete lh;
 }
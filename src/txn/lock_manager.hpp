@@ -2,11 +2,15 @@
 #define _LOCK_MANAGER_HPP
 
 #include <linux/limits.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <list>
+#include <memory>
 #include <unordered_map>
 #include <mutex>
 #include <string>
 #include <vector>
-#include <set>
 
 #include "path_utils.h"
 #include "util/slice.h"
@@ -34,32 +38,129 @@ private:
         // Make LockHandle a friend so it can call unlock
         friend struct LockHandle;
 
-        // The data associated with each locked path in the LockManager -- a
-        // flag for read/write and a reference count
-        struct LockRefCount {
-                // Whether or not the file is being held for writing. This must
-                // be stored in the LockManager alongside the path so we know
-                // whether or not a new reader can acquire the lock jointly.
-                bool write_lock;
+        // Lock modes. A path locked for reading or writing (S/X) covers the
+        // whole subtree below it; every ancestor of the path is marked with
+        // the matching intention mode (IS/IX) so that conflicting subtree
+        // locks can be detected at the ancestor without scanning the tree.
+        enum LockMode { IS = 0, IX, S, X, N_MODES };
+
+        // Number of independently locked partitions of the lock table
+        static const int N_SHARDS = 64;
+
+        // Unused nodes each shard keeps around for reuse, so that locking
+        // hot paths again does not allocate
+        static const int IDLE_NODES_PER_SHARD = 256;
+
+        // One locked path (or ancestor of a locked path) in the lock table,
+        // keyed by the path prefix up to and including its last component.
+        // Counts are only increased with the shard mutex held but may be
+        // decreased without it, so releasing a lock that leaves the node in
+        // use never touches the shard mutex. Once no holder is left the node
+        // goes on its shard's idle list, from which it is either reused or
+        // evicted.
+        struct LockNode {
+                std::string key;
+                int shard;
+                // The node of the parent directory. Whoever holds this node
+                // also holds an intention lock on the parent, so the parent
+                // outlives it. Only valid while the node is in use.
+                LockNode *parent;
+                // Links in the shard's idle list; protected by the shard mutex
+                LockNode *idle_prev;
+                LockNode *idle_next;
+                bool idle;
+                // Number of holders per LockMode
+                std::atomic<int> holders[N_MODES];
+
+                LockNode(std::string key, int shard, LockNode *parent);
+                bool compatible(LockMode mode) const;
+                bool unused() const;
+        };
+
+        struct LockShard {
+                std::mutex mutex;
+                std::unordered_map<std::string, std::unique_ptr<LockNode>> nodes;
+                // Unused nodes, most recently released first
+                LockNode *idle_head;
+                LockNode *idle_tail;
+                int n_idle;
+
+                LockShard();
+                void make_idle(LockNode *node);
+                void make_busy(LockNode *node);
+        };
 
-                std::mutex refcount_mutex;
-                // Reference count for the number of concurrent readers holding
-                // the lock
-                int refcount;
+        // One node that a request has to lock, in the given mode. `key`
+        // points into the clean path of the request.
+        struct LockStep {
+                const char *key;
+                size_t len;
+                int depth;
+                int shard;
+                LockMode mode;
+        };
+
+public:
+        // A lock taken on behalf of one LockHandle: the node of the locked
+        // path. The intention locks on its ancestors are found through the
+        // node's parent links.
+        struct HeldLock {
+                LockNode *node;
+                bool write_lock;
+        };
 
-                LockRefCount(bool write_lock);
+private:
+        // Everything needed to take the locks of one request. Each thread
+        // reuses a single plan, so once its buffers have grown to fit the
+        // largest request, planning and granting locks does not allocate
+        // (except for nodes that are new to the lock table).
+        struct LockPlan {
+                // Sorted, deduplicated requests; only the first n_requests
+                // are valid, the rest keep their buffers for later use.
+                std::vector<CleanLockRequest> requests;
+                size_t n_requests;
+                std::vector<LockStep> steps;
+                uint64_t shard_mask;
+                // Scratch key used for table lookups
+                std::string key;
+                // Filled in by grant()
+                std::vector<HeldLock> locked;
         };
 
-        std::mutex paths_mutex;
-        // Associate all locked paths with a `LockRefCount`: a struct indicating
-        // whether or not the lock is a write lock and a reference count of the
-        // number of readers holding the lock
-        std::unordered_map<std::string, LockRefCount> paths;
+        // A blocked `lock` call. Waiters are queued in arrival order and
+        // woken by `unlock` once all of their paths become available; the
+        // waking thread takes the locks on the waiter's behalf so a waiter
+        // never has to compete for them again after it is woken.
+        struct LockWaiter {
+                LockPlan *plan;
+                std::condition_variable cv;
+                bool granted;
+
+                LockWaiter(LockPlan *plan);
+        };
 
-        bool could_lock(CleanLockRequest file);
-        LockHandle try_lock_clean_paths(std::set<CleanLockRequest, CleanLockRequestCompare> paths);
-        LockHandle add_lock(std::string path, bool write_lock);
-        void unlock(std::vector<std::string> paths);
+        LockShard shards[N_SHARDS];
+
+        // FIFO of blocked `lock` calls, protected by waiters_mutex. A request
+        // is never granted ahead of an older waiter it conflicts with, so a
+        // stream of readers cannot starve a waiting writer. waiters_mutex is
+        // always taken before any shard mutex and only used when there is
+        // contention: while n_waiters is zero, lock and unlock only touch
+        // the shards of their paths.
+        std::mutex waiters_mutex;
+        std::list<LockWaiter *> waiters;
+        std::atomic<int> n_waiters;
+
+        static LockPlan &thread_plan();
+        bool make_plan(LockRequest *files, int n, LockPlan *plan);
+        void lock_shards(uint64_t mask);
+        void unlock_shards(uint64_t mask);
+        bool could_lock_all(LockPlan &plan);
+        bool conflicts_with_waiters(const LockPlan &plan, std::list<LockWaiter *>::iterator end);
+        void grant(LockPlan &plan);
+        bool try_grant(LockPlan &plan);
+        void wake_waiters();
+        void release_node(LockNode *node, LockMode mode);
 
        public:
         LockManager();
@@ -72,22 +173,37 @@ private:
         // This method blocks until the lock can be acquired.
         LockHandle lock(LockRequest *files, int n);
 
+        // Like lock, but gives up once `timeout` has passed. The returned
+        // LockHandle is unsuccessful if the lock could not be acquired in
+        // time.
+        LockHandle lock(LockRequest *files, int n, std::chrono::milliseconds timeout);
+
         // Only attempt to acquire lock -- do not block if the lock cannot be
         // acquired
         LockHandle try_lock(LockRequest *files, int n);
+
+        // Allocation-free core of lock and try_lock. On success the locks
+        // are returned in `*locked`, which stays valid until the calling
+        // thread locks again. `deadline` is ignored unless `blocking`.
+        bool lock_paths(LockRequest *files, int n, bool blocking,
+                        const std::chrono::steady_clock::time_point *deadline,
+                        const std::vector<HeldLock> **locked);
+
+        // Release the locks of one request
+        void release(const HeldLock *locked, size_t n);
 };
 
 struct LockHandle {
         LockManager *lock_manager;
 
-        std::vector<std::string> paths;
+        std::vector<LockManager::HeldLock> locked;
 
         bool success;
 
         LockHandle();
-        LockHandle(LockManager *lock_manager, std::vector<std::string> paths, bool success);
+        LockHandle(LockManager *lock_manager, std::vector<LockManager::HeldLock> locked, bool success);
 
-        // Decrement the refcount of the path associated with this LockHandle
+        // Release every path held by this LockHandle
         void unlock();
 };
 
@@ -1,14 +1,43 @@
 #include <benchmark/benchmark.h>
 
+#include <malloc.h>
+#include <time.h>
+
+#include <algorithm>
+#include <chrono>
 #include <cstdio>
 #include <fstream>
+#include <random>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include "lock_manager.hpp"
 
 using namespace std;
 
+// Count heap allocations made by this process. Every C and C++ allocation
+// goes through malloc, calloc or realloc.
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t n, size_t size);
+extern "C" void *__libc_realloc(void *ptr, size_t size);
+static thread_local uint64_t n_allocs;
+
+extern "C" void *malloc(size_t size) {
+  n_allocs++;
+  return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t n, size_t size) {
+  n_allocs++;
+  return __libc_calloc(n, size);
+}
+
+extern "C" void *realloc(void *ptr, size_t size) {
+  n_allocs++;
+  return __libc_realloc(ptr, size);
+}
+
 std::vector<LockRequest> make_lock_requests(
     std::vector<std::pair<const char *, bool>> data) {
   std::vector<LockRequest> res;
@@ -89,4 +118,162 @@ static void BM_try_lock(benchmark::State &state) {
 }
 BENCHMARK(BM_try_lock)->Range(1, 32768);
 
+// Acquire and release one path while many other paths of the kernel tree
+// are held. The cost should track the depth of the path, not the number of
+// held locks.
+static void BM_lock_with_held_paths(benchmark::State &state) {
+  vector<string> paths = get_paths(state.range(0));
+  LockManager lm;
+  vector<LockHandle> handles;
+  for (auto &path : paths) {
+    auto lock_request = make_lock_requests({{path.c_str(), false}});
+    handles.push_back(lm.lock(lock_request.data(), lock_request.size()));
+  }
+  size_t i = 0;
+  while (state.KeepRunning()) {
+    auto lock_request =
+        make_lock_requests({{paths[i++ % paths.size()].c_str(), false}});
+    LockHandle handle = lm.lock(lock_request.data(), lock_request.size());
+    handle.unlock();
+  }
+  for (auto &handle : handles) {
+    handle.unlock();
+  }
+}
+BENCHMARK(BM_lock_with_held_paths)->Range(1, 32768);
+
+// Try to write-lock the directories of the kernel tree while every file
+// below them is read-locked. Conflicts are found at the directory node.
+static void BM_try_lock_subtree(benchmark::State &state) {
+  vector<string> paths = get_paths(state.range(0));
+  LockManager lm;
+  vector<LockHandle> handles;
+  vector<string> dirs;
+  for (auto &path : paths) {
+    auto lock_request = make_lock_requests({{path.c_str(), false}});
+    handles.push_back(lm.lock(lock_request.data(), lock_request.size()));
+    dirs.push_back(path.substr(0, path.rfind('/')));
+  }
+  size_t i = 0;
+  while (state.KeepRunning()) {
+    auto lock_request =
+        make_lock_requests({{dirs[i++ % dirs.size()].c_str(), true}});
+    benchmark::DoNotOptimize(
+        lm.try_lock(lock_request.data(), lock_request.size()));
+  }
+  for (auto &handle : handles) {
+    handle.unlock();
+  }
+}
+BENCHMARK(BM_try_lock_subtree)->Range(1, 32768);
+
+// Lock and unlock the paths of a typical write compound the way the txn
+// FSAL does and report the number of heap allocations per compound.
+// Arg 0 uses lm_lock() and arg 1 uses lm_lock_r() with an embedded handle.
+static void BM_allocs_per_compound(benchmark::State &state) {
+  const bool embedded = state.range(0);
+  lock_manager_t *lm = new_lock_manager();
+  auto lock_requests = make_lock_requests(
+      {{"/export/home/user/project/src", false},
+       {"/export/home/user/project/src/main.c", true},
+       {"/export/home/user/project/src/../include/main.h", false},
+       {"/export/home/user/project/build", true}});
+  lock_handle_t lh;
+  uint64_t allocs = 0;
+  uint64_t compounds = 0;
+
+  while (state.KeepRunning()) {
+    uint64_t before = n_allocs;
+    if (embedded) {
+      lm_lock_r(lm, lock_requests.data(), lock_requests.size(), &lh);
+      unlock_handle_r(&lh);
+    } else {
+      lock_handle_t *h =
+          lm_lock(lm, lock_requests.data(), lock_requests.size());
+      unlock_handle(h);
+    }
+    allocs += n_allocs - before;
+    compounds++;
+  }
+  state.counters["allocs_per_compound"] = (double)allocs / compounds;
+  free_lock_manager(lm);
+}
+BENCHMARK(BM_allocs_per_compound)->Arg(0)->Arg(1);
+
+static double thread_cpu_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Writers contend for a handful of hot paths. Each thread reports its p99
+// acquire latency and the fraction of wall time it spent on a CPU; with a
+// blocking lock manager the latter should stay far below 1 even when the
+// lock is heavily contended.
+static LockManager contended_lm;
+
+static void BM_contended_lock(benchmark::State &state) {
+  const int n_hot = state.range(0);
+  vector<string> hot;
+  for (int i = 0; i < n_hot; i++) {
+    hot.push_back("/hot/" + to_string(i));
+  }
+  std::default_random_engine rng(std::random_device{}());
+  std::uniform_int_distribution<int> pick(0, n_hot - 1);
+  vector<double> latencies;
+
+  auto wall_start = chrono::steady_clock::now();
+  double cpu_start = thread_cpu_seconds();
+  while (state.KeepRunning()) {
+    auto lock_request = make_lock_requests({{hot[pick(rng)].c_str(), true}});
+    auto start = chrono::steady_clock::now();
+    LockHandle handle =
+        contended_lm.lock(lock_request.data(), lock_request.size());
+    latencies.push_back(
+        chrono::duration<double, micro>(chrono::steady_clock::now() - start)
+            .count());
+    // Hold the lock for a short critical section
+    this_thread::sleep_for(chrono::microseconds(20));
+    handle.unlock();
+  }
+  double wall = chrono::duration<double>(chrono::steady_clock::now() -
+                                         wall_start).count();
+  double cpu = thread_cpu_seconds() - cpu_start;
+
+  if (!latencies.empty()) {
+    size_t p99 = latencies.size() * 99 / 100;
+    nth_element(latencies.begin(), latencies.begin() + p99, latencies.end());
+    state.counters["p99_us"] =
+        benchmark::Counter(latencies[p99], benchmark::Counter::kAvgThreads);
+  }
+  state.counters["cpu_util"] =
+      benchmark::Counter(wall > 0 ? cpu / wall : 0,
+                         benchmark::Counter::kAvgThreads);
+}
+BENCHMARK(BM_contended_lock)
+    ->Arg(1)
+    ->Arg(4)
+    ->ThreadRange(2, 32)
+    ->UseRealTime();
+
+// Write compounds on mostly disjoint files of one export, as seen by the
+// txn FSAL. All requests share the IX locks on the export's ancestors, so
+// this measures how well acquire and release scale with the thread count.
+static LockManager scaling_lm;
+
+static void BM_thread_scaling(benchmark::State &state) {
+  std::default_random_engine rng(std::random_device{}());
+  std::uniform_int_distribution<int> pick(0, 4095);
+
+  while (state.KeepRunning()) {
+    string path = "/export/dir" + to_string(pick(rng) % 64) + "/file" +
+                  to_string(pick(rng));
+    auto lock_request = make_lock_requests({{path.c_str(), true}});
+    LockHandle handle =
+        scaling_lm.lock(lock_request.data(), lock_request.size());
+    handle.unlock();
+  }
+}
+BENCHMARK(BM_thread_scaling)->ThreadRange(1, 64)->UseRealTime();
+
 BENCHMARK_MAIN();
@@ -122,6 +122,96 @@ TEST(LockManagerTest, SharedParentWriteTest) {
   free_lock_manager(lm);
 }
 
+// A lock on a directory covers everything below it
+TEST(LockManagerTest, SubtreeWriteTest) {
+  auto dir_write = make_lock_requests({{"/test", true}});
+  auto dir_read = make_lock_requests({{"/test", false}});
+  auto file_write = make_lock_requests({{"/test/a/b", true}});
+  auto file_read = make_lock_requests({{"/test/a/b", false}});
+  auto other = make_lock_requests({{"/test2/a", true}});
+
+  lock_manager_t *lm = new_lock_manager();
+
+  lock_handle_t *lh = lm_try_lock(lm, dir_write.data(), dir_write.size());
+  ASSERT_TRUE(lh);
+  ASSERT_FALSE(lm_try_lock(lm, file_write.data(), file_write.size()));
+  ASSERT_FALSE(lm_try_lock(lm, file_read.data(), file_read.size()));
+  lock_handle_t *lh2 = lm_try_lock(lm, other.data(), other.size());
+  ASSERT_TRUE(lh2);
+  unlock_handle(lh2);
+  unlock_handle(lh);
+
+  lh = lm_try_lock(lm, file_write.data(), file_write.size());
+  ASSERT_TRUE(lh);
+  ASSERT_FALSE(lm_try_lock(lm, dir_write.data(), dir_write.size()));
+  ASSERT_FALSE(lm_try_lock(lm, dir_read.data(), dir_read.size()));
+  unlock_handle(lh);
+
+  lh = lm_try_lock(lm, dir_write.data(), dir_write.size());
+  ASSERT_TRUE(lh);
+  unlock_handle(lh);
+
+  free_lock_manager(lm);
+}
+
+TEST(LockManagerTest, SubtreeReadTest) {
+  auto dir_read = make_lock_requests({{"/test", false}});
+  auto file_read = make_lock_requests({{"/test/a", false}});
+  auto file_write = make_lock_requests({{"/test/a", true}});
+  auto root_write = make_lock_requests({{"/", true}});
+
+  lock_manager_t *lm = new_lock_manager();
+
+  lock_handle_t *lh = lm_try_lock(lm, dir_read.data(), dir_read.size());
+  ASSERT_TRUE(lh);
+  lock_handle_t *lh2 = lm_try_lock(lm, file_read.data(), file_read.size());
+  ASSERT_TRUE(lh2);
+  ASSERT_FALSE(lm_try_lock(lm, file_write.data(), file_write.size()));
+  ASSERT_FALSE(lm_try_lock(lm, root_write.data(), root_write.size()));
+  unlock_handle(lh);
+
+  ASSERT_FALSE(lm_try_lock(lm, file_write.data(), file_write.size()));
+  unlock_handle(lh2);
+
+  lh = lm_try_lock(lm, root_write.data(), root_write.size());
+  ASSERT_TRUE(lh);
+  ASSERT_FALSE(lm_try_lock(lm, file_read.data(), file_read.size()));
+  unlock_handle(lh);
+
+  free_lock_manager(lm);
+}
+
+// A queued subtree writer holds back later requests inside its subtree but
+// not requests elsewhere
+TEST(LockManagerTest, WaitingSubtreeWriter) {
+  auto file_read = make_lock_requests({{"/test/a", false}});
+  auto dir_write = make_lock_requests({{"/test", true}});
+  auto sibling_read = make_lock_requests({{"/test/b", false}});
+  auto other_read = make_lock_requests({{"/test2", false}});
+
+  lock_manager_t *lm = new_lock_manager();
+
+  lock_handle_t *lh = lm_try_lock(lm, file_read.data(), file_read.size());
+  ASSERT_TRUE(lh);
+
+  std::thread writer([&lm, &dir_write]() {
+    lock_handle_t *lh2 = lm_lock(lm, dir_write.data(), dir_write.size());
+    ASSERT_TRUE(lh2);
+    unlock_handle(lh2);
+  });
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  ASSERT_FALSE(lm_try_lock(lm, sibling_read.data(), sibling_read.size()));
+  lock_handle_t *lh3 = lm_try_lock(lm, other_read.data(), other_read.size());
+  ASSERT_TRUE(lh3);
+  unlock_handle(lh3);
+
+  unlock_handle(lh);
+  writer.join();
+
+  free_lock_manager(lm);
+}
+
 TEST(LockManagerTest, DeepThreadTest) {
   lock_manager_t *lm = new_lock_manager();
 
@@ -200,6 +290,59 @@ TEST(LockManagerTest, ThreadTest) {
   free_lock_manager(lm);
 }
 
+TEST(LockManagerTest, LockTimeout) {
+  lock_manager_t *lm = new_lock_manager();
+
+  auto lr = make_lock_requests({{"test", true}});
+
+  lock_handle_t *lh = lm_try_lock(lm, lr.data(), lr.size());
+  ASSERT_TRUE(lh);
+
+  auto start = std::chrono::steady_clock::now();
+  ASSERT_FALSE(lm_lock_timeout(lm, lr.data(), lr.size(), 100));
+  ASSERT_GE(std::chrono::steady_clock::now() - start,
+            std::chrono::milliseconds(100));
+
+  unlock_handle(lh);
+
+  lh = lm_lock_timeout(lm, lr.data(), lr.size(), 100);
+  ASSERT_TRUE(lh);
+  unlock_handle(lh);
+
+  free_lock_manager(lm);
+}
+
+// A blocked writer must not be overtaken by readers that arrive after it.
+TEST(LockManagerTest, WaitingWriterBlocksNewReaders) {
+  lock_manager_t *lm = new_lock_manager();
+
+  auto test_read = make_lock_requests({{"test", false}});
+  auto test_write = make_lock_requests({{"test", true}});
+
+  lock_handle_t *lh = lm_try_lock(lm, test_read.data(), test_read.size());
+  ASSERT_TRUE(lh);
+
+  std::thread writer([&lm, &test_write]() {
+    lock_handle_t *lh2 = lm_lock(lm, test_write.data(), test_write.size());
+    ASSERT_TRUE(lh2);
+    unlock_handle(lh2);
+  });
+
+  // Give the writer time to queue up behind the reader
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  ASSERT_FALSE(lm_try_lock(lm, test_read.data(), test_read.size()));
+  ASSERT_FALSE(lm_lock_timeout(lm, test_read.data(), test_read.size(), 10));
+
+  unlock_handle(lh);
+  writer.join();
+
+  lh = lm_try_lock(lm, test_read.data(), test_read.size());
+  ASSERT_TRUE(lh);
+  unlock_handle(lh);
+
+  free_lock_manager(lm);
+}
+
 TEST(LockManagerTest, LockSets) {
   lock_manager_t *lm = new_lock_manager();
 
@@ -360,6 +503,54 @@ TEST(LockManagerTest, TrickySanitizedDuplicate) {
   free_lock_manager(lm);
 }
 
+TEST(LockManagerTest, EmbeddedHandle) {
+  lock_manager_t *lm = new_lock_manager();
+
+  auto lr = make_lock_requests({{"/test/a", true}, {"/test/b", false}});
+  auto write_b = make_lock_requests({{"/test/b", true}});
+
+  lock_handle_t lh;
+  ASSERT_EQ(&lh, lm_lock_r(lm, lr.data(), lr.size(), &lh));
+
+  lock_handle_t lh2;
+  ASSERT_FALSE(lm_try_lock_r(lm, write_b.data(), write_b.size(), &lh2));
+  // A failed lock leaves nothing to unlock
+  unlock_handle_r(&lh2);
+
+  unlock_handle_r(&lh);
+  unlock_handle_r(&lh);
+
+  ASSERT_TRUE(lm_try_lock_r(lm, write_b.data(), write_b.size(), &lh2));
+  unlock_handle_r(&lh2);
+
+  free_lock_manager(lm);
+}
+
+TEST(LockManagerTest, TooManyPathsForHandle) {
+  lock_manager_t *lm = new_lock_manager();
+
+  std::vector<std::string> paths;
+  for (int i = 0; i <= LM_MAX_LOCKS; i++) {
+    paths.push_back("/test/" + std::to_string(i));
+  }
+  std::vector<lock_request_t> lr;
+  for (auto &path : paths) {
+    lr.push_back({(char *)path.c_str(), true});
+  }
+
+  lock_handle_t lh;
+  ASSERT_FALSE(lm_lock_r(lm, lr.data(), lr.size(), &lh));
+  ASSERT_TRUE(lm_lock_r(lm, lr.data(), LM_MAX_LOCKS, &lh));
+  unlock_handle_r(&lh);
+
+  // Everything has been released
+  auto root = make_lock_requests({{"/", true}});
+  ASSERT_TRUE(lm_try_lock_r(lm, root.data(), root.size(), &lh));
+  unlock_handle_r(&lh);
+
+  free_lock_manager(lm);
+}
+
 int main(int argc, char **argv) {
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
@@ -5,6 +5,12 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
 #include "lwrapper.h"
 
 #define DEBUG 1
@@ -46,6 +52,34 @@ static char* memdup(const char* buf, size_t len) {
   return (char*)g_memdup(buf, len);
 }
 
+/*
+ * Group commit: callers of db_group_write() queue up behind each other. The
+ * caller at the head of the queue is the leader; it waits for the flush
+ * window to close, folds the writes of every queued follower (up to
+ * max_batch) into one leveldb batch, issues one synced leveldb_write for all
+ * of them and then wakes the followers with the shared result.
+ */
+struct db_group_writer {
+  leveldb_writebatch_t* batch;
+  bool done;
+  int ret;
+};
+
+struct db_group_commit {
+  std::mutex mu;
+  // Signalled when a group is finished and a new leader may take over
+  std::condition_variable done_cv;
+  // Signalled when the queue reaches max_batch so the leader can flush early
+  std::condition_variable full_cv;
+  std::deque<db_group_writer*> queue;
+  std::chrono::microseconds max_delay;
+  size_t max_batch;
+  struct db_group_commit_stats stats;
+
+  db_group_commit(uint32_t max_delay_us, uint32_t max_batch)
+      : max_delay(max_delay_us), max_batch(max_batch), stats() {}
+};
+
 static int insert_markers(const db_store_t* db_st) {
   char* err = NULL;
 
@@ -76,6 +110,7 @@ db_store_t* init_db_store(const char* db_dir_path, bool is_creation) {
   CHECK_SUCCESS(db_st->w_options, "\nERROR: Failed to create DB write options");
   db_st->r_options = leveldb_readoptions_create();
   CHECK_SUCCESS(db_st->r_options, "\nERROR: Failed to create DB read options");
+  db_st->gc = NULL;
 
   // Dont need compression - LevelDB offers Snappy
   // which isn't very effective for int data
@@ -150,6 +185,10 @@ db_store_t* init_db_store(const char* db_dir_path, bool is_creation) {
 }
 
 void destroy_db_store(db_store_t* db_st) {
+  // Group commit must be drained by the caller; nothing can be queued
+  // once the store is being torn down.
+  delete db_st->gc;
+  db_st->gc = NULL;
   // Close the ldb handle first to avoid any
   // requests accessing cache, if they were pending
   leveldb_close(db_st->db);
@@ -166,6 +205,112 @@ void destroy_db_store(db_store_t* db_st) {
   return;
 }
 
+static uint64_t elapsed_ns(std::chrono::steady_clock::time_point since) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now() - since)
+      .count();
+}
+
+static void group_batch_put(void* state, const char* k, size_t klen,
+                            const char* v, size_t vlen) {
+  leveldb_writebatch_put((leveldb_writebatch_t*)state, k, klen, v, vlen);
+}
+
+static void group_batch_delete(void* state, const char* k, size_t klen) {
+  leveldb_writebatch_delete((leveldb_writebatch_t*)state, k, klen);
+}
+
+int db_group_commit_init(db_store_t* db_st, uint32_t max_delay_us,
+                         uint32_t max_batch) {
+  if (db_st == NULL || db_st->gc != NULL) return -1;
+  if (max_batch <= 1) return 0;
+  db_st->gc = new db_group_commit(max_delay_us, max_batch);
+  return 0;
+}
+
+int db_group_write(const db_store_t* db_st, leveldb_writebatch_t* batch) {
+  char* err = NULL;
+  db_group_commit* gc = db_st->gc;
+
+  if (gc == NULL) {
+    leveldb_write(db_st->db, db_st->w_options, batch, &err);
+    CHECK_ERR(err);
+    return 0;
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  db_group_writer w = {batch, false, 0};
+  std::unique_lock<std::mutex> lock(gc->mu);
+
+  gc->queue.push_back(&w);
+  if (gc->queue.size() >= gc->max_batch) gc->full_cv.notify_one();
+  gc->done_cv.wait(lock, [&] { return w.done || gc->queue.front() == &w; });
+  if (w.done) {
+    gc->stats.wait_ns += elapsed_ns(start);
+    return w.ret;
+  }
+
+  // We are the leader: keep the window open for followers to join.
+  if (gc->max_delay.count() > 0) {
+    gc->full_cv.wait_for(lock, gc->max_delay, [&] {
+      return gc->queue.size() >= gc->max_batch;
+    });
+  }
+
+  size_t n = std::min(gc->queue.size(), gc->max_batch);
+  leveldb_writebatch_t* group = batch;
+  if (n > 1) {
+    group = leveldb_writebatch_create();
+    for (size_t i = 0; i < n; ++i) {
+      leveldb_writebatch_iterate(gc->queue[i]->batch, group, group_batch_put,
+                                 group_batch_delete);
+    }
+  }
+
+  // Followers only append to the queue while we sync, so the first n
+  // entries stay ours.
+  lock.unlock();
+  auto sync_start = std::chrono::steady_clock::now();
+  leveldb_write(db_st->db, db_st->w_options, group, &err);
+  uint64_t sync_ns = elapsed_ns(sync_start);
+  if (group != batch) leveldb_writebatch_destroy(group);
+  int ret = 0;
+  if (err != NULL) {
+    fprintf(stderr, "group commit of %zu writes failed: %s\n", n, err);
+    leveldb_free(err);
+    ret = -1;
+  }
+  lock.lock();
+
+  for (size_t i = 0; i < n; ++i) {
+    db_group_writer* follower = gc->queue.front();
+    gc->queue.pop_front();
+    follower->ret = ret;
+    follower->done = true;
+  }
+  gc->stats.batches++;
+  gc->stats.writes += n;
+  if (n > gc->stats.max_batch) gc->stats.max_batch = n;
+  if (n == gc->max_batch) gc->stats.full_batches++;
+  gc->stats.sync_ns += sync_ns;
+  gc->stats.wait_ns += elapsed_ns(start);
+  gc->done_cv.notify_all();
+
+  return ret;
+}
+
+void db_group_commit_get_stats(const db_store_t* db_st,
+                               struct db_group_commit_stats* stats) {
+  db_group_commit* gc = db_st->gc;
+
+  if (gc == NULL) {
+    memset(stats, 0, sizeof(*stats));
+    return;
+  }
+  std::lock_guard<std::mutex> lock(gc->mu);
+  *stats = gc->stats;
+}
+
 static void generate_db_keys(db_kvpair_t* kvp, const char* prefix,
                              db_kvpair_t* new_kvp, int nums,
                              bool alloc_val_mem) {
@@ -3,6 +3,10 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <string>
+#include <thread>
+#include <vector>
+
 #include "lwrapper.h"
 
 MATCHER_P2(IsPair, key, value,
@@ -238,6 +242,49 @@ TEST(TestLWrapper, CommitTransactionAndInsertTest) {
   destroy_db_store(db);
 }
 
+TEST(TestLWrapper, GroupCommitTest) {
+  db_store_t* db = init_db_store("test_db", true);
+  ASSERT_TRUE(db);
+  ASSERT_EQ(0, db_group_commit_init(db, 200, 8));
+
+  const int kThreads = 16;
+  const int kWrites = 50;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kThreads; ++t) {
+    threads.emplace_back([db, t]() {
+      for (int i = 0; i < kWrites; ++i) {
+        std::string key = "gc-" + std::to_string(t) + "-" + std::to_string(i);
+        leveldb_writebatch_t* batch = leveldb_writebatch_create();
+        leveldb_writebatch_put(batch, key.data(), key.size(), key.data(),
+                               key.size());
+        EXPECT_EQ(0, db_group_write(db, batch));
+        leveldb_writebatch_destroy(batch);
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  for (int t = 0; t < kThreads; ++t) {
+    for (int i = 0; i < kWrites; ++i) {
+      std::string key = "gc-" + std::to_string(t) + "-" + std::to_string(i);
+      db_kvpair_t kvp = {key.c_str(), NULL, key.size(), 0};
+      ASSERT_EQ(0, get_keys(&kvp, 1, db));
+      EXPECT_THAT(kvp, IsPair(key.c_str(), key.c_str()));
+      free((void*)kvp.val);
+    }
+  }
+
+  struct db_group_commit_stats stats;
+  db_group_commit_get_stats(db, &stats);
+  EXPECT_EQ(kThreads * kWrites, stats.writes);
+  EXPECT_LE(stats.batches, stats.writes);
+  EXPECT_LE(stats.max_batch, 8);
+
+  destroy_db_store(db);
+}
+
 int main(int argc, char** argv) {
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
@@ -1,11 +1,24 @@
 #include <algorithm>
+#include <array>
+#include <condition_variable>
 #include <iostream>
 #include <fstream>
+#include <mutex>
 #include <string>
+#include <unordered_map>
+#include <vector>
 #include <experimental/filesystem>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <leveldb/db.h>
 #include "txn_logger.h"
+#include "txn_logger_internal.h"
 #include "txn_backend.h"
+#include "txn_record.h"
 #include "txn.pb.h"
 
 using namespace std;
@@ -214,6 +227,518 @@ int fstxn_remove_txn(uint64_t txn_id) {
 
 void fstxn_shutdown(void) {}
 
+// Log segments.
+//
+// A segment is a preallocated file holding a header and then frames, each a
+// txn record (txn_record.h) created or a marker that a txn is done. Nothing
+// is ever deleted: a segment is recycled in place once every txn it holds is
+// done. As the files never change size, fdatasync() has no metadata to
+// flush, and one fdatasync() covers every frame appended before it.
+//
+// Each segment header records the oldest segment still holding live txns
+// when the segment was opened, so recovery only scans from there. Frames
+// carry the sequence number of their segment; those left over from an
+// earlier use of a recycled segment do not match it and end the scan, as do
+// torn frames, which fail their checksum.
+
+static const char* segtxn_backend_root = nullptr;
+static size_t segtxn_segment_size = 0;
+
+namespace {
+
+constexpr uint32_t kSegmentMagic = 0x47455354;  // "TSEG"
+constexpr uint32_t kSegmentVersion = 1;
+constexpr uint32_t kFrameMagic = 0x4d524654;  // "TFRM"
+
+struct SegmentHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t seq;
+  uint64_t first_live;  // oldest segment with live txns
+  uint32_t crc;         // of the fields above
+  uint32_t pad;
+};
+
+enum FrameKind : uint16_t { kFrameCreate = 1, kFrameDone = 2 };
+
+struct FrameHeader {
+  uint32_t magic;
+  uint16_t kind;
+  uint16_t pad;
+  uint64_t seq;  // of the segment
+  uint64_t txn_id;
+  uint32_t len;  // of the record that follows
+  uint32_t crc;  // of this header with crc 0, and of the record
+};
+
+static_assert(sizeof(SegmentHeader) % 8 == 0 && sizeof(FrameHeader) % 8 == 0,
+              "frames must stay 8-byte aligned");
+
+size_t pad8(size_t n) { return (n + 7) & ~(size_t)7; }
+
+// CRC-32C
+uint32_t crc32c(uint32_t crc, const void* data, size_t len) {
+  static const std::array<uint32_t, 256> table = [] {
+    std::array<uint32_t, 256> t;
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t c = i;
+      for (int k = 0; k < 8; k++) {
+        c = (c & 1) ? (c >> 1) ^ 0x82f63b78 : c >> 1;
+      }
+      t[i] = c;
+    }
+    return t;
+  }();
+  const unsigned char* p = (const unsigned char*)data;
+  crc = ~crc;
+  for (size_t i = 0; i < len; i++) {
+    crc = table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+uint32_t header_crc(SegmentHeader hdr) {
+  return crc32c(0, &hdr, offsetof(SegmentHeader, crc));
+}
+
+uint32_t frame_crc(FrameHeader hdr, const char* rec) {
+  hdr.crc = 0;
+  return crc32c(crc32c(0, &hdr, sizeof(hdr)), rec, hdr.len);
+}
+
+int pwrite_all(int fd, const char* buf, size_t len, off_t offset) {
+  while (len > 0) {
+    ssize_t n = pwrite(fd, buf, len, offset);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    buf += n;
+    len -= n;
+    offset += n;
+  }
+  return 0;
+}
+
+struct Segment {
+  int fd;
+  size_t size;
+  uint64_t seq;  // 0 if it holds nothing
+  uint64_t first_live;
+  int live;  // txns created here that are not done
+};
+
+struct LiveTxn {
+  std::string record;
+  int segment;
+};
+
+class SegmentLog {
+ public:
+  int open(const char* root, size_t segment_size);
+  void close();
+
+  int create(uint64_t txn_id, const char* rec, size_t len);
+  int remove(uint64_t txn_id);
+  int get(uint64_t txn_id, struct TxnLog* txn);
+  std::vector<uint64_t> live_txns();
+
+ private:
+  int add_segment();
+  int roll();
+  void relocate(int segment);
+  int write_frame(FrameKind kind, uint64_t txn_id, const char* rec,
+                  size_t len);
+  void scan(int segment);
+  int append(FrameKind kind, uint64_t txn_id, const char* rec, size_t len,
+             uint64_t* ticket);
+  int wait_durable(std::unique_lock<std::mutex>& l, uint64_t ticket);
+
+  std::mutex mu;
+  std::condition_variable synced_cv;
+  std::string root;
+  size_t segment_size = 0;
+  std::vector<Segment> segments;
+  int current = -1;
+  size_t offset = 0;  // in the current segment
+  uint64_t next_seq = 1;
+  // first_live of the newest segment header known to be on disk; segments
+  // before it may be overwritten.
+  uint64_t durable_first_live = 0;
+  std::unordered_map<uint64_t, LiveTxn> live;
+  std::string frame;
+  // Group commit: frames get increasing tickets, and one fdatasync() makes
+  // every ticket up to |appended| durable.
+  uint64_t appended = 0;
+  uint64_t synced = 0;
+  bool syncing = false;
+};
+
+int SegmentLog::open(const char* dir, size_t size) {
+  root = dir;
+  segment_size = size;
+  std::error_code ec;
+  fs::create_directories(root, ec);
+
+  for (int i = 0;; i++) {
+    const std::string path = root + "/seg-" + to_string(i);
+    int fd = ::open(path.c_str(), O_RDWR);
+    if (fd < 0) {
+      break;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+      ::close(fd);
+      return -1;
+    }
+    Segment seg = {fd, (size_t)st.st_size, 0, 0, 0};
+    SegmentHeader hdr;
+    if (pread(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) &&
+        hdr.magic == kSegmentMagic && hdr.version == kSegmentVersion &&
+        hdr.crc == header_crc(hdr)) {
+      seg.seq = hdr.seq;
+      seg.first_live = hdr.first_live;
+    }
+    segments.push_back(seg);
+  }
+
+  // The newest segment tells where the live ones start
+  int newest = -1;
+  for (size_t i = 0; i < segments.size(); i++) {
+    if (segments[i].seq &&
+        (newest < 0 || segments[i].seq > segments[newest].seq)) {
+      newest = i;
+    }
+  }
+  if (newest < 0) {
+    return 0;
+  }
+  next_seq = segments[newest].seq + 1;
+  durable_first_live = segments[newest].first_live;
+
+  std::vector<int> order;
+  for (size_t i = 0; i < segments.size(); i++) {
+    if (segments[i].seq >= durable_first_live) {
+      order.push_back(i);
+    } else {
+      segments[i].seq = 0;
+    }
+  }
+  sort(order.begin(), order.end(),
+       [this](int a, int b) { return segments[a].seq < segments[b].seq; });
+  for (int i : order) {
+    scan(i);
+  }
+  // Appends go to a fresh segment rather than after a possibly torn tail
+  return 0;
+}
+
+void SegmentLog::scan(int i) {
+  Segment& seg = segments[i];
+  void* map = mmap(nullptr, seg.size, PROT_READ, MAP_PRIVATE, seg.fd, 0);
+  if (map == MAP_FAILED) {
+    std::cerr << "Failed to map txn log segment " << i << std::endl;
+    return;
+  }
+  madvise(map, seg.size, MADV_SEQUENTIAL);
+  // Records are read where they are and copied only if still live
+  const char* base = (const char*)map;
+  size_t pos = sizeof(SegmentHeader);
+  while (pos + sizeof(FrameHeader) <= seg.size) {
+    FrameHeader hdr;
+    memcpy(&hdr, base + pos, sizeof(hdr));
+    const char* rec = base + pos + sizeof(hdr);
+    if (hdr.magic != kFrameMagic || hdr.seq != seg.seq ||
+        hdr.len > seg.size - pos - sizeof(hdr) ||
+        hdr.crc != frame_crc(hdr, rec)) {
+      break;
+    }
+    if (hdr.kind == kFrameCreate) {
+      // Relocated txns are created again in a later segment
+      LiveTxn& txn = live[hdr.txn_id];
+      if (!txn.record.empty()) {
+        segments[txn.segment].live--;
+      }
+      txn.record.assign(rec, hdr.len);
+      txn.segment = i;
+      seg.live++;
+    } else if (hdr.kind == kFrameDone) {
+      auto it = live.find(hdr.txn_id);
+      if (it != live.end()) {
+        segments[it->second.segment].live--;
+        live.erase(it);
+      }
+    }
+    pos += pad8(sizeof(hdr) + hdr.len);
+  }
+  munmap(map, seg.size);
+}
+
+void SegmentLog::close() {
+  std::lock_guard<std::mutex> l(mu);
+  for (auto& seg : segments) {
+    ::close(seg.fd);
+  }
+  segments.clear();
+  live.clear();
+  current = -1;
+  offset = 0;
+  next_seq = 1;
+  durable_first_live = 0;
+  appended = synced = 0;
+}
+
+int SegmentLog::add_segment() {
+  const std::string path = root + "/seg-" + to_string(segments.size());
+  int fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+  if (fd < 0) {
+    return -1;
+  }
+  if (posix_fallocate(fd, 0, segment_size) != 0) {
+    ::close(fd);
+    unlink(path.c_str());
+    return -1;
+  }
+  segments.push_back(Segment{fd, segment_size, 0, 0, 0});
+  return segments.size() - 1;
+}
+
+// Moves appends to a segment that holds nothing live; mu is held.
+int SegmentLog::roll() {
+  if (current >= 0) {
+    // Makes the header of the current segment durable, so segments before
+    // its first_live may be overwritten.
+    if (fdatasync(segments[current].fd) != 0) {
+      return -1;
+    }
+    synced = appended;
+    synced_cv.notify_all();
+    durable_first_live = segments[current].first_live;
+  }
+
+  int next = -1;
+  for (size_t i = 0; i < segments.size(); i++) {
+    const Segment& seg = segments[i];
+    if ((int)i != current && seg.live == 0 && seg.seq < durable_first_live &&
+        seg.size >= segment_size) {
+      next = i;
+      break;
+    }
+  }
+  if (next < 0 && (next = add_segment()) < 0) {
+    std::cerr << "Failed to add a txn log segment" << std::endl;
+    return -1;
+  }
+
+  Segment& seg = segments[next];
+  seg.seq = next_seq++;
+  seg.first_live = seg.seq;
+  for (const auto& s : segments) {
+    if (s.live > 0) {
+      seg.first_live = min(seg.first_live, s.seq);
+    }
+  }
+  SegmentHeader hdr = {kSegmentMagic, kSegmentVersion, seg.seq,
+                       seg.first_live, 0, 0};
+  hdr.crc = header_crc(hdr);
+  if (pwrite_all(seg.fd, (const char*)&hdr, sizeof(hdr), 0) != 0) {
+    seg.seq = 0;
+    return -1;
+  }
+  current = next;
+  offset = sizeof(hdr);
+
+  // A long-running txn would keep every segment after its own from being
+  // recycled; move the txns of segments older than the one just left.
+  int oldest = -1;
+  for (size_t i = 0; i < segments.size(); i++) {
+    const Segment& s = segments[i];
+    if (s.live > 0 && (int)i != current &&
+        (oldest < 0 || s.seq < segments[oldest].seq)) {
+      oldest = i;
+    }
+  }
+  if (oldest >= 0 && segments[oldest].seq + 1 < seg.seq) {
+    relocate(oldest);
+  }
+  return 0;
+}
+
+// Creates the txns of |segment| again in the current one, as far as they
+// fit; mu is held. The copies become durable with the next sync, and
+// |segment| can only be recycled after a later roll.
+void SegmentLog::relocate(int segment) {
+  for (auto& entry : live) {
+    LiveTxn& txn = entry.second;
+    if (txn.segment != segment) {
+      continue;
+    }
+    const size_t frame_len = pad8(sizeof(FrameHeader) + txn.record.size());
+    if (offset + frame_len > segments[current].size ||
+        write_frame(kFrameCreate, entry.first, txn.record.data(),
+                    txn.record.size()) != 0) {
+      return;
+    }
+    segments[segment].live--;
+    segments[current].live++;
+    txn.segment = current;
+  }
+}
+
+// Writes a frame at the end of the current segment; mu is held.
+int SegmentLog::write_frame(FrameKind kind, uint64_t txn_id, const char* rec,
+                            size_t len) {
+  const size_t frame_len = pad8(sizeof(FrameHeader) + len);
+  FrameHeader hdr = {kFrameMagic, kind, 0, segments[current].seq, txn_id,
+                     (uint32_t)len, 0};
+  hdr.crc = frame_crc(hdr, rec);
+  frame.assign((const char*)&hdr, sizeof(hdr));
+  frame.append(rec, len);
+  frame.resize(frame_len, '\0');
+  if (pwrite_all(segments[current].fd, frame.data(), frame.size(), offset) !=
+      0) {
+    return -1;
+  }
+  offset += frame_len;
+  appended++;
+  return 0;
+}
+
+// mu is held
+int SegmentLog::append(FrameKind kind, uint64_t txn_id, const char* rec,
+                       size_t len, uint64_t* ticket) {
+  const size_t frame_len = pad8(sizeof(FrameHeader) + len);
+  if (frame_len > segment_size - sizeof(SegmentHeader)) {
+    std::cerr << "Txn log too large for a segment: " << txn_id << std::endl;
+    return -1;
+  }
+  if (current < 0 || offset + frame_len > segments[current].size) {
+    if (roll() != 0) {
+      return -1;
+    }
+  }
+
+  if (write_frame(kind, txn_id, rec, len) != 0) {
+    return -1;
+  }
+  *ticket = appended;
+  return 0;
+}
+
+int SegmentLog::wait_durable(std::unique_lock<std::mutex>& l,
+                             uint64_t ticket) {
+  while (synced < ticket) {
+    if (syncing) {
+      synced_cv.wait(l);
+      continue;
+    }
+    // Sync for every frame appended so far, including those of threads
+    // that wait meanwhile.
+    syncing = true;
+    const uint64_t target = appended;
+    const int fd = segments[current].fd;
+    l.unlock();
+    int ret = fdatasync(fd);
+    l.lock();
+    syncing = false;
+    if (ret == 0) {
+      synced = max(synced, target);
+    }
+    synced_cv.notify_all();
+    if (ret != 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int SegmentLog::create(uint64_t txn_id, const char* rec, size_t len) {
+  std::unique_lock<std::mutex> l(mu);
+  uint64_t ticket;
+  if (append(kFrameCreate, txn_id, rec, len, &ticket) != 0) {
+    std::cerr << "Failed to append txn " << txn_id << std::endl;
+    return -1;
+  }
+  LiveTxn& txn = live[txn_id];
+  if (!txn.record.empty()) {
+    segments[txn.segment].live--;
+  }
+  txn.record.assign(rec, len);
+  txn.segment = current;
+  segments[current].live++;
+  return wait_durable(l, ticket);
+}
+
+int SegmentLog::remove(uint64_t txn_id) {
+  std::unique_lock<std::mutex> l(mu);
+  auto it = live.find(txn_id);
+  if (it == live.end()) {
+    return 0;
+  }
+  uint64_t ticket;
+  if (append(kFrameDone, txn_id, "", 0, &ticket) != 0) {
+    std::cerr << "Failed to mark txn " << txn_id << " done" << std::endl;
+    return -1;
+  }
+  segments[it->second.segment].live--;
+  live.erase(it);
+  return wait_durable(l, ticket);
+}
+
+int SegmentLog::get(uint64_t txn_id, struct TxnLog* txn) {
+  std::lock_guard<std::mutex> l(mu);
+  auto it = live.find(txn_id);
+  if (it == live.end()) {
+    return -1;
+  }
+  const std::string& rec = it->second.record;
+  return txn_record_decode(rec.data(), rec.size(), txn);
+}
+
+std::vector<uint64_t> SegmentLog::live_txns() {
+  std::lock_guard<std::mutex> l(mu);
+  std::vector<uint64_t> ids;
+  for (const auto& txn : live) {
+    ids.push_back(txn.first);
+  }
+  sort(ids.begin(), ids.end());
+  return ids;
+}
+
+SegmentLog segtxn_log;
+
+}  // namespace
+
+int segtxn_init(void) {
+  return segtxn_log.open(segtxn_backend_root, segtxn_segment_size);
+}
+
+int segtxn_create_txn(uint64_t txn_id, struct TxnLog* txn) {
+  size_t len;
+  const char* rec = txn_record_encode(txn, &len);
+  return segtxn_log.create(txn_id, rec, len);
+}
+
+// The TxnLog points into the backend and is valid until the txn is removed
+int segtxn_get_txn(uint64_t txn_id, struct TxnLog* txn) {
+  return segtxn_log.get(txn_id, txn);
+}
+
+void segtxn_enumerate_txn(void (*callback)(struct TxnLog* txn)) {
+  for (uint64_t txn_id : segtxn_log.live_txns()) {
+    struct TxnLog txn;
+    if (segtxn_get_txn(txn_id, &txn) < 0) {
+      continue;
+    }
+    callback(&txn);
+    txn_log_free(&txn);
+  }
+}
+
+int segtxn_remove_txn(uint64_t txn_id) { return segtxn_log.remove(txn_id); }
+
+void segtxn_shutdown(void) { segtxn_log.close(); }
+
 static struct txn_backend ldbtxn_backend = {
     .backend_init = ldbtxn_init,
     .get_txn = ldbtxn_get_txn,
@@ -242,3 +767,18 @@ void init_fstxn_backend(const char* root, const char* filename,
   fstxn_txnfilename = filename;
   *txn_backend = &fstxn_backend;
 }
+
+static struct txn_backend segtxn_backend = {
+    .backend_init = segtxn_init,
+    .get_txn = segtxn_get_txn,
+    .enumerate_txn = segtxn_enumerate_txn,
+    .remove_txn = segtxn_remove_txn,
+    .create_txn = segtxn_create_txn,
+    .backend_shutdown = segtxn_shutdown};
+
+void init_segtxn_backend(const char* root, size_t segment_size,
+                         struct txn_backend** txn_backend) {
+  segtxn_backend_root = root;
+  segtxn_segment_size = segment_size;
+  *txn_backend = &segtxn_backend;
+}
@@ -0,0 +1,83 @@
+#include <benchmark/benchmark.h>
+
+#include <string.h>
+
+#include <atomic>
+#include <experimental/filesystem>
+#include <string>
+
+#include "txn_backend.h"
+#include "txn_logger.h"
+
+namespace fs = std::experimental::filesystem;
+
+// Each iteration logs a VWrite with one inline undo of |range(0)| bytes and
+// then removes it, as a compound that commits does.
+static void create_remove(benchmark::State& state, struct txn_backend* backend,
+                          std::atomic<uint64_t>* next_id) {
+  std::string data(state.range(0), 'u');
+  struct InlineUndo undo;
+  memset(&undo, 0, sizeof(undo));
+  undo.data = data.data();
+  undo.len = data.size();
+  struct TxnLog txn;
+  memset(&txn, 0, sizeof(txn));
+  txn.compound_type = txn_VWrite;
+  txn.backup_dir_path = "";
+  txn.inline_undos = &undo;
+  txn.num_inline_undos = 1;
+
+  while (state.KeepRunning()) {
+    txn.txn_id = next_id->fetch_add(1);
+    backend->create_txn(txn.txn_id, &txn);
+    backend->remove_txn(txn.txn_id);
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+static std::atomic<uint64_t> next_id{1};
+
+// Shared by all threads of a run and opened by whichever thread gets there
+// first.
+static struct txn_backend* ldb_backend() {
+  static struct txn_backend* backend = [] {
+    struct txn_backend* backend;
+    fs::remove_all("/tmp/ldbtxn_bench");
+    init_ldbtxn_backend("/tmp/ldbtxn_bench", "txn_", &backend);
+    backend->backend_init();
+    return backend;
+  }();
+  return backend;
+}
+
+static struct txn_backend* seg_backend() {
+  static struct txn_backend* backend = [] {
+    struct txn_backend* backend;
+    fs::remove_all("/tmp/segtxn_bench");
+    init_segtxn_backend("/tmp/segtxn_bench", 64 << 20, &backend);
+    backend->backend_init();
+    return backend;
+  }();
+  return backend;
+}
+
+// The LevelDB backend writes without syncing, and converts through
+// txn_log_to_pb(), which is not thread-safe, so it runs on one thread.
+static void BM_ldbtxn_create_remove(benchmark::State& state) {
+  create_remove(state, ldb_backend(), &next_id);
+}
+
+BENCHMARK(BM_ldbtxn_create_remove)->Arg(512)->Arg(4096);
+
+// Every create and remove is synced, with the syncs shared between threads
+static void BM_segtxn_create_remove(benchmark::State& state) {
+  create_remove(state, seg_backend(), &next_id);
+}
+
+BENCHMARK(BM_segtxn_create_remove)
+    ->Arg(512)
+    ->Arg(4096)
+    ->ThreadRange(1, 16)
+    ->UseRealTime();
+
+BENCHMARK_MAIN();
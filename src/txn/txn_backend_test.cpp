@@ -2,9 +2,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <experimental/filesystem>
+#include <fstream>
 
 #include "txn_backend.h"
 #include "txn_logger.h"
+#include "txn_logger_internal.h"
 namespace fs = std::experimental::filesystem;
 
 void txn_processor(struct TxnLog* txn) {
@@ -91,6 +93,147 @@ TEST(TxnBackend, SimpleLDbBackend) {
   fs::remove_all(dbroot);
 }
 
+static int num_enumerated;
+
+void count_txn(struct TxnLog* /* txn */) { num_enumerated++; }
+
+static int num_segments(const std::string& root) {
+  return std::distance(fs::directory_iterator(root), fs::directory_iterator());
+}
+
+TEST(TxnBackend, SimpleSegBackend) {
+  struct txn_backend* backend;
+  struct TxnLog txn_write;
+  struct TxnLog txn_read;
+  memset(&txn_write, 0, sizeof(txn_write));
+  txn_write.compound_type = txn_VNone;
+  std::string segroot = "/tmp/segtxn";
+  fs::remove_all(segroot);
+  init_segtxn_backend(segroot.c_str(), 1 << 20, &backend);
+
+  ASSERT_EQ(0, backend->backend_init());
+
+  txn_write.txn_id = 42;
+  ASSERT_EQ(0, backend->create_txn(42, &txn_write));
+
+  txn_write.txn_id = 52;
+  ASSERT_EQ(0, backend->create_txn(52, &txn_write));
+
+  txn_write.txn_id = 92;
+  ASSERT_EQ(0, backend->create_txn(92, &txn_write));
+
+  backend->get_txn(42, &txn_read);
+  ASSERT_EQ(42, txn_read.txn_id);
+
+  backend->get_txn(52, &txn_read);
+  ASSERT_EQ(52, txn_read.txn_id);
+
+  backend->get_txn(92, &txn_read);
+  ASSERT_EQ(92, txn_read.txn_id);
+  ASSERT_EQ(-1, backend->get_txn(12, &txn_read));
+
+  ASSERT_EQ(0, backend->remove_txn(42));
+  ASSERT_EQ(-1, backend->get_txn(42, &txn_read));
+  // okay, even if txn does not exist
+  ASSERT_EQ(0, backend->remove_txn(12));
+
+  num_enumerated = 0;
+  backend->enumerate_txn(&count_txn);
+  EXPECT_EQ(2, num_enumerated);
+  backend->backend_shutdown();
+
+  // Pending txns survive a restart; removed ones do not
+  ASSERT_EQ(0, backend->backend_init());
+  num_enumerated = 0;
+  backend->enumerate_txn(&count_txn);
+  EXPECT_EQ(2, num_enumerated);
+  ASSERT_EQ(-1, backend->get_txn(42, &txn_read));
+  ASSERT_EQ(0, backend->get_txn(92, &txn_read));
+  ASSERT_EQ(92, txn_read.txn_id);
+  backend->backend_shutdown();
+
+  fs::remove_all(segroot);
+}
+
+TEST(TxnBackend, SegBackendRecyclesSegments) {
+  struct txn_backend* backend;
+  struct TxnLog txn;
+  std::string undo_data(1000, 'u');
+  struct InlineUndo undo;
+  memset(&undo, 0, sizeof(undo));
+  undo.data = undo_data.data();
+  undo.len = undo_data.size();
+  memset(&txn, 0, sizeof(txn));
+  txn.compound_type = txn_VWrite;
+  txn.inline_undos = &undo;
+  txn.num_inline_undos = 1;
+
+  std::string segroot = "/tmp/segtxn_recycle";
+  fs::remove_all(segroot);
+  init_segtxn_backend(segroot.c_str(), 8192, &backend);
+  ASSERT_EQ(0, backend->backend_init());
+
+  // One txn stays pending throughout
+  txn.txn_id = 1;
+  ASSERT_EQ(0, backend->create_txn(1, &txn));
+  for (uint64_t id = 2; id < 200; id++) {
+    txn.txn_id = id;
+    ASSERT_EQ(0, backend->create_txn(id, &txn));
+    ASSERT_EQ(0, backend->remove_txn(id));
+  }
+  // Roughly 7 frames fit a segment; without recycling there would be ~60
+  EXPECT_LE(num_segments(segroot), 6);
+  backend->backend_shutdown();
+
+  ASSERT_EQ(0, backend->backend_init());
+  num_enumerated = 0;
+  backend->enumerate_txn(&count_txn);
+  EXPECT_EQ(1, num_enumerated);
+  struct TxnLog txn_read;
+  ASSERT_EQ(0, backend->get_txn(1, &txn_read));
+  ASSERT_EQ(1, txn_read.num_inline_undos);
+  EXPECT_EQ(undo_data, std::string(txn_read.inline_undos[0].data,
+                                   txn_read.inline_undos[0].len));
+  txn_log_free(&txn_read);
+  backend->backend_shutdown();
+
+  fs::remove_all(segroot);
+}
+
+TEST(TxnBackend, SegBackendStopsAtTornFrame) {
+  struct txn_backend* backend;
+  struct TxnLog txn;
+  struct TxnLog txn_read;
+  memset(&txn, 0, sizeof(txn));
+  txn.compound_type = txn_VNone;
+  std::string segroot = "/tmp/segtxn_torn";
+  fs::remove_all(segroot);
+  init_segtxn_backend(segroot.c_str(), 1 << 16, &backend);
+  ASSERT_EQ(0, backend->backend_init());
+  for (uint64_t id = 1; id <= 3; id++) {
+    txn.txn_id = id;
+    ASSERT_EQ(0, backend->create_txn(id, &txn));
+  }
+  backend->backend_shutdown();
+
+  // Flip a byte of the last record, as if its write were torn
+  const std::string seg = segroot + "/seg-0";
+  std::fstream f(seg, std::ios::in | std::ios::out | std::ios::binary);
+  std::string data((std::istreambuf_iterator<char>(f)),
+                   std::istreambuf_iterator<char>());
+  size_t last = data.find_last_not_of('\0');
+  f.seekp(last);
+  f.put(data[last] ^ 1);
+  f.close();
+
+  ASSERT_EQ(0, backend->backend_init());
+  ASSERT_EQ(0, backend->get_txn(2, &txn_read));
+  ASSERT_EQ(-1, backend->get_txn(3, &txn_read));
+  backend->backend_shutdown();
+
+  fs::remove_all(segroot);
+}
+
 int main(int argc, char** argv) {
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
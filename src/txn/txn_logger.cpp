@@ -4,7 +4,7 @@
 #include <fstream>
 #include <functional>
 #include <iostream>
-#include <sstream>
+#include <mutex>
 #include <string>
 
 #include <absl/strings/str_cat.h>
@@ -14,6 +14,7 @@
 #include "txn.pb.h"
 #include "txn_logger.h"
 #include "txn_logger_internal.h"
+#include "txn_record.h"
 #define MAX_LEN 64
 
 using namespace std;
@@ -73,6 +74,32 @@ FSObjectType get_file_type(proto::FileType newType) {
   }
 }
 
+/**
+ * @brief returns the CompoundType logged for a TransactionType
+ *
+ * An OPEN that may create is logged as a create.
+ */
+CompoundType get_compound_type(proto::TransactionType type) {
+  using TransactionType = proto::TransactionType;
+  switch (type) {
+  case TransactionType::VCREATE:
+  case TransactionType::VOPEN:
+    return txn_VCreate;
+  case TransactionType::VMKDIR:
+    return txn_VMkdir;
+  case TransactionType::VWRITE:
+    return txn_VWrite;
+  case TransactionType::VRENAME:
+    return txn_VRename;
+  case TransactionType::VUNLINK:
+    return txn_VUnlink;
+  case TransactionType::VSYMLINK:
+    return txn_VSymlink;
+  default:
+    return txn_VNone;
+  }
+}
+
 /**
  * @brief helper function to convert array of bytes to hex format
  *
@@ -150,13 +177,32 @@ void serialize_mkdir_txn(struct TxnLog *txn_log,
   }
 }
 
+/**
+ * @brief helper function to serialize_write_txn
+ */
+void serialize_inline_undo(const struct InlineUndo *undo,
+                           proto::VWriteTxn::InlineUndo *undo_obj) {
+  undo_obj->mutable_file_id()->set_uuid((const char *)undo->file_id.id,
+                                        TXN_UUID_LEN);
+  undo_obj->mutable_file_id()->set_type(
+      get_file_type_txn(undo->file_id.file_type));
+  undo_obj->set_offset(undo->offset);
+  undo_obj->set_data(undo->data, undo->len);
+  undo_obj->set_orig_size(undo->orig_size);
+}
+
 /**
  * @brief helper function to serialize_txn_log
- * This function fills proto::TransactionLog for transaction involving VMkdir
+ * This function fills proto::TransactionLog for transaction involving VWrite
  */
 void serialize_write_txn(struct TxnLog *txn_log,
                          proto::TransactionLog *txn_log_obj) {
   txn_log_obj->set_type(proto::TransactionType::VWRITE);
+  for (int i = 0; i < txn_log->num_inline_undos; i++) {
+    proto::VWriteTxn *write_txn = txn_log_obj->mutable_writes();
+    write_txn->set_backup_dir_path(txn_log->backup_dir_path);
+    serialize_inline_undo(&txn_log->inline_undos[i], write_txn->add_undos());
+  }
   for (int i = 0; i < txn_log->num_files; i++) {
     proto::VWriteTxn *write_txn = txn_log_obj->mutable_writes();
     write_txn->set_backup_dir_path(txn_log->backup_dir_path);
@@ -332,6 +378,8 @@ void deserialize_mkdir_txn(proto::TransactionLog *txn_log_obj,
 void deserialize_write_txn(proto::TransactionLog *txn_log_obj,
                            struct TxnLog *txn_log) {
   txn_log->compound_type = txn_VWrite;
+  txn_log->inline_undos = nullptr;
+  txn_log->num_inline_undos = 0;
 
   if (txn_log_obj->has_writes()) {
     const proto::VWriteTxn &write_txn = txn_log_obj->writes();
@@ -357,6 +405,22 @@ void deserialize_write_txn(proto::TransactionLog *txn_log_obj,
       // copy path
       strcpy(txnobj->path, object.path().c_str());
     }
+
+    // the data stays in |txn_log_obj|
+    txn_log->num_inline_undos = write_txn.undos_size();
+    txn_log->inline_undos = (struct InlineUndo *)malloc(
+        sizeof(struct InlineUndo) * txn_log->num_inline_undos);
+    for (int i = 0; i < write_txn.undos_size(); i++) {
+      const proto::VWriteTxn::InlineUndo &object = write_txn.undos(i);
+      struct InlineUndo *undo = &txn_log->inline_undos[i];
+
+      memcpy(undo->file_id.id, object.file_id().uuid().c_str(), TXN_UUID_LEN);
+      undo->file_id.file_type = get_file_type(object.file_id().type());
+      undo->offset = object.offset();
+      undo->orig_size = object.orig_size();
+      undo->data = object.data().data();
+      undo->len = object.data().size();
+    }
   }
 }
 
@@ -531,6 +595,32 @@ int txn_log_from_pb(proto::TransactionLog *txnpb, struct TxnLog *txn_log) {
   return ret;
 }
 
+int txn_record_to_pb(const char *rec, size_t len,
+                     proto::TransactionLog *txnpb) {
+  struct TxnLog txn_log;
+  if (txn_record_decode(rec, len, &txn_log) != 0) {
+    return -1;
+  }
+  // Records get their undos without a backup dir; protobuf wants one.
+  if (!txn_log.backup_dir_path) {
+    txn_log.backup_dir_path = "";
+  }
+  int ret = txn_log_to_pb(&txn_log, txnpb);
+  txn_log_free(&txn_log);
+  return ret;
+}
+
+const char *txn_record_from_pb(proto::TransactionLog *txnpb, size_t *len) {
+  struct TxnLog txn_log;
+  memset(&txn_log, 0, sizeof(txn_log));
+  const char *rec = nullptr;
+  if (txn_log_from_pb(txnpb, &txn_log) == 0) {
+    rec = txn_record_encode(&txn_log, len);
+  }
+  txn_log_free(&txn_log);
+  return rec;
+}
+
 void txn_log_free(struct TxnLog *txn_log) {
   if (!txn_log) {
     return;
@@ -540,6 +630,8 @@ void txn_log_free(struct TxnLog *txn_log) {
   case txn_VNone:
     break;
   case txn_VWrite:
+    free(txn_log->inline_undos);
+    /* fall through */
   case txn_VMkdir:
   case txn_VCreate:
     free(txn_log->created_file_ids);
@@ -590,10 +682,71 @@ proto::TransactionType get_txn_type(const COMPOUND4args *arg) {
   return txn_type;
 }
 
-uint64_t get_txn_id() {
-  // A valid txn id starts from 1. 0 is an invalid Id.
-  static std::atomic<uint64_t> next_txn_id{1};
-  return next_txn_id++;
+// Txn ids are reserved in the database in batches, so that they keep
+// increasing across restarts without a database write per txn. The next batch
+// is reserved by the thread that crosses the middle of the current one, and
+// only threads that run out of reserved ids before it is done have to wait.
+constexpr uint64_t kTxnIdReserveBatchSize = 4096;
+const char kNextTxnIdKey[] = "__NEXT_TXN_ID__";
+
+// A valid txn id starts from 1. 0 is an invalid Id.
+std::atomic<uint64_t> next_txn_id{1};
+// The max reserved txn id (exclusive).
+std::atomic<uint64_t> max_reserved_txn_id{0};
+std::mutex txn_id_mutex;
+std::once_flag txn_id_loaded;
+
+// Persists a max reserved txn id past |need|; txn_id_mutex must be held.
+// Returns 0 on success.
+int reserve_txn_ids(const db_store_t *db, uint64_t need) {
+  if (need <= max_reserved_txn_id.load(std::memory_order_relaxed)) return 0;
+
+  const uint64_t reserved = need + kTxnIdReserveBatchSize;
+  db_kvpair_t kvp;
+  kvp.key = kNextTxnIdKey;
+  kvp.key_len = sizeof(kNextTxnIdKey) - 1;
+  kvp.val = (const char *)&reserved;
+  kvp.val_len = sizeof(reserved);
+  if (put_keys(&kvp, 1, db) != 0) {
+    std::cerr << "failed to reserve txn ids" << std::endl;
+    return -1;
+  }
+  max_reserved_txn_id.store(reserved, std::memory_order_release);
+  return 0;
+}
+
+void load_txn_id(const db_store_t *db) {
+  db_kvpair_t kvp;
+  kvp.key = kNextTxnIdKey;
+  kvp.key_len = sizeof(kNextTxnIdKey) - 1;
+  kvp.val = nullptr;
+  kvp.val_len = 0;
+  if (get_keys(&kvp, 1, db) == 0 && kvp.val_len == sizeof(uint64_t)) {
+    uint64_t next;
+    memcpy(&next, kvp.val, sizeof(next));
+    next_txn_id.store(next);
+  }
+  free((void *)kvp.val);
+}
+
+// Returns kInvalidTxnId if no id can be reserved.
+uint64_t get_txn_id(const db_store_t *db) {
+  std::call_once(txn_id_loaded, load_txn_id, db);
+
+  const uint64_t id = next_txn_id.fetch_add(1, std::memory_order_relaxed);
+  const uint64_t reserved =
+      max_reserved_txn_id.load(std::memory_order_acquire);
+  if (id >= reserved) {
+    std::lock_guard<std::mutex> l(txn_id_mutex);
+    if (reserve_txn_ids(db, id + 1) != 0) return kInvalidTxnId;
+  } else if (reserved - id <= kTxnIdReserveBatchSize / 2) {
+    // Past the middle: whoever gets the lock first reserves the next batch,
+    // the others go on with the ids still reserved. A failure is retried
+    // by the next txn.
+    std::unique_lock<std::mutex> l(txn_id_mutex, std::try_to_lock);
+    if (l.owns_lock()) reserve_txn_ids(db, reserved + 1);
+  }
+  return id;
 }
 
 // TODO: Test this.
@@ -689,43 +842,109 @@ int build_vwrite_txn(const COMPOUND4args *arg, proto::VWriteTxn *write_txn) {
   return 0;
 }
 
+// Write |txn_log| as the undo record |seq| of its txn. A record of its own:
+// the cost does not grow with the records written before.
+int put_undo_record(const db_store_t *db, const TxnLog &txn_log,
+                    uint32_t seq) {
+  const string key = absl::StrCat("txn-", txn_log.txn_id, "/u", seq);
+  size_t len;
+  const char *value = txn_record_encode(&txn_log, &len);
+
+  leveldb_writebatch_t *batch = leveldb_writebatch_create();
+  leveldb_writebatch_put(batch, key.data(), key.size(), value, len);
+  int ret = db_group_write(db, batch);
+  leveldb_writebatch_destroy(batch);
+  if (ret != 0) {
+    std::cerr << "Failed to write txn log.";
+  }
+  return ret;
+}
+
 } // namespace internal
 
-uint64_t create_txn_log(const db_store_t *db, const COMPOUND4args *arg) {
-  proto::TransactionLog txn_log;
+int add_txn_undos(const db_store_t *db, uint64_t txn_id, uint32_t seq,
+                  const struct InlineUndo *undos, int n) {
+  struct TxnLog txn_log;
+  memset(&txn_log, 0, sizeof(txn_log));
+  txn_log.txn_id = txn_id;
+  txn_log.compound_type = txn_VWrite;
+  txn_log.inline_undos = (struct InlineUndo *)undos;
+  txn_log.num_inline_undos = n;
+  return internal::put_undo_record(db, txn_log, seq);
+}
+
+int add_txn_backup_dir(const db_store_t *db, uint64_t txn_id, uint32_t seq,
+                       const char *path) {
+  struct TxnLog txn_log;
+  memset(&txn_log, 0, sizeof(txn_log));
+  txn_log.txn_id = txn_id;
+  txn_log.compound_type = txn_VNone;
+  txn_log.backup_dir_path = path;
+  return internal::put_undo_record(db, txn_log, seq);
+}
+
+void delete_txn_log(leveldb_writebatch_t *batch, uint64_t txn_id,
+                    uint32_t n_undo_records) {
+  const string key = absl::StrCat("txn-", txn_id);
+  leveldb_writebatch_delete(batch, key.data(), key.size());
+  for (uint32_t i = 0; i < n_undo_records; i++) {
+    const string undo_key = absl::StrCat(key, "/u", i);
+    leveldb_writebatch_delete(batch, undo_key.data(), undo_key.size());
+  }
+}
 
-  txn_log.set_type(internal::get_txn_type(arg));
-  if (txn_log.type() == proto::TransactionType::NONE) {
+int txn_log_exists(const db_store_t *db, uint64_t txn_id) {
+  const string key = absl::StrCat("txn-", txn_id);
+
+  db_kvpair_t kvp;
+  kvp.key = key.data();
+  kvp.key_len = key.size();
+  kvp.val = nullptr;
+  kvp.val_len = 0;
+  if (get_keys(&kvp, 1, db) != 0) {
+    return -1;
+  }
+  const int found = kvp.val != nullptr;
+  free((void *)kvp.val);
+  return found;
+}
+
+uint64_t create_txn_log(const db_store_t *db, const COMPOUND4args *arg) {
+  const proto::TransactionType type = internal::get_txn_type(arg);
+  if (type == proto::TransactionType::NONE) {
     /* If the compound is read-only or ineligible for transaction,
      * return immediately without doing expensive leveldb_write */
     return kInvalidTxnId;
   }
 
-  txn_log.set_id(internal::get_txn_id());
-  if (txn_log.type() == proto::TransactionType::VCREATE) {
+  struct TxnLog txn_log;
+  memset(&txn_log, 0, sizeof(txn_log));
+  txn_log.txn_id = internal::get_txn_id(db);
+  if (txn_log.txn_id == kInvalidTxnId) {
+    return TXN_LOG_ERROR;
+  }
+  txn_log.compound_type = get_compound_type(type);
+  if (type == proto::TransactionType::VCREATE) {
     // internal::build_vcreate_txn(arg, txn_log.mutable_creates(), context);
-  } else if (txn_log.type() == proto::TransactionType::VWRITE) {
+  } else if (type == proto::TransactionType::VWRITE) {
     // internal::build_vwrite_txn(arg, txn_log.mutable_writes(), context);
   }
 
-  const string key = absl::StrCat("txn-", txn_log.id());
+  const string key = absl::StrCat("txn-", txn_log.txn_id);
 
-  // Write txn_log to database.
-  std::ostringstream output;
-  if (!txn_log.SerializeToOstream(&output)) {
-    std::cerr << "Failed to serialize txn log.";
-    return kInvalidTxnId;
-  }
-  const string value = output.str();
+  // Encoded into a buffer of this thread, which leveldb copies from.
+  size_t len;
+  const char *value = txn_record_encode(&txn_log, &len);
 
-  char *err_msg = nullptr;
-  leveldb_put(db->db, db->w_options, key.data(), key.size(), value.data(),
-              value.size(), &err_msg);
-  if (err_msg != nullptr) {
-    std::cerr << "Failed to write txn log: " << err_msg;
-    free(err_msg);
-    return kInvalidTxnId;
+  // Go through group commit so that concurrent compounds share one fsync.
+  leveldb_writebatch_t *batch = leveldb_writebatch_create();
+  leveldb_writebatch_put(batch, key.data(), key.size(), value, len);
+  int ret = db_group_write(db, batch);
+  leveldb_writebatch_destroy(batch);
+  if (ret != 0) {
+    std::cerr << "Failed to write txn log.";
+    return TXN_LOG_ERROR;
   }
 
-  return txn_log.id();
+  return txn_log.txn_id;
 }
@@ -0,0 +1,110 @@
+#include <benchmark/benchmark.h>
+
+#include <string.h>
+
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "txn.pb.h"
+#include "txn_logger.h"
+#include "txn_logger_internal.h"
+#include "txn_record.h"
+
+// A VWrite log with |n| inline undos of |kUndoSize| bytes, as recovery
+// reads it once its undo records are merged.
+static const size_t kUndoSize = 512;
+
+struct WriteLog {
+  std::string data;
+  std::vector<InlineUndo> undos;
+  TxnLog log;
+
+  explicit WriteLog(int n) : data(kUndoSize, 'x'), undos(n) {
+    for (int i = 0; i < n; i++) {
+      uuid_generate(undos[i].file_id.id);
+      undos[i].file_id.file_type = ft_File;
+      undos[i].offset = kUndoSize * i;
+      undos[i].orig_size = kUndoSize * n;
+      undos[i].data = data.data();
+      undos[i].len = data.size();
+    }
+    memset(&log, 0, sizeof(log));
+    log.txn_id = 4242;
+    log.compound_type = txn_VWrite;
+    log.backup_dir_path = "";
+    log.inline_undos = undos.data();
+    log.num_inline_undos = n;
+  }
+};
+
+static void BM_proto_serialize(benchmark::State& state) {
+  WriteLog w(state.range(0));
+  proto::TransactionLog txnpb;
+  txn_log_to_pb(&w.log, &txnpb);
+
+  while (state.KeepRunning()) {
+    std::ostringstream output;
+    txnpb.SerializeToOstream(&output);
+    const std::string value = output.str();
+    benchmark::DoNotOptimize(value.data());
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK(BM_proto_serialize)->Arg(1)->Arg(8)->Arg(64);
+
+static void BM_record_encode(benchmark::State& state) {
+  WriteLog w(state.range(0));
+  size_t len;
+
+  while (state.KeepRunning()) {
+    benchmark::DoNotOptimize(txn_record_encode(&w.log, &len));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK(BM_record_encode)->Arg(1)->Arg(8)->Arg(64);
+
+static void BM_proto_parse(benchmark::State& state) {
+  WriteLog w(state.range(0));
+  proto::TransactionLog txnpb;
+  txn_log_to_pb(&w.log, &txnpb);
+  const std::string value = txnpb.SerializeAsString();
+
+  while (state.KeepRunning()) {
+    proto::TransactionLog parsed;
+    parsed.ParseFromArray(value.data(), value.size());
+    benchmark::DoNotOptimize(parsed.writes().undos_size());
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK(BM_proto_parse)->Arg(1)->Arg(8)->Arg(64);
+
+// Reads every undo where it is, as from an mmap'd log segment
+static void BM_record_read(benchmark::State& state) {
+  WriteLog w(state.range(0));
+  size_t len;
+  const char* rec = txn_record_encode(&w.log, &len);
+  const std::string value(rec, len);
+
+  while (state.KeepRunning()) {
+    txn_record_header hdr;
+    txn_record_reader reader;
+    txn_record_item item;
+    size_t total = 0;
+    txn_record_open(value.data(), value.size(), &hdr, &reader);
+    while (txn_record_next(&reader, &item) > 0) {
+      if (item.kind == txn_rec_inline_undo) {
+        total += item.u.undo.len;
+      }
+    }
+    benchmark::DoNotOptimize(total);
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK(BM_record_read)->Arg(1)->Arg(8)->Arg(64);
+
+BENCHMARK_MAIN();
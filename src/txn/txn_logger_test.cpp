@@ -16,6 +16,7 @@
 #include "txn.pb.h"
 #include "txn_logger.h"
 #include "txn_logger_internal.h"
+#include "txn_record.h"
 
 using namespace std;
 
@@ -35,6 +36,8 @@ protected:
   struct UnlinkId created_unlinks[1];
   struct SymlinkId created_symlinks[1];
   struct RenameId created_renames[1];
+  struct InlineUndo inline_undos[2];
+  string undo_data = string("old\0data", 8);
   virtual void SetUp() {
     // create
     uuid_generate(created_file[0].base_id.id);
@@ -72,6 +75,18 @@ protected:
     created_renames[0].dst_fileid.flags = 1;
     txn_log.created_rename_ids = created_renames;
     txn_log.num_renames = 1;
+
+    // inline undos
+    for (int i = 0; i < 2; i++) {
+      uuid_generate(inline_undos[i].file_id.id);
+      inline_undos[i].file_id.file_type = ft_File;
+      inline_undos[i].offset = 4096 * i;
+      inline_undos[i].orig_size = 8192;
+      inline_undos[i].data = undo_data.data();
+      inline_undos[i].len = undo_data.size();
+    }
+    txn_log.inline_undos = inline_undos;
+    txn_log.num_inline_undos = 2;
   }
   virtual void TearDown() { txn_log_free(&deserialized_txn_log); }
 
@@ -85,6 +100,11 @@ protected:
       ret = 0;
       break;
     case txn_VWrite:
+      EXPECT_EQ(txn1->num_inline_undos, txn2->num_inline_undos);
+      for (int i = 0; i < txn1->num_inline_undos; i++) {
+        EXPECT_EQ(0, compare(&txn1->inline_undos[i], &txn2->inline_undos[i]));
+      }
+      // fall through
     case txn_VMkdir:
     case txn_VCreate:
       EXPECT_EQ(txn1->num_files, txn2->num_files);
@@ -119,6 +139,15 @@ protected:
     return 0;
   }
 
+  int compare(struct InlineUndo *undo1, struct InlineUndo *undo2) {
+    EXPECT_EQ(compare(&undo1->file_id, &undo2->file_id), 0);
+    EXPECT_EQ(undo1->offset, undo2->offset);
+    EXPECT_EQ(undo1->orig_size, undo2->orig_size);
+    EXPECT_EQ(string(undo1->data, undo1->len),
+              string(undo2->data, undo2->len));
+    return 0;
+  }
+
   int compare(struct CreatedObject *cobj1, struct CreatedObject *cobj2) {
     EXPECT_STREQ(cobj1->path, cobj2->path);
     EXPECT_EQ(compare(&cobj1->base_id, &cobj2->base_id), 0);
@@ -218,6 +247,36 @@ TEST_F(TxnTest, RenameTest) {
   txn_log_from_pb(&txnpb, &deserialized_txn_log);
   EXPECT_EQ(0, compare(&txn_log, &deserialized_txn_log));
 }
+TEST_F(TxnTest, RecordToPbTest) {
+  txn_log.txn_id = 9998;
+  txn_log.compound_type = txn_VWrite;
+  txn_log.backup_dir_path = backup_dir_path.c_str();
+
+  size_t len;
+  const char *rec = txn_record_encode(&txn_log, &len);
+  ASSERT_EQ(0, txn_record_to_pb(rec, len, &txnpb));
+  EXPECT_EQ(proto::TransactionType::VWRITE, txnpb.type());
+  txn_log_from_pb(&txnpb, &deserialized_txn_log);
+  EXPECT_EQ(0, compare(&txn_log, &deserialized_txn_log));
+
+  EXPECT_EQ(-1, txn_record_to_pb("not a record", 12, &txnpb));
+}
+
+TEST_F(TxnTest, RecordFromPbTest) {
+  txn_log.txn_id = 9999;
+  txn_log.compound_type = txn_VRename;
+  txn_log.backup_dir_path = backup_dir_path.c_str();
+  txn_log_to_pb(&txn_log, &txnpb);
+
+  size_t len;
+  const char *rec = txn_record_from_pb(&txnpb, &len);
+  ASSERT_TRUE(rec);
+  const string copy(rec, len);
+  ASSERT_EQ(0, txn_record_decode(copy.data(), copy.size(),
+                                 &deserialized_txn_log));
+  EXPECT_EQ(0, compare(&txn_log, &deserialized_txn_log));
+}
+
 /*
 TEST_F(TxnTest, CreateTxnLogTest) {
   db_store_t *db = init_db_store("test_db", true);
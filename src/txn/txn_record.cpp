@@ -0,0 +1,511 @@
+#include "txn_record.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+
+// Fixed fields of the entries, right after their struct txn_record_entry.
+// Each is a multiple of 8 bytes long.
+
+struct rec_undo {
+  uint8_t id[16];
+  uint32_t file_type;
+  uint32_t pad;
+  uint64_t offset;
+  uint64_t orig_size;
+  uint64_t len;
+};
+
+struct rec_created {
+  uint8_t base[16];
+  uint8_t allocated[16];
+  uint32_t base_type;
+  uint32_t allocated_type;
+};
+
+struct rec_link {
+  uint8_t parent[16];
+  uint32_t parent_type;
+  uint32_t name_len;
+};
+
+// Set in txn_record_entry.flags of a rename with a destination file id
+#define REC_RENAME_HAS_DST 1
+
+struct rec_rename {
+  uint32_t src_type;
+  uint32_t dst_type;
+  int32_t src_flags;
+  int32_t dst_flags;
+  uint32_t src_path_len;
+  uint32_t dst_path_len;
+  uint32_t src_id_len;
+  uint32_t dst_id_len;
+  uint8_t is_directory;
+  uint8_t pad[7];
+};
+
+static_assert(sizeof(txn_record_header) == 24, "unexpected header size");
+static_assert(sizeof(txn_record_entry) == 8, "unexpected entry size");
+static_assert(sizeof(rec_undo) % 8 == 0 && sizeof(rec_created) % 8 == 0 &&
+                  sizeof(rec_link) % 8 == 0 && sizeof(rec_rename) % 8 == 0,
+              "entries must stay 8-byte aligned");
+
+static size_t pad8(size_t n) { return (n + 7) & ~(size_t)7; }
+
+// The buffer records are encoded into; one per thread so that encoding
+// neither allocates once it has grown nor needs a lock.
+static std::string &thread_buffer() {
+  static thread_local std::string buf;
+  return buf;
+}
+
+namespace {
+
+class Writer {
+public:
+  explicit Writer(std::string *buf) : buf(buf) {}
+
+  void begin(uint16_t kind, uint16_t flags = 0) {
+    entry_start = buf->size();
+    txn_record_entry entry = {kind, flags, 0};
+    append(&entry, sizeof(entry));
+  }
+
+  void append(const void *data, size_t len) {
+    buf->append((const char *)data, len);
+  }
+
+  // Appends |str| with its NUL and returns its length
+  uint32_t append_str(const char *str) {
+    size_t len = str ? strlen(str) : 0;
+    buf->append(str ? str : "", len);
+    buf->push_back('\0');
+    return len;
+  }
+
+  void end() {
+    buf->resize(pad8(buf->size()), '\0');
+    uint32_t size = buf->size() - entry_start;
+    memcpy(&(*buf)[entry_start + offsetof(txn_record_entry, size)], &size,
+           sizeof(size));
+    n_entries++;
+  }
+
+  uint32_t n_entries = 0;
+
+private:
+  std::string *buf;
+  size_t entry_start = 0;
+};
+
+}  // namespace
+
+static void copy_id(uint8_t *dst, const ObjectId &id) {
+  memcpy(dst, id.id, sizeof(uuid_t));
+}
+
+static void write_undo(Writer *w, const InlineUndo &undo) {
+  rec_undo fixed;
+  memset(&fixed, 0, sizeof(fixed));
+  copy_id(fixed.id, undo.file_id);
+  fixed.file_type = undo.file_id.file_type;
+  fixed.offset = undo.offset;
+  fixed.orig_size = undo.orig_size;
+  fixed.len = undo.len;
+  w->begin(txn_rec_inline_undo);
+  w->append(&fixed, sizeof(fixed));
+  w->append(undo.data, undo.len);
+  w->end();
+}
+
+// Which entries a record of each type may hold; txn_log_free() only frees
+// the arrays that go with the type.
+static bool type_holds(CompoundType type, txn_record_kind kind) {
+  switch (kind) {
+  case txn_rec_backup_dir:
+    return true;
+  case txn_rec_created:
+    return type == txn_VCreate || type == txn_VMkdir || type == txn_VWrite;
+  case txn_rec_inline_undo:
+    return type == txn_VWrite;
+  case txn_rec_unlink:
+    return type == txn_VUnlink;
+  case txn_rec_symlink:
+    return type == txn_VSymlink;
+  case txn_rec_rename:
+    return type == txn_VRename;
+  }
+  return false;
+}
+
+// How many entries of |kind| to write from an array of |log|
+static int count(const TxnLog *log, txn_record_kind kind, int n,
+                 const void *array) {
+  return array && type_holds(log->compound_type, kind) ? n : 0;
+}
+
+// Writes the entries of |log| that its type holds, as txn_log_to_pb() does
+static void write_entries(Writer *w, const TxnLog *log) {
+  const int n_files =
+      count(log, txn_rec_created, log->num_files, log->created_file_ids);
+  const int n_unlinks =
+      count(log, txn_rec_unlink, log->num_unlinks, log->created_unlink_ids);
+  const int n_symlinks =
+      count(log, txn_rec_symlink, log->num_symlinks, log->created_symlink_ids);
+  const int n_renames =
+      count(log, txn_rec_rename, log->num_renames, log->created_rename_ids);
+  const int n_undos =
+      count(log, txn_rec_inline_undo, log->num_inline_undos, log->inline_undos);
+
+  if (log->backup_dir_path) {
+    w->begin(txn_rec_backup_dir);
+    w->append_str(log->backup_dir_path);
+    w->end();
+  }
+  for (int i = 0; i < n_files; i++) {
+    const CreatedObject &object = log->created_file_ids[i];
+    rec_created fixed;
+    copy_id(fixed.base, object.base_id);
+    copy_id(fixed.allocated, object.allocated_id);
+    fixed.base_type = object.base_id.file_type;
+    fixed.allocated_type = object.allocated_id.file_type;
+    w->begin(txn_rec_created);
+    w->append(&fixed, sizeof(fixed));
+    w->append_str(object.path);
+    w->end();
+  }
+  for (int i = 0; i < n_unlinks; i++) {
+    const UnlinkId &object = log->created_unlink_ids[i];
+    rec_link fixed;
+    copy_id(fixed.parent, object.parent_id);
+    fixed.parent_type = object.parent_id.file_type;
+    fixed.name_len = strlen(object.name);
+    w->begin(txn_rec_unlink);
+    w->append(&fixed, sizeof(fixed));
+    w->append_str(object.name);
+    w->end();
+  }
+  for (int i = 0; i < n_symlinks; i++) {
+    const SymlinkId &object = log->created_symlink_ids[i];
+    rec_link fixed;
+    copy_id(fixed.parent, object.parent_id);
+    fixed.parent_type = object.parent_id.file_type;
+    fixed.name_len = strlen(object.name);
+    w->begin(txn_rec_symlink);
+    w->append(&fixed, sizeof(fixed));
+    w->append_str(object.name);
+    w->append_str(object.src_path);
+    w->end();
+  }
+  for (int i = 0; i < n_renames; i++) {
+    const RenameId &object = log->created_rename_ids[i];
+    const bool has_dst = object.dst_fileid.data != nullptr;
+    rec_rename fixed;
+    memset(&fixed, 0, sizeof(fixed));
+    fixed.src_type = object.src_fileid.file_type;
+    fixed.dst_type = object.dst_fileid.file_type;
+    fixed.src_flags = object.src_fileid.flags;
+    fixed.dst_flags = object.dst_fileid.flags;
+    fixed.src_path_len = strlen(object.src_path);
+    fixed.dst_path_len = strlen(object.dst_path);
+    fixed.src_id_len = object.src_fileid.data ? strlen(object.src_fileid.data)
+                                              : 0;
+    fixed.dst_id_len = has_dst ? strlen(object.dst_fileid.data) : 0;
+    fixed.is_directory = object.is_directory;
+    w->begin(txn_rec_rename, has_dst ? REC_RENAME_HAS_DST : 0);
+    w->append(&fixed, sizeof(fixed));
+    w->append_str(object.src_path);
+    w->append_str(object.dst_path);
+    w->append_str(object.src_fileid.data);
+    w->append_str(object.dst_fileid.data);
+    w->end();
+  }
+  for (int i = 0; i < n_undos; i++) {
+    write_undo(w, log->inline_undos[i]);
+  }
+}
+
+static void set_header(std::string *buf, uint32_t n_entries) {
+  txn_record_header hdr;
+  memcpy(&hdr, buf->data(), sizeof(hdr));
+  hdr.n_entries = n_entries;
+  hdr.size = buf->size();
+  memcpy(&(*buf)[0], &hdr, sizeof(hdr));
+}
+
+const char *txn_record_encode(const TxnLog *log, size_t *len) {
+  std::string &buf = thread_buffer();
+  txn_record_header hdr;
+  hdr.magic = TXN_RECORD_MAGIC;
+  hdr.version = TXN_RECORD_VERSION;
+  hdr.type = log->compound_type;
+  hdr.txn_id = log->txn_id;
+  hdr.n_entries = 0;
+  hdr.size = 0;
+  buf.assign((const char *)&hdr, sizeof(hdr));
+
+  Writer w(&buf);
+  write_entries(&w, log);
+  set_header(&buf, w.n_entries);
+  *len = buf.size();
+  return buf.data();
+}
+
+int txn_record_open(const char *buf, size_t len, txn_record_header *hdr,
+                    txn_record_reader *reader) {
+  if (len < sizeof(*hdr)) {
+    return -1;
+  }
+  memcpy(hdr, buf, sizeof(*hdr));
+  if (hdr->magic != TXN_RECORD_MAGIC || hdr->version != TXN_RECORD_VERSION ||
+      hdr->size < sizeof(*hdr) || hdr->size > len) {
+    return -1;
+  }
+  reader->pos = buf + sizeof(*hdr);
+  reader->end = buf + hdr->size;
+  reader->left = hdr->n_entries;
+  return 0;
+}
+
+// Whether |len| bytes and a NUL are at |str|, before |end|
+static bool has_str(const char *str, size_t len, const char *end) {
+  return len < (size_t)(end - str) && str[len] == '\0';
+}
+
+static void read_id(ObjectId *id, const uint8_t *raw, uint32_t type) {
+  memcpy(id->id, raw, sizeof(uuid_t));
+  id->file_type = (FSObjectType)type;
+}
+
+int txn_record_next(txn_record_reader *reader, txn_record_item *item) {
+  if (reader->left == 0) {
+    return 0;
+  }
+  txn_record_entry entry;
+  if ((size_t)(reader->end - reader->pos) < sizeof(entry)) {
+    return -1;
+  }
+  memcpy(&entry, reader->pos, sizeof(entry));
+  if (entry.size < sizeof(entry) || entry.size % 8 != 0 ||
+      entry.size > (size_t)(reader->end - reader->pos)) {
+    return -1;
+  }
+  const char *body = reader->pos + sizeof(entry);
+  const char *end = reader->pos + entry.size;
+  const size_t body_len = end - body;
+
+  item->kind = (txn_record_kind)entry.kind;
+  switch (entry.kind) {
+  case txn_rec_backup_dir:
+    if (!has_str(body, strnlen(body, body_len), end)) {
+      return -1;
+    }
+    item->u.backup_dir = body;
+    break;
+  case txn_rec_inline_undo: {
+    rec_undo fixed;
+    if (body_len < sizeof(fixed)) {
+      return -1;
+    }
+    memcpy(&fixed, body, sizeof(fixed));
+    if (fixed.len > body_len - sizeof(fixed)) {
+      return -1;
+    }
+    read_id(&item->u.undo.file_id, fixed.id, fixed.file_type);
+    item->u.undo.offset = fixed.offset;
+    item->u.undo.orig_size = fixed.orig_size;
+    item->u.undo.data = body + sizeof(fixed);
+    item->u.undo.len = fixed.len;
+    break;
+  }
+  case txn_rec_created: {
+    rec_created fixed;
+    if (body_len < sizeof(fixed)) {
+      return -1;
+    }
+    memcpy(&fixed, body, sizeof(fixed));
+    const char *path = body + sizeof(fixed);
+    if (!has_str(path, strnlen(path, end - path), end)) {
+      return -1;
+    }
+    read_id(&item->u.created.base_id, fixed.base, fixed.base_type);
+    read_id(&item->u.created.allocated_id, fixed.allocated,
+            fixed.allocated_type);
+    item->u.created.path = path;
+    break;
+  }
+  case txn_rec_unlink:
+  case txn_rec_symlink: {
+    rec_link fixed;
+    if (body_len < sizeof(fixed)) {
+      return -1;
+    }
+    memcpy(&fixed, body, sizeof(fixed));
+    const char *name = body + sizeof(fixed);
+    if (!has_str(name, fixed.name_len, end)) {
+      return -1;
+    }
+    const char *src_path = name + fixed.name_len + 1;
+    if (entry.kind == txn_rec_symlink) {
+      if (!has_str(src_path, strnlen(src_path, end - src_path), end)) {
+        return -1;
+      }
+    } else {
+      src_path = nullptr;
+    }
+    read_id(&item->u.link.parent_id, fixed.parent, fixed.parent_type);
+    item->u.link.name = name;
+    item->u.link.src_path = src_path;
+    break;
+  }
+  case txn_rec_rename: {
+    rec_rename fixed;
+    if (body_len < sizeof(fixed)) {
+      return -1;
+    }
+    memcpy(&fixed, body, sizeof(fixed));
+    const char *src_path = body + sizeof(fixed);
+    if (!has_str(src_path, fixed.src_path_len, end)) {
+      return -1;
+    }
+    const char *dst_path = src_path + fixed.src_path_len + 1;
+    if (!has_str(dst_path, fixed.dst_path_len, end)) {
+      return -1;
+    }
+    const char *src_id = dst_path + fixed.dst_path_len + 1;
+    if (!has_str(src_id, fixed.src_id_len, end)) {
+      return -1;
+    }
+    const char *dst_id = src_id + fixed.src_id_len + 1;
+    if (!has_str(dst_id, fixed.dst_id_len, end)) {
+      return -1;
+    }
+    RenameId &rename = item->u.rename;
+    rename.src_path = src_path;
+    rename.dst_path = dst_path;
+    rename.src_fileid.data = src_id;
+    rename.src_fileid.file_type = (FSObjectType)fixed.src_type;
+    rename.src_fileid.flags = fixed.src_flags;
+    rename.dst_fileid.data =
+        (entry.flags & REC_RENAME_HAS_DST) ? dst_id : nullptr;
+    rename.dst_fileid.file_type = (FSObjectType)fixed.dst_type;
+    rename.dst_fileid.flags = fixed.dst_flags;
+    rename.is_directory = fixed.is_directory;
+    break;
+  }
+  default:
+    return -1;
+  }
+
+  reader->pos = end;
+  reader->left--;
+  return 1;
+}
+
+int txn_record_decode(const char *buf, size_t len, TxnLog *log) {
+  txn_record_header hdr;
+  txn_record_reader reader;
+  txn_record_item item;
+  int ret;
+
+  memset(log, 0, sizeof(*log));
+  if (txn_record_open(buf, len, &hdr, &reader) != 0 ||
+      hdr.type > txn_VSymlink) {
+    return -1;
+  }
+  log->txn_id = hdr.txn_id;
+  log->compound_type = (CompoundType)hdr.type;
+
+  // Count first, so that each array is allocated once
+  txn_record_reader counter = reader;
+  while ((ret = txn_record_next(&counter, &item)) > 0) {
+    if (!type_holds(log->compound_type, item.kind)) {
+      return -1;
+    }
+    switch (item.kind) {
+    case txn_rec_created:
+      log->num_files++;
+      break;
+    case txn_rec_unlink:
+      log->num_unlinks++;
+      break;
+    case txn_rec_symlink:
+      log->num_symlinks++;
+      break;
+    case txn_rec_rename:
+      log->num_renames++;
+      break;
+    case txn_rec_inline_undo:
+      log->num_inline_undos++;
+      break;
+    default:
+      break;
+    }
+  }
+  if (ret < 0) {
+    return -1;
+  }
+
+  if (log->num_files) {
+    log->created_file_ids =
+        (CreatedObject *)malloc(sizeof(CreatedObject) * log->num_files);
+  }
+  if (log->num_unlinks) {
+    log->created_unlink_ids =
+        (UnlinkId *)malloc(sizeof(UnlinkId) * log->num_unlinks);
+  }
+  if (log->num_symlinks) {
+    log->created_symlink_ids =
+        (SymlinkId *)malloc(sizeof(SymlinkId) * log->num_symlinks);
+  }
+  if (log->num_renames) {
+    log->created_rename_ids =
+        (RenameId *)malloc(sizeof(RenameId) * log->num_renames);
+  }
+  if (log->num_inline_undos) {
+    log->inline_undos =
+        (InlineUndo *)malloc(sizeof(InlineUndo) * log->num_inline_undos);
+  }
+
+  int n_files = 0, n_unlinks = 0, n_symlinks = 0, n_renames = 0, n_undos = 0;
+  while (txn_record_next(&reader, &item) > 0) {
+    switch (item.kind) {
+    case txn_rec_backup_dir:
+      log->backup_dir_path = item.u.backup_dir;
+      break;
+    case txn_rec_created: {
+      CreatedObject *object = &log->created_file_ids[n_files++];
+      object->base_id = item.u.created.base_id;
+      object->allocated_id = item.u.created.allocated_id;
+      strncpy(object->path, item.u.created.path, PATH_MAX - 1);
+      object->path[PATH_MAX - 1] = '\0';
+      break;
+    }
+    case txn_rec_unlink: {
+      UnlinkId *object = &log->created_unlink_ids[n_unlinks++];
+      object->parent_id = item.u.link.parent_id;
+      strncpy(object->name, item.u.link.name, NAME_MAX - 1);
+      object->name[NAME_MAX - 1] = '\0';
+      break;
+    }
+    case txn_rec_symlink: {
+      SymlinkId *object = &log->created_symlink_ids[n_symlinks++];
+      object->parent_id = item.u.link.parent_id;
+      strncpy(object->name, item.u.link.name, NAME_MAX - 1);
+      object->name[NAME_MAX - 1] = '\0';
+      strncpy(object->src_path, item.u.link.src_path, PATH_MAX - 1);
+      object->src_path[PATH_MAX - 1] = '\0';
+      break;
+    }
+    case txn_rec_rename:
+      log->created_rename_ids[n_renames++] = item.u.rename;
+      break;
+    case txn_rec_inline_undo:
+      log->inline_undos[n_undos++] = item.u.undo;
+      break;
+    }
+  }
+  return 0;
+}
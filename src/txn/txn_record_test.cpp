@@ -0,0 +1,255 @@
+#include "txn_record.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+using namespace std;
+
+class TxnRecordTest : public ::testing::Test {
+protected:
+  TxnLog log;
+  TxnLog decoded;
+  CreatedObject created[2];
+  UnlinkId unlinks[1];
+  SymlinkId symlinks[1];
+  RenameId renames[2];
+  InlineUndo undos[2];
+  string undo_data = string("old\0data", 8);
+  string backup_dir = "/backup/42";
+
+  virtual void SetUp() {
+    memset(&log, 0, sizeof(log));
+    memset(&decoded, 0, sizeof(decoded));
+    log.txn_id = 42;
+
+    for (int i = 0; i < 2; i++) {
+      uuid_generate(created[i].base_id.id);
+      created[i].base_id.file_type = ft_Directory;
+      uuid_generate(created[i].allocated_id.id);
+      created[i].allocated_id.file_type = ft_File;
+      snprintf(created[i].path, PATH_MAX, "dir/file%d", i);
+    }
+    uuid_generate(unlinks[0].parent_id.id);
+    unlinks[0].parent_id.file_type = ft_Directory;
+    strcpy(unlinks[0].name, "victim");
+    uuid_generate(symlinks[0].parent_id.id);
+    symlinks[0].parent_id.file_type = ft_Directory;
+    strcpy(symlinks[0].name, "link");
+    strcpy(symlinks[0].src_path, "/target/of/link");
+
+    renames[0] = {"/a/src", "/a/dst", {"srcid", ft_File, 1},
+                  {"dstid", ft_File, 2}, false};
+    renames[1] = {"/b/src", "/b/dst", {"srcid2", ft_Directory, 0},
+                  {nullptr, ft_None, 0}, true};
+
+    for (int i = 0; i < 2; i++) {
+      uuid_generate(undos[i].file_id.id);
+      undos[i].file_id.file_type = ft_File;
+      undos[i].offset = 4096 * i;
+      undos[i].orig_size = 8192;
+      undos[i].data = undo_data.data();
+      undos[i].len = undo_data.size() - i;
+    }
+  }
+
+  virtual void TearDown() { free_decoded(); }
+
+  // txn_log_free() is in txn_logger; the arrays are plain malloc() ones
+  void free_decoded() {
+    free(decoded.created_file_ids);
+    free(decoded.created_unlink_ids);
+    free(decoded.created_symlink_ids);
+    free(decoded.created_rename_ids);
+    free(decoded.inline_undos);
+    memset(&decoded, 0, sizeof(decoded));
+  }
+
+  // Decode |rec| from a copy at an odd address
+  string roundtrip(const char *rec, size_t len) {
+    string copy = string(1, 'x') + string(rec, len);
+    EXPECT_EQ(0, txn_record_decode(&copy[1], len, &decoded));
+    return copy;
+  }
+
+  static void expect_id(const ObjectId &a, const ObjectId &b) {
+    EXPECT_EQ(0, uuid_compare(a.id, b.id));
+    EXPECT_EQ(a.file_type, b.file_type);
+  }
+
+  static void expect_undo(const InlineUndo &a, const InlineUndo &b) {
+    expect_id(a.file_id, b.file_id);
+    EXPECT_EQ(a.offset, b.offset);
+    EXPECT_EQ(a.orig_size, b.orig_size);
+    EXPECT_EQ(string(a.data, a.len), string(b.data, b.len));
+  }
+};
+
+TEST_F(TxnRecordTest, HeaderOnly) {
+  log.compound_type = txn_VCreate;
+  size_t len;
+  const char *rec = txn_record_encode(&log, &len);
+  EXPECT_EQ(sizeof(txn_record_header), len);
+
+  string keep = roundtrip(rec, len);
+  EXPECT_EQ(42, decoded.txn_id);
+  EXPECT_EQ(txn_VCreate, decoded.compound_type);
+  EXPECT_EQ(0, decoded.num_files);
+  EXPECT_EQ(nullptr, decoded.backup_dir_path);
+}
+
+TEST_F(TxnRecordTest, Write) {
+  log.compound_type = txn_VWrite;
+  log.backup_dir_path = backup_dir.c_str();
+  log.created_file_ids = created;
+  log.num_files = 2;
+  log.inline_undos = undos;
+  log.num_inline_undos = 2;
+  size_t len;
+  const char *rec = txn_record_encode(&log, &len);
+  EXPECT_EQ(0, len % 8);
+
+  string keep = roundtrip(rec, len);
+  EXPECT_EQ(txn_VWrite, decoded.compound_type);
+  EXPECT_STREQ(backup_dir.c_str(), decoded.backup_dir_path);
+  ASSERT_EQ(2, decoded.num_files);
+  for (int i = 0; i < 2; i++) {
+    expect_id(created[i].base_id, decoded.created_file_ids[i].base_id);
+    expect_id(created[i].allocated_id,
+              decoded.created_file_ids[i].allocated_id);
+    EXPECT_STREQ(created[i].path, decoded.created_file_ids[i].path);
+  }
+  ASSERT_EQ(2, decoded.num_inline_undos);
+  for (int i = 0; i < 2; i++) {
+    expect_undo(undos[i], decoded.inline_undos[i]);
+  }
+  // The data is read where it is
+  EXPECT_GT(decoded.inline_undos[0].data, keep.data());
+  EXPECT_LT(decoded.inline_undos[0].data, keep.data() + keep.size());
+}
+
+TEST_F(TxnRecordTest, OnlyEntriesOfTheType) {
+  log.compound_type = txn_VMkdir;
+  log.created_file_ids = created;
+  log.num_files = 1;
+  log.created_unlink_ids = unlinks;
+  log.num_unlinks = 1;
+  log.inline_undos = undos;
+  log.num_inline_undos = 2;
+  size_t len;
+  const char *rec = txn_record_encode(&log, &len);
+  string keep = roundtrip(rec, len);
+  EXPECT_EQ(1, decoded.num_files);
+  EXPECT_EQ(0, decoded.num_unlinks);
+  EXPECT_EQ(0, decoded.num_inline_undos);
+}
+
+TEST_F(TxnRecordTest, UnlinkAndSymlink) {
+  log.compound_type = txn_VUnlink;
+  log.created_unlink_ids = unlinks;
+  log.num_unlinks = 1;
+  size_t len;
+  const char *rec = txn_record_encode(&log, &len);
+  string keep = roundtrip(rec, len);
+  ASSERT_EQ(1, decoded.num_unlinks);
+  expect_id(unlinks[0].parent_id, decoded.created_unlink_ids[0].parent_id);
+  EXPECT_STREQ("victim", decoded.created_unlink_ids[0].name);
+  free_decoded();
+
+  memset(&log, 0, sizeof(log));
+  log.compound_type = txn_VSymlink;
+  log.created_symlink_ids = symlinks;
+  log.num_symlinks = 1;
+  rec = txn_record_encode(&log, &len);
+  keep = roundtrip(rec, len);
+  ASSERT_EQ(1, decoded.num_symlinks);
+  expect_id(symlinks[0].parent_id, decoded.created_symlink_ids[0].parent_id);
+  EXPECT_STREQ("link", decoded.created_symlink_ids[0].name);
+  EXPECT_STREQ("/target/of/link", decoded.created_symlink_ids[0].src_path);
+}
+
+TEST_F(TxnRecordTest, Rename) {
+  log.compound_type = txn_VRename;
+  log.created_rename_ids = renames;
+  log.num_renames = 2;
+  size_t len;
+  const char *rec = txn_record_encode(&log, &len);
+  string keep = roundtrip(rec, len);
+  ASSERT_EQ(2, decoded.num_renames);
+  for (int i = 0; i < 2; i++) {
+    const RenameId &a = renames[i], &b = decoded.created_rename_ids[i];
+    EXPECT_STREQ(a.src_path, b.src_path);
+    EXPECT_STREQ(a.dst_path, b.dst_path);
+    EXPECT_STREQ(a.src_fileid.data, b.src_fileid.data);
+    EXPECT_EQ(a.src_fileid.file_type, b.src_fileid.file_type);
+    EXPECT_EQ(a.src_fileid.flags, b.src_fileid.flags);
+    EXPECT_EQ(a.is_directory, b.is_directory);
+  }
+  EXPECT_STREQ("dstid", decoded.created_rename_ids[0].dst_fileid.data);
+  EXPECT_EQ(2, decoded.created_rename_ids[0].dst_fileid.flags);
+  EXPECT_EQ(nullptr, decoded.created_rename_ids[1].dst_fileid.data);
+}
+
+TEST_F(TxnRecordTest, ReadInPlace) {
+  log.compound_type = txn_VWrite;
+  log.backup_dir_path = backup_dir.c_str();
+  log.inline_undos = undos;
+  log.num_inline_undos = 2;
+  size_t len;
+  const char *rec = txn_record_encode(&log, &len);
+
+  txn_record_header hdr;
+  txn_record_reader reader;
+  txn_record_item item;
+  ASSERT_EQ(0, txn_record_open(rec, len, &hdr, &reader));
+  EXPECT_EQ(3, hdr.n_entries);
+  ASSERT_EQ(1, txn_record_next(&reader, &item));
+  EXPECT_EQ(txn_rec_backup_dir, item.kind);
+  EXPECT_STREQ(backup_dir.c_str(), item.u.backup_dir);
+  for (int i = 0; i < 2; i++) {
+    ASSERT_EQ(1, txn_record_next(&reader, &item));
+    ASSERT_EQ(txn_rec_inline_undo, item.kind);
+    expect_undo(undos[i], item.u.undo);
+  }
+  EXPECT_EQ(0, txn_record_next(&reader, &item));
+}
+
+TEST_F(TxnRecordTest, CorruptRecords) {
+  log.compound_type = txn_VUnlink;
+  log.created_unlink_ids = unlinks;
+  log.num_unlinks = 1;
+  size_t len;
+  const char *encoded = txn_record_encode(&log, &len);
+  string rec(encoded, len);
+
+  // Truncated anywhere
+  for (size_t cut = 0; cut < rec.size(); cut++) {
+    EXPECT_EQ(-1, txn_record_decode(rec.data(), cut, &decoded)) << cut;
+  }
+  // Not a record
+  string bad = rec;
+  bad[0] ^= 1;
+  EXPECT_EQ(-1, txn_record_decode(bad.data(), bad.size(), &decoded));
+  // Entry that does not fit its record
+  bad = rec;
+  bad[sizeof(txn_record_header) + 4] = 0x7f;
+  EXPECT_EQ(-1, txn_record_decode(bad.data(), bad.size(), &decoded));
+  // Name without its NUL
+  bad = rec;
+  bad[bad.size() - 2] = 'x';
+  bad[bad.size() - 1] = 'x';
+  uint32_t name_len = 64;
+  memcpy(&bad[sizeof(txn_record_header) + 8 + 20], &name_len,
+         sizeof(name_len));
+  EXPECT_EQ(-1, txn_record_decode(bad.data(), bad.size(), &decoded));
+  // Entry the type cannot hold
+  bad = rec;
+  uint16_t type = txn_VCreate;
+  memcpy(&bad[offsetof(txn_record_header, type)], &type, sizeof(type));
+  EXPECT_EQ(-1, txn_record_decode(bad.data(), bad.size(), &decoded));
+  EXPECT_EQ(nullptr, decoded.created_unlink_ids);
+}
@@ -0,0 +1,400 @@
+#include "txn_recovery.hpp"
+
+#include <algorithm>
+#include <ctype.h>
+#include <iostream>
+#include <numeric>
+#include <stdlib.h>
+#include <string.h>
+
+#include <absl/strings/str_cat.h>
+
+#include "txn.pb.h"
+#include "txn_record.h"
+
+using namespace std;
+
+// Must match the key create_txn_log() writes
+static const char kTxnLogPrefix[] = "txn-";
+// Written under the log of a txn left pending for its backup directory
+static const char kKeptSuffix[] = "/kept";
+
+static string uuid_object(const uuid_t id) {
+  return absl::StrCat("u", string((const char *)id, sizeof(uuid_t)));
+}
+
+static string name_object(const uuid_t dir, const char *name) {
+  return absl::StrCat("n", string((const char *)dir, sizeof(uuid_t)), name);
+}
+
+static string path_object(const char *path) {
+  return absl::StrCat("p", path);
+}
+
+static bool all_digits(const char *begin, const char *end) {
+  return begin != end && all_of(begin, end, [](char c) {
+           return isdigit((unsigned char)c);
+         });
+}
+
+// Add what the undo record |undo| holds to the log of its txn
+static bool merge_record(TxnLog *log, const TxnLog &undo) {
+  if (log->txn_id != undo.txn_id) {
+    return false;
+  }
+  if (undo.backup_dir_path) {
+    log->backup_dir_path = undo.backup_dir_path;
+  }
+  if (undo.num_inline_undos == 0) {
+    return true;
+  }
+  if (log->compound_type != txn_VWrite) {
+    return false;
+  }
+  const int n = log->num_inline_undos + undo.num_inline_undos;
+  log->inline_undos =
+      (InlineUndo *)realloc(log->inline_undos, sizeof(InlineUndo) * n);
+  copy(undo.inline_undos, undo.inline_undos + undo.num_inline_undos,
+       log->inline_undos + log->num_inline_undos);
+  log->num_inline_undos = n;
+  return true;
+}
+
+TxnRecovery::TxnRecovery() : n_corrupt(0) {}
+
+TxnRecovery::~TxnRecovery() {
+  for (auto &log : logs) {
+    txn_log_free(&log);
+  }
+}
+
+vector<string> TxnRecovery::touched_objects(const TxnLog &txn) {
+  vector<string> objects;
+  for (int i = 0; i < txn.num_files && txn.created_file_ids; i++) {
+    const CreatedObject &object = txn.created_file_ids[i];
+    objects.push_back(name_object(object.base_id.id, object.path));
+    objects.push_back(uuid_object(object.allocated_id.id));
+  }
+  for (int i = 0; i < txn.num_unlinks && txn.created_unlink_ids; i++) {
+    const UnlinkId &object = txn.created_unlink_ids[i];
+    objects.push_back(name_object(object.parent_id.id, object.name));
+  }
+  for (int i = 0; i < txn.num_symlinks && txn.created_symlink_ids; i++) {
+    const SymlinkId &object = txn.created_symlink_ids[i];
+    objects.push_back(name_object(object.parent_id.id, object.name));
+  }
+  for (int i = 0; i < txn.num_renames && txn.created_rename_ids; i++) {
+    const RenameId &object = txn.created_rename_ids[i];
+    objects.push_back(path_object(object.src_path));
+    objects.push_back(path_object(object.dst_path));
+  }
+  for (int i = 0; i < txn.num_inline_undos && txn.inline_undos; i++) {
+    objects.push_back(uuid_object(txn.inline_undos[i].file_id.id));
+  }
+  return objects;
+}
+
+vector<vector<int>> TxnRecovery::partition(
+    const vector<vector<string>> &objects) {
+  const int n = objects.size();
+  // Union-find over txns; the root of a set is its smallest txn
+  vector<int> parent(n);
+  iota(parent.begin(), parent.end(), 0);
+  auto find = [&parent](int i) {
+    while (parent[i] != i) {
+      parent[i] = parent[parent[i]];
+      i = parent[i];
+    }
+    return i;
+  };
+
+  unordered_map<string, int> owner;
+  for (int i = 0; i < n; i++) {
+    for (const auto &object : objects[i]) {
+      auto res = owner.emplace(object, i);
+      if (res.second) {
+        continue;
+      }
+      int a = find(i), b = find(res.first->second);
+      if (a != b) {
+        parent[max(a, b)] = min(a, b);
+      }
+    }
+  }
+
+  vector<vector<int>> groups;
+  vector<int> index(n, -1);
+  for (int i = 0; i < n; i++) {
+    int root = find(i);
+    if (index[root] < 0) {
+      index[root] = groups.size();
+      groups.emplace_back();
+    }
+    groups[index[root]].push_back(i);
+  }
+  stable_sort(groups.begin(), groups.end(),
+              [](const vector<int> &a, const vector<int> &b) {
+                return a.size() > b.size();
+              });
+  return groups;
+}
+
+bool TxnRecovery::read_logs(const db_store_t *db) {
+  const size_t prefix_len = sizeof(kTxnLogPrefix) - 1;
+  leveldb_iterator_t *iter = leveldb_create_iterator(db->db, db->r_options);
+  for (leveldb_iter_seek(iter, kTxnLogPrefix, prefix_len);
+       leveldb_iter_valid(iter); leveldb_iter_next(iter)) {
+    size_t key_len, val_len;
+    const char *key = leveldb_iter_key(iter, &key_len);
+    if (key_len < prefix_len || memcmp(key, kTxnLogPrefix, prefix_len) != 0) {
+      break;
+    }
+    // Skip the anchor of lwrapper and anything else but "txn-<id>", the
+    // undo records "txn-<id>/u<seq>" and the "txn-<id>/kept" mark, which
+    // come right after their log.
+    const char *key_end = key + key_len;
+    const char *id_end = find(key + prefix_len, key_end, '/');
+    if (!all_digits(key + prefix_len, id_end)) {
+      continue;
+    }
+    if (string(id_end, key_end) == kKeptSuffix) {
+      if (!logs.empty() &&
+          logs.back().txn_id == strtoull(key + prefix_len, nullptr, 10)) {
+        kept_ids.insert(logs.back().txn_id);
+      }
+      continue;
+    }
+    const bool undo_record = id_end != key_end;
+    if (undo_record && (key_end - id_end < 3 || id_end[1] != 'u' ||
+                        !all_digits(id_end + 2, key_end))) {
+      continue;
+    }
+    const char *val = leveldb_iter_value(iter, &val_len);
+    if (undo_record) {
+      records.emplace_back(val, val_len);
+      TxnLog undo;
+      if (txn_record_decode(records.back().data(), records.back().size(),
+                            &undo) != 0) {
+        std::cerr << "Corrupt txn undo record: " << string(key, key_len);
+        records.pop_back();
+        n_corrupt++;
+        continue;
+      }
+      if (logs.empty() || !merge_record(&logs.back(), undo)) {
+        std::cerr << "Txn undo record without its log: "
+                  << string(key, key_len);
+        n_corrupt++;
+      }
+      txn_log_free(&undo);
+      continue;
+    }
+    uint32_t magic = 0;
+    if (val_len >= sizeof(magic)) {
+      memcpy(&magic, val, sizeof(magic));
+    }
+    if (magic == TXN_RECORD_MAGIC) {
+      records.emplace_back(val, val_len);
+      TxnLog log;
+      if (txn_record_decode(records.back().data(), records.back().size(),
+                            &log) != 0) {
+        std::cerr << "Corrupt txn log: " << string(key, key_len);
+        records.pop_back();
+        n_corrupt++;
+        continue;
+      }
+      logs.push_back(log);
+      continue;
+    }
+
+    // Logs written before txn_record.h
+    unique_ptr<proto::TransactionLog> txnpb(new proto::TransactionLog);
+    if (!txnpb->ParseFromArray(val, val_len)) {
+      std::cerr << "Failed to parse txn log: " << string(key, key_len);
+      n_corrupt++;
+      continue;
+    }
+    protos.push_back(std::move(txnpb));
+  }
+
+  char *err = nullptr;
+  leveldb_iter_get_error(iter, &err);
+  leveldb_iter_destroy(iter);
+  if (err) {
+    std::cerr << "Failed to read txn logs: " << err;
+    leveldb_free(err);
+    return false;
+  }
+
+  // Converted only once every log is parsed, as txn_log_from_pb() shuts
+  // the protobuf library down.
+  for (const auto &txnpb : protos) {
+    TxnLog log;
+    memset(&log, 0, sizeof(log));
+    // Types without anything to undo, like VOPEN, are left as txn_VNone
+    txn_log_from_pb(txnpb.get(), &log);
+    logs.push_back(log);
+  }
+  return true;
+}
+
+bool TxnRecovery::read_handles(const db_store_t *db, const string &prefix) {
+  vector<string> keys;
+  for (const auto &log : logs) {
+    for (int i = 0; i < log.num_inline_undos; i++) {
+      keys.push_back(
+          absl::StrCat(prefix, string((const char *)log.inline_undos[i].file_id.id,
+                                      sizeof(uuid_t))));
+    }
+  }
+  sort(keys.begin(), keys.end());
+  keys.erase(unique(keys.begin(), keys.end()), keys.end());
+
+  // Sorted keys let one iterator walk the table forward instead of a get
+  // per key that starts over from the top of the tree.
+  leveldb_readoptions_set_fill_cache(db->r_options, 0);
+  leveldb_iterator_t *iter = leveldb_create_iterator(db->db, db->r_options);
+  for (const auto &key : keys) {
+    leveldb_iter_seek(iter, key.data(), key.size());
+    if (!leveldb_iter_valid(iter)) {
+      break;
+    }
+    size_t key_len, val_len;
+    const char *found = leveldb_iter_key(iter, &key_len);
+    if (key_len != key.size() || memcmp(found, key.data(), key_len) != 0) {
+      continue;
+    }
+    const char *val = leveldb_iter_value(iter, &val_len);
+    handles.emplace(key.substr(prefix.size()), string(val, val_len));
+  }
+
+  char *err = nullptr;
+  leveldb_iter_get_error(iter, &err);
+  leveldb_iter_destroy(iter);
+  leveldb_readoptions_set_fill_cache(db->r_options, 1);
+  if (err) {
+    std::cerr << "Failed to read handles: " << err;
+    leveldb_free(err);
+    return false;
+  }
+  return true;
+}
+
+bool TxnRecovery::load(const db_store_t *db, const char *uuid_prefix) {
+  if (!read_logs(db) || !read_handles(db, uuid_prefix)) {
+    return false;
+  }
+
+  vector<vector<string>> objects;
+  for (const auto &log : logs) {
+    objects.push_back(touched_objects(log));
+  }
+  for (auto &members : partition(objects)) {
+    vector<TxnLog *> txns;
+    for (int i : members) {
+      txns.push_back(&logs[i]);
+    }
+    sort(txns.begin(), txns.end(), [](const TxnLog *a, const TxnLog *b) {
+      return a->txn_id > b->txn_id;
+    });
+    group_txns.push_back(std::move(txns));
+  }
+  for (auto &txns : group_txns) {
+    groups.push_back({txns.data(), (int)txns.size()});
+  }
+  return true;
+}
+
+const string *TxnRecovery::handle_key(const uuid_t uuid) const {
+  auto it = handles.find(string((const char *)uuid, sizeof(uuid_t)));
+  return it == handles.end() ? nullptr : &it->second;
+}
+
+txn_recovery_t *txn_recovery_load(const db_store_t *db,
+                                  const char *uuid_prefix) {
+  TxnRecovery *rec = new TxnRecovery();
+  if (!rec->load(db, uuid_prefix)) {
+    delete rec;
+    return nullptr;
+  }
+  return (txn_recovery_t *)rec;
+}
+
+void txn_recovery_free(txn_recovery_t *rec) { delete (TxnRecovery *)rec; }
+
+int txn_recovery_num_txns(const txn_recovery_t *rec) {
+  return ((const TxnRecovery *)rec)->num_txns();
+}
+
+int txn_recovery_num_corrupt(const txn_recovery_t *rec) {
+  return ((const TxnRecovery *)rec)->num_corrupt();
+}
+
+int txn_recovery_num_groups(const txn_recovery_t *rec) {
+  return ((const TxnRecovery *)rec)->num_groups();
+}
+
+const struct txn_recovery_group *txn_recovery_get_group(
+    const txn_recovery_t *rec, int i) {
+  return ((const TxnRecovery *)rec)->group(i);
+}
+
+const char *txn_recovery_handle_key(const txn_recovery_t *rec,
+                                    const uuid_t uuid, size_t *len) {
+  const string *key = ((const TxnRecovery *)rec)->handle_key(uuid);
+  if (key == nullptr) {
+    return nullptr;
+  }
+  *len = key->size();
+  return key->data();
+}
+
+bool txn_recovery_is_kept(const txn_recovery_t *rec, uint64_t txn_id) {
+  return ((const TxnRecovery *)rec)->is_kept(txn_id);
+}
+
+int txn_recovery_keep(const db_store_t *db, struct TxnLog *const *txns,
+                      int n) {
+  leveldb_writebatch_t *batch = leveldb_writebatch_create();
+  for (int i = 0; i < n; i++) {
+    const string key =
+        absl::StrCat(kTxnLogPrefix, txns[i]->txn_id, kKeptSuffix);
+    leveldb_writebatch_put(batch, key.data(), key.size(), "", 0);
+  }
+  int ret = db_group_write(db, batch);
+  leveldb_writebatch_destroy(batch);
+  return ret;
+}
+
+int txn_recovery_remove(const db_store_t *db, struct TxnLog *const *txns,
+                        int n) {
+  leveldb_writebatch_t *batch = leveldb_writebatch_create();
+  leveldb_iterator_t *iter = leveldb_create_iterator(db->db, db->r_options);
+  for (int i = 0; i < n; i++) {
+    const string key = absl::StrCat(kTxnLogPrefix, txns[i]->txn_id);
+    leveldb_writebatch_delete(batch, key.data(), key.size());
+    // and its undo records
+    const string prefix = absl::StrCat(key, "/");
+    for (leveldb_iter_seek(iter, prefix.data(), prefix.size());
+         leveldb_iter_valid(iter); leveldb_iter_next(iter)) {
+      size_t key_len;
+      const char *found = leveldb_iter_key(iter, &key_len);
+      if (key_len < prefix.size() ||
+          memcmp(found, prefix.data(), prefix.size()) != 0) {
+        break;
+      }
+      leveldb_writebatch_delete(batch, found, key_len);
+    }
+  }
+  char *err = nullptr;
+  leveldb_iter_get_error(iter, &err);
+  leveldb_iter_destroy(iter);
+  if (err) {
+    std::cerr << "Failed to read txn undo records: " << err;
+    leveldb_free(err);
+    leveldb_writebatch_destroy(batch);
+    return -1;
+  }
+  int ret = db_group_write(db, batch);
+  leveldb_writebatch_destroy(batch);
+  return ret;
+}
@@ -0,0 +1,57 @@
+#ifndef _TXN_RECOVERY_HPP
+#define _TXN_RECOVERY_HPP
+
+#include <deque>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// Contains C interface
+#include "txn_recovery.h"
+#include "txn_logger_internal.h"
+
+struct TxnRecovery {
+private:
+        // Records read and legacy protobuf logs; the TxnLogs point into
+        // them
+        std::deque<std::string> records;
+        std::vector<std::unique_ptr<proto::TransactionLog>> protos;
+        std::vector<TxnLog> logs;
+        std::vector<std::vector<TxnLog *>> group_txns;
+        std::vector<txn_recovery_group> groups;
+        int n_corrupt;
+        // Txns already marked by txn_recovery_keep()
+        std::unordered_set<uint64_t> kept_ids;
+        // Raw uuid => Sub-FSAL handle key
+        std::unordered_map<std::string, std::string> handles;
+
+        bool read_logs(const db_store_t *db);
+        bool read_handles(const db_store_t *db, const std::string &prefix);
+
+public:
+        TxnRecovery();
+        ~TxnRecovery();
+
+        bool load(const db_store_t *db, const char *uuid_prefix);
+
+        int num_txns() const { return logs.size(); }
+        int num_corrupt() const { return n_corrupt; }
+        int num_groups() const { return groups.size(); }
+        const txn_recovery_group *group(int i) const { return &groups[i]; }
+        const std::string *handle_key(const uuid_t uuid) const;
+        bool is_kept(uint64_t txn_id) const { return kept_ids.count(txn_id); }
+
+        // The objects |txn| changed, as opaque keys: two txns that do not
+        // share a key can be undone in any order.
+        static std::vector<std::string> touched_objects(const TxnLog &txn);
+
+        // Split txns into groups so that no key of |objects| (the objects
+        // of each txn) is in two groups. Groups come largest first, each
+        // listing its txns in input order.
+        static std::vector<std::vector<int>> partition(
+            const std::vector<std::vector<std::string>> &objects);
+};
+
+#endif  //_TXN_RECOVERY_HPP
@@ -0,0 +1,327 @@
+#include "txn_recovery.hpp"
+
+#include <string.h>
+
+#include <set>
+#include <string>
+#include <vector>
+
+#include <absl/strings/str_cat.h>
+#include <gtest/gtest.h>
+
+#include "txn.pb.h"
+#include "txn_record.h"
+
+using namespace std;
+
+static const char kTestDb[] = "txn_recovery_test_db";
+
+TEST(TxnRecoveryPartitionTest, DisjointTxnsAreSeparated) {
+  auto groups = TxnRecovery::partition({{"a"}, {"b"}, {"c", "d"}});
+  ASSERT_EQ(3, groups.size());
+  for (const auto &group : groups) {
+    EXPECT_EQ(1, group.size());
+  }
+}
+
+TEST(TxnRecoveryPartitionTest, SharedObjectsAreGroupedTransitively) {
+  // 0-2 share "a", 2-4 share "c"; 1 and 3 stand alone
+  auto groups =
+      TxnRecovery::partition({{"a"}, {"b"}, {"a", "c"}, {"d"}, {"c"}, {}});
+  ASSERT_EQ(4, groups.size());
+  EXPECT_EQ(vector<int>({0, 2, 4}), groups[0]);
+  EXPECT_EQ(vector<int>({1}), groups[1]);
+  EXPECT_EQ(vector<int>({3}), groups[2]);
+  EXPECT_EQ(vector<int>({5}), groups[3]);
+}
+
+TEST(TxnRecoveryPartitionTest, LateLinksMergeEarlierGroups) {
+  auto groups = TxnRecovery::partition({{"a"}, {"b"}, {"c"}, {"b", "c", "a"}});
+  ASSERT_EQ(1, groups.size());
+  EXPECT_EQ(vector<int>({0, 1, 2, 3}), groups[0]);
+}
+
+TEST(TxnRecoveryPartitionTest, TouchedObjects) {
+  InlineUndo undos[2];
+  memset(undos, 0, sizeof(undos));
+  uuid_generate(undos[0].file_id.id);
+  uuid_copy(undos[1].file_id.id, undos[0].file_id.id);
+  UnlinkId unlink;
+  uuid_generate(unlink.parent_id.id);
+  strcpy(unlink.name, "victim");
+
+  TxnLog write_txn;
+  memset(&write_txn, 0, sizeof(write_txn));
+  write_txn.compound_type = txn_VWrite;
+  write_txn.inline_undos = undos;
+  write_txn.num_inline_undos = 2;
+  TxnLog unlink_txn;
+  memset(&unlink_txn, 0, sizeof(unlink_txn));
+  unlink_txn.compound_type = txn_VUnlink;
+  unlink_txn.created_unlink_ids = &unlink;
+  unlink_txn.num_unlinks = 1;
+
+  auto written = TxnRecovery::touched_objects(write_txn);
+  auto unlinked = TxnRecovery::touched_objects(unlink_txn);
+  EXPECT_EQ(1, set<string>(written.begin(), written.end()).size());
+  ASSERT_EQ(1, unlinked.size());
+  EXPECT_NE(written[0], unlinked[0]);
+}
+
+class TxnRecoveryTest : public ::testing::Test {
+protected:
+  db_store_t *db;
+
+  virtual void SetUp() {
+    char *err = nullptr;
+    leveldb_options_t *options = leveldb_options_create();
+    leveldb_destroy_db(options, kTestDb, &err);
+    leveldb_options_destroy(options);
+    leveldb_free(err);
+    db = init_db_store(kTestDb, true);
+    ASSERT_TRUE(db);
+  }
+
+  virtual void TearDown() { destroy_db_store(db); }
+
+  void put(const string &key, const string &value) {
+    char *err = nullptr;
+    leveldb_put(db->db, db->w_options, key.data(), key.size(), value.data(),
+                value.size(), &err);
+    ASSERT_EQ(nullptr, err);
+  }
+
+  // Log a pending VWrite of txn |id| over the files |ids|
+  void put_write_txn(uint64_t id, const vector<const unsigned char *> &ids) {
+    vector<InlineUndo> undos(ids.size());
+    for (size_t i = 0; i < ids.size(); i++) {
+      uuid_copy(undos[i].file_id.id, ids[i]);
+      undos[i].file_id.file_type = ft_File;
+      undos[i].offset = id;
+      undos[i].orig_size = 4096;
+      undos[i].data = "old";
+      undos[i].len = 3;
+    }
+    TxnLog txn;
+    memset(&txn, 0, sizeof(txn));
+    txn.txn_id = id;
+    txn.compound_type = txn_VWrite;
+    txn.inline_undos = undos.data();
+    txn.num_inline_undos = undos.size();
+    size_t len;
+    const char *rec = txn_record_encode(&txn, &len);
+    put(absl::StrCat("txn-", id), string(rec, len));
+  }
+
+  // As put_write_txn(), in the protobuf format logs had before txn_record.h
+  void put_legacy_write_txn(uint64_t id,
+                            const vector<const unsigned char *> &ids) {
+    proto::TransactionLog txnpb;
+    txnpb.set_id(id);
+    txnpb.set_type(proto::TransactionType::VWRITE);
+    proto::VWriteTxn *writes = txnpb.mutable_writes();
+    writes->set_backup_dir_path("");
+    for (const unsigned char *uuid : ids) {
+      auto *undo = writes->add_undos();
+      undo->mutable_file_id()->set_uuid(string((const char *)uuid, 16));
+      undo->set_offset(id);
+      undo->set_data("old");
+      undo->set_orig_size(4096);
+    }
+    put(absl::StrCat("txn-", id), txnpb.SerializeAsString());
+  }
+
+  void put_handle(const unsigned char *uuid, const string &handle) {
+    put(absl::StrCat("uuid-", string((const char *)uuid, 16)), handle);
+  }
+};
+
+TEST_F(TxnRecoveryTest, NothingPending) {
+  txn_recovery_t *rec = txn_recovery_load(db, "uuid-");
+  ASSERT_TRUE(rec);
+  EXPECT_EQ(0, txn_recovery_num_txns(rec));
+  EXPECT_EQ(0, txn_recovery_num_groups(rec));
+  txn_recovery_free(rec);
+}
+
+TEST_F(TxnRecoveryTest, GroupsAndHandles) {
+  uuid_t a, b, c;
+  uuid_generate(a);
+  uuid_generate(b);
+  uuid_generate(c);
+  put_handle(a, "handle-a");
+  put_handle(b, "handle-b");
+  put_write_txn(3, {a});
+  put_legacy_write_txn(12, {b});
+  put_write_txn(7, {a, c});
+  put("txn-corrupt", "not a txn id");
+  put("txn-99", "not a txn log");
+  size_t len;
+  TxnLog txn;
+  memset(&txn, 0, sizeof(txn));
+  txn.txn_id = 100;
+  const char *truncated = txn_record_encode(&txn, &len);
+  put("txn-100", string(truncated, len - 1));
+
+  txn_recovery_t *rec = txn_recovery_load(db, "uuid-");
+  ASSERT_TRUE(rec);
+  EXPECT_EQ(3, txn_recovery_num_txns(rec));
+  EXPECT_EQ(2, txn_recovery_num_corrupt(rec));
+  ASSERT_EQ(2, txn_recovery_num_groups(rec));
+
+  // The two txns on |a| are undone together, newest first
+  const txn_recovery_group *group = txn_recovery_get_group(rec, 0);
+  ASSERT_EQ(2, group->n_txns);
+  EXPECT_EQ(7, group->txns[0]->txn_id);
+  EXPECT_EQ(3, group->txns[1]->txn_id);
+  ASSERT_EQ(2, group->txns[0]->num_inline_undos);
+  EXPECT_EQ(string("old"), string(group->txns[0]->inline_undos[0].data,
+                                  group->txns[0]->inline_undos[0].len));
+  group = txn_recovery_get_group(rec, 1);
+  ASSERT_EQ(1, group->n_txns);
+  EXPECT_EQ(12, group->txns[0]->txn_id);
+
+  len = 0;
+  const char *key = txn_recovery_handle_key(rec, a, &len);
+  ASSERT_TRUE(key);
+  EXPECT_EQ("handle-a", string(key, len));
+  key = txn_recovery_handle_key(rec, b, &len);
+  ASSERT_TRUE(key);
+  EXPECT_EQ("handle-b", string(key, len));
+  EXPECT_EQ(nullptr, txn_recovery_handle_key(rec, c, &len));
+
+  // Undone txns are gone after a restart
+  group = txn_recovery_get_group(rec, 0);
+  EXPECT_EQ(0, txn_recovery_remove(db, group->txns, group->n_txns));
+  txn_recovery_free(rec);
+  rec = txn_recovery_load(db, "uuid-");
+  ASSERT_TRUE(rec);
+  ASSERT_EQ(1, txn_recovery_num_txns(rec));
+  EXPECT_EQ(12, txn_recovery_get_group(rec, 0)->txns[0]->txn_id);
+  txn_recovery_free(rec);
+}
+
+TEST_F(TxnRecoveryTest, UndoRecords) {
+  uuid_t a, b;
+  uuid_generate(a);
+  uuid_generate(b);
+  put_write_txn(5, {});
+  put_write_txn(50, {b});
+  InlineUndo undos[2];
+  memset(undos, 0, sizeof(undos));
+  for (int i = 0; i < 2; i++) {
+    uuid_copy(undos[i].file_id.id, a);
+    undos[i].file_id.file_type = ft_File;
+    undos[i].offset = 4096 * i;
+    undos[i].data = "old";
+    undos[i].len = 3;
+  }
+  ASSERT_EQ(0, add_txn_undos(db, 5, 0, &undos[0], 1));
+  ASSERT_EQ(0, add_txn_undos(db, 5, 1, &undos[1], 1));
+  ASSERT_EQ(0, add_txn_backup_dir(db, 50, 0, "50"));
+  // Left by nothing the logger writes
+  ASSERT_EQ(0, add_txn_undos(db, 6, 0, &undos[0], 1));
+
+  txn_recovery_t *rec = txn_recovery_load(db, "uuid-");
+  ASSERT_TRUE(rec);
+  EXPECT_EQ(2, txn_recovery_num_txns(rec));
+  EXPECT_EQ(1, txn_recovery_num_corrupt(rec));
+  ASSERT_EQ(2, txn_recovery_num_groups(rec));
+  const txn_recovery_group *group = txn_recovery_get_group(rec, 0);
+  ASSERT_EQ(1, group->n_txns);
+  TxnLog *txn = group->txns[0];
+  if (txn->txn_id != 5) {
+    group = txn_recovery_get_group(rec, 1);
+    txn = group->txns[0];
+  }
+  ASSERT_EQ(5, txn->txn_id);
+  ASSERT_EQ(2, txn->num_inline_undos);
+  EXPECT_EQ(0, txn->inline_undos[0].offset);
+  EXPECT_EQ(4096, txn->inline_undos[1].offset);
+  EXPECT_EQ(string("old"),
+            string(txn->inline_undos[1].data, txn->inline_undos[1].len));
+  EXPECT_EQ(nullptr, txn->backup_dir_path);
+  const int other_group = group == txn_recovery_get_group(rec, 0) ? 1 : 0;
+  const TxnLog *other = txn_recovery_get_group(rec, other_group)->txns[0];
+  EXPECT_EQ(1, other->num_inline_undos);
+  EXPECT_STREQ("50", other->backup_dir_path);
+
+  // The undo records go with their log
+  EXPECT_EQ(0, txn_recovery_remove(db, group->txns, group->n_txns));
+  txn_recovery_free(rec);
+  rec = txn_recovery_load(db, "uuid-");
+  ASSERT_TRUE(rec);
+  ASSERT_EQ(1, txn_recovery_num_txns(rec));
+  EXPECT_EQ(50, txn_recovery_get_group(rec, 0)->txns[0]->txn_id);
+  EXPECT_EQ(1, txn_recovery_num_corrupt(rec));
+  txn_recovery_free(rec);
+}
+
+TEST_F(TxnRecoveryTest, InterruptedAppend) {
+  uuid_t a;
+  uuid_generate(a);
+  put_handle(a, "handle-a");
+  put_write_txn(3, {a});
+  // Txn 9 appended to |a|: its only undo carries the original size
+  put_write_txn(9, {});
+  InlineUndo size;
+  memset(&size, 0, sizeof(size));
+  uuid_copy(size.file_id.id, a);
+  size.file_id.file_type = ft_File;
+  size.offset = 100;
+  size.orig_size = 100;
+  size.data = "";
+  size.len = 0;
+  ASSERT_EQ(0, add_txn_undos(db, 9, 0, &size, 1));
+
+  txn_recovery_t *rec = txn_recovery_load(db, "uuid-");
+  ASSERT_TRUE(rec);
+  EXPECT_EQ(2, txn_recovery_num_txns(rec));
+  EXPECT_EQ(0, txn_recovery_num_corrupt(rec));
+  ASSERT_EQ(1, txn_recovery_num_groups(rec));
+  // The append is undone first, by truncating |a| back to 100 bytes
+  const txn_recovery_group *group = txn_recovery_get_group(rec, 0);
+  ASSERT_EQ(2, group->n_txns);
+  const TxnLog *txn = group->txns[0];
+  EXPECT_EQ(9, txn->txn_id);
+  ASSERT_EQ(1, txn->num_inline_undos);
+  EXPECT_EQ(0, txn->inline_undos[0].len);
+  EXPECT_EQ(100, txn->inline_undos[0].orig_size);
+  EXPECT_EQ(0, uuid_compare(a, txn->inline_undos[0].file_id.id));
+  EXPECT_EQ(3, group->txns[1]->txn_id);
+  txn_recovery_free(rec);
+}
+
+TEST_F(TxnRecoveryTest, KeptMark) {
+  uuid_t a;
+  uuid_generate(a);
+  put_write_txn(4, {a});
+  put_write_txn(40, {a});
+
+  txn_recovery_t *rec = txn_recovery_load(db, "uuid-");
+  ASSERT_TRUE(rec);
+  ASSERT_EQ(1, txn_recovery_num_groups(rec));
+  const txn_recovery_group *group = txn_recovery_get_group(rec, 0);
+  ASSERT_EQ(2, group->n_txns);
+  EXPECT_FALSE(txn_recovery_is_kept(rec, 40));
+  // Marking txn 4 leaves it pending and does not make it corrupt
+  EXPECT_EQ(0, txn_recovery_keep(db, group->txns + 1, 1));
+  txn_recovery_free(rec);
+
+  rec = txn_recovery_load(db, "uuid-");
+  ASSERT_TRUE(rec);
+  EXPECT_EQ(2, txn_recovery_num_txns(rec));
+  EXPECT_EQ(0, txn_recovery_num_corrupt(rec));
+  EXPECT_TRUE(txn_recovery_is_kept(rec, 4));
+  EXPECT_FALSE(txn_recovery_is_kept(rec, 40));
+  group = txn_recovery_get_group(rec, 0);
+  EXPECT_EQ(0, txn_recovery_remove(db, group->txns, group->n_txns));
+  txn_recovery_free(rec);
+
+  // The mark went with the log
+  rec = txn_recovery_load(db, "uuid-");
+  ASSERT_TRUE(rec);
+  EXPECT_EQ(0, txn_recovery_num_txns(rec));
+  EXPECT_FALSE(txn_recovery_is_kept(rec, 4));
+  txn_recovery_free(rec);
+}
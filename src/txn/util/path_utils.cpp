@@ -215,21 +215,60 @@ int tc_path_append(buf_t *pbuf, slice_t comp)
 	return tc_path_normalize(asstr(pbuf), pbuf->data, pbuf->capacity);
 }
 
+/*
+ * Normalize without building a component vector: components are copied to
+ * the output as they are scanned and ".." rewinds the output to the previous
+ * '/'. The output never runs ahead of the input, so "path" may point into
+ * "pbuf".
+ */
 int tc_path_normalize_s(slice_t path, buf_t *pbuf)
 {
-	std::vector<Slice> components = tc_get_path_components(path);
-	if (components.empty()) {
-		assert(path.data[0] != '/');
-		buf_append_char(pbuf, '.');
-		return 1;
-	}
+	bool is_absolute = path.size > 0 && path.data[0] == '/';
+	size_t start = pbuf->size;
+	size_t n_comps = 0;
+	size_t n_dotdot = 0;	/* leading ".." of a relative path */
+	size_t i = 0;
+
+	if (is_absolute && buf_append_char(pbuf, '/') < 0)
+		return -1;
 
-	int old_size = pbuf->size;
-	for (size_t i = 0; i < components.size(); ++i) {
-		if (i > 0) buf_append_char(pbuf, '/');
-		buf_append_slice(pbuf, components[i].toslice());
+	while (i < path.size) {
+		while (i < path.size && path.data[i] == '/')
+			++i;
+		size_t beg = i;
+		while (i < path.size && path.data[i] != '/')
+			++i;
+		size_t len = i - beg;
+		if (len == 0 || (len == 1 && path.data[beg] == '.'))
+			continue;
+		if (len == 2 && path.data[beg] == '.' &&
+		    path.data[beg + 1] == '.') {
+			if (n_comps > n_dotdot) {
+				/* drop the last component and its '/' */
+				char *first = pbuf->data + start;
+				char *p = pbuf->data + pbuf->size;
+				while (p > first && p[-1] != '/')
+					--p;
+				if (p > first && (p - 1 > first || !is_absolute))
+					--p;
+				pbuf->size = p - pbuf->data;
+				--n_comps;
+				continue;
+			}
+			if (is_absolute)
+				continue;
+			++n_dotdot;
+		}
+		if (n_comps > 0 && buf_append_char(pbuf, '/') < 0)
+			return -1;
+		if (buf_append_slice(pbuf, mkslice(path.data + beg, len)) < 0)
+			return -1;
+		++n_comps;
 	}
-	return pbuf->size - old_size;
+
+	if (pbuf->size == start && buf_append_char(pbuf, '.') < 0)
+		return -1;
+	return pbuf->size - start;
 }
 
 int tc_path_normalize(const char *path, char *buf, size_t buf_size)
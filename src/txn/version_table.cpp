@@ -0,0 +1,217 @@
+#include "version_table.hpp"
+
+#include <algorithm>
+#include <assert.h>
+#include <linux/limits.h>
+#include <stdint.h>
+
+#include "path_utils.h"
+
+VersionTable::VersionNode::VersionNode(std::string key, int shard)
+    : key(std::move(key)), shard(shard), version(0), pins(0) {}
+
+VersionTable::VersionTable() {}
+
+// Normalize `path` into `clean` the same way the lock manager does, so that
+// both agree on what a path is.
+static bool clean_path(const char *path, std::string *clean) {
+  char buf[PATH_MAX];
+  int ret = tc_path_normalize(path, buf, PATH_MAX);
+  if (ret == -1) {
+    return false;
+  }
+  if (buf[0] == '/') {
+    clean->assign(buf, ret);
+  } else if (ret == 1 && buf[0] == '.') {
+    clean->assign("/");
+  } else {
+    clean->assign("/");
+    clean->append(buf, ret);
+  }
+  return true;
+}
+
+static int shard_of(const std::string &key, int n_shards) {
+  // FNV-1a
+  uint64_t h = 14695981039346656037ULL;
+  for (unsigned char c : key) {
+    h = (h ^ c) * 1099511628211ULL;
+  }
+  return h % n_shards;
+}
+
+std::vector<std::pair<std::string, bool>> &VersionTable::thread_requests() {
+  static thread_local std::vector<std::pair<std::string, bool>> requests;
+  return requests;
+}
+
+VersionTable::VersionNode *VersionTable::pin(const std::string &key) {
+  int s = shard_of(key, N_SHARDS);
+  VersionShard &shard = shards[s];
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  auto &node = shard.nodes[key];
+  if (!node) {
+    node.reset(new VersionNode(key, s));
+  }
+  node->pins++;
+  return node.get();
+}
+
+void VersionTable::unpin(VersionNode *node) {
+  VersionShard &shard = shards[node->shard];
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  if (--node->pins == 0) {
+    shard.nodes.erase(node->key);
+  }
+}
+
+// Sort the first `n` requests and merge those of the same path; a path that
+// is both read and written is only written. Returns the number left.
+static int merge_requests(std::vector<std::pair<std::string, bool>> &requests,
+                          int n) {
+  auto begin = requests.begin();
+  std::sort(begin, begin + n);
+  int n_requests = 0;
+  for (int i = 0; i < n; i++) {
+    if (n_requests > 0 && requests[n_requests - 1].first == requests[i].first) {
+      requests[n_requests - 1].second |= requests[i].second;
+      continue;
+    }
+    if (n_requests != i) {
+      std::swap(requests[n_requests], requests[i]);
+    }
+    n_requests++;
+  }
+  return n_requests;
+}
+
+bool VersionTable::begin(lock_request_t *files, int n, vt_handle_t *vh) {
+  auto &requests = thread_requests();
+  if (requests.size() < (size_t)n) {
+    requests.resize(n);
+  }
+  for (int i = 0; i < n; i++) {
+    if (!clean_path(files[i].path, &requests[i].first)) {
+      return false;
+    }
+    requests[i].second = files[i].write_lock;
+  }
+  int n_requests = merge_requests(requests, n);
+
+  // A path read also depends on its ancestors: creating, removing or
+  // renaming an entry only writes the directory it is in.
+  int n_paths = n_requests;
+  for (int i = 0; i < n_paths; i++) {
+    if (requests[i].second || requests[i].first.size() == 1) {
+      continue;
+    }
+    size_t pos = 0;
+    do {
+      if ((size_t)n_requests == requests.size()) {
+        requests.emplace_back();
+      }
+      requests[n_requests].first.assign(requests[i].first, 0,
+                                        std::max<size_t>(pos, 1));
+      requests[n_requests].second = false;
+      n_requests++;
+      pos = requests[i].first.find('/', pos + 1);
+    } while (pos != std::string::npos);
+  }
+  if (n_requests > n_paths) {
+    n_requests = merge_requests(requests, n_requests);
+  }
+  if (n_requests > LM_MAX_LOCKS) {
+    return false;
+  }
+
+  vh->vt = (version_table_t *)this;
+  vh->n_entries = 0;
+  for (int i = 0; i < n_requests; i++) {
+    VersionNode *node = pin(requests[i].first);
+    vt_entry &entry = vh->entries[vh->n_entries++];
+    entry.node = (uintptr_t)node;
+    if (requests[i].second) {
+      // The caller holds the write lock, so nobody else is writing
+      entry.node |= 1;
+      entry.version = node->version.fetch_add(1);
+      assert(entry.version % 2 == 0);
+    } else {
+      entry.version = node->version.load();
+      if (entry.version % 2 != 0) {
+        end(vh);
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+bool VersionTable::validate(const vt_handle_t *vh) {
+  for (int i = 0; i < vh->n_entries; i++) {
+    const vt_entry &entry = vh->entries[i];
+    if (entry.node & 1) {
+      continue;
+    }
+    VersionNode *node = (VersionNode *)entry.node;
+    if (node->version.load() != entry.version) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void VersionTable::end(vt_handle_t *vh) {
+  for (int i = 0; i < vh->n_entries; i++) {
+    const vt_entry &entry = vh->entries[i];
+    VersionNode *node = (VersionNode *)(entry.node & ~(uintptr_t)1);
+    if (entry.node & 1) {
+      // Even again, but different from what readers saw before the write
+      node->version.fetch_add(1);
+    }
+    unpin(node);
+  }
+  vh->n_entries = 0;
+}
+
+uint64_t VersionTable::version(const char *path) {
+  std::string key;
+  if (!clean_path(path, &key)) {
+    return 0;
+  }
+  VersionShard &shard = shards[shard_of(key, N_SHARDS)];
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  auto it = shard.nodes.find(key);
+  return it == shard.nodes.end() ? 0 : it->second->version.load();
+}
+
+size_t VersionTable::size() {
+  size_t n = 0;
+  for (auto &shard : shards) {
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    n += shard.nodes.size();
+  }
+  return n;
+}
+
+version_table_t *new_version_table() {
+  return (version_table_t *)new VersionTable();
+}
+
+void free_version_table(version_table_t *vt) { delete (VersionTable *)vt; }
+
+bool vt_begin(version_table_t *vt, lock_request_t *files, int n,
+              vt_handle_t *vh) {
+  vh->vt = nullptr;
+  vh->n_entries = 0;
+  return ((VersionTable *)vt)->begin(files, n, vh);
+}
+
+bool vt_validate(const vt_handle_t *vh) { return VersionTable::validate(vh); }
+
+void vt_end(vt_handle_t *vh) {
+  if (vh->vt == nullptr) {
+    return;
+  }
+  ((VersionTable *)vh->vt)->end(vh);
+  vh->vt = nullptr;
+}
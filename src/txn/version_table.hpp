@@ -0,0 +1,60 @@
+#ifndef _VERSION_TABLE_HPP
+#define _VERSION_TABLE_HPP
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Contains C interface
+#include "version_table.h"
+
+struct VersionTable {
+private:
+        // Number of independently locked partitions of the table
+        static const int N_SHARDS = 64;
+
+        // The version of one path. A node stays in the table as long as a
+        // vt_handle_t pins it, so that a version recorded by a reader cannot
+        // be lost; the last handle to unpin it removes it.
+        struct VersionNode {
+                std::string key;
+                int shard;
+                std::atomic<uint64_t> version;
+                // Number of handles pinning the node; protected by the
+                // shard mutex
+                int pins;
+
+                VersionNode(std::string key, int shard);
+        };
+
+        struct VersionShard {
+                std::mutex mutex;
+                std::unordered_map<std::string, std::unique_ptr<VersionNode>> nodes;
+        };
+
+        VersionShard shards[N_SHARDS];
+
+        // Clean, sorted and deduplicated paths of the request being begun.
+        // Each thread reuses its own so that the buffers are kept around.
+        static std::vector<std::pair<std::string, bool>> &thread_requests();
+
+        VersionNode *pin(const std::string &key);
+        void unpin(VersionNode *node);
+
+public:
+        VersionTable();
+
+        bool begin(lock_request_t *files, int n, vt_handle_t *vh);
+        static bool validate(const vt_handle_t *vh);
+        void end(vt_handle_t *vh);
+
+        // Current version of `path` and number of pinned paths, for tests
+        uint64_t version(const char *path);
+        size_t size();
+};
+
+#endif  //_VERSION_TABLE_HPP
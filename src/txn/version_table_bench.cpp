@@ -0,0 +1,134 @@
+#include <benchmark/benchmark.h>
+
+#include <chrono>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "lock_manager.h"
+#include "version_table.h"
+
+using namespace std;
+
+// Compounds as seen by the txn FSAL: each one reads a few files and, with
+// some probability, writes one of them, picking the files among n_files
+// (the fewer files, the more contention). A compound runs either with all
+// of its paths locked (arg 0), or optimistically (arg 1): only the path it
+// writes is locked, without waiting, and the paths it reads are validated
+// at the end. An optimistic compound that fails is aborted and retried,
+// and after kMaxAborts aborts in a row it falls back to locking, as the
+// txn FSAL does. Reports the number of aborts per compound.
+
+static const int kPathsPerCompound = 4;
+static const int kMaxAborts = 8;
+
+static lock_manager_t *bench_lm() {
+  static lock_manager_t *lm = new_lock_manager();
+  return lm;
+}
+
+static version_table_t *bench_vt() {
+  static version_table_t *vt = new_version_table();
+  return vt;
+}
+
+// Stand-in for executing the ops of a compound
+static void execute(int n_ops) {
+  auto until = chrono::steady_clock::now() + chrono::microseconds(2 * n_ops);
+  while (chrono::steady_clock::now() < until) {
+  }
+}
+
+static void run_locked(vector<lock_request_t> &requests, int n_writes,
+                       lock_handle_t *lh, vt_handle_t *vh) {
+  lm_lock_r(bench_lm(), requests.data(), requests.size(), lh);
+  // Writes still bump the versions for optimistic readers
+  vt_begin(bench_vt(), requests.data(), n_writes, vh);
+  execute(requests.size());
+  vt_end(vh);
+  unlock_handle_r(lh);
+}
+
+static bool run_optimistic(vector<lock_request_t> &requests, int n_writes,
+                           lock_handle_t *lh, vt_handle_t *vh) {
+  if (n_writes > 0 &&
+      lm_try_lock_r(bench_lm(), requests.data(), n_writes, lh) == nullptr) {
+    return false;
+  }
+  if (!vt_begin(bench_vt(), requests.data(), requests.size(), vh)) {
+    unlock_handle_r(lh);
+    return false;
+  }
+  execute(requests.size());
+  bool valid = vt_validate(vh);
+  vt_end(vh);
+  unlock_handle_r(lh);
+  return valid;
+}
+
+static void BM_compound_contention(benchmark::State &state) {
+  const bool optimistic = state.range(0);
+  const int n_files = state.range(1);
+  const double write_ratio = state.range(2) / 100.0;
+  std::default_random_engine rng(std::random_device{}());
+  std::uniform_int_distribution<int> pick(0, n_files - 1);
+  std::bernoulli_distribution writes(write_ratio);
+  vector<string> paths(kPathsPerCompound);
+  vector<lock_request_t> requests(kPathsPerCompound);
+  lock_handle_t lh = {nullptr, 0};
+  vt_handle_t vh = {nullptr, 0};
+  uint64_t aborts = 0, fallbacks = 0, compounds = 0;
+  int streak = 0;
+
+  while (state.KeepRunning()) {
+    // The written path, if any, comes first
+    int n_writes = writes(rng) ? 1 : 0;
+    for (int i = 0; i < kPathsPerCompound; i++) {
+      paths[i] = "/export/dir/file" + to_string(pick(rng));
+      requests[i].path = (char *)paths[i].c_str();
+      requests[i].write_lock = i < n_writes;
+    }
+
+    bool done = false;
+    while (optimistic && !done && streak < kMaxAborts) {
+      done = run_optimistic(requests, n_writes, &lh, &vh);
+      if (done) {
+        streak = 0;
+      } else {
+        streak++;
+        aborts++;
+      }
+    }
+    if (!done) {
+      run_locked(requests, n_writes, &lh, &vh);
+      if (optimistic) {
+        streak--;
+        fallbacks++;
+      }
+    }
+    compounds++;
+  }
+
+  state.counters["aborts_per_compound"] = benchmark::Counter(
+      (double)aborts / compounds, benchmark::Counter::kAvgThreads);
+  state.counters["fallbacks_per_compound"] = benchmark::Counter(
+      (double)fallbacks / compounds, benchmark::Counter::kAvgThreads);
+  state.SetItemsProcessed(compounds);
+}
+
+static void ContentionArgs(benchmark::internal::Benchmark *b) {
+  for (int optimistic : {0, 1}) {
+    for (int n_files : {16, 256, 65536}) {
+      for (int write_pct : {5, 50}) {
+        b->Args({optimistic, n_files, write_pct});
+      }
+    }
+  }
+}
+BENCHMARK(BM_compound_contention)
+    ->Apply(ContentionArgs)
+    ->ThreadRange(1, 16)
+    ->UseRealTime();
+
+BENCHMARK_MAIN();
@@ -0,0 +1,203 @@
+#include "version_table.hpp"
+#include "lock_manager.h"
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+static std::vector<lock_request_t> make_requests(
+    std::vector<std::pair<const char *, bool>> data) {
+  std::vector<lock_request_t> res;
+  for (const auto &pair : data) {
+    lock_request_t request;
+    request.path = (char *)pair.first;
+    request.write_lock = pair.second;
+    res.push_back(request);
+  }
+  return res;
+}
+
+TEST(VersionTableTest, ReadersDoNotConflict) {
+  version_table_t *vt = new_version_table();
+  auto reads = make_requests({{"/a/b", false}, {"/a/c", false}});
+  vt_handle_t vh1, vh2;
+
+  ASSERT_TRUE(vt_begin(vt, reads.data(), reads.size(), &vh1));
+  ASSERT_TRUE(vt_begin(vt, reads.data(), reads.size(), &vh2));
+  EXPECT_TRUE(vt_validate(&vh1));
+  EXPECT_TRUE(vt_validate(&vh2));
+  vt_end(&vh1);
+  vt_end(&vh2);
+
+  EXPECT_EQ(0, ((VersionTable *)vt)->size());
+  free_version_table(vt);
+}
+
+TEST(VersionTableTest, WriteInvalidatesReader) {
+  version_table_t *vt = new_version_table();
+  auto read = make_requests({{"/a/b", false}});
+  auto write = make_requests({{"/a/./b", true}});
+  vt_handle_t reader, writer;
+
+  ASSERT_TRUE(vt_begin(vt, read.data(), read.size(), &reader));
+  ASSERT_TRUE(vt_begin(vt, write.data(), write.size(), &writer));
+  EXPECT_FALSE(vt_validate(&reader));
+  vt_end(&writer);
+  EXPECT_FALSE(vt_validate(&reader));
+  vt_end(&reader);
+
+  // A reader that starts after the write is fine
+  ASSERT_TRUE(vt_begin(vt, read.data(), read.size(), &reader));
+  EXPECT_TRUE(vt_validate(&reader));
+  vt_end(&reader);
+  free_version_table(vt);
+}
+
+TEST(VersionTableTest, ReadingWrittenPathFails) {
+  version_table_t *vt = new_version_table();
+  auto write = make_requests({{"/a/b", true}});
+  auto read = make_requests({{"/a/c", false}, {"/a/b", false}});
+  vt_handle_t reader, writer;
+
+  ASSERT_TRUE(vt_begin(vt, write.data(), write.size(), &writer));
+  EXPECT_FALSE(vt_begin(vt, read.data(), read.size(), &reader));
+  // Nothing stays pinned by the failed reader
+  EXPECT_EQ(1, ((VersionTable *)vt)->size());
+  vt_end(&reader);
+  vt_end(&writer);
+  EXPECT_EQ(0, ((VersionTable *)vt)->size());
+  free_version_table(vt);
+}
+
+TEST(VersionTableTest, OwnWritesDoNotConflict) {
+  version_table_t *vt = new_version_table();
+  auto requests = make_requests({{"/a/b", false}, {"/a/b", true}});
+  vt_handle_t vh;
+
+  ASSERT_TRUE(vt_begin(vt, requests.data(), requests.size(), &vh));
+  EXPECT_EQ(1, vh.n_entries);
+  EXPECT_TRUE(vt_validate(&vh));
+  vt_end(&vh);
+  EXPECT_EQ(0, ((VersionTable *)vt)->size());
+  free_version_table(vt);
+}
+
+TEST(VersionTableTest, VersionsAreKeptWhilePinned) {
+  version_table_t *vt = new_version_table();
+  VersionTable *table = (VersionTable *)vt;
+  auto read = make_requests({{"/x", false}});
+  auto write = make_requests({{"/x", true}});
+  vt_handle_t reader, writer;
+
+  ASSERT_TRUE(vt_begin(vt, read.data(), read.size(), &reader));
+  for (int i = 0; i < 3; i++) {
+    ASSERT_TRUE(vt_begin(vt, write.data(), write.size(), &writer));
+    EXPECT_EQ(2 * i + 1, table->version("/x"));
+    vt_end(&writer);
+  }
+  EXPECT_EQ(6, table->version("/x"));
+  EXPECT_FALSE(vt_validate(&reader));
+  vt_end(&reader);
+  free_version_table(vt);
+}
+
+// Removing or renaming an entry of /a only writes /a
+TEST(VersionTableTest, WritingParentInvalidatesReader) {
+  version_table_t *vt = new_version_table();
+  auto read = make_requests({{"/a/b/c", false}});
+  auto write_parent = make_requests({{"/a/b", true}});
+  auto write_root = make_requests({{"/", true}});
+  vt_handle_t reader, writer;
+
+  ASSERT_TRUE(vt_begin(vt, read.data(), read.size(), &reader));
+  EXPECT_EQ(4, reader.n_entries);
+  ASSERT_TRUE(vt_begin(vt, write_parent.data(), write_parent.size(),
+                       &writer));
+  vt_end(&writer);
+  EXPECT_FALSE(vt_validate(&reader));
+  vt_end(&reader);
+
+  ASSERT_TRUE(vt_begin(vt, read.data(), read.size(), &reader));
+  ASSERT_TRUE(vt_begin(vt, write_root.data(), write_root.size(), &writer));
+  vt_end(&writer);
+  EXPECT_FALSE(vt_validate(&reader));
+  vt_end(&reader);
+
+  // Nor can a reader begin while an ancestor is being written
+  ASSERT_TRUE(vt_begin(vt, write_parent.data(), write_parent.size(),
+                       &writer));
+  EXPECT_FALSE(vt_begin(vt, read.data(), read.size(), &reader));
+  vt_end(&writer);
+
+  EXPECT_EQ(0, ((VersionTable *)vt)->size());
+  free_version_table(vt);
+}
+
+TEST(VersionTableTest, WritingChildKeepsReader) {
+  version_table_t *vt = new_version_table();
+  auto read = make_requests({{"/a", false}, {"/a/b", false}});
+  auto write = make_requests({{"/a/b/c", true}, {"/d", true}});
+  vt_handle_t reader, writer;
+
+  ASSERT_TRUE(vt_begin(vt, read.data(), read.size(), &reader));
+  EXPECT_EQ(3, reader.n_entries);
+  ASSERT_TRUE(vt_begin(vt, write.data(), write.size(), &writer));
+  vt_end(&writer);
+  EXPECT_TRUE(vt_validate(&reader));
+  vt_end(&reader);
+
+  EXPECT_EQ(0, ((VersionTable *)vt)->size());
+  free_version_table(vt);
+}
+
+// Writers take the write lock before pinning their paths, as the txn FSAL
+// does. Readers either fail to begin, fail to validate, or saw no write
+// at all in between.
+TEST(VersionTableTest, ConcurrentReadersAndWriters) {
+  version_table_t *vt = new_version_table();
+  lock_manager_t *lm = new_lock_manager();
+  std::atomic<uint64_t> value(0);
+  std::atomic<int> inconsistent(0);
+  std::vector<std::thread> threads;
+
+  for (int t = 0; t < 4; t++) {
+    threads.emplace_back([&]() {
+      auto write = make_requests({{"/shared", true}});
+      lock_handle_t lh;
+      vt_handle_t vh;
+      for (int i = 0; i < 2000; i++) {
+        lm_lock_r(lm, write.data(), write.size(), &lh);
+        ASSERT_TRUE(vt_begin(vt, write.data(), write.size(), &vh));
+        value.fetch_add(1);
+        value.fetch_add(1);
+        vt_end(&vh);
+        unlock_handle_r(&lh);
+      }
+    });
+    threads.emplace_back([&]() {
+      auto read = make_requests({{"/shared", false}});
+      vt_handle_t vh;
+      for (int i = 0; i < 2000; i++) {
+        if (!vt_begin(vt, read.data(), read.size(), &vh)) {
+          continue;
+        }
+        uint64_t seen = value.load();
+        if (vt_validate(&vh) && seen % 2 != 0) {
+          inconsistent++;
+        }
+        vt_end(&vh);
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+
+  EXPECT_EQ(0, inconsistent.load());
+  EXPECT_EQ(0, ((VersionTable *)vt)->size());
+  free_lock_manager(lm);
+  free_version_table(vt);
+}